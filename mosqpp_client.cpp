@@ -1,12 +1,15 @@
-#include <iostream>
+#include <string.h>
 #include "mosqpp_client.h"
+#include "msg_tracepoint.h"
 
 #define PUBLISH_TOPIC "EXAMPLE_TOPIC"
 
 
-mosqpp_client::mosqpp_client(const char *id, const char *host, int port) : mosquittopp(id)
+mosqpp_client::mosqpp_client(const char *id, const char *host, int port, const char *topic) : mosquittopp(id, false)
 {
 	keepalive = DEFAULT_MQTT_KEEPALIVE;
+	this->topic = topic;
+	reconnect_init(&backoff, RECONNECT_DEFAULT_BASE_MS, RECONNECT_DEFAULT_CAP_MS, 0);
 	connect(host, port, keepalive);
 }
 
@@ -14,22 +17,45 @@ mosqpp_client::~mosqpp_client()
 {
 }
 
-void mosqpp_client::on_connect(int result)
+int mosqpp_client::reconnect_backoff(volatile bool *run)
 {
+	int rc = MOSQ_ERR_NO_CONN;
+
+	while (reconnect_wait(&backoff, run)) {
+		rc = reconnect();
+		if (rc == MOSQ_ERR_SUCCESS) break;
+		backoff.stats.failed_attempts++;
+	}
+	return rc;
+}
+
+void mosqpp_client::on_connect_with_flags(int result, int flags)
+{
+	/* persistent session: subscribe only if the broker lost it */
+	if (reconnect_connected(&backoff, result, flags))
+	{
+		subscribe(NULL, topic);
+	}
+
 	if (result != MQTT_RC_SUCCESS)
 	{
 		if (result == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION) 
 		{
-			std::cout << "Connection error: " << mosquitto_reason_string(result) 
-				<< ". Try connecting to an MQTT v5 broker, or use MQTT v3.x mode." << std::endl;
+			TP_ERROR(connect_error, "Connection error: %s. Try connecting to an MQTT v5 broker, or use MQTT v3.x mode.",
+				mosquitto_reason_string(result));
 		}
 		else
 		{
-			std::cout << "Connection error: " << mosquitto_reason_string(result) << std::endl;
+			TP_ERROR(connect_error, "Connection error: %s", mosquitto_reason_string(result));
 		}
 	}
 }
 
+void mosqpp_client::on_disconnect(int result)
+{
+	reconnect_lost(&backoff);
+}
+
 void mosqpp_client::on_message(const mosquitto_message * message)
 {
 	int payload_size = MAX_PAYLOAD + 1;
@@ -47,22 +73,22 @@ void mosqpp_client::on_message(const mosquitto_message * message)
 			snprintf(buf, payload_size, "This is a Status Message...");
 			publish(NULL, PUBLISH_TOPIC, strlen(buf), buf);
 
-			std::cout << "Status Request Recieved." << std::endl;
+			TP_INFO(status_request, "Status Request Recieved.");
 
 		}
 	}
 	else 
 	{
-		std::cout << "on_message : " << message->topic << " : " << buf << std::endl;
+		TP_DEBUG(on_message, "on_message : %s : %s", message->topic, buf);
 	}
 }
 
 void mosqpp_client::on_publish(int mid)
 {
-	std::cout << "on_publish : " << mid << std::endl;
+	TP_DEBUG(on_publish, "on_publish : %d", mid);
 }
 
 void mosqpp_client::on_subscribe(int mid, int qos_count, const int * granted_qos)
 {
-	//std::cout << "on_subscribe : " << mid << " : " << qos_count << std::endl;
+	TP_DEBUG(on_subscribe, "on_subscribe : %d : %d", mid, qos_count);
 }
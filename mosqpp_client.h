@@ -1,6 +1,7 @@
 #pragma once
 #include <mosquittopp.h>
 #include <mqtt_protocol.h>
+#include "msg_reconnect.h"
 
 #define MAX_PAYLOAD 50
 #define DEFAULT_MQTT_KEEPALIVE 60
@@ -8,15 +9,22 @@
 class mosqpp_client : public mosqpp::mosquittopp
 {
 public :
-	mosqpp_client(const char *id, const char *host, int port);
+	mosqpp_client(const char *id, const char *host, int port, const char *topic);
 	~mosqpp_client();
 
-	void on_connect(int result);
+	/* back off, then reconnect; returns once connected or *run is false */
+	int reconnect_backoff(volatile bool *run);
+
+	void on_connect_with_flags(int result, int flags);
+	void on_disconnect(int result);
 	void on_message(const struct mosquitto_message *message);
 	void on_publish(int mid);
 	void on_subscribe(int mid, int qos_count, const int *granted_qos);
 
+	struct reconnect_state backoff;
+
 private:
 	int keepalive;
+	const char *topic;
 };
 
@@ -0,0 +1,305 @@
+/*
+  mqtt_fanout
+  Local fan-out daemon: one broker subscription per host, any number of local
+  readers attached to a shared memory ring (see msg_ring.h).
+  Readers: mosquitto_v5_recv -R <ring>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#define sleep(x) Sleep((x)*1000)
+#define strdup _strdup
+#else
+#include <unistd.h>
+#endif
+#include <signal.h>
+
+#include <mosquitto.h>
+#include "msg_verify.h"
+#include "msg_chunk.h"
+#include "msg_claim.h"
+#include "msg_ring.h"
+
+#define DEFAULT_MQTT_HOST "127.0.0.1"
+#define DEFAULT_MQTT_PORT 1883
+#define DEFAULT_MQTT_KEEPALIVE 60
+#define DEFAULT_MQTT_TOPIC "EXAMPLE_TOPIC"
+#define DEFAULT_RING_NAME "fanout"
+#define DEFAULT_STATS_INTERVAL 10
+
+static bool run = true;
+static char **topics = NULL;
+static int topic_count = 0;
+static struct ring ring;
+static struct verify_cache verify_cache;
+static struct chunk_reassembly reassembly;
+static struct claim_reader claim_reader;
+static uint64_t forwarded = 0;
+static uint64_t rejected = 0;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-t topic]... [-r ring] [-s size_mb] [-i interval]\n"
+		" -t : subscribe to topic, may be repeated. Default: %s\n"
+		" -r : shared memory ring name. Default: %s\n"
+		" -s : ring size in MB. Default: %d\n"
+		" -i : seconds between reader lag reports. Default: %d\n",
+		argv0, DEFAULT_MQTT_TOPIC, DEFAULT_RING_NAME, RING_DEFAULT_SIZE / (1024 * 1024), DEFAULT_STATS_INTERVAL);
+	exit(1);
+}
+
+void signal_handler(int s) {
+	run = false;
+}
+
+void forward(const char *topic, const void *payload, size_t len) {
+
+	int rc = ring_write(&ring, topic, payload, len);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: message on topic '%s' not forwarded: %s\n", topic, mosquitto_strerror(rc));
+		rejected++;
+		return;
+	}
+	forwarded++;
+}
+
+void connect_callback(struct mosquitto *mosq, void *obj, int result) {
+	printf("connect callback, rc=%d\n", result);
+
+	if (!result) {
+		mosquitto_subscribe_multiple(mosq, NULL, topic_count, topics, 0, 0, NULL);
+	}
+}
+
+/* verified once here instead of in every reader */
+static bool verify(const char *topic, const void *payload, size_t len)
+{
+	if (verify_cached(&verify_cache, topic, (const uint8_t *)payload, len)) return true;
+
+	fprintf(stderr, "Error: malformed FlexBuffer on topic '%s', dropped.\n", topic);
+	rejected++;
+	return false;
+}
+
+void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
+
+	if (msg->payloadlen == 0) return;
+
+	/* readers resolve claim descriptors themselves; the claimed payload is checked here */
+	if (claim_is_desc(msg->payload, msg->payloadlen)) {
+		struct claim_view claim;
+		int rc = claim_resolve(&claim_reader, msg->payload, msg->payloadlen, &claim);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: claim on topic '%s' not readable: %s\n", msg->topic, mosquitto_strerror(rc));
+			rejected++;
+			return;
+		}
+		bool ok = verify(msg->topic, claim.data, claim.size);
+		claim_release(&claim);
+		if (ok) forward(msg->topic, msg->payload, msg->payloadlen);
+		return;
+	}
+
+	/* readers get whole payloads, never chunk frames */
+	if (chunk_is_frame(msg->payload, msg->payloadlen)) {
+		struct chunk_view chunk;
+		int rc = chunk_receive(&reassembly, msg->topic, msg->payload, msg->payloadlen, &chunk);
+		if (rc == CHUNK_PENDING) return;
+		if (rc != CHUNK_COMPLETE) {
+			rejected++;
+			return;
+		}
+
+		if (verify(msg->topic, chunk.data, chunk.size)) forward(msg->topic, chunk.data, chunk.size);
+		chunk_release(&reassembly, &chunk);
+		return;
+	}
+
+	if (verify(msg->topic, msg->payload, msg->payloadlen)) forward(msg->topic, msg->payload, msg->payloadlen);
+}
+
+void print_stats(void) {
+
+	struct ring_reader_stats stats;
+	int readers = 0;
+
+	fprintf(stderr, "fanout: %llu forwarded, %llu rejected\n", (unsigned long long)forwarded, (unsigned long long)rejected);
+	for (int i = 0; i < RING_MAX_READERS; i++) {
+		if (!ring_stats(&ring, i, &stats)) continue;
+
+		readers++;
+		fprintf(stderr, "  reader %d (pid %d): lag %llu bytes, %llu read, %llu dropped, %llu overruns\n",
+			i, stats.pid, (unsigned long long)stats.lag_bytes, (unsigned long long)stats.messages,
+			(unsigned long long)stats.dropped, (unsigned long long)stats.overruns);
+	}
+	if (!readers) fprintf(stderr, "  no readers attached\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *mqtt_host = strdup(DEFAULT_MQTT_HOST);
+	char *ring_name = strdup(DEFAULT_RING_NAME);
+	int mqtt_port = DEFAULT_MQTT_PORT;
+	int mqtt_keepalive = DEFAULT_MQTT_KEEPALIVE;
+	size_t ring_size = RING_DEFAULT_SIZE;
+	int stats_interval = DEFAULT_STATS_INTERVAL;
+	bool clean_session = true;
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -h argument given but no host specified.");
+				return 1;
+			}
+			else {
+				free(mqtt_host);
+				mqtt_host = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-p"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -p argument given but no port specified.");
+				return 1;
+			}
+			else {
+				mqtt_port = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-t"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -t argument given but no topic specified.");
+				return 1;
+			}
+			else if (mosquitto_sub_topic_check(argv[i + 1]) != MOSQ_ERR_SUCCESS) {
+				fprintf(stderr, "Error: Invalid subscription topic '%s'.\n", argv[i + 1]);
+				return 1;
+			}
+			else {
+				topics = (char **)realloc(topics, (size_t)(topic_count + 1) * sizeof(char *));
+				topics[topic_count++] = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-r"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -r argument given but no ring name specified.");
+				return 1;
+			}
+			else {
+				free(ring_name);
+				ring_name = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-s"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -s argument given but no size specified.");
+				return 1;
+			}
+			else {
+				ring_size = (size_t)atoi(argv[i + 1]) * 1024 * 1024;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-i"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -i argument given but no interval specified.");
+				return 1;
+			}
+			else {
+				stats_interval = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else
+		{
+			usage(argv[0]);
+		}
+
+	}
+
+	if (topic_count == 0) {
+		topics = (char **)malloc(sizeof(char *));
+		topics[topic_count++] = strdup(DEFAULT_MQTT_TOPIC);
+	}
+
+	int rc = ring_create(&ring, ring_name, ring_size);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to create ring '%s': %s\n", ring_name, mosquitto_strerror(rc));
+		if (rc == MOSQ_ERR_ALREADY_EXISTS) {
+			fprintf(stderr, "Another mosquitto_fanout uses it, or remove /dev/shm/mqtt_ring.%s left by one that crashed.\n", ring_name);
+		}
+		return 1;
+	}
+
+	verify_cache_init(&verify_cache);
+	chunk_reassembly_init(&reassembly, CHUNK_DEFAULT_TIMEOUT_MS);
+	claim_reader_init(&claim_reader);
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	struct mosquitto *mosq = NULL;
+	mosquitto_lib_init();
+	mosq = mosquitto_new(NULL, clean_session, NULL);
+	if (!mosq) {
+		fprintf(stderr, "Could not create new mosquitto struct\n");
+
+		exit(1);
+	}
+
+	mosquitto_connect_callback_set(mosq, connect_callback);
+	mosquitto_message_callback_set(mosq, message_callback);
+
+	if (mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive)) {
+		fprintf(stderr, "Unable to connect mosquitto.\n");
+
+		exit(1);
+	}
+
+	time_t next_stats = time(NULL) + stats_interval;
+	while (run) {
+		int loop = mosquitto_loop(mosq, 1000, 1);
+		if (loop) {
+			fprintf(stderr, "mosquitto connection error!\n");
+			sleep(1);
+			mosquitto_reconnect(mosq);
+		}
+
+		if (stats_interval > 0 && time(NULL) >= next_stats) {
+			print_stats();
+			next_stats = time(NULL) + stats_interval;
+		}
+	}
+
+	print_stats();
+
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+	chunk_reassembly_cleanup(&reassembly);
+	claim_reader_cleanup(&claim_reader);
+	ring_close(&ring);
+	for (int i = 0; i < topic_count; i++) {
+		free(topics[i]);
+	}
+	free(topics);
+	free(mqtt_host);
+	free(ring_name);
+
+
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+  mosquitto_loopback
+  Stand-in broker for tests and benchmarks on one host (see msg_broker.h).
+  Listens on loopback TCP and optionally a Unix socket; clients connect to
+  the socket with -h <path> -p 0. With -X it records traced messages as a
+  forwarding hop (see msg_trace.h).
+
+  Compile: g++ -O2 -Imosquitto-2.0.8/includes mosquitto_loopback.cpp msg_broker.cpp msg_trace.cpp -lmosquitto -lpthread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+
+#include <mosquitto.h>
+#include "msg_broker.h"
+
+#define DEFAULT_BIND_HOST "127.0.0.1"
+#define DEFAULT_STATS_INTERVAL 0
+
+#define UNUSED(A) (void)(A)
+
+#ifndef _WINDOWS
+
+static volatile bool run = true;
+static struct broker broker;
+static struct trace_file trace;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-h bind_host] [-p port] [-u unix_path] [-i interval] [-X trace_file]\n"
+		" -h : address to listen on. Default: %s\n"
+		" -p : TCP port, 0 for any free port, -1 for none. Default: %d\n"
+		" -u : also listen on this Unix socket path\n"
+		" -i : seconds between stats reports, 0 for none. Default: %d\n"
+		" -X : record receive and forward times of traced messages to trace_file\n",
+		argv0, DEFAULT_BIND_HOST, BROKER_DEFAULT_PORT, DEFAULT_STATS_INTERVAL);
+	exit(1);
+}
+
+void signal_handler(int s) {
+	UNUSED(s);
+	run = false;
+}
+
+int main(int argc, char **argv)
+{
+	char *bind_host = strdup(DEFAULT_BIND_HOST);
+	char *unix_path = NULL;
+	char *trace_path = NULL;
+	int port = BROKER_DEFAULT_PORT;
+	int stats_interval = DEFAULT_STATS_INTERVAL;
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -h argument given but no host specified.");
+				return 1;
+			}
+			else {
+				free(bind_host);
+				bind_host = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-p"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -p argument given but no port specified.");
+				return 1;
+			}
+			else {
+				port = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-u"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -u argument given but no path specified.");
+				return 1;
+			}
+			else {
+				free(unix_path);
+				unix_path = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-i"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -i argument given but no interval specified.");
+				return 1;
+			}
+			else {
+				stats_interval = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-X"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -X argument given but no trace file specified.");
+				return 1;
+			}
+			else {
+				free(trace_path);
+				trace_path = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else
+		{
+			usage(argv[0]);
+		}
+	}
+
+	if (port < 0 && !unix_path) {
+		fprintf(stderr, "Error: no TCP port and no Unix socket to listen on.\n");
+		return 1;
+	}
+
+	int rc = broker_init(&broker);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to start broker: %s\n", mosquitto_strerror(rc));
+		return 1;
+	}
+	if (trace_path) {
+		rc = trace_file_open(&trace, trace_path, "loopback");
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to open trace file '%s'.\n", trace_path);
+			broker_cleanup(&broker);
+			return 1;
+		}
+		broker.trace = &trace;
+	}
+	if (port >= 0) {
+		rc = broker_listen_tcp(&broker, bind_host, port);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to listen on %s:%d: %s\n", bind_host, port, mosquitto_strerror(rc));
+			broker_cleanup(&broker);
+			return 1;
+		}
+		printf("listening on %s:%d\n", bind_host, broker.port);
+	}
+	if (unix_path) {
+		rc = broker_listen_unix(&broker, unix_path);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to listen on %s: %s\n", unix_path, mosquitto_strerror(rc));
+			broker_cleanup(&broker);
+			return 1;
+		}
+		printf("listening on %s\n", unix_path);
+	}
+	fflush(stdout);
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (stats_interval > 0) {
+		/* the broker serves on its own thread so this one can report */
+		broker_start(&broker);
+		time_t next_stats = time(NULL) + stats_interval;
+		while (run) {
+			struct timespec ts = { 0, 100 * 1000000 };
+			nanosleep(&ts, NULL);
+			if (time(NULL) >= next_stats) {
+				broker_print_stats(&broker, stderr);
+				next_stats = time(NULL) + stats_interval;
+			}
+		}
+		broker_stop(&broker);
+	}
+	else {
+		rc = broker_run(&broker, &run);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+		}
+	}
+
+	broker_print_stats(&broker, stderr);
+	broker_cleanup(&broker);
+	if (trace_path) {
+		fprintf(stderr, "%llu trace records written to %s\n", (unsigned long long)trace.records, trace_path);
+		trace_file_close(&trace);
+	}
+	free(trace_path);
+	free(bind_host);
+	free(unix_path);
+
+	return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+	UNUSED(argc);
+	UNUSED(argv);
+	fprintf(stderr, "mosquitto_loopback is not supported on Windows.\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,351 @@
+/*
+  mqtt_lvc
+  Last-value cache: keeps the latest payload of every topic in a memory-mapped
+  file (see msg_lvc.h) that local tools read without talking to the broker.
+
+  mosquitto_lvc [-t topic]... [-c file]      run the cache
+  mosquitto_lvc -c file -q topic             print the cached value of topic
+  mosquitto_lvc -c file -l                   list cached topics
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#if defined(_WINDOWS)
+# include <windows.h>
+#define sleep(x) Sleep((x)*1000)
+#define strdup _strdup
+#else
+#include <unistd.h>
+#endif
+#include <signal.h>
+
+#include <mosquitto.h>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_projection.h"
+#include "msg_verify.h"
+#include "msg_chunk.h"
+#include "msg_lvc.h"
+
+#define DEFAULT_MQTT_HOST "127.0.0.1"
+#define DEFAULT_MQTT_PORT 1883
+#define DEFAULT_MQTT_KEEPALIVE 60
+#define DEFAULT_MQTT_TOPIC "EXAMPLE_TOPIC"
+#define DEFAULT_LVC_FILE "mqtt_lvc.dat"
+
+static bool run = true;
+static char **topics = NULL;
+static int topic_count = 0;
+static struct lvc cache;
+static struct verify_cache verify_cache;
+static struct chunk_reassembly reassembly;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-t topic]... [-c file] [-n slots] [-v value_size]\n"
+		"       %s [-c file] -q topic | -l\n"
+		" -t : cache topic, may be repeated. Default: %s\n"
+		" -c : cache file. Default: %s\n"
+		" -n : number of topic slots. Default: %d\n"
+		" -v : largest payload kept, in bytes. Default: %d\n"
+		" -q : print the cached value of topic and exit\n"
+		" -l : list cached topics and exit\n",
+		argv0, argv0, DEFAULT_MQTT_TOPIC, DEFAULT_LVC_FILE, LVC_DEFAULT_SLOTS, LVC_DEFAULT_VALUE_SIZE);
+	exit(1);
+}
+
+void signal_handler(int s) {
+	run = false;
+}
+
+void connect_callback(struct mosquitto *mosq, void *obj, int result) {
+	printf("connect callback, rc=%d\n", result);
+
+	if (!result) {
+		mosquitto_subscribe_multiple(mosq, NULL, topic_count, topics, 0, 0, NULL);
+	}
+}
+
+void store(const char *topic, const uint8_t *payload, size_t len) {
+
+	if (!verify_cached(&verify_cache, topic, payload, len)) {
+		fprintf(stderr, "Error: malformed FlexBuffer on topic '%s', dropped.\n", topic);
+		return;
+	}
+
+	int rc = lvc_put(&cache, topic, payload, len);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: topic '%s' not cached: %s\n", topic, mosquitto_strerror(rc));
+	}
+}
+
+void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
+
+	if (msg->payloadlen == 0) return;
+
+	if (chunk_is_frame(msg->payload, msg->payloadlen)) {
+		struct chunk_view chunk;
+		int rc = chunk_receive(&reassembly, msg->topic, msg->payload, msg->payloadlen, &chunk);
+		if (rc != CHUNK_COMPLETE) return;
+
+		store(msg->topic, chunk.data, chunk.size);
+		chunk_release(&reassembly, &chunk);
+		return;
+	}
+
+	store(msg->topic, (const uint8_t *)msg->payload, msg->payloadlen);
+}
+
+int query(const char *path, const char *topic) {
+
+	struct lvc_entry entry;
+	std::vector<uint8_t> buf(LVC_DEFAULT_VALUE_SIZE);
+
+	int rc = lvc_open(&cache, path);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to open cache '%s': %s\n", path, mosquitto_strerror(rc));
+		return 1;
+	}
+
+	rc = lvc_get(&cache, topic, buf.data(), buf.size(), &entry);
+	if (rc == MOSQ_ERR_PAYLOAD_SIZE) {
+		buf.resize(entry.len);
+		rc = lvc_get(&cache, topic, buf.data(), buf.size(), &entry);
+	}
+	if (rc == MOSQ_ERR_SUCCESS && entry.len == 0) rc = MOSQ_ERR_NOT_FOUND;
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: topic '%s': %s\n", topic, mosquitto_strerror(rc));
+		lvc_close(&cache);
+		return 1;
+	}
+
+	fprintf(stdout, "topic '%s': %zu bytes, version %llu, %llu ms old\n", topic, entry.len,
+		(unsigned long long)entry.version, (unsigned long long)((uint64_t)time(NULL) * 1000 - entry.updated_ms));
+
+	auto root = flexbuffers::GetRoot(buf.data(), entry.len);
+	if (root.IsMap()) {
+		auto map = root.AsMap();
+		auto keys = map.Keys();
+		auto values = map.Values();
+
+		for (size_t i = 0; i < keys.size(); i++) {
+			fprintf(stdout, "%s : ", keys[i].AsKey());
+			projection_print(stdout, values[i]);
+			fprintf(stdout, "\n");
+		}
+	}
+
+	lvc_close(&cache);
+	return 0;
+}
+
+int list(const char *path) {
+
+	char topic[LVC_MAX_TOPIC];
+
+	int rc = lvc_open(&cache, path);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to open cache '%s': %s\n", path, mosquitto_strerror(rc));
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < cache.hdr->slot_count; i++) {
+		if (lvc_topic_at(&cache, i, topic, sizeof(topic))) {
+			fprintf(stdout, "%s\n", topic);
+		}
+	}
+	fprintf(stderr, "%u of %u slots used, %u updates rejected\n", cache.hdr->used_slots.load(), cache.hdr->slot_count, cache.hdr->rejected.load());
+
+	lvc_close(&cache);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *mqtt_host = strdup(DEFAULT_MQTT_HOST);
+	char *lvc_file = strdup(DEFAULT_LVC_FILE);
+	char *query_topic = NULL;
+	bool list_topics = false;
+	int mqtt_port = DEFAULT_MQTT_PORT;
+	int mqtt_keepalive = DEFAULT_MQTT_KEEPALIVE;
+	int slot_count = LVC_DEFAULT_SLOTS;
+	int value_size = LVC_DEFAULT_VALUE_SIZE;
+	bool clean_session = true;
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -h argument given but no host specified.");
+				return 1;
+			}
+			else {
+				free(mqtt_host);
+				mqtt_host = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-p"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -p argument given but no port specified.");
+				return 1;
+			}
+			else {
+				mqtt_port = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-t"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -t argument given but no topic specified.");
+				return 1;
+			}
+			else if (mosquitto_sub_topic_check(argv[i + 1]) != MOSQ_ERR_SUCCESS) {
+				fprintf(stderr, "Error: Invalid subscription topic '%s'.\n", argv[i + 1]);
+				return 1;
+			}
+			else {
+				topics = (char **)realloc(topics, (size_t)(topic_count + 1) * sizeof(char *));
+				topics[topic_count++] = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-c"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -c argument given but no file specified.");
+				return 1;
+			}
+			else {
+				free(lvc_file);
+				lvc_file = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-n"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -n argument given but no slot count specified.");
+				return 1;
+			}
+			else {
+				long n = strtol(argv[i + 1], NULL, 10);
+				if (n < 1 || n > LVC_MAX_SLOTS) {
+					fprintf(stderr, "Error: -n slot count must be between 1 and %d.\n", LVC_MAX_SLOTS);
+					return 1;
+				}
+				slot_count = (int)n;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-v"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -v argument given but no size specified.");
+				return 1;
+			}
+			else {
+				long n = strtol(argv[i + 1], NULL, 10);
+				if (n < 1 || n > LVC_MAX_VALUE_SIZE) {
+					fprintf(stderr, "Error: -v size must be between 1 and %d.\n", LVC_MAX_VALUE_SIZE);
+					return 1;
+				}
+				value_size = (int)n;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-q"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -q argument given but no topic specified.");
+				return 1;
+			}
+			else {
+				query_topic = argv[i + 1];
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-l"))
+		{
+			list_topics = true;
+		}
+		else
+		{
+			usage(argv[0]);
+		}
+
+	}
+
+	/* reader modes: no broker connection */
+	if (query_topic || list_topics) {
+		int rc = query_topic ? query(lvc_file, query_topic) : list(lvc_file);
+		free(mqtt_host);
+		free(lvc_file);
+		return rc;
+	}
+
+	if (topic_count == 0) {
+		topics = (char **)malloc(sizeof(char *));
+		topics[topic_count++] = strdup(DEFAULT_MQTT_TOPIC);
+	}
+
+	int rc = lvc_create(&cache, lvc_file, (uint32_t)slot_count, (uint32_t)value_size);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to create cache '%s': %s\n", lvc_file, mosquitto_strerror(rc));
+		return 1;
+	}
+	fprintf(stderr, "cache '%s': %u topics kept from the last run\n", lvc_file, cache.hdr->used_slots.load());
+
+	verify_cache_init(&verify_cache);
+	chunk_reassembly_init(&reassembly, CHUNK_DEFAULT_TIMEOUT_MS);
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	struct mosquitto *mosq = NULL;
+	mosquitto_lib_init();
+	mosq = mosquitto_new(NULL, clean_session, NULL);
+	if (!mosq) {
+		fprintf(stderr, "Could not create new mosquitto struct\n");
+
+		exit(1);
+	}
+
+	mosquitto_connect_callback_set(mosq, connect_callback);
+	mosquitto_message_callback_set(mosq, message_callback);
+
+	if (mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive)) {
+		fprintf(stderr, "Unable to connect mosquitto.\n");
+
+		exit(1);
+	}
+
+	while (run) {
+		int loop = mosquitto_loop(mosq, -1, 1);
+		if (loop) {
+			fprintf(stderr, "mosquitto connection error!\n");
+			sleep(1);
+			mosquitto_reconnect(mosq);
+		}
+	}
+
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+	chunk_reassembly_cleanup(&reassembly);
+	lvc_close(&cache);
+	for (int i = 0; i < topic_count; i++) {
+		free(topics[i]);
+	}
+	free(topics);
+	free(mqtt_host);
+	free(lvc_file);
+
+
+	return 0;
+}
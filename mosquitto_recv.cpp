@@ -20,20 +20,32 @@
 
 #include <mosquitto.h>
 #include <flatbuffers/flexbuffers.h>
-
-#define IN_BUF_LENGTH 65536
+#include "msg_projection.h"
+#include "msg_verify.h"
+#include "msg_chunk.h"
+#include "msg_claim.h"
+#include "msg_reconnect.h"
 
 #define DEFAULT_MQTT_HOST "127.0.0.1"
 #define DEFAULT_MQTT_PORT 1883
 #define DEFAULT_MQTT_KEEPALIVE 60
 #define DEFAULT_MQTT_TOPIC "EXAMPLE_TOPIC"
 
-static bool run = true;
+static volatile bool run = true;
+static bool dump_all = false;
+static struct msg_projection projection;
+static struct verify_cache verify_cache;
+static struct chunk_reassembly reassembly;
+static struct claim_reader claim_reader;
+static struct reconnect_state reconnector;
 
 void usage(char *argv0)
 {
 	fprintf(stderr,
-		"Usage: %s [-h host] [-p port]\n", argv0);
+		"Usage: %s [-h host] [-p port] [-i id] [-f field]... [-a]\n"
+		" -i : client id; keeps a persistent session across reconnects\n"
+		" -f : decode only this (dotted) field, may be repeated. Default: time, text\n"
+		" -a : dump every key of the payload\n", argv0);
 	exit(1);
 }
 
@@ -41,8 +53,48 @@ void signal_handler(int s) {
 	run = false;
 }
 
-void connect_callback(struct mosquitto *mosq, void *obj, int result) {
+void connect_callback(struct mosquitto *mosq, void *obj, int result, int flags) {
 	printf("connect callback, rc=%d\n", result);
+
+	/* with a persistent session the broker kept our subscription */
+	if (reconnect_connected(&reconnector, result, flags)) {
+		mosquitto_subscribe(mosq, NULL, (const char *)obj, 0);
+	}
+}
+
+void print_payload(const char *topic, const uint8_t *payload, size_t len) {
+
+	if (!verify_cached(&verify_cache, topic, payload, len)) {
+		fprintf(stderr, "Error: malformed FlexBuffer on topic '%s', dropped.\n", topic);
+		return;
+	}
+	
+	if (dump_all) {
+		auto map = flexbuffers::GetRoot(payload, len).AsMap();
+		fprintf(stdout, "Map size: %zu\n", map.size());
+
+		auto keys = map.Keys();
+		auto values = map.Values();
+
+		for (int i = 0; i < keys.size(); i++) {
+			fprintf(stderr, "Key[%d]: %s : ", i, keys[i].AsKey());
+			projection_print(stderr, values[i]);
+			fprintf(stderr, "\n");
+		}
+		return;
+	}
+
+	flexbuffers::Reference fields[PROJECTION_MAX_FIELDS];
+	if (projection_decode(&projection, payload, len, fields) < 0) {
+		fprintf(stderr, "Error: payload is not a FlexBuffer map.\n");
+		return;
+	}
+
+	for (int i = 0; i < projection.key_count; i++) {
+		fprintf(stderr, "%s : ", projection.keys[i]);
+		projection_print(stderr, fields[i]);
+		fprintf(stderr, "\n");
+	}
 }
 
 void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
@@ -53,25 +105,38 @@ void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_
 	
 	//fprintf(stderr, "message : '%s'\n", (char *)msg->payload);
 
-	unsigned char in_buf[IN_BUF_LENGTH];
-	memcpy_s(in_buf, IN_BUF_LENGTH, msg->payload, msg->payloadlen);
-	std::vector<uint8_t> buf(in_buf, in_buf + msg->payloadlen);
-	
-	auto map = flexbuffers::GetRoot(buf).AsMap();
-	fprintf(stdout, "Map size: %zu\n", map.size());
-
-	auto keys = map.Keys();
-	auto values = map.Values();
-
-	for (int i = 0; i < keys.size(); i++) {
-		auto key = keys[i];
-		auto val = values[i];
-		
-		fprintf(stderr, "Key[%d]: %s : %s\n", i, key.AsString().c_str(),
-			val.ToString().c_str());
+	/* decode in place: libmosquitto owns msg->payload until we return */
+	if (claim_is_desc(msg->payload, msg->payloadlen)) {
+		struct claim_view claim;
+		int rc = claim_resolve(&claim_reader, msg->payload, msg->payloadlen, &claim);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: claim on topic '%s' not readable: %s\n", msg->topic, mosquitto_strerror(rc));
+			return;
+		}
+
+		fprintf(stdout, "topic '%s': claimed %zu bytes from shared memory\n", msg->topic, claim.size);
+		print_payload(msg->topic, claim.data, claim.size);
+		claim_release(&claim);
+		return;
 	}
 
-	
+	if (chunk_is_frame(msg->payload, msg->payloadlen)) {
+		struct chunk_view chunk;
+		int rc = chunk_receive(&reassembly, msg->topic, msg->payload, msg->payloadlen, &chunk);
+		if (rc == CHUNK_PENDING) return;
+		if (rc != CHUNK_COMPLETE) {
+			fprintf(stderr, "Error: chunk on topic '%s' dropped (%d).\n", msg->topic, rc);
+			return;
+		}
+
+		fprintf(stdout, "topic '%s': reassembled %zu bytes\n", msg->topic, chunk.size);
+		print_payload(msg->topic, chunk.data, chunk.size);
+		chunk_release(&reassembly, &chunk);
+		return;
+	}
+
+	print_payload(msg->topic, (const uint8_t *)msg->payload, msg->payloadlen);
+
 	//write(fileno(stdout), (char *)msg->payload, msg->payloadlen);
 	//mosquitto_topic_matches_sub("/devices/test/+", msg->topic, &match);
 }
@@ -85,6 +150,7 @@ int main(int argc, char **argv)
 
 
 	int mdelay = 0;
+	char *client_id = NULL;
 	bool clean_session = true;
 
 	/* Parse options */
@@ -111,6 +177,33 @@ int main(int argc, char **argv)
 			}
 			i++;
 		}
+		else if (!strcmp(argv[i], "-i"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -i argument given but no id specified.");
+				return 1;
+			}
+			else {
+				client_id = strdup(argv[i + 1]);
+				clean_session = false;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-f"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -f argument given but no field specified.");
+				return 1;
+			}
+			else if (projection_add(&projection, argv[i + 1])) {
+				return 1;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-a"))
+		{
+			dump_all = true;
+		}
 		else
 		{
 			usage(argv[0]);
@@ -118,20 +211,30 @@ int main(int argc, char **argv)
 
 	}
 
+	if (projection.key_count == 0) {
+		projection_add(&projection, "time");
+		projection_add(&projection, "text");
+	}
+
+
+	verify_cache_init(&verify_cache);
+	chunk_reassembly_init(&reassembly, CHUNK_DEFAULT_TIMEOUT_MS);
+	claim_reader_init(&claim_reader);
+	reconnect_init(&reconnector, RECONNECT_DEFAULT_BASE_MS, RECONNECT_DEFAULT_CAP_MS, 0);
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 
 	struct mosquitto *mosq = NULL;
 	mosquitto_lib_init();
-	mosq = mosquitto_new(NULL, clean_session, NULL);
+	mosq = mosquitto_new(client_id, clean_session, mqtt_topic);
 	if (!mosq) {
 		fprintf(stderr, "Could not create new mosquitto struct\n");
 
 		exit(1);
 	}
 
-	mosquitto_connect_callback_set(mosq, connect_callback);
+	mosquitto_connect_with_flags_callback_set(mosq, connect_callback);
 	mosquitto_message_callback_set(mosq, message_callback);
 
 	if (mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive)) {
@@ -140,19 +243,20 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	mosquitto_subscribe(mosq, NULL, mqtt_topic, 0);
-
 	while (run) {
 		int loop = mosquitto_loop(mosq, -1, 1);
 		if (loop) {
-			fprintf(stderr, "mosquitto connection error!\n");
-			sleep(1);
-			mosquitto_reconnect(mosq);
+			fprintf(stderr, "mosquitto connection error: %s\n", mosquitto_strerror(loop));
+			reconnect_run(&reconnector, mosq, &run);
 		}
 	}
+	reconnect_print_stats(&reconnector, stderr);
 
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
+	chunk_reassembly_cleanup(&reassembly);
+	claim_reader_cleanup(&claim_reader);
+	free(client_id);
 	free(mqtt_host);
 	free(mqtt_topic);
 
@@ -8,6 +8,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 #if defined(_WINDOWS)
 # include <windows.h>
 #define sleep(x) Sleep((x)*1000)
@@ -16,9 +18,16 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <sys/time.h>
+/* the interactive loop reads one word into buf[BUF_LENGTH] */
+#define scanf_s(format, buf, size) scanf("%65535s", buf)
 #endif
 #include <mosquitto.h>
 #include <flatbuffers/flexbuffers.h>
+#include "sensor_msg.h"
+#include "msg_chunk.h"
+#include "msg_spool.h"
+#include "msg_conflate.h"
+#include "msg_loadgen.h"
 
 
 #define DEFAULT_MQTT_HOST "127.0.0.1"
@@ -27,17 +36,45 @@
 #define DEFAULT_MQTT_TOPIC "EXAMPLE_TOPIC"
 
 #define BUF_LENGTH 65536
+#define CONFLATE_DRAIN_POLLS 200 /* 10 ms each: how long exit waits for waiting state values */
+
+static struct chunk_sender chunker;
+static struct spool outbox;
+static bool spooling = false;
+static struct conflate_outbox outbox_state;
+static bool conflating = false;
 
 void usage(char *argv0)
 {
 	fprintf(stderr,
-		"Usage: %s [-h host] [-p port]\n", argv0);
+		"Usage: %s [-h host] [-p port] [-c chunk_size] [-s spool_dir [-y sync_every]] [-S] [-L load]\n"
+		" -c : send payloads larger than chunk_size bytes as a chunked transfer\n"
+		" -s : store messages in spool_dir and forward them (QoS 1) whenever the broker is reachable\n"
+		" -y : sync the spool to disk every sync_every messages; more is faster, but a power failure can lose up to sync_every - 1. Default: %d\n"
+		" -S : the topic carries state: when the connection is congested only its newest value is sent\n"
+		" -L : generate load instead of reading stdin, e.g. poisson,rate=5000,topics=100,connections=4,size=64-1024,duration=30\n"
+		"      keys: constant|poisson|burst, sensor|samples|random, rate, burst, topics, connections, size, pool, qos, count, duration\n", argv0, SPOOL_DEFAULT_SYNC_EVERY);
 	exit(1);
 }
 
 
 void connect_callback(struct mosquitto *mosq, void *obj, int result) {
 	printf("connect callback, rc=%d\n", result);
+	if (spooling && result == 0) spool_drain(&outbox, mosq);
+}
+
+void disconnect_callback(struct mosquitto *mosq, void *obj, int result) {
+	printf("disconnect callback, rc=%d\n", result);
+	if (spooling) spool_rewind(&outbox);
+}
+
+void publish_callback(struct mosquitto *mosq, void *obj, int mid) {
+	chunk_sender_acked(&chunker, mid);
+	if (conflating) conflate_acked(&outbox_state, mosq, mid);
+	if (spooling) {
+		spool_acked(&outbox, mid);
+		spool_drain(&outbox, mosq);
+	}
 }
 
 void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
@@ -46,6 +83,14 @@ void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_
 }
 
 
+static volatile bool load_running = true;
+
+static void stop_load(int signum)
+{
+	(void)signum;
+	load_running = false;
+}
+
 int main(int argc, char **argv)
 {
 	int rc;
@@ -55,9 +100,13 @@ int main(int argc, char **argv)
 	int mqtt_keepalive = DEFAULT_MQTT_KEEPALIVE;
 
 	int mdelay = 0;
+	int chunk_size = 0;
+	char *spool_dir = NULL;
+	int sync_every = SPOOL_DEFAULT_SYNC_EVERY;
+	char *load_spec = NULL;
 	bool clean_session = true;
 
-	flexbuffers::Builder fbb;
+	flexbuffers::Builder fbb(256, flexbuffers::BUILDER_FLAG_NONE);
 
 	/* Parse options */
 	for (int i = 1; i < argc; i++) {
@@ -84,22 +133,123 @@ int main(int argc, char **argv)
 			}
 			i++;
 		}
+		else if (!strcmp(argv[i], "-c"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -c argument given but no chunk size specified.");
+				return 1;
+			}
+			else {
+				chunk_size = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-s"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -s argument given but no spool directory specified.");
+				return 1;
+			}
+			else {
+				spool_dir = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-y"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -y argument given but no count specified.");
+				return 1;
+			}
+			else {
+				sync_every = atoi(argv[i + 1]);
+				if (sync_every < 1) {
+					fprintf(stderr, "Error: -y count must be at least 1.\n");
+					return 1;
+				}
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-S"))
+		{
+			conflating = true;
+		}
+		else if (!strcmp(argv[i], "-L"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -L argument given but no load specification.");
+				return 1;
+			}
+			else {
+				load_spec = strdup(argv[i + 1]);
+			}
+			i++;
+		}
 		else
 		{
 			usage(argv[0]);
 		}
 
 	}
+
+	/* the load generator publishes on connections of its own, none of these would apply */
+	if (load_spec && (chunk_size > 0 || spool_dir || conflating)) {
+		fprintf(stderr, "Error: -L cannot be combined with -c, -s or -S.\n");
+		return 1;
+	}
 	
 	struct mosquitto *mosq = NULL;
 	mosquitto_lib_init();
+
+	if (load_spec) {
+		signal(SIGINT, stop_load);
+		signal(SIGTERM, stop_load);
+		rc = loadgen_main(load_spec, mqtt_host, mqtt_port, mqtt_keepalive, MQTT_PROTOCOL_V311, mqtt_topic, NULL, NULL, &load_running);
+		mosquitto_lib_cleanup();
+		free(load_spec);
+		return rc == MOSQ_ERR_SUCCESS ? 0 : 1;
+	}
+
 	mosq = mosquitto_new(NULL, clean_session, NULL);
 	if (!mosq) {
 		fprintf(stderr, "Could not create new mosquitto struct\n");
 		exit(1);
 	}
 
-	if (mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive)) {
+	mosquitto_connect_callback_set(mosq, connect_callback);
+	mosquitto_disconnect_callback_set(mosq, disconnect_callback);
+	mosquitto_publish_callback_set(mosq, publish_callback);
+
+	if (conflating) {
+		conflate_init(&outbox_state, CONFLATE_DEFAULT_WINDOW);
+		conflate_add_state(&outbox_state, mqtt_topic);
+	}
+
+	if (spool_dir) {
+		rc = spool_open(&outbox, spool_dir, 0, 0);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Unable to open spool %s: %s\n", spool_dir, mosquitto_strerror(rc));
+			exit(1);
+		}
+		spooling = true;
+		spool_set_sync_every(&outbox, sync_every);
+
+		struct spool_stats stats;
+		spool_get_stats(&outbox, &stats);
+		printf("spool %s: %llu messages pending\n", spool_dir, (unsigned long long)stats.pending);
+	}
+
+#ifndef _WINDOWS
+	chunk_sender_init(&chunker, (uint32_t)chunk_size, CHUNK_DEFAULT_WINDOW, 1, true);
+#else
+	chunk_sender_init(&chunker, (uint32_t)chunk_size, CHUNK_DEFAULT_WINDOW, 1, false);
+#endif
+
+	if (spooling) {
+		/* start offline if need be, the network thread keeps reconnecting */
+		mosquitto_connect_async(mosq, mqtt_host, mqtt_port, mqtt_keepalive);
+	}
+	else if (mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive)) {
 		fprintf(stderr, "Unable to connect mosquitto.\n");
 		exit(1);
 	}
@@ -116,9 +266,10 @@ int main(int argc, char **argv)
 	struct timeval tv;
 	char buf[BUF_LENGTH];
 	std::vector<uint8_t> flex_buf;
+	sensor_msg msg;
 	
 	do {
-		rc = mosquitto_loop(mosq, -1, 1);
+		if (!spooling) rc = mosquitto_loop(mosq, -1, 1);
 
 		scanf_s("%s", buf, BUF_LENGTH);
 		if (!strcmp(buf, "exit")) break;
@@ -132,24 +283,59 @@ int main(int argc, char **argv)
 		double timestamp = (double)ticks;
 #endif
 
-		fbb.Clear();
-		fbb.Map([&]() {
-			fbb.Double("time", timestamp);
-			fbb.String("text", buf);
-		});
-		fbb.Finish();				
+		msg.time = timestamp;
+		msg.text = buf;
+		msg_schema::encode_flex(fbb, msg);
 		
 		flex_buf = fbb.GetBuffer();
 
-		rc = mosquitto_publish(mosq, NULL, mqtt_topic, flex_buf.size(), flex_buf.data(), 0, 0);
+		if (spooling) {
+			/* offline the message waits in the spool for the connect callback */
+			rc = spool_append(&outbox, mqtt_topic, flex_buf.data(), flex_buf.size(), 1);
+			if (rc == MOSQ_ERR_SUCCESS) spool_drain(&outbox, mosq);
+		}
+		else if (chunk_size > 0 && flex_buf.size() > (size_t)chunk_size) {
+			rc = chunk_publish(&chunker, mosq, mqtt_topic, flex_buf.data(), flex_buf.size(), NULL);
+		}
+		else if (conflating) {
+			rc = conflate_publish(&outbox_state, mosq, mqtt_topic, flex_buf.data(), flex_buf.size(), 0, false, NULL);
+		}
+		else {
+			rc = mosquitto_publish(mosq, NULL, mqtt_topic, flex_buf.size(), flex_buf.data(), 0, 0);
+		}
 		if (rc != MOSQ_ERR_SUCCESS) {
 			fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
 		}
 		
 	} while (rc == MOSQ_ERR_SUCCESS);
 
+	if (conflating) {
+		/* the newest state values still waiting in their slots go out before the disconnect */
+		struct conflate_stats stats;
+		for (int i = 0; i < CONFLATE_DRAIN_POLLS; i++) {
+			if (conflate_flush(&outbox_state, mosq) != MOSQ_ERR_SUCCESS) break;
+			conflate_get_stats(&outbox_state, &stats);
+			if (!stats.pending && !mosquitto_want_write(mosq)) break;
+#ifndef _WINDOWS
+			usleep(10000);
+#else
+			mosquitto_loop(mosq, 10, 1);
+#endif
+		}
+	}
+	mosquitto_disconnect(mosq);
+	mosquitto_loop_stop(mosq, false);
+	if (spooling) spool_close(&outbox);
+	if (conflating) {
+		struct conflate_stats stats;
+		conflate_get_stats(&outbox_state, &stats);
+		printf("state: %llu sent, %llu conflated, longest wait %llu ms\n", (unsigned long long)stats.published,
+			(unsigned long long)stats.conflated, (unsigned long long)stats.max_delay_ms);
+		conflate_cleanup(&outbox_state);
+	}
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
+	free(spool_dir);
 	free(mqtt_host);
 	free(mqtt_topic);
 
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <atomic>
 #if defined(_WINDOWS)
 # include <windows.h>
 #define sleep(x) Sleep((x)*1000)
@@ -13,6 +16,19 @@
 #include <mosquitto.h>
 #include <mqtt_protocol.h>
 #include <flatbuffers/flexbuffers.h>
+#include "msg_projection.h"
+#include "msg_verify.h"
+#include "msg_chunk.h"
+#include "msg_claim.h"
+#include "msg_ring.h"
+#include "msg_sched.h"
+#include "msg_stage.h"
+#include "msg_trace.h"
+#include "msg_metrics.h"
+#include "msg_tracepoint.h"
+#include "msg_flight.h"
+#include "msg_alloc.h"
+#include "msg_topic_cache.h"
 
 
 #define UNUSED(A) (void)(A)
@@ -22,9 +38,6 @@
 #define DEFAULT_MQTT_KEEPALIVE 60
 
 
-#define BUF_LENGTH 65536
-
-
 struct mosq_config {
 	char *id;
 	int protocol_version;
@@ -41,6 +54,19 @@ struct mosq_config {
 	char **unsub_topics; /* sub */
 	int unsub_topic_count; /* sub */
 	int sub_opts; /* sub */
+	bool dump_all;
+	char *ring_name; /* read from a local fan-out ring instead of the broker */
+	int trace_every; /* time the stages of one message in this many, 0: off */
+	char *trace_file; /* record receive times of traced messages */
+	char *metrics_target; /* Prometheus endpoint port or text file */
+	char *stats_topic; /* publish metrics snapshots here */
+	int metrics_interval; /* seconds between metrics exports */
+	char *flight_file; /* flight recorder dumps, path.<pid>.<n> */
+	int flight_records; /* per thread */
+	int flight_prefix; /* payload bytes per record */
+	bool alloc_report; /* count allocations by stage */
+	bool changes_only; /* skip payloads equal to the topic's last value */
+	struct msg_projection projection;
 	mosquitto_property *connect_props;
 	mosquitto_property *publish_props;
 	mosquitto_property *subscribe_props;
@@ -49,17 +75,53 @@ struct mosq_config {
 };
 
 struct mosq_config cfg;
+static struct verify_cache verify_cache;
+static struct chunk_reassembly reassembly;
+static struct claim_reader claim_reader;
+static struct rx_sched sched;
+static struct topic_cache last_values; /* -D, touched by the decoding thread only */
+static int control_lane = -1;
+static int bulk_lane = -1;
 
 int last_mid = 0;
+static volatile bool process_messages = true;
 static bool timed_out = false;
 static int connack_result = 0;
 bool connack_received = false;
+static struct mosquitto *g_mosq = NULL; /* for the signal handler */
+static struct tracer tracer;
+static std::atomic<struct mosquitto *> stats_mosq(NULL); /* NULL: no snapshots (ring reader) */
+static bool ever_connected = false;
+
+/* stage timing (-T) and flight record (-F) of one received message */
+struct rx_trace {
+	struct stage_span span;
+	double arrival; /* wall clock seconds at the message callback, 0: unknown */
+	struct flight_rec *flight;
+};
 
 
 void usage(char *argv0)
 {
 	fprintf(stderr,
-		"Usage: %s [-h host] [-p port]\n", argv0);
+		"Usage: %s [-h host] [-p port] [-I id] [-f field]... [-a] [-R ring] [-C pattern]... [-B pattern]... [-T every] [-X trace_file] [-M [host:]port|file] [-S stats_topic] [-i interval] [-F flight_file] [-N records] [-P bytes] [-D] [-A]\n"
+		" -I : client id; keeps a persistent session across reconnects\n"
+		" -f : decode only this (dotted) field, may be repeated. Default: time, text\n"
+		" -a : dump every key of the payload\n"
+		" -R : read from the shared memory ring of a local mosquitto_fanout\n"
+		" -C : control topics, handled before anything else\n"
+		" -B : bulk topics, only the latest value per topic is kept when we fall behind\n"
+		" -T : time transit, queueing and decode for one message in every, print the histograms on exit\n"
+		" -X : record the receive time of messages carrying a trace context in trace_file\n"
+		" -M : serve Prometheus metrics on this TCP port (127.0.0.1 unless host:port), or write them to this file\n"
+		" -S : publish a FlexBuffer metrics snapshot on stats_topic\n"
+		" -i : seconds between metrics exports. Default: %d\n"
+		" -F : keep a flight recorder of the last messages, dumped to flight_file.<pid>.<n> on SIGUSR1 or a crash\n"
+		" -N : flight recorder records per thread. Default: %d\n"
+		" -P : payload bytes kept per flight record, at most %d. Default: 0\n"
+		" -D : print only payloads that differ from the last one on their topic\n"
+		" -A : count heap allocations by pipeline stage, print them on exit\n", argv0, METRICS_DEFAULT_INTERVAL_MS / 1000,
+		FLIGHT_DEFAULT_RECORDS, FLIGHT_PREFIX_MAX);
 	exit(1);
 }
 
@@ -80,6 +142,12 @@ void my_signal_handler(int signum)
 		timed_out = true;
 	}
 }
+
+void ring_signal_handler(int signum)
+{
+	UNUSED(signum);
+	process_messages = false;
+}
 #endif
 
 void err_printf(const struct mosq_config *cfg, const char *fmt, ...)
@@ -148,37 +216,174 @@ void my_publish_callback(struct mosquitto *mosq, void *obj, int mid, int reason_
 	}
 }
 
-void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg, const mosquitto_property *properties)
+static void trace_begin(struct rx_trace *trace)
 {
-	UNUSED(obj);
-	UNUSED(properties);
-	
-	if (msg->payloadlen == 0) return;
+	stage_begin(&trace->span);
+	trace->arrival = 0;
+	trace->flight = NULL;
+#ifndef _WINDOWS
+	/* the Windows sender stamps GetTickCount64(), not comparable */
+	if (stage_traced(&trace->span)) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		trace->arrival = tv.tv_sec + 1e-6*tv.tv_usec;
+	}
+#endif
+}
 
-	fprintf(stdout, "topic '%s': message %d bytes\n", msg->topic, msg->payloadlen);
+/* sensor_msg time is the sender's wall clock; meaningful between hosts only as far as their clocks agree */
+static void trace_transit(struct rx_trace *trace, const uint8_t *payload, size_t len)
+{
+	if (!stage_traced(&trace->span) || trace->arrival <= 0) return;
 
-	//fprintf(stderr, "message : '%s'\n", (char *)msg->payload);
+	auto sent = flexbuffers::GetRoot(payload, len).AsMap()["time"];
+	if (!sent.IsNumeric()) return;
 
-	unsigned char in_buf[BUF_LENGTH];
-	memcpy_s(in_buf, BUF_LENGTH, msg->payload, msg->payloadlen);
-	std::vector<uint8_t> buf(in_buf, in_buf + msg->payloadlen);
+	double transit = trace->arrival - sent.AsDouble();
+	if (transit > 0) stage_record(&trace->span, STAGE_TRANSIT, (uint64_t)(transit * 1e9));
+}
 
-	auto map = flexbuffers::GetRoot(buf).AsMap();
-	fprintf(stdout, "Map size: %zu\n", map.size());
+void print_payload(const char *topic, const uint8_t *payload, size_t len, struct rx_trace *trace)
+{
+	uint64_t decode_start = metrics_enabled ? metrics_now_ns() : 0;
+
+	stage_skip(&trace->span);
+	if (cfg.changes_only) {
+		/* the cached value passed verification already */
+		struct topic_cache_view last;
+		if (topic_cache_get(&last_values, topic, &last) && last.len == len && !memcmp(last.data, payload, len)) {
+			flight_done(trace->flight, FLIGHT_UNCHANGED);
+			return;
+		}
+	}
+	if (!verify_cached(&verify_cache, topic, payload, len)) {
+		metrics_count(METRIC_DECODE_ERRORS, 1);
+		flight_done(trace->flight, FLIGHT_MALFORMED);
+		err_printf(&cfg, "Error: malformed FlexBuffer on topic '%s', dropped.\n", topic);
+		return;
+	}
+	if (cfg.changes_only) topic_cache_put(&last_values, topic, payload, len);
+
+	if (cfg.dump_all) {
+		auto map = flexbuffers::GetRoot(payload, len).AsMap();
+		auto keys = map.Keys();
+		auto values = map.Values();
+		stage_mark(&trace->span, STAGE_DECODE);
+		flight_done(trace->flight, FLIGHT_OK);
+		if (decode_start) metrics_record(METRIC_DECODE_NS, metrics_now_ns() - decode_start);
+		trace_transit(trace, payload, len);
+		alloc_tag(ALLOC_PRINT);
+		fprintf(stdout, "Map size: %zu\n", map.size());
+
+		for (int i = 0; i < keys.size(); i++) {
+			fprintf(stdout, "Key[%d]: %s : ", i, keys[i].AsKey());
+			projection_print(stdout, values[i]);
+			fprintf(stdout, "\n");
+		}
+		return;
+	}
 
-	auto keys = map.Keys();
-	auto values = map.Values();
+	flexbuffers::Reference fields[PROJECTION_MAX_FIELDS];
+	if (projection_decode(&cfg.projection, payload, len, fields) < 0) {
+		metrics_count(METRIC_DECODE_ERRORS, 1);
+		flight_done(trace->flight, FLIGHT_NOT_MAP);
+		err_printf(&cfg, "Error: payload is not a FlexBuffer map.\n");
+		return;
+	}
+	stage_mark(&trace->span, STAGE_DECODE);
+	flight_done(trace->flight, FLIGHT_OK);
+	if (decode_start) metrics_record(METRIC_DECODE_NS, metrics_now_ns() - decode_start);
+	trace_transit(trace, payload, len);
+	alloc_tag(ALLOC_PRINT);
+
+	for (int i = 0; i < cfg.projection.key_count; i++) {
+		fprintf(stdout, "%s : ", cfg.projection.keys[i]);
+		projection_print(stdout, fields[i]);
+		fprintf(stdout, "\n");
+	}
+}
 
-	for (int i = 0; i < keys.size(); i++) {
-		auto key = keys[i];
-		auto val = values[i];
+void handle_payload(const char *topic, const void *payload, size_t len, struct rx_trace *trace)
+{
+	alloc_tag(ALLOC_DECODE);
+	if (claim_is_desc(payload, len)) {
+		struct claim_view claim;
+		int rc = claim_resolve(&claim_reader, payload, len, &claim);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			flight_done(trace->flight, FLIGHT_DROPPED);
+			err_printf(&cfg, "Error: claim on topic '%s' not readable: %s\n", topic, mosquitto_strerror(rc));
+			return;
+		}
 
-		fprintf(stdout, "Key[%d]: %s : %s\n", i, key.AsString().c_str(),
-			val.ToString().c_str());
+		fprintf(stdout, "topic '%s': claimed %zu bytes from shared memory\n", topic, claim.size);
+		print_payload(topic, claim.data, claim.size, trace);
+		claim_release(&claim);
+		return;
 	}
 
+	if (chunk_is_frame(payload, len)) {
+		struct chunk_view chunk;
+		int rc = chunk_receive(&reassembly, topic, payload, len, &chunk);
+		if (rc == CHUNK_PENDING) {
+			flight_done(trace->flight, FLIGHT_CHUNK);
+			return;
+		}
+		if (rc != CHUNK_COMPLETE) {
+			flight_done(trace->flight, FLIGHT_DROPPED);
+			err_printf(&cfg, "Error: chunk on topic '%s' dropped (%d).\n", topic, rc);
+			return;
+		}
+
+		fprintf(stdout, "topic '%s': reassembled %zu bytes\n", topic, chunk.size);
+		print_payload(topic, chunk.data, chunk.size, trace);
+		chunk_release(&reassembly, &chunk);
+		return;
+	}
+
+	print_payload(topic, (const uint8_t *)payload, len, trace);
+}
+
+static void count_received(size_t len)
+{
+	metrics_message(METRIC_MSGS_IN, METRIC_BYTES_IN, len);
+	metrics_record(METRIC_PAYLOAD_BYTES, len);
+	alloc_message();
+}
+
+void my_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg, const mosquitto_property *properties)
+{
+	struct rx_trace trace;
+	struct trace_ctx ctx;
+
+	UNUSED(obj);
+	
+	if (msg->payloadlen == 0) return;
 
+	/* before anything else, the receive time is what the stitched report uses */
+	tracer_receive(&tracer, msg->topic, properties, &ctx);
+	count_received((size_t)msg->payloadlen);
+	struct flight_rec *flight = flight_record(msg->topic, msg->payload, (size_t)msg->payloadlen, msg->mid, msg->qos, 0);
+
+	/* with lanes the network thread only queues, main() decodes */
+	if (control_lane >= 0 || bulk_lane >= 0) {
+		flight_done(flight, FLIGHT_QUEUED);
+		alloc_tag(ALLOC_QUEUE);
+		sched_push(&sched, msg->topic, msg->payload, (size_t)msg->payloadlen);
+		alloc_tag(ALLOC_NETWORK);
+		return;
+	}
+
+	trace_begin(&trace);
+	trace.flight = flight;
+
+	alloc_tag(ALLOC_PRINT);
+	fprintf(stdout, "topic '%s': message %d bytes\n", msg->topic, msg->payloadlen);
 
+	//fprintf(stderr, "message : '%s'\n", (char *)msg->payload);
+
+	/* decode in place: libmosquitto owns msg->payload until we return */
+	handle_payload(msg->topic, msg->payload, (size_t)msg->payloadlen, &trace);
+	alloc_tag(ALLOC_NETWORK);
 }
 
 void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flags, const mosquitto_property *properties)
@@ -186,35 +391,51 @@ void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flag
 	int i;
 
 	UNUSED(obj);
-	UNUSED(flags);
 	UNUSED(properties);
 
+	alloc_tag(ALLOC_NETWORK);
 	connack_received = true;
 
 	connack_result = result;
 	if (!result) {
-		mosquitto_subscribe_multiple(mosq, NULL, cfg.topic_count, cfg.topics, cfg.qos, cfg.sub_opts, cfg.subscribe_props);
-
-		for (i = 0; i < cfg.unsub_topic_count; i++) {
-			mosquitto_unsubscribe_v5(mosq, NULL, cfg.unsub_topics[i], cfg.unsubscribe_props);
-		}
+		/* libmosquitto reconnects by itself inside loop_forever/loop_start */
+		if (ever_connected) metrics_count(METRIC_RECONNECTS, 1);
+		ever_connected = true;
+		metrics_gauge_set(METRIC_CONNECTED, 1);
 	}
-	else {
-		if (result) {
-			if (cfg.protocol_version == MQTT_PROTOCOL_V5) {
-				if (result == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION) {
-					err_printf(&cfg, "Connection error: %s. Try connecting to an MQTT v5 broker, or use MQTT v3.x mode.\n", mosquitto_reason_string(result));
-				}
-				else {
-					err_printf(&cfg, "Connection error: %s\n", mosquitto_reason_string(result));
-				}
+	if (result) {
+		if (cfg.protocol_version == MQTT_PROTOCOL_V5) {
+			if (result == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION) {
+				err_printf(&cfg, "Connection error: %s. Try connecting to an MQTT v5 broker, or use MQTT v3.x mode.\n", mosquitto_reason_string(result));
 			}
 			else {
-				err_printf(&cfg, "Connection error: %s\n", mosquitto_connack_string(result));
+				err_printf(&cfg, "Connection error: %s\n", mosquitto_reason_string(result));
 			}
 		}
+		else {
+			err_printf(&cfg, "Connection error: %s\n", mosquitto_connack_string(result));
+		}
 		mosquitto_disconnect_v5(mosq, 0, cfg.disconnect_props);
+		return;
 	}
+	/* session present (flags bit 0): the broker kept our subscriptions */
+	if (flags & 1) return;
+
+	mosquitto_subscribe_multiple(mosq, NULL, cfg.topic_count, cfg.topics, cfg.qos, cfg.sub_opts, cfg.subscribe_props);
+
+	for (i = 0; i < cfg.unsub_topic_count; i++) {
+		mosquitto_unsubscribe_v5(mosq, NULL, cfg.unsub_topics[i], cfg.unsubscribe_props);
+	}
+}
+
+void my_disconnect_callback(struct mosquitto *mosq, void *obj, int rc, const mosquitto_property *properties)
+{
+	UNUSED(mosq);
+	UNUSED(obj);
+	UNUSED(rc);
+	UNUSED(properties);
+
+	metrics_gauge_set(METRIC_CONNECTED, 0);
 }
 
 void my_subscribe_callback(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
@@ -242,9 +463,19 @@ void my_log_callback(struct mosquitto *mosq, void *obj, int level, const char *s
 {
 	UNUSED(mosq);
 	UNUSED(obj);
-	UNUSED(level);
 
-	printf("%s\n", str);
+	switch (level) {
+	case MOSQ_LOG_ERR:
+		TP_ERROR(mosq_log, "%s", str);
+		break;
+	case MOSQ_LOG_WARNING:
+		TP_WARN(mosq_log, "%s", str);
+		break;
+	default:
+		/* libmosquitto's debug lines (PUBLISH, PINGREQ, ...) were always printed: keep them in a default build */
+		TP_INFO(mosq_log, "%s", str);
+		break;
+	}
 }
 
 
@@ -254,6 +485,11 @@ void client_config_cleanup(struct mosq_config *cfg)
 
 	free(cfg->id);
 	free(cfg->host);
+	free(cfg->ring_name);
+	free(cfg->trace_file);
+	free(cfg->metrics_target);
+	free(cfg->stats_topic);
+	free(cfg->flight_file);
 
 	if (cfg->topics) {
 		for (i = 0; i < cfg->topic_count; i++) {
@@ -277,6 +513,97 @@ void client_config_cleanup(struct mosq_config *cfg)
 }
 
 
+/* metrics thread: the lanes count their own depth */
+static void sample_queue_depth(void *user)
+{
+	struct sched_lane_stats stats;
+	int64_t depth = 0;
+
+	UNUSED(user);
+	for (int i = 0; i < (int)sched.lanes.size(); i++) {
+		sched_get_stats(&sched, i, &stats);
+		depth += (int64_t)stats.depth;
+	}
+	metrics_gauge_set(METRIC_RECV_QUEUE, depth);
+}
+
+/* -S: called from the metrics thread */
+static void publish_stats(const uint8_t *data, size_t len, void *user)
+{
+	UNUSED(user);
+
+	struct mosquitto *mosq = stats_mosq.load();
+
+	if (!mosq) return;
+	int rc = mosquitto_publish_v5(mosq, NULL, cfg.stats_topic, (int)len, data, 0, false, NULL);
+	if (rc != MOSQ_ERR_SUCCESS) metrics_publish_error(rc);
+}
+
+static void print_allocations(void)
+{
+	struct alloc_totals totals;
+
+	alloc_snapshot(&totals);
+	alloc_print(stderr, &totals);
+}
+
+/* -D: on exit */
+static void print_last_values(void)
+{
+	struct topic_cache_stats stats;
+
+	topic_cache_usage(&last_values, &stats);
+	fprintf(stderr, "last values: %llu topics, %llu distinct payloads, %.1f bytes per topic\n",
+		(unsigned long long)stats.topics, (unsigned long long)stats.unique_values, stats.bytes_per_topic);
+	topic_cache_cleanup(&last_values);
+}
+
+/* local reader: no broker connection, poll the fan-out ring until interrupted */
+int read_ring(const char *name)
+{
+	struct ring_reader reader;
+	struct ring_msg msg;
+	struct rx_trace trace;
+
+	int rc = ring_attach(&reader, name);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		err_printf(&cfg, "Error: Unable to attach to ring '%s': %s\n", name, mosquitto_strerror(rc));
+		return 1;
+	}
+
+#ifndef _WINDOWS
+	signal(SIGINT, ring_signal_handler);
+	signal(SIGTERM, ring_signal_handler);
+#endif
+
+	while (process_messages) {
+		if (!ring_read(&reader, &msg)) {
+			ring_wait(&reader);
+			continue;
+		}
+
+		count_received(msg.payloadlen);
+		trace_begin(&trace);
+		trace.flight = flight_record(msg.topic, msg.payload, msg.payloadlen, 0, 0, 0);
+		alloc_tag(ALLOC_PRINT);
+		fprintf(stdout, "topic '%s': message %zu bytes\n", msg.topic, msg.payloadlen);
+		handle_payload(msg.topic, msg.payload, msg.payloadlen, &trace);
+	}
+
+	metrics_stop();
+	if (stage_enabled) {
+		stage_stop();
+		stage_print(stderr);
+	}
+	if (cfg.alloc_report) print_allocations();
+	if (cfg.changes_only) print_last_values();
+	ring_detach(&reader);
+	client_config_cleanup(&cfg);
+	chunk_reassembly_cleanup(&reassembly);
+	claim_reader_cleanup(&claim_reader);
+
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -297,6 +624,19 @@ int main(int argc, char *argv[])
 	
 	cfg.debug = true;
 	cfg.quiet = false;
+	cfg.dump_all = false;
+	cfg.ring_name = NULL;
+	cfg.trace_every = 0;
+	cfg.trace_file = NULL;
+	cfg.metrics_target = NULL;
+	cfg.stats_topic = NULL;
+	cfg.metrics_interval = METRICS_DEFAULT_INTERVAL_MS / 1000;
+	cfg.flight_file = NULL;
+	cfg.flight_records = FLIGHT_DEFAULT_RECORDS;
+	cfg.flight_prefix = 0;
+	cfg.alloc_report = false;
+	cfg.changes_only = false;
+	projection_init(&cfg.projection);
 
 	cfg.host = strdup(DEFAULT_MQTT_HOST);
 	cfg.port = DEFAULT_MQTT_PORT;
@@ -313,6 +653,8 @@ int main(int argc, char *argv[])
 	char un_topic_1[] = "MY_TOPIC";
 	cfg_unsub_topic(&cfg, un_topic_1);
 
+	sched_init(&sched);
+
 	/* Parse options */
 	for (int i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-h"))
@@ -338,6 +680,164 @@ int main(int argc, char *argv[])
 			}
 			i++;
 		}
+		else if (!strcmp(argv[i], "-f"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -f argument given but no field specified.");
+				return 1;
+			}
+			else if (projection_add(&cfg.projection, argv[i + 1])) {
+				return 1;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-a"))
+		{
+			cfg.dump_all = true;
+		}
+		else if (!strcmp(argv[i], "-D"))
+		{
+			cfg.changes_only = true;
+		}
+		else if (!strcmp(argv[i], "-R"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -R argument given but no ring name specified.");
+				return 1;
+			}
+			else {
+				cfg.ring_name = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-T"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -T argument given but no sampling interval specified.");
+				return 1;
+			}
+			else {
+				cfg.trace_every = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-X"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -X argument given but no trace file specified.");
+				return 1;
+			}
+			else {
+				free(cfg.trace_file);
+				cfg.trace_file = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-M"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -M argument given but no port or file specified.");
+				return 1;
+			}
+			else {
+				free(cfg.metrics_target);
+				cfg.metrics_target = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-S"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -S argument given but no topic specified.");
+				return 1;
+			}
+			else {
+				free(cfg.stats_topic);
+				cfg.stats_topic = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-I"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -I argument given but no id specified.");
+				return 1;
+			}
+			else {
+				free(cfg.id);
+				cfg.id = strdup(argv[i + 1]);
+				cfg.clean_session = false;
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-i"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -i argument given but no interval specified.");
+				return 1;
+			}
+			else {
+				cfg.metrics_interval = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-F"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -F argument given but no flight file specified.");
+				return 1;
+			}
+			else {
+				free(cfg.flight_file);
+				cfg.flight_file = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-N"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -N argument given but no record count specified.");
+				return 1;
+			}
+			else {
+				cfg.flight_records = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-P"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -P argument given but no byte count specified.");
+				return 1;
+			}
+			else {
+				cfg.flight_prefix = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-A"))
+		{
+			cfg.alloc_report = true;
+		}
+		else if (!strcmp(argv[i], "-C") || !strcmp(argv[i], "-B"))
+		{
+			bool control = argv[i][1] == 'C';
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: %s argument given but no topic pattern specified.", argv[i]);
+				return 1;
+			}
+			if (control && control_lane < 0) {
+				control_lane = sched_add_lane(&sched, "control", SCHED_PRIORITY_CONTROL, false, 0);
+			}
+			if (!control && bulk_lane < 0) {
+				bulk_lane = sched_add_lane(&sched, "bulk", SCHED_PRIORITY_BULK, true, 0);
+			}
+			if (sched_add_pattern(&sched, control ? control_lane : bulk_lane, argv[i + 1])) {
+				fprintf(stderr, "Error: Invalid topic pattern '%s'.\n", argv[i + 1]);
+				return 1;
+			}
+			i++;
+		}
 		else
 		{
 			usage(argv[0]);
@@ -345,10 +845,77 @@ int main(int argc, char *argv[])
 
 	}
 
+	if (cfg.projection.key_count == 0) {
+		projection_add(&cfg.projection, "time");
+		projection_add(&cfg.projection, "text");
+	}
+
+
+	/* libmosquitto's log lines are recorded by tracepoints and written by their drain thread */
+	tp_init(stdout, cfg.debug ? TP_LEVEL_DEBUG : TP_LEVEL_INFO);
+
+	if (cfg.trace_every > 0 && stage_init((uint32_t)cfg.trace_every, true) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to set up stage timing.\n");
+		return 1;
+	}
+
+	/* receivers only follow the sender's sampling decision */
+	if (cfg.trace_file && tracer_open(&tracer, cfg.trace_file, "v5_recv", 0) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to open trace file '%s'.\n", cfg.trace_file);
+		return 1;
+	}
+
+	if (cfg.flight_file) {
+		if (cfg.flight_records <= 0 || cfg.flight_prefix < 0) {
+			fprintf(stderr, "Error: Invalid flight recorder size.\n");
+			return 1;
+		}
+		rc = flight_init(cfg.flight_file, "v5_recv", (uint32_t)cfg.flight_records, (uint32_t)cfg.flight_prefix);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to set up the flight recorder: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+	}
+
+	if (cfg.alloc_report) {
+		alloc_init();
+		alloc_tag(ALLOC_NETWORK);
+	}
+
+	if (cfg.metrics_target || cfg.stats_topic) {
+		struct metrics_export ex;
+
+		metrics_init("v5_recv");
+		metrics_export_init(&ex, cfg.metrics_target, cfg.metrics_interval);
+		ex.sample = sample_queue_depth;
+		if (cfg.stats_topic) ex.snapshot = publish_stats;
+		rc = metrics_start(&ex);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to export metrics: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+	}
+
+	verify_cache_init(&verify_cache);
+	if (cfg.changes_only) topic_cache_init(&last_values);
+	chunk_reassembly_init(&reassembly, CHUNK_DEFAULT_TIMEOUT_MS);
+	claim_reader_init(&claim_reader);
+
+	if (cfg.ring_name) {
+		return read_ring(cfg.ring_name);
+	}
 
 	mosquitto_lib_init();
 	
 	//Client Config Load
+	if (!cfg.clean_session && cfg.protocol_version == MQTT_PROTOCOL_V5) {
+		/* v5 ends the session on disconnect unless it is given an expiry: keep it, as v3 does */
+		rc = mosquitto_property_add_int32(&cfg.connect_props, MQTT_PROP_SESSION_EXPIRY_INTERVAL, UINT32_MAX);
+		if (rc) {
+			err_printf(&cfg, "Error in CONNECT properties: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+	}
 	rc = mosquitto_property_check_all(CMD_CONNECT, cfg.connect_props);
 	if (rc) {
 		err_printf(&cfg, "Error in CONNECT properties: %s\n", mosquitto_strerror(rc));
@@ -376,11 +943,12 @@ int main(int argc, char *argv[])
 	}
 
 	/* Create a new client instance.
-	 * id = NULL -> ask the broker to generate a client id for us
-	 * clean session = true -> the broker should remove old sessions when we connect
+	 * id = NULL -> ask the broker to generate a client id for us, unless -I
+	 * clean session = true -> the broker should remove old sessions when we connect; false with -I
 	 * obj = NULL -> we aren't passing any of our private data for callbacks
 	 */
 	mosq = mosquitto_new(cfg.id, cfg.clean_session, NULL);
+	g_mosq = mosq;
 
 	if (!mosq) {
 		switch (errno) {
@@ -406,6 +974,7 @@ int main(int argc, char *argv[])
 	}
 	mosquitto_subscribe_callback_set(mosq, my_subscribe_callback);
 	mosquitto_connect_v5_callback_set(mosq, my_connect_callback);
+	mosquitto_disconnect_v5_callback_set(mosq, my_disconnect_callback);
 	mosquitto_message_v5_callback_set(mosq, my_message_callback);
 
 
@@ -442,13 +1011,62 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	rc = mosquitto_loop_forever(mosq, -1, 1);
+	/* from here on every exit goes through metrics_stop() before mosquitto_destroy() */
+	stats_mosq.store(mosq);
+	if (control_lane >= 0 || bulk_lane >= 0) {
+		struct sched_msg msg;
+		struct rx_trace trace;
+
+		rc = mosquitto_loop_start(mosq);
+		while (rc == MOSQ_ERR_SUCCESS && process_messages) {
+			/* short timeout: the signal handler only clears process_messages */
+			alloc_tag(ALLOC_QUEUE);
+			if (!sched_pop(&sched, &msg, 100)) continue;
+
+			/* traced from the pop; the lane sojourn is measured against the push stamp */
+			trace_begin(&trace);
+			if (stage_traced(&trace.span)) {
+				uint64_t queued_ns = stage_now_ns() - msg.enqueued_ns;
+				stage_record(&trace.span, STAGE_QUEUE, queued_ns);
+				trace.arrival -= queued_ns / 1e9;
+			}
+			if (flight_enabled) {
+				/* recorded again by the decoding thread, without the mid */
+				trace.flight = flight_record(msg.topic.c_str(), msg.payload.data(), msg.payload.size(), 0, 0,
+					(uint32_t)((stage_now_ns() - msg.enqueued_ns) / 1000));
+			}
 
+			alloc_tag(ALLOC_PRINT);
+			fprintf(stdout, "topic '%s': message %zu bytes (lane %s)\n", msg.topic.c_str(), msg.payload.size(), sched.lanes[msg.lane].name);
+			handle_payload(msg.topic.c_str(), msg.payload.data(), msg.payload.size(), &trace);
+		}
+		mosquitto_loop_stop(mosq, false);
+		sched_print_stats(&sched, stderr);
+	}
+	else {
+		rc = mosquitto_loop_forever(mosq, -1, 1);
+	}
+
+	metrics_stop();
+	if (stage_enabled) {
+		stage_stop();
+		stage_print(stderr);
+	}
+	if (cfg.alloc_report) print_allocations();
+	if (cfg.changes_only) print_last_values();
+	tracer_close(&tracer);
+
+#ifndef _WINDOWS
+cleanup:
+#endif
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
 
 	
 	client_config_cleanup(&cfg);
+	chunk_reassembly_cleanup(&reassembly);
+	claim_reader_cleanup(&claim_reader);
+	sched_cleanup(&sched);
 	if (timed_out) {
 		err_printf(&cfg, "Timed out\n");
 		return MOSQ_ERR_TIMEOUT;
@@ -1,17 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
 #if defined(_WINDOWS)
 # include <windows.h>
 #define sleep(x) Sleep((x)*1000)
 #define strdup _strdup
 #else
 #include <getopt.h>
+#include <poll.h>
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+/* the interactive loop reads one word into buf[BUF_LENGTH] */
+#define scanf_s(format, buf, size) scanf("%65535s", buf)
 #endif
 #include <mosquitto.h>
 #include <mqtt_protocol.h>
 #include <flatbuffers/flexbuffers.h>
+#include "sensor_msg.h"
+#include "msg_chunk.h"
+#include "msg_claim.h"
+#include "msg_timer.h"
+#include "msg_pacer.h"
+#include "msg_loadgen.h"
+#include "msg_stage.h"
+#include "msg_trace.h"
+#include "msg_metrics.h"
+#include "msg_alloc.h"
 
 
 #define UNUSED(A) (void)(A)
@@ -28,6 +54,8 @@
 #define DEFAULT_MQTT_KEEPALIVE 60
 #define DEFAULT_MQTT_TOPIC "EXAMPLE_TOPIC"
 
+#define DEFAULT_TRACE_SAMPLE 100
+
 #define BUF_LENGTH 65536
 
 
@@ -45,6 +73,20 @@ struct mosq_config {
 	int msglen; /* pub, rr */
 	int repeat_count; /* pub */
 	struct timeval repeat_delay; /* pub */
+	int chunk_size; /* pub */
+	char *claim_arena; /* pub */
+	int sensors; /* pub: emulated sensors, 0: interactive */
+	double rate; /* pub: paced publishes per second, 0: interactive */
+	int spin_us; /* pub: busy-wait before each paced publish */
+	int cpu; /* pub: pin the paced loop to this CPU, -1: don't */
+	char *load; /* pub: load generator specification */
+	int trace_every; /* pub: time the stages of one message in this many, 0: off */
+	char *trace_file; /* pub: cross-process trace records */
+	int trace_sample; /* pub: trace one message in this many */
+	char *metrics_target; /* Prometheus endpoint port or text file */
+	char *stats_topic; /* publish metrics snapshots here */
+	int metrics_interval; /* seconds between metrics exports */
+	bool alloc_report; /* count heap allocations by stage */
 	mosquitto_property *connect_props;
 	mosquitto_property *publish_props;
 	mosquitto_property *subscribe_props;
@@ -57,12 +99,38 @@ struct mosq_config cfg;
 static int publish_count = 0;
 static bool ready_for_repeat = false;
 static volatile int status = STATUS_CONNECTING;
+static struct chunk_sender chunker;
+static struct claim_arena arena;
+static struct timer_wheel wheel;
+static uint32_t repeat_job = TIMER_NONE;
+static bool repeat_elapsed = false;
+static struct tracer tracer;
+static std::atomic<struct mosquitto *> stats_mosq(NULL); /* NULL: no snapshots (load generator) */
+static std::mutex stats_lock;
+static std::unordered_set<int> stats_mids; /* snapshots not yet written (QoS 0 acks on write) */
+static std::vector<int> stats_early_mids; /* completed while a snapshot was being published */
+static bool stats_publishing = false;
 
 
 void usage(char *argv0)
 {
 	fprintf(stderr,
-		"Usage: %s [-h host] [-p port]\n", argv0);
+		"Usage: %s [-h host] [-p port] [-c chunk_size] [-s arena] [-E sensors] [-R rate [-W spin_us] [-P cpu]] [-L load] [-T every] [-X trace_file [-x every]] [-M [host:]port|file] [-S stats_topic] [-i interval] [-A]\n"
+		" -c : send payloads larger than chunk_size bytes as a chunked transfer\n"
+		" -s : hand payloads of %d bytes or more to same-host receivers through shared memory arena\n"
+		" -E : emulate this many sensors, each publishing to <topic>/<n> at its own rate around the repeat delay\n"
+		" -R : publish at this many messages per second on absolute deadlines until interrupted, then print interval jitter\n"
+		" -W : with -R, busy-wait the last spin_us microseconds before each deadline\n"
+		" -P : with -R, pin the publishing thread to this CPU\n"
+		" -L : generate load instead of reading stdin, e.g. poisson,rate=5000,topics=100,connections=4,size=64-1024,duration=30\n"
+		"      keys: constant|poisson|burst, sensor|samples|random, rate, burst, topics, connections, size, pool, qos, count, duration\n"
+		" -T : time encode, copy and publish for one message in every, print the histograms on exit\n"
+		" -X : carry a trace context in one message in every (-x, default %d) and record its send in trace_file\n"
+		" -M : serve Prometheus metrics on this TCP port (127.0.0.1 unless host:port), or write them to this file\n"
+		" -S : publish a FlexBuffer metrics snapshot on stats_topic\n"
+		" -i : seconds between metrics exports. Default: %d\n"
+		" -A : count heap allocations by pipeline stage, print them on exit\n", argv0, CLAIM_DEFAULT_THRESHOLD, DEFAULT_TRACE_SAMPLE,
+		METRICS_DEFAULT_INTERVAL_MS / 1000);
 	exit(1);
 }
 
@@ -75,57 +143,47 @@ void err_printf(const struct mosq_config *cfg, const char *fmt, ...)
 	va_end(va);
 }
 
-#ifdef _WINDOWS
-static uint64_t next_publish_tv;
-
-static void set_repeat_time(void)
+static void repeat_elapsed_job(struct timer_wheel *wheel, uint32_t id, void *user)
 {
-	uint64_t ticks = GetTickCount64();
-	next_publish_tv = ticks + cfg.repeat_delay.tv_sec * 1000 + cfg.repeat_delay.tv_usec / 1000;
+	UNUSED(wheel);
+	UNUSED(id);
+	UNUSED(user);
+
+	repeat_elapsed = true;
+	repeat_job = TIMER_NONE;
 }
 
-static int check_repeat_time(void)
+static void set_repeat_time(void)
 {
-	uint64_t ticks = GetTickCount64();
+	uint64_t delay_us = (uint64_t)cfg.repeat_delay.tv_sec * 1000000 + cfg.repeat_delay.tv_usec;
 
-	if (ticks > next_publish_tv) {
-		return 1;
-	}
-	else {
-		return 0;
-	}
+	timer_cancel(&wheel, repeat_job);
+	repeat_elapsed = false;
+	repeat_job = timer_add(&wheel, delay_us, 0, repeat_elapsed_job, NULL);
 }
-#else
-
-static struct timeval next_publish_tv;
 
-static void set_repeat_time(void)
+/* mosquitto_loop() timeout: until the next timer slot, at most a second */
+static int loop_timeout_ms(void)
 {
-	gettimeofday(&next_publish_tv, NULL);
-	next_publish_tv.tv_sec += cfg.repeat_delay.tv_sec;
-	next_publish_tv.tv_usec += cfg.repeat_delay.tv_usec;
+	int64_t wait = timer_next_us(&wheel);
 
-	next_publish_tv.tv_sec += next_publish_tv.tv_usec / 1000000;
-	next_publish_tv.tv_usec = next_publish_tv.tv_usec % 1000000;
+	if (wait < 0 || wait > 1000000) return 1000;
+	return (int)((wait + 999) / 1000);
 }
 
-static int check_repeat_time(void)
+static void publish_acked(int mid)
 {
-	struct timeval tv;
+	/* only the last chunk of a chunked transfer counts as a publish */
+	if (chunk_sender_acked(&chunker, mid)) return;
 
-	gettimeofday(&tv, NULL);
-
-	if (tv.tv_sec > next_publish_tv.tv_sec) {
-		return 1;
-	}
-	else if (tv.tv_sec == next_publish_tv.tv_sec
-		&& tv.tv_usec > next_publish_tv.tv_usec) {
+	metrics_gauge_add(METRIC_SEND_QUEUE, -1);
+	publish_count++;
 
-		return 1;
+	if (publish_count < cfg.repeat_count && cfg.sensors == 0 && cfg.rate <= 0) {
+		ready_for_repeat = true;
+		set_repeat_time();
 	}
-	return 0;
 }
-#endif
 
 void my_publish_callback(struct mosquitto *mosq, void *obj, int mid, int reason_code, const mosquitto_property *properties)
 {
@@ -141,14 +199,312 @@ void my_publish_callback(struct mosquitto *mosq, void *obj, int mid, int reason_
 			free(reason_string);
 		}
 	}
-	publish_count++;
+	/* metrics snapshots are none of the user's publishes */
+	{
+		std::lock_guard<std::mutex> guard(stats_lock);
+		if (stats_mids.erase(mid)) return;
+		/* may be the snapshot itself: publish_stats sorts it out once it has the mid */
+		if (stats_publishing) {
+			stats_early_mids.push_back(mid);
+			return;
+		}
+	}
+	publish_acked(mid);
+}
 
-	if (publish_count < cfg.repeat_count) {
-		ready_for_repeat = true;
-		set_repeat_time();
+/* -S: called from the metrics thread */
+static void publish_stats(const uint8_t *data, size_t len, void *user)
+{
+	UNUSED(user);
+
+	struct mosquitto *mosq = stats_mosq.load();
+	std::vector<int> early;
+	int mid = 0;
+
+	if (!mosq) return;
+	/*
+	  Not locked across the publish: without a network thread the packet is
+	  written, and the callback run, on this thread before it returns.
+	*/
+	{
+		std::lock_guard<std::mutex> guard(stats_lock);
+		stats_publishing = true;
+	}
+	int rc = mosquitto_publish_v5(mosq, &mid, cfg.stats_topic, (int)len, data, 0, false, NULL);
+	bool done = false;
+	{
+		std::lock_guard<std::mutex> guard(stats_lock);
+		stats_publishing = false;
+		early.swap(stats_early_mids);
+		for (size_t i = 0; i < early.size(); i++) {
+			if (rc == MOSQ_ERR_SUCCESS && early[i] == mid) done = true;
+		}
+		if (rc == MOSQ_ERR_SUCCESS && !done) stats_mids.insert(mid);
+	}
+	if (rc != MOSQ_ERR_SUCCESS) metrics_publish_error(rc);
+
+	/* the user's publishes that completed meanwhile */
+	for (size_t i = 0; i < early.size(); i++) {
+		if (rc != MOSQ_ERR_SUCCESS || early[i] != mid) publish_acked(early[i]);
+	}
+}
+
+/* -A: on exit */
+static void print_allocations(void)
+{
+	struct alloc_totals totals;
+
+	alloc_snapshot(&totals);
+	alloc_print(stderr, &totals);
+}
+
+/* -E: emulated sensors, one periodic timer job each */
+struct emulated_sensor {
+	struct mosquitto *mosq;
+	std::string topic;
+	uint64_t published;
+};
+
+static std::vector<struct emulated_sensor> sensors;
+static flexbuffers::Builder sensor_fbb(256, flexbuffers::BUILDER_FLAG_NONE);
+static volatile bool run = true;
+static uint64_t sensor_errors = 0;
+
+/* seconds since the epoch, what receivers compare msg.time against */
+static double wall_seconds(void)
+{
+#ifndef _WINDOWS
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+#else
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+	/* 100 ns units since 1601 */
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return (double)(t - 116444736000000000ULL) / 1e7;
+#endif
+}
+
+static void handle_signal(int signum)
+{
+	UNUSED(signum);
+
+	run = false;
+}
+
+static void sensor_job(struct timer_wheel *wheel, uint32_t id, void *user)
+{
+	struct emulated_sensor *sensor = (struct emulated_sensor *)user;
+	struct stage_span span;
+	sensor_msg msg;
+	int rc;
+
+	UNUSED(wheel);
+	UNUSED(id);
+
+	stage_begin(&span);
+
+#ifndef _WINDOWS
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	msg.time = tv.tv_sec + 1e-6*tv.tv_usec;
+#else
+	msg.time = (double)GetTickCount64();
+#endif
+	alloc_tag(ALLOC_ENCODE);
+	msg.text = sensor->topic;
+	msg_schema::encode_flex(sensor_fbb, msg);
+	stage_mark(&span, STAGE_ENCODE);
+
+	/* only queued here; the loop writes everything due this tick in one go */
+	const std::vector<uint8_t> &flex_buf = sensor_fbb.GetBuffer();
+	mosquitto_property *trace_props;
+	alloc_tag(ALLOC_PUBLISH);
+	const mosquitto_property *props = tracer_send(&tracer, cfg.publish_props, &trace_props);
+	rc = mosquitto_publish_v5(sensor->mosq, NULL, sensor->topic.c_str(), (int)flex_buf.size(), flex_buf.data(), cfg.qos, false, props);
+	stage_mark(&span, STAGE_PUBLISH);
+	mosquitto_property_free_all(&trace_props);
+	tracer_sent(&tracer, sensor->topic.c_str(), rc);
+	alloc_tag(ALLOC_NETWORK);
+	if (rc == MOSQ_ERR_SUCCESS) {
+		sensor->published++;
+		metrics_message(METRIC_MSGS_OUT, METRIC_BYTES_OUT, flex_buf.size());
+		metrics_gauge_add(METRIC_SEND_QUEUE, 1);
+		alloc_message();
+	}
+	else {
+		sensor_errors++;
+		metrics_publish_error(rc);
 	}
 }
 
+#ifndef _WINDOWS
+static int flush_batch(struct mosquitto *mosq)
+{
+	int fd = mosquitto_socket(mosq);
+	int on = 1, off = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	/* cork so a batch of small publishes leaves in as few segments as possible */
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	while (rc == MOSQ_ERR_SUCCESS && mosquitto_want_write(mosq)) {
+		rc = mosquitto_loop_write(mosq, 1);
+		if (rc == MOSQ_ERR_SUCCESS && mosquitto_want_write(mosq)) {
+			/* socket buffer full, the rest goes on POLLOUT */
+			break;
+		}
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	return rc;
+}
+#endif
+
+/*
+  Publish from count sensors, each on <topic>/<n> with a period within
+  +-10% of the repeat delay. All sensors run off one timer wheel; the
+  publishes due in a tick are queued and written out in one pass.
+*/
+static int emulate_sensors(struct mosquitto *mosq, int count)
+{
+#ifndef _WINDOWS
+	uint64_t delay_us = (uint64_t)cfg.repeat_delay.tv_sec * 1000000 + cfg.repeat_delay.tv_usec;
+	struct pollfd fds[2];
+	int rc = MOSQ_ERR_SUCCESS;
+
+	/* publishes from here on are queued instead of written inline */
+	mosquitto_threaded_set(mosq, true);
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	sensors.resize(count);
+	srand((unsigned)time(NULL));
+	for (int i = 0; i < count; i++) {
+		uint64_t period_us = delay_us - delay_us / 10 + (uint64_t)rand() % (delay_us / 5 + 1);
+		/* a period of 0 would make the job one-shot: a zero delay means once per tick */
+		if (period_us < TIMER_DEFAULT_TICK_US) period_us = TIMER_DEFAULT_TICK_US;
+		uint64_t phase_us = (uint64_t)rand() % (period_us + 1);
+		char topic[256];
+
+		snprintf(topic, sizeof(topic), "%s/%d", cfg.topic, i);
+		sensors[i].mosq = mosq;
+		sensors[i].topic = topic;
+		sensors[i].published = 0;
+		timer_add(&wheel, phase_us, period_us, sensor_job, &sensors[i]);
+	}
+
+	while (run && rc == MOSQ_ERR_SUCCESS && status != STATUS_NOHOPE) {
+		timer_arm(&wheel);
+
+		fds[0].fd = mosquitto_socket(mosq);
+		fds[0].events = POLLIN | (mosquitto_want_write(mosq) ? POLLOUT : 0);
+		fds[0].revents = 0;
+		fds[1].fd = wheel.fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if (poll(fds, 2, 1000) < 0) {
+			if (errno == EINTR) continue;
+			rc = MOSQ_ERR_ERRNO;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) rc = mosquitto_loop_read(mosq, 1);
+		if (rc == MOSQ_ERR_SUCCESS && (fds[1].revents & POLLIN)) {
+			timer_ack(&wheel);
+			timer_advance(&wheel);
+		}
+		if (rc == MOSQ_ERR_SUCCESS && mosquitto_want_write(mosq)) rc = flush_batch(mosq);
+		if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_misc(mosq);
+	}
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+	}
+
+	uint64_t published = 0;
+	for (size_t i = 0; i < sensors.size(); i++) published += sensors[i].published;
+	fprintf(stderr, "sensors %d published %llu errors %llu timer fired %llu missed %llu passes %llu (%.1f per pass)\n",
+		count, (unsigned long long)published, (unsigned long long)sensor_errors,
+		(unsigned long long)wheel.fired, (unsigned long long)wheel.missed, (unsigned long long)wheel.passes,
+		wheel.passes ? (double)wheel.fired / wheel.passes : 0.0);
+	return rc;
+#else
+	UNUSED(mosq);
+	UNUSED(count);
+	fprintf(stderr, "Error: sensor emulation needs timerfd, not available on this platform.\n");
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  -R: publish sensor_msg at a fixed rate. The pacer sleeps to an absolute
+  deadline (optionally spinning the tail); network I/O is serviced without
+  blocking in between so it never delays a deadline.
+*/
+static int publish_paced(struct mosquitto *mosq)
+{
+	flexbuffers::Builder fbb(256, flexbuffers::BUILDER_FLAG_NONE);
+	struct pacer pacer;
+	sensor_msg msg;
+	uint64_t published = 0, errors = 0;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if (cfg.cpu >= 0) {
+		/* not fatal: the run goes on unpinned */
+		int pin_rc = pacer_pin_cpu(cfg.cpu);
+		if (pin_rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Warning: Unable to pin to CPU %d: %s\n", cfg.cpu, mosquitto_strerror(pin_rc));
+		}
+	}
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	/* wait for CONNACK before the clock starts */
+	while (run && status == STATUS_CONNECTING && rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop(mosq, 100, 1);
+
+	pacer_init(&pacer, (uint64_t)(1e9 / cfg.rate), (uint64_t)cfg.spin_us * 1000);
+	msg.text = cfg.topic;
+	while (run && rc == MOSQ_ERR_SUCCESS && status != STATUS_NOHOPE) {
+		struct stage_span span;
+
+		pacer_wait(&pacer);
+		stage_begin(&span);
+
+		msg.time = wall_seconds();
+		alloc_tag(ALLOC_ENCODE);
+		msg_schema::encode_flex(fbb, msg);
+		stage_mark(&span, STAGE_ENCODE);
+		const std::vector<uint8_t> &flex_buf = fbb.GetBuffer();
+		mosquitto_property *trace_props;
+		alloc_tag(ALLOC_PUBLISH);
+		const mosquitto_property *props = tracer_send(&tracer, cfg.publish_props, &trace_props);
+		int pub_rc = mosquitto_publish_v5(mosq, NULL, cfg.topic, (int)flex_buf.size(), flex_buf.data(), cfg.qos, false, props);
+		if (pub_rc == MOSQ_ERR_SUCCESS) {
+			published++;
+			metrics_message(METRIC_MSGS_OUT, METRIC_BYTES_OUT, flex_buf.size());
+			metrics_gauge_add(METRIC_SEND_QUEUE, 1);
+			alloc_message();
+		}
+		else {
+			errors++;
+			metrics_publish_error(pub_rc);
+		}
+		stage_mark(&span, STAGE_PUBLISH);
+		mosquitto_property_free_all(&trace_props);
+		tracer_sent(&tracer, cfg.topic, pub_rc);
+
+		alloc_tag(ALLOC_NETWORK);
+		rc = mosquitto_loop(mosq, 0, 1);
+	}
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+	}
+
+	fprintf(stderr, "rate %.1f/s published %llu errors %llu\n", cfg.rate, (unsigned long long)published, (unsigned long long)errors);
+	pacer_print_stats(&pacer, stderr);
+	return rc;
+}
+
 void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flags, const mosquitto_property *properties)
 {
 	int rc = MOSQ_ERR_SUCCESS;
@@ -158,10 +514,17 @@ void my_connect_callback(struct mosquitto *mosq, void *obj, int result, int flag
 	UNUSED(properties);
 		
 	if (!result) {
-		
+		status = STATUS_CONNACK_RECVD;
+		metrics_gauge_set(METRIC_CONNECTED, 1);
+
 		rc = mosquitto_publish_v5(mosq, NULL, cfg.topic, 0, NULL, cfg.qos, cfg.retain, cfg.publish_props);
+		if (rc == MOSQ_ERR_SUCCESS) {
+			metrics_message(METRIC_MSGS_OUT, METRIC_BYTES_OUT, 0);
+			metrics_gauge_add(METRIC_SEND_QUEUE, 1);
+		}
 		
 		if (rc) {
+			metrics_publish_error(rc);
 			switch (rc) {
 			case MOSQ_ERR_INVAL:
 				fprintf(stderr, "Error: Invalid input. Does your topic contain '+' or '#'?\n");
@@ -213,6 +576,7 @@ void my_disconnect_callback(struct mosquitto *mosq, void *obj, int rc, const mos
 	UNUSED(rc);
 	UNUSED(properties);
 
+	metrics_gauge_set(METRIC_CONNECTED, 0);
 	if (rc == 0) {
 		status = STATUS_DISCONNECTED;
 	}
@@ -225,6 +589,11 @@ void client_config_cleanup(struct mosq_config *cfg)
 	free(cfg->host);
 	free(cfg->message);
 	free(cfg->topic);
+	free(cfg->claim_arena);
+	free(cfg->load);
+	free(cfg->trace_file);
+	free(cfg->metrics_target);
+	free(cfg->stats_topic);
 	
 	mosquitto_property_free_all(&cfg->connect_props);
 	mosquitto_property_free_all(&cfg->publish_props);
@@ -238,7 +607,7 @@ void client_config_cleanup(struct mosq_config *cfg)
 int main(int argc, char *argv[])
 {
 
-	flexbuffers::Builder fbb;
+	flexbuffers::Builder fbb(256, flexbuffers::BUILDER_FLAG_NONE);
 	struct mosquitto *mosq = NULL;
 	int rc;
 
@@ -248,6 +617,20 @@ int main(int argc, char *argv[])
 	cfg.retain = true; ///	retain - set to true to make the message retained.
 	cfg.clean_session = true;
 	cfg.repeat_count = 2;
+	cfg.chunk_size = 0;
+	cfg.claim_arena = NULL;
+	cfg.sensors = 0;
+	cfg.rate = 0;
+	cfg.spin_us = 0;
+	cfg.cpu = -1;
+	cfg.load = NULL;
+	cfg.trace_every = 0;
+	cfg.trace_file = NULL;
+	cfg.trace_sample = DEFAULT_TRACE_SAMPLE;
+	cfg.metrics_target = NULL;
+	cfg.stats_topic = NULL;
+	cfg.metrics_interval = METRICS_DEFAULT_INTERVAL_MS / 1000;
+	cfg.alloc_report = false;
 	
 	//repeat Delay
 	float f = 1 * 1.0e6f;
@@ -285,6 +668,160 @@ int main(int argc, char *argv[])
 			}
 			i++;
 		}
+		else if (!strcmp(argv[i], "-c"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -c argument given but no chunk size specified.");
+				return 1;
+			}
+			else {
+				cfg.chunk_size = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-s"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -s argument given but no arena name specified.");
+				return 1;
+			}
+			else {
+				cfg.claim_arena = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-E"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -E argument given but no sensor count specified.");
+				return 1;
+			}
+			else {
+				cfg.sensors = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-R"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -R argument given but no rate specified.");
+				return 1;
+			}
+			else {
+				cfg.rate = atof(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-W"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -W argument given but no spin time specified.");
+				return 1;
+			}
+			else {
+				cfg.spin_us = atoi(argv[i + 1]);
+				if (cfg.spin_us < 0) {
+					fprintf(stderr, "Error: -W spin time must not be negative.\n");
+					return 1;
+				}
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-L"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -L argument given but no load specification.");
+				return 1;
+			}
+			else {
+				cfg.load = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-A"))
+		{
+			cfg.alloc_report = true;
+		}
+		else if (!strcmp(argv[i], "-T"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -T argument given but no sampling interval specified.");
+				return 1;
+			}
+			else {
+				cfg.trace_every = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-X"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -X argument given but no trace file specified.");
+				return 1;
+			}
+			else {
+				free(cfg.trace_file);
+				cfg.trace_file = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-x"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -x argument given but no sampling interval specified.");
+				return 1;
+			}
+			else {
+				cfg.trace_sample = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-M"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -M argument given but no port or file specified.");
+				return 1;
+			}
+			else {
+				free(cfg.metrics_target);
+				cfg.metrics_target = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-S"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -S argument given but no topic specified.");
+				return 1;
+			}
+			else {
+				free(cfg.stats_topic);
+				cfg.stats_topic = strdup(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-i"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -i argument given but no interval specified.");
+				return 1;
+			}
+			else {
+				cfg.metrics_interval = atoi(argv[i + 1]);
+			}
+			i++;
+		}
+		else if (!strcmp(argv[i], "-P"))
+		{
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: -P argument given but no CPU specified.");
+				return 1;
+			}
+			else {
+				cfg.cpu = atoi(argv[i + 1]);
+			}
+			i++;
+		}
 		else
 		{
 			usage(argv[0]);
@@ -292,6 +829,60 @@ int main(int argc, char *argv[])
 
 	}
 
+	/* the load generator publishes on connections of its own, none of these would apply */
+	if (cfg.load && (cfg.chunk_size > 0 || cfg.claim_arena || cfg.stats_topic || cfg.sensors > 0 || cfg.rate > 0)) {
+		fprintf(stderr, "Error: -L cannot be combined with -c, -s, -S, -E or -R.\n");
+		return 1;
+	}
+
+	if (cfg.trace_every > 0 && stage_init((uint32_t)cfg.trace_every, true) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to set up stage timing.\n");
+		return 1;
+	}
+
+	if (cfg.trace_file && tracer_open(&tracer, cfg.trace_file, "v5_send", (uint32_t)(cfg.trace_sample > 0 ? cfg.trace_sample : 1)) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to open trace file '%s'.\n", cfg.trace_file);
+		return 1;
+	}
+
+	if (cfg.metrics_target || cfg.stats_topic) {
+		struct metrics_export ex;
+
+		metrics_init("v5_send");
+		metrics_export_init(&ex, cfg.metrics_target, cfg.metrics_interval);
+		if (cfg.stats_topic) ex.snapshot = publish_stats;
+		rc = metrics_start(&ex);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to export metrics: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+	}
+
+	if (cfg.alloc_report) {
+		alloc_init();
+		/* until a publish path tags otherwise, this thread runs libmosquitto */
+		alloc_tag(ALLOC_NETWORK);
+	}
+
+	if (timer_wheel_init(&wheel, TIMER_DEFAULT_TICK_US) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: Unable to create timer.\n");
+		return 1;
+	}
+
+	if (cfg.claim_arena) {
+		rc = claim_arena_create(&arena, cfg.claim_arena, CLAIM_DEFAULT_SEGMENTS, CLAIM_DEFAULT_SEGMENT_SIZE, CLAIM_DEFAULT_HOLD_MS);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: Unable to create claim arena '%s': %s\n", cfg.claim_arena, mosquitto_strerror(rc));
+			if (rc == MOSQ_ERR_ALREADY_EXISTS) {
+				fprintf(stderr, "Another sender uses it, or remove /dev/shm/mqtt_claim.%s left by one that crashed.\n", cfg.claim_arena);
+			}
+			return 1;
+		}
+	}
+
+	/* chunks are pipelined at QoS 1 at least */
+	chunk_sender_init(&chunker, (uint32_t)cfg.chunk_size, CHUNK_DEFAULT_WINDOW, cfg.qos > 0 ? cfg.qos : 1, false);
+
 
 	mosquitto_lib_init();
 
@@ -322,6 +913,21 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (cfg.load) {
+		signal(SIGINT, handle_signal);
+		signal(SIGTERM, handle_signal);
+		rc = loadgen_main(cfg.load, cfg.host, cfg.port, cfg.keepalive, cfg.protocol_version, cfg.topic,
+			cfg.connect_props, cfg.publish_props, &run);
+		metrics_stop();
+		if (cfg.alloc_report) print_allocations();
+		timer_wheel_cleanup(&wheel);
+		tracer_close(&tracer);
+		if (cfg.claim_arena) claim_arena_close(&arena);
+		client_config_cleanup(&cfg);
+		mosquitto_lib_cleanup();
+		return rc == MOSQ_ERR_SUCCESS ? 0 : 1;
+	}
+
 	/* Create a new client instance.
 	 * id = NULL -> ask the broker to generate a client id for us
 	 * clean session = true -> the broker should remove old sessions when we connect
@@ -368,22 +974,34 @@ int main(int argc, char *argv[])
 	struct timeval tv;
 	char buf[BUF_LENGTH];
 	std::vector<uint8_t> flex_buf;
+	sensor_msg msg;
+	flatbuffers::FlatBufferBuilder desc_fbb;
+	struct claim_desc claim;
 
-	//Loop
-	int loop_delay = 1000;
-
-	if (cfg.repeat_count > 1 && (cfg.repeat_delay.tv_sec == 0 || cfg.repeat_delay.tv_usec != 0)) {
-		loop_delay = (int)cfg.repeat_delay.tv_usec / 2000;
+	/* from here on every exit goes through metrics_stop() before mosquitto_destroy() */
+	stats_mosq.store(mosq);
+	if (cfg.sensors > 0) {
+		rc = emulate_sensors(mosq, cfg.sensors);
+		goto done;
 	}
-		
+	if (cfg.rate > 0) {
+		rc = publish_paced(mosq);
+		goto done;
+	}
+
+	//Loop
 	do {
-		rc = mosquitto_loop(mosq, loop_delay, 1);
-		if (ready_for_repeat && check_repeat_time()) {
+		rc = mosquitto_loop(mosq, loop_timeout_ms(), 1);
+		timer_advance(&wheel);
+		if (ready_for_repeat && repeat_elapsed) {
 			rc = MOSQ_ERR_SUCCESS;
 
 			scanf_s("%s", buf, BUF_LENGTH);
 			if (!strcmp(buf, "exit")) break;
 
+			struct stage_span span;
+			stage_begin(&span);
+
 #ifndef _WINDOWS
 			gettimeofday(&tv, NULL);
 			double timestamp = tv.tv_sec + 1e-6*tv.tv_usec;
@@ -392,18 +1010,58 @@ int main(int argc, char *argv[])
 			double timestamp = (double)ticks;
 #endif
 
-			fbb.Clear();
-			fbb.Map([&]() {
-				fbb.Double("time", timestamp);
-				fbb.String("text", buf);
-			});
-			fbb.Finish();
+			alloc_tag(ALLOC_ENCODE);
+			msg.time = timestamp;
+			msg.text = buf;
+			msg_schema::encode_flex(fbb, msg);
+			stage_mark(&span, STAGE_ENCODE);
 
+			alloc_tag(ALLOC_COPY);
 			flex_buf = fbb.GetBuffer();
+			stage_mark(&span, STAGE_COPY);
 
-			rc = mosquitto_publish_v5(mosq, NULL, cfg.topic, flex_buf.size(), flex_buf.data(), cfg.qos, cfg.retain, cfg.publish_props);
+			alloc_tag(ALLOC_PUBLISH);
+			/* chunked transfers are not traced: every chunk would count as a delivery */
+			mosquitto_property *trace_props = NULL;
+			const mosquitto_property *props = cfg.publish_props;
+			if (cfg.chunk_size <= 0 || flex_buf.size() <= (size_t)cfg.chunk_size) {
+				props = tracer_send(&tracer, cfg.publish_props, &trace_props);
+			}
+
+			bool claimed = false;
+			if (cfg.claim_arena && flex_buf.size() >= CLAIM_DEFAULT_THRESHOLD) {
+				/* payload goes through shared memory, the broker only sees the descriptor */
+				rc = claim_put(&arena, flex_buf.data(), flex_buf.size(), &claim);
+				/* arena full (every segment pinned or held) or payload over a segment: sent the ordinary way below */
+				claimed = rc != MOSQ_ERR_NOMEM && rc != MOSQ_ERR_PAYLOAD_SIZE;
+				if (!claimed) {
+					metrics_count(METRIC_CLAIM_FALLBACKS, 1);
+				}
+				else if (rc == MOSQ_ERR_SUCCESS) {
+					claim_encode(desc_fbb, &claim);
+					rc = mosquitto_publish_v5(mosq, NULL, cfg.topic, desc_fbb.GetSize(), desc_fbb.GetBufferPointer(), cfg.qos, false, props);
+				}
+			}
+			if (!claimed) {
+				if (cfg.chunk_size > 0 && flex_buf.size() > (size_t)cfg.chunk_size) {
+					rc = chunk_publish(&chunker, mosq, cfg.topic, flex_buf.data(), flex_buf.size(), cfg.publish_props);
+				}
+				else {
+					rc = mosquitto_publish_v5(mosq, NULL, cfg.topic, flex_buf.size(), flex_buf.data(), cfg.qos, cfg.retain, props);
+				}
+			}
+			stage_mark(&span, STAGE_PUBLISH);
+			mosquitto_property_free_all(&trace_props);
+			tracer_sent(&tracer, cfg.topic, rc);
+			alloc_tag(ALLOC_NETWORK);
 			
-			if (rc != MOSQ_ERR_SUCCESS) {
+			if (rc == MOSQ_ERR_SUCCESS) {
+				metrics_message(METRIC_MSGS_OUT, METRIC_BYTES_OUT, flex_buf.size());
+				metrics_gauge_add(METRIC_SEND_QUEUE, 1);
+				alloc_message();
+			}
+			else {
+				metrics_publish_error(rc);
 				fprintf(stderr, "Error publishing: %s\n", mosquitto_strerror(rc));
 			}
 
@@ -411,8 +1069,17 @@ int main(int argc, char *argv[])
 	
 	} while (rc == MOSQ_ERR_SUCCESS);
 
+done:
+	metrics_stop();
+	if (stage_enabled) {
+		stage_stop();
+		stage_print(stderr);
+	}
+	if (cfg.alloc_report) print_allocations();
+	tracer_close(&tracer);
+	timer_wheel_cleanup(&wheel);
 
-
+	if (cfg.claim_arena) claim_arena_close(&arena);
 	client_config_cleanup(&cfg);
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
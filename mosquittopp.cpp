@@ -1,11 +1,19 @@
 #include <iostream>
+#include <signal.h>
+#include <string.h>
+#if defined(_WINDOWS)
+#define strdup _strdup
+#endif
 #include "mosqpp_client.h"
+#include "msg_tracepoint.h"
 
 #define CLIENT_ID "Client_ID"
 #define DEFAULT_MQTT_HOST "127.0.0.1"
 #define DEFAULT_MQTT_PORT 1883
 #define DEFAULT_MQTT_TOPIC "EXAMPLE_TOPIC"
 
+static volatile bool run = true;
+
 void usage(char *argv0)
 {
 	fprintf(stderr,
@@ -13,6 +21,11 @@ void usage(char *argv0)
 	exit(1);
 }
 
+void signal_handler(int s)
+{
+	run = false;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -33,7 +46,7 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 			else {
-				host = _strdup(argv[i + 1]);
+				host = strdup(argv[i + 1]);
 			}
 			i++;
 		}
@@ -55,28 +68,34 @@ int main(int argc, char *argv[])
 
 	}
 
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	/* whatever the build compiled in (MSG_TP_LEVEL) */
+	tp_init(stdout, TP_LEVEL_DEBUG);
+
 	mosqpp::lib_init();
 
 	if (host == NULL) 
 	{
-		client = new mosqpp_client(client_id, DEFAULT_MQTT_HOST, port);
+		client = new mosqpp_client(client_id, DEFAULT_MQTT_HOST, port, DEFAULT_MQTT_TOPIC);
 	}
 	else
 	{
-		client = new mosqpp_client(client_id, host, port);
+		client = new mosqpp_client(client_id, host, port, DEFAULT_MQTT_TOPIC);
 	}
 
-	while (1)
+	while (run)
 	{
 		rc = client->loop();
 		if (rc)
 		{
-			client->reconnect();
+			client->reconnect_backoff(&run);
 		}
-		else
-			client->subscribe(NULL, DEFAULT_MQTT_TOPIC);
 	}
 
+	reconnect_print_stats(&client->backoff, stderr);
+	delete client;
 	mosqpp::lib_cleanup();
 	free(host);
 
@@ -1,11 +1,8 @@
 #include "mosquittopp_client.h"
+#include "msg_tracepoint.h"
 
 #define PUBLISH_TOPIC "EXAMPLE_TOPIC"
 
-#ifdef DEBUG
-#include <iostream>
-#endif
-
 mqtt_client::mqtt_client(const char *id, const char *host, int port) : mosquittopp(id)
 {
 	int keepalive = DEFAULT_KEEP_ALIVE;
@@ -20,17 +17,13 @@ void mqtt_client::on_connect(int rc)
 {
 	if (!rc)
 	{
-#ifdef DEBUG
-		std::cout << "Connected - code " << rc << std::endl;
-#endif
+		TP_DEBUG(on_connect, "Connected - code %d", rc);
 	}
 }
 
 void mqtt_client::on_subscribe(int mid, int qos_count, const int *granted_qos)
 {
-#ifdef DEBUG
-	std::cout << "Subscription succeeded." << std::endl;
-#endif
+	TP_DEBUG(on_subscribe, "Subscription succeeded.");
 }
 
 void mqtt_client::on_message(const struct mosquitto_message *message)
@@ -45,36 +38,28 @@ void mqtt_client::on_message(const struct mosquitto_message *message)
 		/* Copy N-1 bytes to ensure always 0 terminated. */
 		memcpy(buf, message->payload, MAX_PAYLOAD * sizeof(char));
 
-#ifdef DEBUG
-		std::cout << buf << std::endl;
-#endif
+		TP_DEBUG(on_message, "%s", buf);
 
 		// Examples of messages for M2M communications...
 		if (!strcmp(buf, "STATUS"))
 		{
 			snprintf(buf, payload_size, "This is a Status Message...");
 			publish(NULL, PUBLISH_TOPIC, strlen(buf), buf);
-#ifdef DEBUG
-			std::cout << "Status Request Recieved." << std::endl;
-#endif
+			TP_DEBUG(status_request, "Status Request Recieved.");
 		}
 
 		if (!strcmp(buf, "ON"))
 		{
 			snprintf(buf, payload_size, "Turning on...");
 			publish(NULL, PUBLISH_TOPIC, strlen(buf), buf);
-#ifdef DEBUG
-			std::cout << "Request to turn on." << std::endl;
-#endif
+			TP_DEBUG(turn_on, "Request to turn on.");
 		}
 
 		if (!strcmp(buf, "OFF"))
 		{
 			snprintf(buf, payload_size, "Turning off...");
 			publish(NULL, PUBLISH_TOPIC, strlen(buf), buf);
-#ifdef DEBUG
-			std::cout << "Request to turn off." << std::endl;
-#endif
+			TP_DEBUG(turn_off, "Request to turn off.");
 		}
 	}
 }
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "msg_alloc.h"
+#include "msg_per_thread.h"
+
+enum alloc_op {
+	ALLOC_OP_NEW,
+	ALLOC_OP_MALLOC,
+	ALLOC_OP_FREE,
+	ALLOC_OP_COUNT
+};
+
+/* written by its thread only, except overflow_shard which all threads beyond PER_THREAD_MAX share */
+struct alloc_shard {
+	std::atomic<uint64_t> ops[ALLOC_OP_COUNT][ALLOC_STAGE_COUNT];
+	std::atomic<uint64_t> bytes[ALLOC_STAGE_COUNT];
+};
+
+bool alloc_enabled = false;
+thread_local enum alloc_stage alloc_thread_stage = ALLOC_OTHER;
+std::atomic<uint64_t> alloc_messages(0);
+
+const char *alloc_stage_names[ALLOC_STAGE_COUNT] = {
+	"other", "encode", "copy", "publish", "network", "queue", "decode", "print"
+};
+
+/* static, zero initialised before anything can allocate; registering allocates nothing */
+static struct alloc_shard shard_cells[PER_THREAD_MAX];
+static struct alloc_shard overflow_shard;
+static struct per_thread_registry<struct alloc_shard> shards;
+static thread_local struct alloc_shard *thread_shard = NULL;
+
+static void add_shard(struct alloc_totals *totals, const struct alloc_shard *shard)
+{
+	for (int s = 0; s < ALLOC_STAGE_COUNT; s++) {
+		totals->news[s] += shard->ops[ALLOC_OP_NEW][s].load(std::memory_order_relaxed);
+		totals->mallocs[s] += shard->ops[ALLOC_OP_MALLOC][s].load(std::memory_order_relaxed);
+		totals->frees[s] += shard->ops[ALLOC_OP_FREE][s].load(std::memory_order_relaxed);
+		totals->bytes[s] += shard->bytes[s].load(std::memory_order_relaxed);
+	}
+}
+
+static struct alloc_shard *claim_shard(void)
+{
+	struct alloc_shard *shard = per_thread_register(&shards, [](int index) { return &shard_cells[index]; });
+	thread_shard = shard ? shard : &overflow_shard;
+	return thread_shard;
+}
+
+static inline void shard_add(struct alloc_shard *shard, std::atomic<uint64_t> *cell, uint64_t n)
+{
+	if (shard == &overflow_shard) cell->fetch_add(n, std::memory_order_relaxed);
+	else cell->store(cell->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static void charge(enum alloc_op op, size_t size)
+{
+	struct alloc_shard *shard = thread_shard ? thread_shard : claim_shard();
+	enum alloc_stage stage = alloc_thread_stage;
+
+	shard_add(shard, &shard->ops[op][stage], 1);
+	if (size) shard_add(shard, &shard->bytes[stage], size);
+}
+
+#if MSG_ALLOC_MALLOC
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) __THROW
+{
+	void *p = __libc_malloc(size);
+	if (p && alloc_enabled) charge(ALLOC_OP_MALLOC, size);
+	return p;
+}
+
+void *calloc(size_t nmemb, size_t size) __THROW
+{
+	void *p = __libc_calloc(nmemb, size);
+	if (p && alloc_enabled) charge(ALLOC_OP_MALLOC, nmemb * size);
+	return p;
+}
+
+void *realloc(void *ptr, size_t size) __THROW
+{
+	void *p = __libc_realloc(ptr, size);
+	if (alloc_enabled) {
+		if (ptr && (p || !size)) charge(ALLOC_OP_FREE, 0);
+		if (p) charge(ALLOC_OP_MALLOC, size);
+	}
+	return p;
+}
+
+void free(void *ptr) __THROW
+{
+	if (ptr && alloc_enabled) charge(ALLOC_OP_FREE, 0);
+	__libc_free(ptr);
+}
+}
+
+/* straight to glibc, so a C++ allocation is not counted again as a malloc */
+#define raw_malloc __libc_malloc
+#define raw_free __libc_free
+#else
+#define raw_malloc malloc
+#define raw_free free
+#endif
+
+void *operator new(size_t size)
+{
+	void *p = raw_malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	if (alloc_enabled) charge(ALLOC_OP_NEW, size);
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	void *p = raw_malloc(size ? size : 1);
+	if (p && alloc_enabled) charge(ALLOC_OP_NEW, size);
+	return p;
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	if (!ptr) return;
+	if (alloc_enabled) charge(ALLOC_OP_FREE, 0);
+	raw_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	operator delete(ptr);
+}
+
+void alloc_init(void)
+{
+	alloc_enabled = true;
+}
+
+void alloc_snapshot(struct alloc_totals *totals)
+{
+	int count = per_thread_count(&shards);
+
+	memset(totals, 0, sizeof(*totals));
+	for (int i = 0; i < count; i++) {
+		const struct alloc_shard *shard = per_thread_at(&shards, i);
+		if (shard) add_shard(totals, shard);
+	}
+	add_shard(totals, &overflow_shard);
+	totals->messages = alloc_messages.load(std::memory_order_relaxed);
+}
+
+void alloc_since(struct alloc_totals *totals, const struct alloc_totals *before)
+{
+	for (int s = 0; s < ALLOC_STAGE_COUNT; s++) {
+		totals->news[s] -= before->news[s];
+		totals->mallocs[s] -= before->mallocs[s];
+		totals->frees[s] -= before->frees[s];
+		totals->bytes[s] -= before->bytes[s];
+	}
+	totals->messages -= before->messages;
+}
+
+double alloc_per_message(const struct alloc_totals *totals)
+{
+	uint64_t allocs = 0;
+
+	if (!totals->messages) return 0.0;
+	for (int s = ALLOC_OTHER + 1; s < ALLOC_STAGE_COUNT; s++) allocs += totals->news[s] + totals->mallocs[s];
+	return (double)allocs / (double)totals->messages;
+}
+
+static void print_row(FILE *out, const char *name, uint64_t news, uint64_t mallocs, uint64_t frees, uint64_t bytes,
+	uint64_t messages)
+{
+	fprintf(out, "%-8s %12llu %12llu %12llu %14llu", name, (unsigned long long)news, (unsigned long long)mallocs,
+		(unsigned long long)frees, (unsigned long long)bytes);
+	if (messages) fprintf(out, " %10.2f %10.1f", (double)(news + mallocs) / messages, (double)bytes / messages);
+	fprintf(out, "\n");
+}
+
+void alloc_print(FILE *out, const struct alloc_totals *totals)
+{
+	uint64_t sum[4] = { 0, 0, 0, 0 };
+
+	fprintf(out, "allocations by stage, %llu messages\n", (unsigned long long)totals->messages);
+	fprintf(out, "%-8s %12s %12s %12s %14s %10s %10s\n", "stage", "new", "malloc", "free", "bytes", "allocs/msg", "bytes/msg");
+	for (int s = 0; s < ALLOC_STAGE_COUNT; s++) {
+		if (!totals->news[s] && !totals->mallocs[s] && !totals->frees[s]) continue;
+		print_row(out, alloc_stage_names[s], totals->news[s], totals->mallocs[s], totals->frees[s], totals->bytes[s],
+			totals->messages);
+		if (s == ALLOC_OTHER) continue;
+		sum[0] += totals->news[s];
+		sum[1] += totals->mallocs[s];
+		sum[2] += totals->frees[s];
+		sum[3] += totals->bytes[s];
+	}
+	/* other is not part of the message path */
+	print_row(out, "total", sum[0], sum[1], sum[2], sum[3], totals->messages);
+}
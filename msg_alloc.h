@@ -0,0 +1,95 @@
+#pragma once
+/*
+  msg_alloc
+  Heap allocations counted by pipeline stage (-A).
+
+  Every allocation and free is charged to the stage its thread last tagged
+  itself with. alloc_tag() is a thread local store and the tag stays until
+  the next one, so a thread about to hand control to libmosquitto tags what
+  libmosquitto will do with it (ALLOC_PUBLISH around a publish,
+  ALLOC_NETWORK before the loop or when a callback returns).
+
+  Two hooks feed the counts:
+      operator new/delete   replaced in this module: every C++ allocation
+                            (std::vector, std::string, builders)
+      malloc/calloc/realloc/free
+                            on glibc, forwarded to __libc_malloc & co.
+                            libmosquitto's client library has no allocation
+                            hooks of its own; this catches its packet and
+                            message copies, and strdup & co. Build with
+                            -DMSG_ALLOC_MALLOC=0 to leave them out, e.g.
+                            under a sanitizer that wraps malloc itself.
+  Elsewhere only operator new/delete are seen. A realloc counts as a free
+  and an allocation.
+
+  Both hooks are linked into every program that uses this module. Until
+  alloc_init() they cost a load and a branch per call. Counts go to static
+  per-thread shards like msg_metrics, so counting never allocates.
+
+  msg_alloc_bench runs the send and receive paths of the v5 clients and
+  fails when the allocations per message exceed a budget.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#if !defined(MSG_ALLOC_MALLOC) && defined(__GLIBC__)
+# define MSG_ALLOC_MALLOC 1
+#endif
+
+enum alloc_stage {
+	ALLOC_OTHER, /* untagged threads, e.g. an in-process broker */
+	ALLOC_ENCODE,
+	ALLOC_COPY,
+	ALLOC_PUBLISH, /* mosquitto_publish*(): libmosquitto's packet */
+	ALLOC_NETWORK, /* libmosquitto reading and writing, incoming message copies */
+	ALLOC_QUEUE, /* receive lanes */
+	ALLOC_DECODE,
+	ALLOC_PRINT,
+	ALLOC_STAGE_COUNT
+};
+
+struct alloc_totals {
+	uint64_t news[ALLOC_STAGE_COUNT]; /* operator new */
+	uint64_t mallocs[ALLOC_STAGE_COUNT]; /* malloc & co., 0 without MSG_ALLOC_MALLOC */
+	uint64_t frees[ALLOC_STAGE_COUNT];
+	uint64_t bytes[ALLOC_STAGE_COUNT]; /* requested */
+	uint64_t messages;
+};
+
+extern bool alloc_enabled;
+extern thread_local enum alloc_stage alloc_thread_stage;
+extern std::atomic<uint64_t> alloc_messages;
+
+extern const char *alloc_stage_names[ALLOC_STAGE_COUNT];
+
+/* Charge this thread's allocations to stage from now on; returns the previous tag. */
+static inline enum alloc_stage alloc_tag(enum alloc_stage stage)
+{
+	enum alloc_stage prev = alloc_thread_stage;
+	alloc_thread_stage = stage;
+	return prev;
+}
+
+/* one message through the path being measured, for the per message figures */
+static inline void alloc_message(void)
+{
+	if (alloc_enabled) alloc_messages.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Start counting. */
+void alloc_init(void);
+
+/* The sums over all shards. */
+void alloc_snapshot(struct alloc_totals *totals);
+
+/* totals -= before, for counts over an interval */
+void alloc_since(struct alloc_totals *totals, const struct alloc_totals *before);
+
+/* allocations (new and malloc) per message, over the stages other than ALLOC_OTHER */
+double alloc_per_message(const struct alloc_totals *totals);
+
+/* A table by stage, with per message columns when messages were counted. */
+void alloc_print(FILE *out, const struct alloc_totals *totals);
@@ -0,0 +1,325 @@
+/*
+  msg_alloc_bench
+  Heap allocations per message on the path of the v5 clients, and a budget
+  for them. A sender client repeats what mosquitto_v5_send does per line
+  (encode the sensor_msg, copy the buffer out of the builder, publish) and
+  a receiver client in the same process what mosquitto_v5_recv does per
+  message (verify, decode the projected fields, print them, to /dev/null
+  here). Both tag their stages as the clients do (msg_alloc.h), so the
+  table shows where the allocations come from, libmosquitto's included.
+
+  Counting starts once the warm-up messages have arrived: the builders,
+  caches and stdio buffers have their steady state size by then and what
+  is left is paid for every message. The bench fails (exit 1) when the
+  allocations per message exceed the budget (-B), e.g. after a change that
+  builds a std::string per message. The default budget is an estimate,
+  not a measurement: reading libmosquitto, its own packet and message
+  copies at QoS 0 come to about six per message sent and received, and 8
+  leaves some room over that. Measure a run on the target and pass -B
+  before relying on it.
+
+  Runs against any MQTT broker, or with -b the stand-in broker inside this
+  process (msg_broker.h); its thread is not tagged and shows as "other",
+  outside the per message figures.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -Imosquitto-2.0.8/includes -o msg_alloc_bench msg_alloc_bench.cpp msg_alloc.cpp msg_verify.cpp msg_projection.cpp msg_broker.cpp msg_trace.cpp -lmosquitto -lpthread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include <mosquitto.h>
+#include <flatbuffers/flexbuffers.h>
+#include "sensor_msg.h"
+#include "msg_verify.h"
+#include "msg_projection.h"
+#include "msg_broker.h"
+#include "msg_alloc.h"
+
+#define DEFAULT_MQTT_HOST "127.0.0.1"
+#define DEFAULT_MQTT_PORT 1883
+#define DEFAULT_MQTT_KEEPALIVE 60
+#define DEFAULT_TOPIC "bench/alloc"
+#define DEFAULT_COUNT 100000
+#define DEFAULT_WARMUP 1000
+#define DEFAULT_PAYLOAD 16
+#define DEFAULT_BUDGET 8.0
+#define MAX_IN_FLIGHT 256 /* published but not received yet */
+#define DRAIN_TIMEOUT_MS 5000
+
+static volatile bool connected = false;
+static volatile bool subscribed = false;
+static std::atomic<uint64_t> received(0);
+static std::atomic<uint64_t> malformed(0);
+
+/* receiver state, touched by its network thread only */
+static struct verify_cache verify_cache;
+static struct msg_projection projection;
+static FILE *devnull;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-b] [-t topic] [-n count] [-w warmup] [-q qos] [-s payload] [-B budget]\n"
+		" -b : run the stand-in broker in this process instead of using -h/-p\n"
+		" -n : messages counted (default %d)\n"
+		" -w : messages sent before counting starts (default %d)\n"
+		" -q : QoS of the messages (default 0)\n"
+		" -s : characters of text per message (default %d)\n"
+		" -B : fail when the allocations per message exceed this (default %.1f)\n", argv0, DEFAULT_COUNT,
+		DEFAULT_WARMUP, DEFAULT_PAYLOAD, DEFAULT_BUDGET);
+	exit(1);
+}
+
+#ifndef _WINDOWS
+
+void connect_callback(struct mosquitto *mosq, void *obj, int result)
+{
+	alloc_tag(ALLOC_NETWORK);
+	if (result) {
+		fprintf(stderr, "Connection error: %s\n", mosquitto_connack_string(result));
+		return;
+	}
+	/* the receiver subscribes; the sender has no user data */
+	if (obj) mosquitto_subscribe(mosq, NULL, (const char *)obj, 2);
+	else connected = true;
+}
+
+void subscribe_callback(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+	(void)mosq;
+	(void)obj;
+	(void)mid;
+	(void)qos_count;
+	(void)granted_qos;
+	subscribed = true;
+}
+
+/* mosquitto_v5_recv's print_payload(), without the tracing */
+void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
+{
+	const uint8_t *payload = (const uint8_t *)message->payload;
+	size_t len = (size_t)message->payloadlen;
+	flexbuffers::Reference fields[PROJECTION_MAX_FIELDS];
+
+	(void)mosq;
+	(void)obj;
+
+	alloc_message();
+	alloc_tag(ALLOC_DECODE);
+	if (!verify_cached(&verify_cache, message->topic, payload, len)
+		|| projection_decode(&projection, payload, len, fields) < 0) {
+		malformed++;
+	}
+	else {
+		alloc_tag(ALLOC_PRINT);
+		fprintf(devnull, "topic '%s': message %zu bytes\n", message->topic, len);
+		for (int i = 0; i < projection.key_count; i++) {
+			fprintf(devnull, "%s : ", projection.keys[i]);
+			projection_print(devnull, fields[i]);
+			fprintf(devnull, "\n");
+		}
+	}
+	alloc_tag(ALLOC_NETWORK);
+	received++;
+}
+
+static bool wait_for(volatile bool *flag, int timeout_ms)
+{
+	for (int i = 0; i < timeout_ms / 10 && !*flag; i++) usleep(10000);
+	return *flag;
+}
+
+/* everything sent so far has arrived, or the drain timeout passed */
+static bool wait_received(uint64_t sent)
+{
+	for (int i = 0; i < DRAIN_TIMEOUT_MS / 10; i++) {
+		if (received.load() >= sent) return true;
+		usleep(10000);
+	}
+	return false;
+}
+
+/* mosquitto_v5_send's interactive loop, one line per message */
+static uint64_t send_messages(struct mosquitto *sender, const char *topic, uint64_t count, int qos, size_t payload,
+	uint64_t sent)
+{
+	static flexbuffers::Builder fbb(256 + payload, flexbuffers::BUILDER_FLAG_NONE);
+	static std::vector<uint8_t> flex_buf;
+	static std::string text;
+	sensor_msg msg;
+
+	text.assign(payload, 'x');
+	for (uint64_t i = 0; i < count; i++) {
+		/* bounded, so libmosquitto's queue does not grow with the run */
+		while (sent - received.load() >= MAX_IN_FLIGHT) usleep(100);
+
+		alloc_tag(ALLOC_ENCODE);
+		msg.time = (double)sent;
+		msg.text = text;
+		msg_schema::encode_flex(fbb, msg);
+
+		alloc_tag(ALLOC_COPY);
+		flex_buf = fbb.GetBuffer();
+
+		alloc_tag(ALLOC_PUBLISH);
+		int rc = mosquitto_publish(sender, NULL, topic, (int)flex_buf.size(), flex_buf.data(), qos, false);
+		alloc_tag(ALLOC_NETWORK);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: publish: %s\n", mosquitto_strerror(rc));
+			break;
+		}
+		sent++;
+	}
+	return sent;
+}
+
+int main(int argc, char *argv[])
+{
+	char *mqtt_host = strdup(DEFAULT_MQTT_HOST);
+	int mqtt_port = DEFAULT_MQTT_PORT;
+	char *topic = strdup(DEFAULT_TOPIC);
+	long count = DEFAULT_COUNT;
+	long warmup = DEFAULT_WARMUP;
+	int qos = 0;
+	size_t payload = DEFAULT_PAYLOAD;
+	double budget = DEFAULT_BUDGET;
+	bool in_process = false;
+	struct broker broker;
+	int rc;
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-b")) {
+			in_process = true;
+			continue;
+		}
+		if (i == argc - 1) usage(argv[0]);
+
+		if (!strcmp(argv[i], "-h")) {
+			free(mqtt_host);
+			mqtt_host = strdup(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-p")) mqtt_port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t")) {
+			free(topic);
+			topic = strdup(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-n")) count = atol(argv[++i]);
+		else if (!strcmp(argv[i], "-w")) warmup = atol(argv[++i]);
+		else if (!strcmp(argv[i], "-q")) qos = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s")) payload = (size_t)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-B")) budget = atof(argv[++i]);
+		else usage(argv[0]);
+	}
+	if (count <= 0 || warmup < 0 || qos < 0 || qos > 2 || budget < 0) usage(argv[0]);
+
+	devnull = fopen("/dev/null", "w");
+	if (!devnull) {
+		fprintf(stderr, "Error: Unable to open /dev/null.\n");
+		return 1;
+	}
+	verify_cache_init(&verify_cache);
+	projection_init(&projection);
+	projection_add(&projection, "time");
+	projection_add(&projection, "text");
+
+	if (in_process) {
+		rc = broker_init(&broker);
+		if (rc == MOSQ_ERR_SUCCESS) rc = broker_listen_tcp(&broker, DEFAULT_MQTT_HOST, 0);
+		if (rc == MOSQ_ERR_SUCCESS) rc = broker_start(&broker);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: in-process broker: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+		free(mqtt_host);
+		mqtt_host = strdup(DEFAULT_MQTT_HOST);
+		mqtt_port = broker.port;
+	}
+
+	/* counted from here, but nothing is charged to the message path until the snapshot */
+	alloc_init();
+	mosquitto_lib_init();
+
+	struct mosquitto *receiver = mosquitto_new(NULL, true, topic);
+	struct mosquitto *sender = mosquitto_new(NULL, true, NULL);
+	if (!receiver || !sender) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	mosquitto_connect_callback_set(receiver, connect_callback);
+	mosquitto_subscribe_callback_set(receiver, subscribe_callback);
+	mosquitto_message_callback_set(receiver, message_callback);
+	mosquitto_connect_callback_set(sender, connect_callback);
+	mosquitto_max_inflight_messages_set(sender, 0);
+
+	rc = mosquitto_connect(receiver, mqtt_host, mqtt_port, DEFAULT_MQTT_KEEPALIVE);
+	if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_connect(sender, mqtt_host, mqtt_port, DEFAULT_MQTT_KEEPALIVE);
+	if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_start(receiver);
+	if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_start(sender);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+		return 1;
+	}
+	if (!wait_for(&subscribed, 5000) || !wait_for(&connected, 5000)) {
+		fprintf(stderr, "Error: no connection to %s:%d\n", mqtt_host, mqtt_port);
+		return 1;
+	}
+
+	struct alloc_totals before, totals;
+	uint64_t sent = send_messages(sender, topic, (uint64_t)warmup, qos, payload, 0);
+	bool drained = wait_received(sent);
+	alloc_snapshot(&before);
+
+	uint64_t warm = sent;
+	sent = send_messages(sender, topic, (uint64_t)count, qos, payload, sent);
+	drained = wait_received(sent) && drained && sent == warm + (uint64_t)count;
+	alloc_snapshot(&totals);
+	alloc_since(&totals, &before);
+
+	mosquitto_disconnect(sender);
+	mosquitto_disconnect(receiver);
+	mosquitto_loop_stop(sender, false);
+	mosquitto_loop_stop(receiver, false);
+	mosquitto_destroy(sender);
+	mosquitto_destroy(receiver);
+	mosquitto_lib_cleanup();
+	if (in_process) broker_cleanup(&broker);
+
+	printf("qos %d, %zu text bytes, %llu sent, %llu received, %llu malformed\n", qos, payload,
+		(unsigned long long)(sent - warm), (unsigned long long)totals.messages,
+		(unsigned long long)malformed.load());
+	alloc_print(stdout, &totals);
+
+	double per_message = alloc_per_message(&totals);
+	printf("%.2f allocations per message, budget %.2f: %s\n", per_message, budget,
+		per_message <= budget ? "ok" : "over budget");
+
+	fclose(devnull);
+	free(topic);
+	free(mqtt_host);
+
+	if (!drained || malformed.load()) {
+		fprintf(stderr, "Error: not every message arrived intact.\n");
+		return 1;
+	}
+	return per_message <= budget ? 0 : 1;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "msg_alloc_bench counts malloc through glibc and is not supported on Windows.\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,1248 @@
+#include <string.h>
+#include <algorithm>
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+#include <mosquitto.h>
+#include "msg_broker.h"
+
+#define BROKER_CONN_BUFFER (64 * 1024)
+#define BROKER_MAX_EVENTS 64
+#define BROKER_POLL_MS 100
+
+/* epoll_event.data.u64: kind in the upper half, index in the lower */
+#define BROKER_EV_CONN 0ULL
+#define BROKER_EV_LISTEN 1ULL
+#define BROKER_EV_WAKE 2ULL
+
+/* packet types */
+#define CMD_CONNECT 1
+#define CMD_CONNACK 2
+#define CMD_PUBLISH 3
+#define CMD_PUBACK 4
+#define CMD_PUBREC 5
+#define CMD_PUBREL 6
+#define CMD_PUBCOMP 7
+#define CMD_SUBSCRIBE 8
+#define CMD_SUBACK 9
+#define CMD_UNSUBSCRIBE 10
+#define CMD_UNSUBACK 11
+#define CMD_PINGREQ 12
+#define CMD_PINGRESP 13
+#define CMD_DISCONNECT 14
+
+/* v5 subscription options above the QoS bits */
+#define SUB_NO_LOCAL 0x04
+#define SUB_RETAIN_AS_PUBLISHED 0x08
+#define SUB_RETAIN_HANDLING(options) (((options) >> 4) & 0x03)
+
+#define PROP_TOPIC_ALIAS 0x23
+
+bool broker_topic_match(const char *filter, size_t filter_len, const char *topic, size_t topic_len)
+{
+	size_t f = 0, t = 0;
+
+	if (topic_len && topic[0] == '$' && filter_len && (filter[0] == '+' || filter[0] == '#')) return false;
+
+	while (f < filter_len) {
+		if (filter[f] == '#') return true;
+
+		if (filter[f] == '+') {
+			while (t < topic_len && topic[t] != '/') t++;
+			f++;
+		}
+		else {
+			while (f < filter_len && filter[f] != '/') {
+				if (t >= topic_len || topic[t] != filter[f]) return false;
+				f++;
+				t++;
+			}
+			if (t < topic_len && topic[t] != '/') return false;
+		}
+
+		/* both at a separator or at the end */
+		if (f == filter_len) return t == topic_len;
+		f++;
+		if (t == topic_len) {
+			/* "a/#" also matches "a" */
+			return f + 1 == filter_len && filter[f] == '#';
+		}
+		t++;
+	}
+	return t == topic_len;
+}
+
+#if defined(__linux__)
+
+struct packet_reader {
+	const uint8_t *p;
+	size_t len;
+	size_t pos;
+	bool error;
+};
+
+static uint8_t read_u8(struct packet_reader *r)
+{
+	if (r->pos + 1 > r->len) {
+		r->error = true;
+		return 0;
+	}
+	return r->p[r->pos++];
+}
+
+static uint16_t read_u16(struct packet_reader *r)
+{
+	if (r->pos + 2 > r->len) {
+		r->error = true;
+		return 0;
+	}
+	uint16_t v = (uint16_t)((r->p[r->pos] << 8) | r->p[r->pos + 1]);
+	r->pos += 2;
+	return v;
+}
+
+static uint32_t read_varint(struct packet_reader *r)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < 4; i++) {
+		uint8_t byte = read_u8(r);
+		v |= (uint32_t)(byte & 0x7F) << (7 * i);
+		if (!(byte & 0x80)) return v;
+	}
+	r->error = true;
+	return 0;
+}
+
+/* length prefixed string or binary data, left in place */
+static const uint8_t *read_bytes(struct packet_reader *r, uint16_t *len)
+{
+	*len = read_u16(r);
+	if (r->error || r->pos + *len > r->len) {
+		r->error = true;
+		return NULL;
+	}
+	const uint8_t *data = r->p + r->pos;
+	r->pos += *len;
+	return data;
+}
+
+static void skip(struct packet_reader *r, size_t n)
+{
+	if (r->pos + n > r->len) r->error = true;
+	else r->pos += n;
+}
+
+static void skip_properties(struct packet_reader *r)
+{
+	uint32_t len = read_varint(r);
+	if (!r->error) skip(r, len);
+}
+
+static size_t varint_size(size_t v)
+{
+	return v < 128 ? 1 : v < 16384 ? 2 : v < 2097152 ? 3 : 4;
+}
+
+static uint64_t topic_hash(const char *topic, size_t len)
+{
+	uint64_t h = 1469598103934665603ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)topic[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool topic_valid(const uint8_t *topic, size_t len)
+{
+	if (!len) return false;
+	for (size_t i = 0; i < len; i++) {
+		if (topic[i] == '+' || topic[i] == '#' || topic[i] == 0) return false;
+	}
+	return true;
+}
+
+static bool filter_valid(const uint8_t *filter, size_t len)
+{
+	if (!len) return false;
+	for (size_t i = 0; i < len; i++) {
+		if (filter[i] == 0) return false;
+		if (filter[i] != '+' && filter[i] != '#') continue;
+
+		/* wildcards fill a whole level, # only the last one */
+		if (i > 0 && filter[i - 1] != '/') return false;
+		if (filter[i] == '#' && i + 1 != len) return false;
+		if (filter[i] == '+' && i + 1 < len && filter[i + 1] != '/') return false;
+	}
+	return true;
+}
+
+static bool filter_wildcard(const uint8_t *filter, size_t len)
+{
+	return memchr(filter, '+', len) || memchr(filter, '#', len);
+}
+
+/*
+  A user property carrying a sampled trace context: advance the hop in the
+  copy in b->props (same length, patched in place) and keep it in
+  b->trace_ctx. handle_publish records the receive once the PUBLISH is
+  accepted.
+*/
+static void trace_property(struct broker *b, size_t start)
+{
+	uint8_t *p = b->props.data() + start + 1;
+	size_t name_len = (size_t)((p[0] << 8) | p[1]);
+	if (name_len != strlen(TRACE_PROPERTY) || memcmp(p + 2, TRACE_PROPERTY, name_len)) return;
+
+	char *value = (char *)p + 2 + name_len + 2;
+	size_t value_len = (size_t)((p[2 + name_len] << 8) | p[2 + name_len + 1]);
+	struct trace_ctx ctx;
+	if (!trace_parse(value, value_len, &ctx) || !(ctx.flags & TRACE_SAMPLED)) return;
+
+	ctx.hop++;
+	char patched[TRACE_VALUE_LEN + 1];
+	trace_format(&ctx, patched);
+	memcpy(value, patched, TRACE_VALUE_LEN);
+	b->trace_ctx = ctx;
+	b->traced = true;
+}
+
+/*
+  Copy v5 PUBLISH properties into b->props without the topic alias, which is
+  only meaningful on the publisher's connection.
+*/
+static bool filter_properties(struct broker *b, const uint8_t *p, size_t len)
+{
+	b->props.clear();
+
+	size_t pos = 0;
+	while (pos < len) {
+		size_t start = pos;
+		uint8_t id = p[pos++];
+		size_t value = 0;
+
+		switch (id) {
+		case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+			value = 1;
+			break;
+		case 0x13: case 0x21: case 0x22: case 0x23:
+			value = 2;
+			break;
+		case 0x02: case 0x11: case 0x18: case 0x27:
+			value = 4;
+			break;
+		case 0x0B:
+			while (pos + value < len && (p[pos + value] & 0x80)) value++;
+			value++;
+			break;
+		case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+			if (pos + 2 > len) return false;
+			value = 2 + (size_t)((p[pos] << 8) | p[pos + 1]);
+			break;
+		case 0x26:
+			if (pos + 2 > len) return false;
+			value = 2 + (size_t)((p[pos] << 8) | p[pos + 1]);
+			if (pos + value + 2 > len) return false;
+			value += 2 + (size_t)((p[pos + value] << 8) | p[pos + value + 1]);
+			break;
+		default:
+			return false;
+		}
+		if (pos + value > len) return false;
+		pos += value;
+
+		if (id == PROP_TOPIC_ALIAS) continue;
+		size_t offset = b->props.size();
+		b->props.insert(b->props.end(), p + start, p + pos);
+		if (id == 0x26 && b->trace && !b->traced) trace_property(b, offset);
+	}
+	return true;
+}
+
+/* output */
+
+static void flush_conn(struct broker *b, uint32_t index);
+
+static uint8_t *out_reserve(struct broker *b, uint32_t index, size_t n)
+{
+	struct broker_conn *c = &b->conns[index];
+
+	if (c->out_len + n > c->out.size()) {
+		if (c->out_pos) {
+			memmove(c->out.data(), c->out.data() + c->out_pos, c->out_len - c->out_pos);
+			c->out_len -= c->out_pos;
+			c->out_pos = 0;
+		}
+		if (c->out_len + n > c->out.size()) {
+			c->out.resize(std::max(c->out.size() * 2, c->out_len + n));
+		}
+	}
+	if (!c->dirty) {
+		c->dirty = true;
+		b->dirty.push_back(index);
+	}
+
+	uint8_t *p = c->out.data() + c->out_len;
+	c->out_len += n;
+	return p;
+}
+
+static uint8_t *put_varint(uint8_t *p, size_t v)
+{
+	do {
+		uint8_t byte = v & 0x7F;
+		v >>= 7;
+		if (v) byte |= 0x80;
+		*p++ = byte;
+	} while (v);
+	return p;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+	*p++ = (uint8_t)(v >> 8);
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static uint8_t *put_header(uint8_t *p, uint8_t type_flags, size_t remaining)
+{
+	*p++ = type_flags;
+	return put_varint(p, remaining);
+}
+
+static void send_ack(struct broker *b, uint32_t index, uint8_t type_flags, uint16_t mid)
+{
+	uint8_t *p = out_reserve(b, index, 4);
+	p = put_header(p, type_flags, 2);
+	put_u16(p, mid);
+}
+
+static void deliver(struct broker *b, uint32_t index, const char *topic, size_t topic_len, const uint8_t *props,
+	size_t props_len, const uint8_t *payload, size_t payload_len, uint8_t qos, bool retain)
+{
+	struct broker_conn *c = &b->conns[index];
+
+	if (c->overflowed) return;
+	if (c->out_len - c->out_pos > BROKER_OUT_LIMIT) {
+		if (qos == 0) {
+			b->stats.dropped++;
+			return;
+		}
+		/* a client that stopped reading can't be owed QoS 1/2 messages forever */
+		c->overflowed = true;
+		b->stats.overflows++;
+		if (!c->dirty) {
+			c->dirty = true;
+			b->dirty.push_back(index);
+		}
+		return;
+	}
+
+	bool v5 = c->version == 5;
+	size_t remaining = 2 + topic_len + (qos ? 2 : 0) + payload_len;
+	if (v5) remaining += varint_size(props_len) + props_len;
+
+	uint8_t *p = out_reserve(b, index, 1 + varint_size(remaining) + remaining);
+	p = put_header(p, (uint8_t)((CMD_PUBLISH << 4) | (qos << 1) | (retain ? 1 : 0)), remaining);
+	p = put_u16(p, (uint16_t)topic_len);
+	memcpy(p, topic, topic_len);
+	p += topic_len;
+	if (qos) {
+		if (++c->next_mid == 0) c->next_mid = 1;
+		p = put_u16(p, c->next_mid);
+	}
+	if (v5) {
+		p = put_varint(p, props_len);
+		if (props_len) memcpy(p, props, props_len);
+		p += props_len;
+	}
+	if (payload_len) memcpy(p, payload, payload_len);
+
+	b->stats.deliveries++;
+}
+
+/* routing */
+
+static void add_match(struct broker *b, uint32_t sub_index, uint32_t from, uint8_t qos)
+{
+	const struct broker_sub *s = &b->subs[sub_index];
+	if ((s->options & SUB_NO_LOCAL) && s->conn == from) return;
+
+	struct broker_conn *c = &b->conns[s->conn];
+	uint8_t granted = std::min(qos, s->qos);
+
+	/* one delivery per client, at the highest QoS of its matching subscriptions */
+	if (c->match_seq != b->match_seq) {
+		c->match_seq = b->match_seq;
+		c->match_index = b->matches.size();
+		b->matches.push_back({ s->conn, sub_index, granted });
+	}
+	else {
+		struct broker_match *m = &b->matches[c->match_index];
+		if (granted > m->qos) m->qos = granted;
+		if (s->options & SUB_RETAIN_AS_PUBLISHED) m->sub = sub_index;
+	}
+}
+
+static void route(struct broker *b, uint32_t from, const char *topic, size_t topic_len, const uint8_t *props,
+	size_t props_len, const uint8_t *payload, size_t payload_len, uint8_t qos, bool retain)
+{
+	b->match_seq++;
+	b->matches.clear();
+
+	auto exact = b->exact.find(topic_hash(topic, topic_len));
+	if (exact != b->exact.end()) {
+		for (uint32_t sub_index : exact->second) {
+			const std::string &filter = b->subs[sub_index].filter;
+			if (filter.size() == topic_len && !memcmp(filter.data(), topic, topic_len)) {
+				add_match(b, sub_index, from, qos);
+			}
+		}
+	}
+	for (uint32_t sub_index : b->wildcards) {
+		const std::string &filter = b->subs[sub_index].filter;
+		if (broker_topic_match(filter.data(), filter.size(), topic, topic_len)) {
+			add_match(b, sub_index, from, qos);
+		}
+	}
+
+	for (const struct broker_match &m : b->matches) {
+		bool keep_retain = retain && (b->subs[m.sub].options & SUB_RETAIN_AS_PUBLISHED);
+		deliver(b, m.conn, topic, topic_len, props, props_len, payload, payload_len, m.qos, keep_retain);
+	}
+}
+
+static void store_retained(struct broker *b, const char *topic, size_t topic_len, const uint8_t *payload,
+	size_t payload_len, uint8_t qos)
+{
+	std::string key(topic, topic_len);
+
+	if (!payload_len) {
+		b->retained.erase(key);
+		return;
+	}
+
+	struct broker_retained &r = b->retained[key];
+	r.payload.assign(payload, payload + payload_len);
+	r.props.assign(b->props.begin(), b->props.end());
+	r.qos = qos;
+}
+
+static void send_retained(struct broker *b, uint32_t sub_index)
+{
+	const struct broker_sub *s = &b->subs[sub_index];
+
+	for (auto &entry : b->retained) {
+		const std::string &topic = entry.first;
+		if (!broker_topic_match(s->filter.data(), s->filter.size(), topic.data(), topic.size())) continue;
+
+		const struct broker_retained &r = entry.second;
+		deliver(b, s->conn, topic.data(), topic.size(), r.props.data(), r.props.size(), r.payload.data(),
+			r.payload.size(), std::min(r.qos, s->qos), true);
+	}
+}
+
+/* subscriptions */
+
+static int find_sub(struct broker *b, uint32_t index, const uint8_t *filter, size_t len)
+{
+	const std::vector<uint32_t> *list = &b->wildcards;
+	if (!filter_wildcard(filter, len)) {
+		auto exact = b->exact.find(topic_hash((const char *)filter, len));
+		if (exact == b->exact.end()) return -1;
+		list = &exact->second;
+	}
+
+	for (uint32_t sub_index : *list) {
+		const struct broker_sub *s = &b->subs[sub_index];
+		if (s->conn == index && s->filter.size() == len && !memcmp(s->filter.data(), filter, len)) {
+			return (int)sub_index;
+		}
+	}
+	return -1;
+}
+
+static uint32_t add_sub(struct broker *b, uint32_t index, const uint8_t *filter, size_t len, uint8_t options)
+{
+	uint32_t sub_index;
+	if (!b->free_subs.empty()) {
+		sub_index = b->free_subs.back();
+		b->free_subs.pop_back();
+	}
+	else {
+		sub_index = (uint32_t)b->subs.size();
+		b->subs.emplace_back();
+	}
+
+	struct broker_sub *s = &b->subs[sub_index];
+	s->filter.assign((const char *)filter, len);
+	s->conn = index;
+	s->qos = options & 0x03;
+	s->options = options & ~0x03;
+	s->wildcard = filter_wildcard(filter, len);
+	s->active = true;
+
+	if (s->wildcard) b->wildcards.push_back(sub_index);
+	else b->exact[topic_hash((const char *)filter, len)].push_back(sub_index);
+	b->stats.subscriptions++;
+	return sub_index;
+}
+
+static void remove_sub(struct broker *b, uint32_t sub_index)
+{
+	struct broker_sub *s = &b->subs[sub_index];
+
+	std::vector<uint32_t> *list = &b->wildcards;
+	auto exact = b->exact.end();
+	if (!s->wildcard) {
+		exact = b->exact.find(topic_hash(s->filter.data(), s->filter.size()));
+		list = &exact->second;
+	}
+	list->erase(std::find(list->begin(), list->end(), sub_index));
+	if (exact != b->exact.end() && list->empty()) b->exact.erase(exact);
+
+	s->active = false;
+	s->filter.clear();
+	b->free_subs.push_back(sub_index);
+	b->stats.subscriptions--;
+}
+
+/* connections */
+
+static void close_conn(struct broker *b, uint32_t index)
+{
+	struct broker_conn *c = &b->conns[index];
+	if (c->fd < 0) return;
+
+	epoll_ctl(b->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->version = 0;
+	c->in_len = 0;
+	c->out_pos = 0;
+	c->out_len = 0;
+	c->want_write = false;
+	c->overflowed = false;
+	std::fill(c->qos2_pending.begin(), c->qos2_pending.end(), 0);
+
+	for (uint32_t i = 0; i < b->subs.size(); i++) {
+		if (b->subs[i].active && b->subs[i].conn == index) remove_sub(b, i);
+	}
+
+	b->closed.push_back(index);
+	b->stats.connections--;
+}
+
+static uint64_t broker_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void listen_events(struct broker *b, uint32_t events)
+{
+	for (int i = 0; i < b->listeners; i++) {
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.u64 = (BROKER_EV_LISTEN << 32) | (uint32_t)i;
+		epoll_ctl(b->epfd, EPOLL_CTL_MOD, b->listen_fds[i], &ev);
+	}
+}
+
+static void accept_conn(struct broker *b, int listen_fd)
+{
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) return;
+
+		/*
+		  EMFILE, ENFILE, ENOBUFS...: the pending connection stays queued and
+		  the level-triggered listener would wake us again at once. Stop
+		  listening for a while instead of spinning.
+		*/
+		b->stats.accept_errors++;
+		if (!b->accept_resume_ms) listen_events(b, 0);
+		b->accept_resume_ms = broker_now_ms() + BROKER_ACCEPT_BACKOFF_MS;
+		return;
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); /* fails harmlessly on Unix sockets */
+
+	uint32_t index;
+	if (!b->free_conns.empty()) {
+		index = b->free_conns.back();
+		b->free_conns.pop_back();
+	}
+	else {
+		index = (uint32_t)b->conns.size();
+		b->conns.emplace_back();
+		struct broker_conn *c = &b->conns[index];
+		c->in.resize(BROKER_CONN_BUFFER);
+		c->out.resize(BROKER_CONN_BUFFER);
+		c->qos2_pending.assign(65536 / 64, 0);
+		c->dirty = false;
+		c->match_seq = 0;
+		c->match_index = 0;
+	}
+
+	struct broker_conn *c = &b->conns[index];
+	c->fd = fd;
+	c->version = 0;
+	c->in_len = 0;
+	c->out_pos = 0;
+	c->out_len = 0;
+	c->want_write = false;
+	c->overflowed = false;
+	c->next_mid = 0;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (BROKER_EV_CONN << 32) | index;
+	if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		c->fd = -1;
+		b->free_conns.push_back(index);
+		return;
+	}
+
+	b->stats.connections++;
+	b->stats.accepted++;
+}
+
+/* packet handlers, MOSQ_ERR_PROTOCOL closes the connection */
+
+static int handle_connect(struct broker *b, uint32_t index, struct packet_reader *r)
+{
+	struct broker_conn *c = &b->conns[index];
+	uint16_t len;
+
+	read_bytes(r, &len);
+	uint8_t level = read_u8(r);
+	uint8_t flags = read_u8(r);
+	read_u16(r); /* keepalive, not enforced */
+	if (r->error) return MOSQ_ERR_PROTOCOL;
+
+	if (level != 3 && level != 4 && level != 5) {
+		/* 3.1.1 style refusal, understood by every version */
+		uint8_t *p = out_reserve(b, index, 4);
+		p = put_header(p, CMD_CONNACK << 4, 2);
+		*p++ = 0;
+		*p = 0x01; /* unacceptable protocol version */
+		flush_conn(b, index);
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	c->version = level;
+
+	if (level == 5) skip_properties(r);
+	read_bytes(r, &len); /* client id */
+	if (flags & 0x04) {
+		if (level == 5) skip_properties(r);
+		read_bytes(r, &len);
+		read_bytes(r, &len);
+	}
+	if (flags & 0x80) read_bytes(r, &len);
+	if (flags & 0x40) read_bytes(r, &len);
+	if (r->error) return MOSQ_ERR_PROTOCOL;
+
+	uint8_t *p = out_reserve(b, index, level == 5 ? 5 : 4);
+	p = put_header(p, CMD_CONNACK << 4, level == 5 ? 3 : 2);
+	*p++ = 0; /* no session present */
+	*p++ = 0; /* accepted */
+	if (level == 5) *p = 0; /* no properties */
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int handle_publish(struct broker *b, uint32_t index, uint8_t flags, struct packet_reader *r)
+{
+	struct broker_conn *c = &b->conns[index];
+	uint8_t qos = (flags >> 1) & 0x03;
+	bool retain = flags & 0x01;
+	uint16_t topic_len;
+	uint16_t mid = 0;
+
+	if (qos == 3) return MOSQ_ERR_PROTOCOL;
+
+	const char *topic = (const char *)read_bytes(r, &topic_len);
+	if (qos) mid = read_u16(r);
+	b->props.clear();
+	b->traced = false;
+	if (c->version == 5) {
+		uint32_t props_len = read_varint(r);
+		if (r->error || r->pos + props_len > r->len || !topic) return MOSQ_ERR_PROTOCOL;
+		if (!filter_properties(b, r->p + r->pos, props_len)) return MOSQ_ERR_PROTOCOL;
+		r->pos += props_len;
+	}
+	if (r->error || !topic_valid((const uint8_t *)topic, topic_len)) return MOSQ_ERR_PROTOCOL;
+	if (b->traced) trace_file_event(b->trace, &b->trace_ctx, TRACE_RECV, b->trace_ctx.hop, topic, topic_len);
+
+	const uint8_t *payload = r->p + r->pos;
+	size_t payload_len = r->len - r->pos;
+	b->stats.publishes_in++;
+
+	if (qos == 2) {
+		uint64_t bit = 1ULL << (mid & 63);
+		uint64_t *word = &c->qos2_pending[mid >> 6];
+		bool duplicate = *word & bit;
+		*word |= bit;
+
+		send_ack(b, index, CMD_PUBREC << 4, mid);
+		if (duplicate) return MOSQ_ERR_SUCCESS;
+	}
+	else if (qos == 1) {
+		send_ack(b, index, CMD_PUBACK << 4, mid);
+	}
+
+	if (retain) store_retained(b, topic, topic_len, payload, payload_len, qos);
+	route(b, index, topic, topic_len, b->props.data(), b->props.size(), payload, payload_len, qos, retain);
+	if (b->traced) trace_file_event(b->trace, &b->trace_ctx, TRACE_FORWARD, b->trace_ctx.hop, topic, topic_len);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int handle_subscribe(struct broker *b, uint32_t index, struct packet_reader *r)
+{
+	bool v5 = b->conns[index].version == 5;
+	uint16_t mid = read_u16(r);
+	uint16_t len;
+
+	if (v5) skip_properties(r);
+	if (r->error) return MOSQ_ERR_PROTOCOL;
+
+	/* count the filters first, the SUBACK is written while subscribing */
+	size_t start = r->pos;
+	size_t count = 0;
+	while (r->pos < r->len) {
+		read_bytes(r, &len);
+		read_u8(r);
+		if (r->error) return MOSQ_ERR_PROTOCOL;
+		count++;
+	}
+	if (!count) return MOSQ_ERR_PROTOCOL;
+
+	size_t remaining = 2 + (v5 ? 1 : 0) + count;
+	uint8_t *p = out_reserve(b, index, 1 + varint_size(remaining) + remaining);
+	p = put_header(p, (CMD_SUBACK << 4), remaining);
+	p = put_u16(p, mid);
+	if (v5) *p++ = 0;
+	size_t code_offset = (size_t)(p - b->conns[index].out.data());
+
+	b->granted.clear();
+	r->pos = start;
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *filter = read_bytes(r, &len);
+		uint8_t options = read_u8(r);
+		uint8_t code;
+
+		if (!filter_valid(filter, len) || (options & 0x03) == 3) {
+			code = v5 ? 0x8F : 0x80;
+		}
+		else {
+			int existing = find_sub(b, index, filter, len);
+			if (existing >= 0) {
+				b->subs[existing].qos = options & 0x03;
+				b->subs[existing].options = options & ~0x03;
+				b->granted.push_back({ (uint32_t)existing, false });
+			}
+			else {
+				b->granted.push_back({ add_sub(b, index, filter, len, options), true });
+			}
+			code = options & 0x03;
+		}
+		b->conns[index].out[code_offset + i] = code;
+	}
+
+	/* retained messages follow the SUBACK */
+	for (auto &g : b->granted) {
+		int handling = SUB_RETAIN_HANDLING(b->subs[g.first].options);
+		if (handling == 0 || (handling == 1 && g.second)) send_retained(b, g.first);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int handle_unsubscribe(struct broker *b, uint32_t index, struct packet_reader *r)
+{
+	bool v5 = b->conns[index].version == 5;
+	uint16_t mid = read_u16(r);
+	uint16_t len;
+
+	if (v5) skip_properties(r);
+	if (r->error) return MOSQ_ERR_PROTOCOL;
+
+	size_t start = r->pos;
+	size_t count = 0;
+	while (r->pos < r->len) {
+		read_bytes(r, &len);
+		if (r->error) return MOSQ_ERR_PROTOCOL;
+		count++;
+	}
+	if (!count) return MOSQ_ERR_PROTOCOL;
+
+	/* 3.1.1 UNSUBACK carries no reason codes */
+	size_t remaining = 2 + (v5 ? 1 + count : 0);
+	uint8_t *p = out_reserve(b, index, 1 + varint_size(remaining) + remaining);
+	p = put_header(p, (CMD_UNSUBACK << 4), remaining);
+	p = put_u16(p, mid);
+	if (v5) *p++ = 0;
+	size_t code_offset = (size_t)(p - b->conns[index].out.data());
+
+	r->pos = start;
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *filter = read_bytes(r, &len);
+		int existing = find_sub(b, index, filter, len);
+		if (existing >= 0) remove_sub(b, (uint32_t)existing);
+		if (v5) b->conns[index].out[code_offset + i] = existing >= 0 ? 0x00 : 0x11;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int handle_packet(struct broker *b, uint32_t index, uint8_t header, const uint8_t *body, size_t len)
+{
+	struct packet_reader r = { body, len, 0, false };
+	uint8_t type = header >> 4;
+	uint8_t flags = header & 0x0F;
+
+	if (b->conns[index].version == 0 && type != CMD_CONNECT) return MOSQ_ERR_PROTOCOL;
+
+	switch (type) {
+	case CMD_CONNECT:
+		if (b->conns[index].version != 0) return MOSQ_ERR_PROTOCOL;
+		return handle_connect(b, index, &r);
+	case CMD_PUBLISH:
+		return handle_publish(b, index, flags, &r);
+	case CMD_PUBACK:
+	case CMD_PUBCOMP:
+		return MOSQ_ERR_SUCCESS; /* nothing is kept for redelivery */
+	case CMD_PUBREC:
+		send_ack(b, index, (CMD_PUBREL << 4) | 0x02, read_u16(&r));
+		return r.error ? MOSQ_ERR_PROTOCOL : MOSQ_ERR_SUCCESS;
+	case CMD_PUBREL: {
+		uint16_t mid = read_u16(&r);
+		if (r.error) return MOSQ_ERR_PROTOCOL;
+		b->conns[index].qos2_pending[mid >> 6] &= ~(1ULL << (mid & 63));
+		send_ack(b, index, CMD_PUBCOMP << 4, mid);
+		return MOSQ_ERR_SUCCESS;
+	}
+	case CMD_SUBSCRIBE:
+		if (flags != 0x02) return MOSQ_ERR_PROTOCOL;
+		return handle_subscribe(b, index, &r);
+	case CMD_UNSUBSCRIBE:
+		if (flags != 0x02) return MOSQ_ERR_PROTOCOL;
+		return handle_unsubscribe(b, index, &r);
+	case CMD_PINGREQ: {
+		uint8_t *p = out_reserve(b, index, 2);
+		put_header(p, CMD_PINGRESP << 4, 0);
+		return MOSQ_ERR_SUCCESS;
+	}
+	case CMD_DISCONNECT:
+		return MOSQ_ERR_CONN_LOST;
+	default:
+		return MOSQ_ERR_PROTOCOL;
+	}
+}
+
+static void read_conn(struct broker *b, uint32_t index)
+{
+	struct broker_conn *c = &b->conns[index];
+
+	if (c->in_len == c->in.size()) {
+		if (c->in.size() >= BROKER_MAX_PACKET + 5) {
+			b->stats.protocol_errors++;
+			close_conn(b, index);
+			return;
+		}
+		c->in.resize(c->in.size() * 2);
+	}
+
+	ssize_t n = recv(c->fd, c->in.data() + c->in_len, c->in.size() - c->in_len, 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		close_conn(b, index);
+		return;
+	}
+	if (n < 0) return;
+	c->in_len += (size_t)n;
+	b->stats.bytes_in += (uint64_t)n;
+
+	size_t pos = 0;
+	while (pos + 2 <= c->in_len) {
+		/* fixed header: type/flags and a variable length remaining length */
+		size_t remaining = 0;
+		size_t header_len = 1;
+		bool complete = false;
+		for (int i = 0; i < 4 && pos + header_len < c->in_len; i++) {
+			uint8_t byte = c->in[pos + header_len++];
+			remaining |= (size_t)(byte & 0x7F) << (7 * i);
+			if (!(byte & 0x80)) {
+				complete = true;
+				break;
+			}
+		}
+		if (!complete) {
+			if (header_len == 5) {
+				b->stats.protocol_errors++;
+				close_conn(b, index);
+				return;
+			}
+			break;
+		}
+		if (remaining > BROKER_MAX_PACKET) {
+			b->stats.protocol_errors++;
+			close_conn(b, index);
+			return;
+		}
+		if (pos + header_len + remaining > c->in_len) break;
+
+		int rc = handle_packet(b, index, c->in[pos], c->in.data() + pos + header_len, remaining);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			if (rc == MOSQ_ERR_PROTOCOL) b->stats.protocol_errors++;
+			close_conn(b, index);
+			return;
+		}
+		pos += header_len + remaining;
+	}
+
+	if (pos) {
+		memmove(c->in.data(), c->in.data() + pos, c->in_len - pos);
+		c->in_len -= pos;
+	}
+}
+
+static void set_want_write(struct broker *b, uint32_t index, bool want)
+{
+	struct broker_conn *c = &b->conns[index];
+	if (c->want_write == want) return;
+
+	struct epoll_event ev;
+	ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.u64 = (BROKER_EV_CONN << 32) | index;
+	epoll_ctl(b->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_write = want;
+}
+
+static void flush_conn(struct broker *b, uint32_t index)
+{
+	struct broker_conn *c = &b->conns[index];
+
+	while (c->out_pos < c->out_len) {
+		ssize_t n = send(c->fd, c->out.data() + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) {
+				set_want_write(b, index, true);
+				return;
+			}
+			close_conn(b, index);
+			return;
+		}
+		c->out_pos += (size_t)n;
+		b->stats.bytes_out += (uint64_t)n;
+	}
+
+	c->out_pos = 0;
+	c->out_len = 0;
+	set_want_write(b, index, false);
+}
+
+static void flush_dirty(struct broker *b)
+{
+	for (uint32_t index : b->dirty) {
+		struct broker_conn *c = &b->conns[index];
+		c->dirty = false;
+		if (c->fd >= 0 && c->overflowed) close_conn(b, index);
+		else if (c->fd >= 0 && !c->want_write) flush_conn(b, index);
+	}
+	b->dirty.clear();
+}
+
+/* listeners */
+
+static int add_listener(struct broker *b, int fd)
+{
+	if (listen(fd, 128) < 0) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (BROKER_EV_LISTEN << 32) | (uint32_t)b->listeners;
+	if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+	b->listen_fds[b->listeners++] = fd;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int broker_init(struct broker *b)
+{
+	b->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (b->epfd < 0) return MOSQ_ERR_ERRNO;
+
+	b->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (b->wake_fd < 0) {
+		close(b->epfd);
+		return MOSQ_ERR_ERRNO;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = BROKER_EV_WAKE << 32;
+	epoll_ctl(b->epfd, EPOLL_CTL_ADD, b->wake_fd, &ev);
+
+	b->listeners = 0;
+	b->port = 0;
+	b->unix_path.clear();
+	b->accept_resume_ms = 0;
+	b->conns.clear();
+	b->free_conns.clear();
+	b->closed.clear();
+	b->dirty.clear();
+	b->subs.clear();
+	b->free_subs.clear();
+	b->exact.clear();
+	b->wildcards.clear();
+	b->retained.clear();
+	b->matches.clear();
+	b->matches.reserve(64);
+	b->props.clear();
+	b->props.reserve(1024);
+	b->granted.clear();
+	b->match_seq = 0;
+	b->trace = NULL;
+	b->traced = false;
+	memset(&b->stats, 0, sizeof(b->stats));
+	memset(&b->published, 0, sizeof(b->published));
+	b->run = false;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int broker_listen_tcp(struct broker *b, const char *host, int port)
+{
+	if (b->listeners == BROKER_MAX_LISTENERS) return MOSQ_ERR_INVAL;
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &ai) != 0) return MOSQ_ERR_EAI;
+
+	int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		freeaddrinfo(ai);
+		return MOSQ_ERR_ERRNO;
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		freeaddrinfo(ai);
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+	freeaddrinfo(ai);
+
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) == 0) {
+		if (addr.ss_family == AF_INET) b->port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+		else if (addr.ss_family == AF_INET6) b->port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	}
+	return add_listener(b, fd);
+}
+
+int broker_listen_unix(struct broker *b, const char *path)
+{
+	if (b->listeners == BROKER_MAX_LISTENERS) return MOSQ_ERR_INVAL;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) return MOSQ_ERR_INVAL;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return MOSQ_ERR_ERRNO;
+
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+	b->unix_path = path;
+	return add_listener(b, fd);
+}
+
+int broker_run(struct broker *b, volatile bool *run)
+{
+	struct epoll_event events[BROKER_MAX_EVENTS];
+
+	if (!b->listeners) return MOSQ_ERR_INVAL;
+
+	while (*run) {
+		int n = epoll_wait(b->epfd, events, BROKER_MAX_EVENTS, BROKER_POLL_MS);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return MOSQ_ERR_ERRNO;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t kind = events[i].data.u64 >> 32;
+			uint32_t index = (uint32_t)events[i].data.u64;
+
+			if (kind == BROKER_EV_LISTEN) {
+				accept_conn(b, b->listen_fds[index]);
+			}
+			else if (kind == BROKER_EV_WAKE) {
+				uint64_t value;
+				if (read(b->wake_fd, &value, sizeof(value)) < 0) {
+					/* nothing to drain */
+				}
+			}
+			else if (b->conns[index].fd >= 0) {
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) read_conn(b, index);
+				if (b->conns[index].fd >= 0 && (events[i].events & EPOLLOUT)) flush_conn(b, index);
+			}
+		}
+
+		/* one write per client for everything routed in this wakeup */
+		flush_dirty(b);
+
+		b->free_conns.insert(b->free_conns.end(), b->closed.begin(), b->closed.end());
+		b->closed.clear();
+
+		if (b->accept_resume_ms && broker_now_ms() >= b->accept_resume_ms) {
+			b->accept_resume_ms = 0;
+			listen_events(b, EPOLLIN);
+		}
+
+		b->stats.retained = b->retained.size();
+		std::lock_guard<std::mutex> guard(b->stats_lock);
+		b->published = b->stats;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int broker_start(struct broker *b)
+{
+	if (!b->listeners) return MOSQ_ERR_INVAL;
+	if (b->thread.joinable()) return MOSQ_ERR_INVAL;
+
+	b->run = true;
+	b->thread = std::thread([b]() { broker_run(b, &b->run); });
+	return MOSQ_ERR_SUCCESS;
+}
+
+void broker_stop(struct broker *b)
+{
+	if (!b->thread.joinable()) return;
+
+	b->run = false;
+	uint64_t one = 1;
+	if (write(b->wake_fd, &one, sizeof(one)) < 0) {
+		/* the poll timeout ends the loop anyway */
+	}
+	b->thread.join();
+}
+
+void broker_cleanup(struct broker *b)
+{
+	broker_stop(b);
+
+	for (uint32_t i = 0; i < b->conns.size(); i++) {
+		if (b->conns[i].fd >= 0) close(b->conns[i].fd);
+	}
+	for (int i = 0; i < b->listeners; i++) close(b->listen_fds[i]);
+	if (!b->unix_path.empty()) unlink(b->unix_path.c_str());
+	close(b->wake_fd);
+	close(b->epfd);
+
+	b->listeners = 0;
+	b->conns.clear();
+	b->subs.clear();
+	b->exact.clear();
+	b->wildcards.clear();
+	b->retained.clear();
+}
+
+void broker_get_stats(struct broker *b, struct broker_stats *stats)
+{
+	std::lock_guard<std::mutex> guard(b->stats_lock);
+	*stats = b->published;
+}
+
+#else
+
+int broker_init(struct broker *b)
+{
+	b->listeners = 0;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void broker_cleanup(struct broker *b)
+{
+}
+
+int broker_listen_tcp(struct broker *b, const char *host, int port)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int broker_listen_unix(struct broker *b, const char *path)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int broker_run(struct broker *b, volatile bool *run)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int broker_start(struct broker *b)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void broker_stop(struct broker *b)
+{
+}
+
+void broker_get_stats(struct broker *b, struct broker_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
+void broker_print_stats(struct broker *b, FILE *out)
+{
+	struct broker_stats stats;
+	broker_get_stats(b, &stats);
+
+	fprintf(out, "broker: %llu connected (%llu accepted), %llu subscriptions, %llu retained\n",
+		(unsigned long long)stats.connections, (unsigned long long)stats.accepted,
+		(unsigned long long)stats.subscriptions, (unsigned long long)stats.retained);
+	fprintf(out, "  %llu publishes in, %llu deliveries, %llu dropped, %llu protocol errors\n",
+		(unsigned long long)stats.publishes_in, (unsigned long long)stats.deliveries,
+		(unsigned long long)stats.dropped, (unsigned long long)stats.protocol_errors);
+	fprintf(out, "  %llu clients over the queue limit, %llu accept errors\n",
+		(unsigned long long)stats.overflows, (unsigned long long)stats.accept_errors);
+	fprintf(out, "  %llu bytes in, %llu bytes out\n", (unsigned long long)stats.bytes_in,
+		(unsigned long long)stats.bytes_out);
+}
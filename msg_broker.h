@@ -0,0 +1,163 @@
+#pragma once
+/*
+  msg_broker
+  Minimal MQTT 3.1.1/5 broker for tests and benchmarks on one host.
+
+  Runs inside the process under test (broker_start, on its own thread) or as
+  the mosquitto_loopback daemon, and listens on loopback TCP and/or a Unix
+  socket. libmosquitto clients connect to a Unix socket by passing its path
+  as the host and port 0.
+
+  Supported: CONNECT/CONNACK, PUBLISH at QoS 0, 1 and 2 in both directions,
+  SUBSCRIBE/UNSUBSCRIBE with + and # wildcards, retained messages, PINGREQ
+  and DISCONNECT. v5 PUBLISH properties are passed through to v5 subscribers
+  (topic aliases are not offered); v5 subscription options no-local,
+  retain-as-published and retain handling are honoured. With b->trace set,
+  the broker is a forwarding hop for messages carrying a trace context
+  (msg_trace.h): it records their receive and forward times and advances
+  the hop in the context it passes on.
+
+  Not supported, by design: persistent sessions (session present is always
+  0, nothing is kept after a disconnect), redelivery of unacknowledged
+  messages, will messages, authentication, keepalive enforcement and client
+  id takeover.
+
+  Everything runs on one epoll thread. Routing a PUBLISH does not allocate
+  once the connection buffers and scratch vectors have grown to the working
+  size: exact subscriptions are found through a hash of the topic, wildcard
+  subscriptions by a linear match, and each delivery is encoded straight
+  into the subscriber's output buffer. Output is flushed once per epoll
+  wakeup, so a burst from one publisher reaches a subscriber in few writes.
+
+  Linux only; on other platforms every call returns MOSQ_ERR_NOT_SUPPORTED.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "msg_trace.h"
+
+#define BROKER_DEFAULT_PORT 1883
+#define BROKER_MAX_LISTENERS 4
+#define BROKER_MAX_PACKET (16 * 1024 * 1024)
+#define BROKER_OUT_LIMIT (64 * 1024 * 1024) /* QoS 0 deliveries to a client with more queued are dropped, QoS 1/2 disconnect it */
+#define BROKER_ACCEPT_BACKOFF_MS 100 /* listeners paused after accept() runs out of descriptors */
+
+struct broker_conn {
+	int fd;
+	int version; /* 0 until CONNECT, then the protocol level: 3, 4 (3.1.1) or 5 */
+	std::vector<uint8_t> in;
+	size_t in_len;
+	std::vector<uint8_t> out;
+	size_t out_pos;
+	size_t out_len;
+	bool dirty; /* on the flush list */
+	bool want_write; /* EPOLLOUT armed */
+	bool overflowed; /* QoS 1/2 queue passed BROKER_OUT_LIMIT: closed at the next flush */
+	uint16_t next_mid;
+	std::vector<uint64_t> qos2_pending; /* bitmap of inbound QoS 2 ids awaiting PUBREL */
+	uint64_t match_seq; /* last routing pass that matched this connection */
+	size_t match_index;
+};
+
+struct broker_sub {
+	std::string filter;
+	uint32_t conn;
+	uint8_t qos;
+	uint8_t options; /* v5 subscription options byte without the QoS bits */
+	bool wildcard;
+	bool active;
+};
+
+struct broker_retained {
+	std::vector<uint8_t> payload;
+	std::vector<uint8_t> props; /* v5 properties as received, topic alias removed */
+	uint8_t qos;
+};
+
+struct broker_stats {
+	uint64_t connections; /* currently connected */
+	uint64_t accepted;
+	uint64_t publishes_in;
+	uint64_t deliveries;
+	uint64_t dropped; /* QoS 0 deliveries over BROKER_OUT_LIMIT */
+	uint64_t overflows; /* clients disconnected for QoS 1/2 deliveries over BROKER_OUT_LIMIT */
+	uint64_t accept_errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t retained;
+	uint64_t subscriptions;
+	uint64_t protocol_errors;
+};
+
+struct broker_match {
+	uint32_t conn;
+	uint32_t sub;
+	uint8_t qos;
+};
+
+struct broker {
+	int epfd;
+	int wake_fd;
+	int listen_fds[BROKER_MAX_LISTENERS];
+	int listeners;
+	int port; /* bound TCP port, useful after listening on port 0 */
+	std::string unix_path;
+	uint64_t accept_resume_ms; /* listeners out of epoll until then, 0: listening */
+
+	std::vector<struct broker_conn> conns;
+	std::vector<uint32_t> free_conns;
+	std::vector<uint32_t> closed; /* freed after the epoll batch: its stale events must not reach a new client */
+	std::vector<uint32_t> dirty;
+
+	std::vector<struct broker_sub> subs;
+	std::vector<uint32_t> free_subs;
+	std::unordered_map<uint64_t, std::vector<uint32_t>> exact; /* topic hash -> subs */
+	std::vector<uint32_t> wildcards;
+	std::unordered_map<std::string, struct broker_retained> retained;
+
+	/* reused by every routing pass */
+	std::vector<struct broker_match> matches;
+	std::vector<uint8_t> props;
+	std::vector<std::pair<uint32_t, bool>> granted; /* subscription, newly created */
+	uint64_t match_seq;
+
+	struct trace_file *trace; /* NULL: don't record traced messages */
+	struct trace_ctx trace_ctx; /* context of the PUBLISH being routed */
+	bool traced;
+
+	struct broker_stats stats; /* broker thread only */
+	std::mutex stats_lock;
+	struct broker_stats published; /* copy of stats after each epoll batch, under stats_lock */
+	volatile bool run;
+	std::thread thread;
+};
+
+int broker_init(struct broker *b);
+void broker_cleanup(struct broker *b);
+
+/* Listen on host:port (port 0 picks a free port, see b->port). */
+int broker_listen_tcp(struct broker *b, const char *host, int port);
+
+/* Listen on a Unix socket path, replacing a stale socket file. */
+int broker_listen_unix(struct broker *b, const char *path);
+
+/* Serve on the calling thread until *run turns false or broker_stop. */
+int broker_run(struct broker *b, volatile bool *run);
+
+/* Serve on a background thread; broker_stop ends it. */
+int broker_start(struct broker *b);
+void broker_stop(struct broker *b);
+
+/* The counters as of the broker thread's last epoll batch; exact once it is stopped. */
+void broker_get_stats(struct broker *b, struct broker_stats *stats);
+void broker_print_stats(struct broker *b, FILE *out);
+
+/* MQTT topic filter match, + and # wildcards; $ topics only match filters starting with $. */
+bool broker_topic_match(const char *filter, size_t filter_len, const char *topic, size_t topic_len);
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "msg_chunk.h"
+
+static uint64_t chunk_now_ms(void)
+{
+#ifdef _WINDOWS
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static uint64_t chunk_topic_hash(const char *topic)
+{
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ull;
+	for (; *topic; topic++) {
+		h ^= (uint8_t)*topic;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static void write_header(uint8_t *p, const struct chunk_header *header)
+{
+	memcpy(p, CHUNK_MAGIC, 4);
+	memcpy(p + 4, &header->transfer_id, 4);
+	memcpy(p + 8, &header->seq, 4);
+	memcpy(p + 12, &header->chunk_count, 4);
+	memcpy(p + 16, &header->chunk_size, 4);
+	memcpy(p + 20, &header->total_len, 4);
+}
+
+static bool read_header(const uint8_t *p, size_t len, struct chunk_header *header)
+{
+	if (len < CHUNK_HEADER_SIZE || memcmp(p, CHUNK_MAGIC, 4)) return false;
+
+	memcpy(&header->transfer_id, p + 4, 4);
+	memcpy(&header->seq, p + 8, 4);
+	memcpy(&header->chunk_count, p + 12, 4);
+	memcpy(&header->chunk_size, p + 16, 4);
+	memcpy(&header->total_len, p + 20, 4);
+
+	if (header->chunk_size == 0 || header->total_len > CHUNK_MAX_TRANSFER) return false;
+	if (header->chunk_count > CHUNK_MAX_CHUNKS) return false;
+	if (header->chunk_count != (header->total_len + header->chunk_size - 1) / header->chunk_size) return false;
+	if (header->seq >= header->chunk_count) return false;
+
+	/* every chunk but the last is exactly chunk_size long */
+	size_t expected = header->chunk_size;
+	if (header->seq == header->chunk_count - 1) {
+		expected = header->total_len - (size_t)header->seq * header->chunk_size;
+	}
+	return len - CHUNK_HEADER_SIZE == expected;
+}
+
+void chunk_sender_init(struct chunk_sender *sender, uint32_t chunk_size, int window, int qos, bool threaded)
+{
+	sender->chunk_size = chunk_size ? chunk_size : CHUNK_DEFAULT_SIZE;
+	sender->window = window > 0 ? window : CHUNK_DEFAULT_WINDOW;
+	sender->qos = qos;
+	sender->threaded = threaded;
+	sender->next_transfer_id = (uint32_t)chunk_now_ms();
+	sender->inflight.clear();
+	sender->frame.resize(CHUNK_HEADER_SIZE + sender->chunk_size);
+}
+
+int chunk_publish(struct chunk_sender *sender, struct mosquitto *mosq, const char *topic, const void *payload, size_t len, const mosquitto_property *props)
+{
+	struct chunk_header header;
+	const uint8_t *src = (const uint8_t *)payload;
+	int rc, mid;
+	std::unique_lock<std::mutex> guard(sender->lock);
+
+	if (len == 0 || len > CHUNK_MAX_TRANSFER) return MOSQ_ERR_PAYLOAD_SIZE;
+	/* receivers refuse transfers of more chunks */
+	if ((len + sender->chunk_size - 1) / sender->chunk_size > CHUNK_MAX_CHUNKS) return MOSQ_ERR_PAYLOAD_SIZE;
+
+	header.transfer_id = sender->next_transfer_id++;
+	header.chunk_size = sender->chunk_size;
+	header.total_len = (uint32_t)len;
+	header.chunk_count = (uint32_t)((len + sender->chunk_size - 1) / sender->chunk_size);
+
+	for (header.seq = 0; header.seq < header.chunk_count; header.seq++) {
+		size_t offset = (size_t)header.seq * sender->chunk_size;
+		size_t slice = len - offset < sender->chunk_size ? len - offset : sender->chunk_size;
+
+		while ((int)sender->inflight.size() >= sender->window) {
+			if (sender->threaded) {
+				sender->acked.wait(guard);
+			}
+			else {
+				guard.unlock();
+				rc = mosquitto_loop(mosq, 10, 1);
+				guard.lock();
+				if (rc != MOSQ_ERR_SUCCESS) return rc;
+			}
+		}
+
+		write_header(sender->frame.data(), &header);
+		memcpy(sender->frame.data() + CHUNK_HEADER_SIZE, src + offset, slice);
+
+		/*
+		  never retained: only the last chunk would survive. The lock is held
+		  across the publish so that its ack cannot be looked up before the
+		  mid is in inflight (chunks go at QoS 1+, acked from a later read).
+		*/
+		rc = mosquitto_publish_v5(mosq, &mid, topic, (int)(CHUNK_HEADER_SIZE + slice), sender->frame.data(), sender->qos, false, props);
+		if (rc != MOSQ_ERR_SUCCESS) return rc;
+
+		sender->inflight[mid] = header.seq == header.chunk_count - 1;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool chunk_sender_acked(struct chunk_sender *sender, int mid)
+{
+	std::lock_guard<std::mutex> guard(sender->lock);
+
+	auto it = sender->inflight.find(mid);
+	if (it == sender->inflight.end()) return false;
+
+	bool intermediate = !it->second;
+	sender->inflight.erase(it);
+	sender->acked.notify_one();
+	return intermediate;
+}
+
+bool chunk_is_frame(const void *payload, size_t len)
+{
+	return len >= CHUNK_HEADER_SIZE && !memcmp(payload, CHUNK_MAGIC, 4);
+}
+
+void chunk_reassembly_init(struct chunk_reassembly *reasm, uint32_t timeout_ms)
+{
+	for (int i = 0; i < CHUNK_MAX_TRANSFERS; i++) {
+		struct chunk_transfer *t = &reasm->transfers[i];
+		t->active = false;
+		t->data = NULL;
+		t->capacity = 0;
+		t->received.clear();
+		t->received_count = 0;
+		t->delivered = false;
+	}
+	reasm->timeout_ms = timeout_ms ? timeout_ms : CHUNK_DEFAULT_TIMEOUT_MS;
+	reasm->max_memory = CHUNK_RECV_MAX_MEMORY;
+	reasm->memory = 0;
+	reasm->completed = 0;
+	reasm->expired = 0;
+}
+
+void chunk_reassembly_cleanup(struct chunk_reassembly *reasm)
+{
+	for (int i = 0; i < CHUNK_MAX_TRANSFERS; i++) {
+		free(reasm->transfers[i].data);
+		reasm->transfers[i].data = NULL;
+		reasm->transfers[i].capacity = 0;
+		reasm->transfers[i].active = false;
+	}
+	reasm->memory = 0;
+}
+
+int chunk_expire(struct chunk_reassembly *reasm)
+{
+	uint64_t now = chunk_now_ms();
+	int dropped = 0;
+
+	for (int i = 0; i < CHUNK_MAX_TRANSFERS; i++) {
+		struct chunk_transfer *t = &reasm->transfers[i];
+		if (t->active && !t->delivered && now > t->deadline_ms) {
+			/* keep the buffer for the next transfer */
+			t->active = false;
+			reasm->expired++;
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+static struct chunk_transfer *find_transfer(struct chunk_reassembly *reasm, uint64_t h, const struct chunk_header *header, int *slot)
+{
+	int free_slot = -1;
+
+	for (int i = 0; i < CHUNK_MAX_TRANSFERS; i++) {
+		struct chunk_transfer *t = &reasm->transfers[i];
+		if (t->active) {
+			if (t->topic_hash == h && t->header.transfer_id == header->transfer_id) {
+				*slot = i;
+				return t;
+			}
+		}
+		else if (free_slot < 0) {
+			free_slot = i;
+		}
+	}
+	if (free_slot < 0) return NULL;
+
+	struct chunk_transfer *t = &reasm->transfers[free_slot];
+	if (t->capacity < header->total_len) {
+		reasm->memory -= t->capacity;
+		free(t->data);
+		t->data = NULL;
+		t->capacity = 0;
+
+		/* make room by dropping the buffers kept for reuse first */
+		for (int i = 0; i < CHUNK_MAX_TRANSFERS && reasm->memory + header->total_len > reasm->max_memory; i++) {
+			struct chunk_transfer *idle = &reasm->transfers[i];
+			if (idle->active || !idle->data) continue;
+			reasm->memory -= idle->capacity;
+			free(idle->data);
+			idle->data = NULL;
+			idle->capacity = 0;
+		}
+		if (reasm->memory + header->total_len > reasm->max_memory) return NULL;
+
+		t->data = (uint8_t *)malloc(header->total_len);
+		if (!t->data) return NULL;
+		t->capacity = header->total_len;
+		reasm->memory += t->capacity;
+	}
+
+	t->active = true;
+	t->delivered = false;
+	t->topic_hash = h;
+	t->header = *header;
+	t->received.assign((header->chunk_count + 63) / 64, 0);
+	t->received_count = 0;
+	t->deadline_ms = chunk_now_ms() + reasm->timeout_ms;
+
+	*slot = free_slot;
+	return t;
+}
+
+int chunk_receive(struct chunk_reassembly *reasm, const char *topic, const void *frame, size_t len, struct chunk_view *view)
+{
+	struct chunk_header header;
+	const uint8_t *p = (const uint8_t *)frame;
+	int slot;
+
+	if (!read_header(p, len, &header)) return CHUNK_INVALID;
+
+	chunk_expire(reasm);
+
+	struct chunk_transfer *t = find_transfer(reasm, chunk_topic_hash(topic), &header, &slot);
+	if (!t) return CHUNK_NO_SLOT;
+
+	/* the sender must not change the layout halfway through */
+	if (t->header.chunk_count != header.chunk_count || t->header.chunk_size != header.chunk_size
+		|| t->header.total_len != header.total_len) {
+		return CHUNK_INVALID;
+	}
+	uint64_t bit = (uint64_t)1 << (header.seq % 64);
+	if (t->delivered || (t->received[header.seq / 64] & bit)) {
+		/* QoS 1 redelivery */
+		return CHUNK_PENDING;
+	}
+
+	memcpy(t->data + (size_t)header.seq * header.chunk_size, p + CHUNK_HEADER_SIZE, len - CHUNK_HEADER_SIZE);
+	t->received[header.seq / 64] |= bit;
+	t->received_count++;
+
+	if (t->received_count < header.chunk_count) return CHUNK_PENDING;
+
+	t->delivered = true;
+	reasm->completed++;
+
+	view->data = t->data;
+	view->size = header.total_len;
+	view->slot = slot;
+	return CHUNK_COMPLETE;
+}
+
+void chunk_release(struct chunk_reassembly *reasm, const struct chunk_view *view)
+{
+	if (view->slot < 0 || view->slot >= CHUNK_MAX_TRANSFERS) return;
+
+	struct chunk_transfer *t = &reasm->transfers[view->slot];
+	t->active = false;
+	t->delivered = false;
+}
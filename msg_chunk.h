@@ -0,0 +1,123 @@
+#pragma once
+/*
+  msg_chunk
+  Chunked transfer of large FlexBuffer/FlatBuffer payloads.
+
+  chunk_publish() splits a payload into sequence-numbered PUBLISHes, each
+  carrying a CHUNK_HEADER_SIZE header (magic, transfer id, sequence, chunk
+  count, chunk size, total length) in front of the slice. Chunks are pipelined
+  at QoS 1 with a bounded in-flight window instead of one multi-megabyte
+  PUBLISH hitting the broker.
+
+  The receiver side (chunk_receive) preallocates the whole payload on the
+  first chunk, copies every chunk straight to its final offset (so order does
+  not matter), drops transfers that stall past their timeout and hands out the
+  assembled payload as a view into that buffer. Since one frame header is
+  enough to make it allocate, the buffers of all transfers together stay
+  under max_memory (CHUNK_RECV_MAX_MEMORY unless changed after init), and no
+  transfer may have more than CHUNK_MAX_CHUNKS chunks.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <mosquitto.h>
+
+#define CHUNK_MAGIC "MQCK"
+#define CHUNK_HEADER_SIZE 24
+#define CHUNK_DEFAULT_SIZE (64 * 1024)
+#define CHUNK_DEFAULT_WINDOW 16
+#define CHUNK_MAX_TRANSFER (64 * 1024 * 1024)
+#define CHUNK_MAX_TRANSFERS 8
+#define CHUNK_MAX_CHUNKS 65536
+#define CHUNK_RECV_MAX_MEMORY (2 * CHUNK_MAX_TRANSFER)
+#define CHUNK_DEFAULT_TIMEOUT_MS 10000
+
+enum chunk_result {
+	CHUNK_PENDING = 0,
+	CHUNK_COMPLETE = 1,
+	CHUNK_INVALID = -1,
+	CHUNK_NO_SLOT = -2,
+};
+
+struct chunk_header {
+	uint32_t transfer_id;
+	uint32_t seq;
+	uint32_t chunk_count;
+	uint32_t chunk_size;
+	uint32_t total_len;
+};
+
+struct chunk_sender {
+	uint32_t chunk_size;
+	int window;
+	int qos;
+	bool threaded; /* mosquitto_loop_start() is running, don't pump the loop ourselves */
+	uint32_t next_transfer_id;
+	/* acks arrive on libmosquitto's loop thread */
+	std::mutex lock;
+	std::condition_variable acked;
+	std::unordered_map<int, bool> inflight; /* chunk mid -> last chunk of its transfer */
+	std::vector<uint8_t> frame;
+};
+
+struct chunk_transfer {
+	bool active;
+	uint64_t topic_hash;
+	struct chunk_header header;
+	uint8_t *data;
+	size_t capacity;
+	std::vector<uint64_t> received; /* one bit per chunk */
+	uint32_t received_count;
+	uint64_t deadline_ms;
+	bool delivered; /* handed out as a view, waiting for chunk_release */
+};
+
+struct chunk_reassembly {
+	struct chunk_transfer transfers[CHUNK_MAX_TRANSFERS];
+	uint32_t timeout_ms;
+	size_t max_memory; /* all transfer buffers together */
+	size_t memory;
+	uint64_t completed;
+	uint64_t expired;
+};
+
+struct chunk_view {
+	const uint8_t *data;
+	size_t size;
+	int slot;
+};
+
+void chunk_sender_init(struct chunk_sender *sender, uint32_t chunk_size, int window, int qos, bool threaded);
+
+/*
+  Publish payload on topic as a chunked transfer. Blocks (pumping the
+  mosquitto loop unless threaded) while the in-flight window is full.
+  Returns a MOSQ_ERR_* code.
+*/
+int chunk_publish(struct chunk_sender *sender, struct mosquitto *mosq, const char *topic, const void *payload, size_t len, const mosquitto_property *props);
+
+/*
+  Call from the publish callback, for every mid. Returns true when mid was
+  an intermediate chunk that the caller should not count as a completed
+  message; other publishes are left alone.
+*/
+bool chunk_sender_acked(struct chunk_sender *sender, int mid);
+
+bool chunk_is_frame(const void *payload, size_t len);
+
+void chunk_reassembly_init(struct chunk_reassembly *reasm, uint32_t timeout_ms);
+void chunk_reassembly_cleanup(struct chunk_reassembly *reasm);
+
+/*
+  Feed one chunk frame. On CHUNK_COMPLETE view points at the assembled
+  payload, valid until chunk_release(reasm, view).
+*/
+int chunk_receive(struct chunk_reassembly *reasm, const char *topic, const void *frame, size_t len, struct chunk_view *view);
+void chunk_release(struct chunk_reassembly *reasm, const struct chunk_view *view);
+
+/* Drop incomplete transfers past their deadline; returns the number dropped. */
+int chunk_expire(struct chunk_reassembly *reasm);
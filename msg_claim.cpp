@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#if !defined(_WINDOWS)
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <mosquitto.h>
+#include "msg_claim.h"
+
+#define CLAIM_MAGIC "MQCLAIM2"
+#define CLAIM_PAGE 4096
+
+void claim_encode(flatbuffers::FlatBufferBuilder &fbb, const struct claim_desc *desc)
+{
+	msg_schema::encode_table(fbb, *desc, CLAIM_IDENTIFIER);
+}
+
+bool claim_is_desc(const void *payload, size_t len)
+{
+	/* root offset, then the 4 byte identifier */
+	return len >= 8 && flatbuffers::BufferHasIdentifier(payload, CLAIM_IDENTIFIER);
+}
+
+void claim_reader_init(struct claim_reader *reader)
+{
+	reader->arena_count = 0;
+}
+
+void claim_reader_cleanup(struct claim_reader *reader)
+{
+	for (int i = 0; i < reader->arena_count; i++) {
+		claim_arena_close(&reader->arenas[i]);
+	}
+	reader->arena_count = 0;
+}
+
+int claim_resolve(struct claim_reader *reader, const void *payload, size_t len, struct claim_view *view)
+{
+	struct claim_desc desc;
+	const uint8_t *data = (const uint8_t *)payload;
+	struct claim_arena *arena = NULL;
+	int index;
+
+	if (!msg_schema::verify_table<claim_desc>(data, len)) return MOSQ_ERR_MALFORMED_PACKET;
+	if (!msg_schema::decode_table(data, len, desc)) return MOSQ_ERR_MALFORMED_PACKET;
+
+	for (index = 0; index < reader->arena_count; index++) {
+		if (!strcmp(reader->arenas[index].name, desc.arena.c_str())) {
+			arena = &reader->arenas[index];
+			break;
+		}
+	}
+	if (arena && arena->hdr->instance != desc.instance) {
+		/* the sender restarted: the name is a new arena now, ours is unlinked */
+		claim_arena_close(arena);
+		int rc = claim_arena_open(arena, desc.arena.c_str());
+		if (rc != MOSQ_ERR_SUCCESS) {
+			reader->arena_count--;
+			if (index != reader->arena_count) reader->arenas[index] = reader->arenas[reader->arena_count];
+			reader->arenas[reader->arena_count].base = NULL;
+			return rc;
+		}
+	}
+	if (!arena) {
+		if (reader->arena_count >= CLAIM_MAX_ARENAS) return MOSQ_ERR_NOMEM;
+
+		arena = &reader->arenas[reader->arena_count];
+		int rc = claim_arena_open(arena, desc.arena.c_str());
+		if (rc != MOSQ_ERR_SUCCESS) return rc;
+		reader->arena_count++;
+	}
+
+	return claim_acquire(arena, &desc, view);
+}
+
+#ifndef _WINDOWS
+
+static uint64_t claim_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* different for every arena created under a name, never 0 */
+static uint64_t claim_instance(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t x = ((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
+
+	/* splitmix64 finaliser */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x ? x : 1;
+}
+
+static int claim_shm_name(const char *name, char *shm_name, size_t size)
+{
+	if (!name[0] || strchr(name, '/') || strlen(name) >= CLAIM_NAME_MAX) return MOSQ_ERR_INVAL;
+
+	snprintf(shm_name, size, "/mqtt_claim.%s", name);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static size_t claim_align(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static void claim_arena_bind(struct claim_arena *arena)
+{
+	arena->hdr = (struct claim_arena_hdr *)arena->base;
+	arena->ctl = (struct claim_segment_ctl *)(arena->base + claim_align(sizeof(struct claim_arena_hdr), 64));
+	arena->data = arena->base + arena->hdr->data_offset;
+}
+
+int claim_arena_create(struct claim_arena *arena, const char *name, uint32_t segment_count, uint64_t segment_size, uint32_t hold_ms)
+{
+	char shm_name[CLAIM_NAME_MAX + 16];
+	int rc = claim_shm_name(name, shm_name, sizeof(shm_name));
+	if (rc) return rc;
+	if (segment_count == 0 || segment_size == 0) return MOSQ_ERR_INVAL;
+
+	size_t ctl_offset = claim_align(sizeof(struct claim_arena_hdr), 64);
+	size_t data_offset = claim_align(ctl_offset + segment_count * sizeof(struct claim_segment_ctl), CLAIM_PAGE);
+	size_t map_size = data_offset + (size_t)segment_count * claim_align(segment_size, 64);
+
+	/* never take over an arena another sender may still be publishing from */
+	int fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) return errno == EEXIST ? MOSQ_ERR_ALREADY_EXISTS : MOSQ_ERR_ERRNO;
+
+	if (ftruncate(fd, (off_t)map_size) < 0) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	strcpy(arena->name, name);
+	arena->fd = fd;
+	arena->base = (uint8_t *)base;
+	arena->map_size = map_size;
+	arena->owner = true;
+	arena->next_segment = 0;
+	arena->hold_ms = hold_ms;
+	arena->published_ms.assign(segment_count, 0);
+
+	struct claim_arena_hdr *hdr = (struct claim_arena_hdr *)base;
+	hdr->segment_count = segment_count;
+	hdr->reserved = 0;
+	hdr->segment_size = claim_align(segment_size, 64);
+	hdr->data_offset = data_offset;
+	hdr->instance = claim_instance();
+	claim_arena_bind(arena);
+
+	for (uint32_t i = 0; i < segment_count; i++) {
+		new (&arena->ctl[i]) claim_segment_ctl();
+		arena->ctl[i].refs.store(0);
+		arena->ctl[i].generation.store(0);
+		arena->ctl[i].length.store(0);
+	}
+
+	/* readers check the magic last */
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(hdr->magic, CLAIM_MAGIC, sizeof(hdr->magic));
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int claim_arena_open(struct claim_arena *arena, const char *name)
+{
+	char shm_name[CLAIM_NAME_MAX + 16];
+	struct stat st;
+	int rc = claim_shm_name(name, shm_name, sizeof(shm_name));
+	if (rc) return rc;
+
+	int fd = shm_open(shm_name, O_RDWR, 0);
+	if (fd < 0) return errno == ENOENT ? MOSQ_ERR_NOT_FOUND : MOSQ_ERR_ERRNO;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct claim_arena_hdr)) {
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	/* read-write: pinning a segment updates its reference count */
+	void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	struct claim_arena_hdr *hdr = (struct claim_arena_hdr *)base;
+	size_t ctl_end = claim_align(sizeof(struct claim_arena_hdr), 64) + (size_t)hdr->segment_count * sizeof(struct claim_segment_ctl);
+	if (memcmp(hdr->magic, CLAIM_MAGIC, sizeof(hdr->magic)) || ctl_end > hdr->data_offset
+		|| hdr->data_offset + (uint64_t)hdr->segment_count * hdr->segment_size > (uint64_t)st.st_size) {
+		munmap(base, (size_t)st.st_size);
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	strcpy(arena->name, name);
+	arena->fd = fd;
+	arena->base = (uint8_t *)base;
+	arena->map_size = (size_t)st.st_size;
+	arena->owner = false;
+	arena->next_segment = 0;
+	arena->hold_ms = 0;
+	arena->published_ms.clear();
+	claim_arena_bind(arena);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void claim_arena_close(struct claim_arena *arena)
+{
+	char shm_name[CLAIM_NAME_MAX + 16];
+
+	if (!arena->base) return;
+
+	munmap(arena->base, arena->map_size);
+	close(arena->fd);
+	if (arena->owner && claim_shm_name(arena->name, shm_name, sizeof(shm_name)) == MOSQ_ERR_SUCCESS) {
+		shm_unlink(shm_name);
+	}
+	arena->base = NULL;
+	arena->fd = -1;
+}
+
+int claim_put(struct claim_arena *arena, const void *payload, size_t len, struct claim_desc *desc)
+{
+	uint32_t count = arena->hdr->segment_count;
+	uint64_t now = claim_now_ms();
+
+	if (len > arena->hdr->segment_size) return MOSQ_ERR_PAYLOAD_SIZE;
+
+	for (uint32_t n = 0; n < count; n++) {
+		uint32_t i = (arena->next_segment + n) % count;
+		struct claim_segment_ctl *ctl = &arena->ctl[i];
+		int32_t free_refs = 0;
+
+		if (arena->published_ms[i] && now - arena->published_ms[i] < arena->hold_ms) continue;
+		if (!ctl->refs.compare_exchange_strong(free_refs, -1, std::memory_order_acquire)) continue;
+
+		uint32_t generation = ctl->generation.load(std::memory_order_relaxed) + 1;
+		ctl->generation.store(generation, std::memory_order_relaxed);
+		memcpy(arena->data + (size_t)i * arena->hdr->segment_size, payload, len);
+		ctl->length.store(len, std::memory_order_relaxed);
+		ctl->refs.store(0, std::memory_order_release);
+
+		arena->published_ms[i] = now;
+		arena->next_segment = (i + 1) % count;
+
+		desc->arena = arena->name;
+		desc->segment = i;
+		desc->offset = 0;
+		desc->length = len;
+		desc->generation = generation;
+		desc->instance = arena->hdr->instance;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	/* every segment is pinned or still inside its hold time */
+	return MOSQ_ERR_NOMEM;
+}
+
+int claim_acquire(struct claim_arena *arena, const struct claim_desc *desc, struct claim_view *view)
+{
+	if (desc->instance != arena->hdr->instance) return MOSQ_ERR_NOT_FOUND;
+	if (desc->segment >= arena->hdr->segment_count) return MOSQ_ERR_INVAL;
+	if (desc->offset > arena->hdr->segment_size || desc->length > arena->hdr->segment_size - desc->offset) return MOSQ_ERR_INVAL;
+
+	struct claim_segment_ctl *ctl = &arena->ctl[desc->segment];
+	int32_t refs = ctl->refs.load(std::memory_order_relaxed);
+	do {
+		/* being refilled: the claimed generation is gone */
+		if (refs < 0) return MOSQ_ERR_NOT_FOUND;
+	} while (!ctl->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acquire));
+
+	if (ctl->generation.load(std::memory_order_relaxed) != desc->generation
+		|| ctl->length.load(std::memory_order_relaxed) < desc->offset + desc->length) {
+		ctl->refs.fetch_sub(1, std::memory_order_release);
+		return MOSQ_ERR_NOT_FOUND;
+	}
+
+	view->data = arena->data + (size_t)desc->segment * arena->hdr->segment_size + desc->offset;
+	view->size = (size_t)desc->length;
+	view->arena = arena;
+	view->segment = desc->segment;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void claim_release(const struct claim_view *view)
+{
+	view->arena->ctl[view->segment].refs.fetch_sub(1, std::memory_order_release);
+}
+
+#else
+
+int claim_arena_create(struct claim_arena *arena, const char *name, uint32_t segment_count, uint64_t segment_size, uint32_t hold_ms)
+{
+	arena->base = NULL;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int claim_arena_open(struct claim_arena *arena, const char *name)
+{
+	arena->base = NULL;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void claim_arena_close(struct claim_arena *arena)
+{
+}
+
+int claim_put(struct claim_arena *arena, const void *payload, size_t len, struct claim_desc *desc)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int claim_acquire(struct claim_arena *arena, const struct claim_desc *desc, struct claim_view *view)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void claim_release(const struct claim_view *view)
+{
+}
+
+#endif
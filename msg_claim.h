@@ -0,0 +1,133 @@
+#pragma once
+/*
+  msg_claim
+  Claim-check handoff of large payloads between processes on one host.
+
+  The publisher writes the payload once into a segment of a named shared
+  memory arena (shm_open) and publishes only a small FlatBuffer descriptor
+  (arena, segment, offset, length, generation) tagged CLAIM_IDENTIFIER.
+  Receivers on the same host map the arena and read the payload in place.
+
+  Each segment has a shared reference count and generation. A reader pins a
+  segment by bumping its count and then checks the generation, so a segment
+  the publisher has already recycled is detected instead of read. The
+  publisher only recycles segments with no readers that have been held for at
+  least hold_ms after publishing, to give slow subscribers time to claim them.
+
+  Every arena gets a random instance number when it is created, carried in
+  each descriptor. A sender that restarts creates a new arena under the old
+  name; readers still mapping the old one see the instance change and map
+  the name again instead of reading the unlinked copy.
+
+  Linux/POSIX only; on Windows every call returns MOSQ_ERR_NOT_SUPPORTED.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "msg_schema.h"
+
+#define CLAIM_IDENTIFIER "MQCC"
+#define CLAIM_NAME_MAX 64
+#define CLAIM_MAX_ARENAS 4
+#define CLAIM_DEFAULT_SEGMENTS 32
+#define CLAIM_DEFAULT_SEGMENT_SIZE (1024 * 1024)
+#define CLAIM_DEFAULT_THRESHOLD 4096
+#define CLAIM_DEFAULT_HOLD_MS 5000
+
+/* descriptor carried in the MQTT payload */
+struct claim_desc {
+	std::string arena;
+	uint32_t segment;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t generation;
+	uint64_t instance;
+
+	static constexpr auto fields()
+	{
+		return std::make_tuple(
+			msg_schema::field("arena", &claim_desc::arena),
+			msg_schema::field("segment", &claim_desc::segment),
+			msg_schema::field("offset", &claim_desc::offset),
+			msg_schema::field("length", &claim_desc::length),
+			msg_schema::field("generation", &claim_desc::generation),
+			msg_schema::field("instance", &claim_desc::instance));
+	}
+};
+
+struct claim_segment_ctl {
+	std::atomic<int32_t> refs; /* readers pinning the segment, -1 while being refilled */
+	std::atomic<uint32_t> generation;
+	std::atomic<uint64_t> length;
+};
+
+struct claim_arena_hdr {
+	char magic[8];
+	uint32_t segment_count;
+	uint32_t reserved;
+	uint64_t segment_size;
+	uint64_t data_offset;
+	uint64_t instance; /* random, per claim_arena_create */
+};
+
+struct claim_arena {
+	char name[CLAIM_NAME_MAX];
+	int fd;
+	uint8_t *base;
+	size_t map_size;
+	struct claim_arena_hdr *hdr;
+	struct claim_segment_ctl *ctl;
+	uint8_t *data;
+	bool owner;
+	/* publisher side */
+	uint32_t next_segment;
+	uint32_t hold_ms;
+	std::vector<uint64_t> published_ms;
+};
+
+struct claim_view {
+	const uint8_t *data;
+	size_t size;
+	struct claim_arena *arena;
+	uint32_t segment;
+};
+
+/* receiver side: arenas mapped on demand by name */
+struct claim_reader {
+	struct claim_arena arenas[CLAIM_MAX_ARENAS];
+	int arena_count;
+};
+
+/*
+  MOSQ_ERR_ALREADY_EXISTS if the name is taken: by another sender, or left
+  behind by one that crashed (/dev/shm/mqtt_claim.<name>).
+*/
+int claim_arena_create(struct claim_arena *arena, const char *name, uint32_t segment_count, uint64_t segment_size, uint32_t hold_ms);
+int claim_arena_open(struct claim_arena *arena, const char *name);
+void claim_arena_close(struct claim_arena *arena);
+
+/*
+  Copy payload into a free segment and fill desc. Returns a MOSQ_ERR_*
+  code; MOSQ_ERR_NOMEM when every segment is pinned or still held.
+*/
+int claim_put(struct claim_arena *arena, const void *payload, size_t len, struct claim_desc *desc);
+
+/* Pin the segment desc refers to; view stays valid until claim_release. */
+int claim_acquire(struct claim_arena *arena, const struct claim_desc *desc, struct claim_view *view);
+void claim_release(const struct claim_view *view);
+
+void claim_encode(flatbuffers::FlatBufferBuilder &fbb, const struct claim_desc *desc);
+bool claim_is_desc(const void *payload, size_t len);
+
+void claim_reader_init(struct claim_reader *reader);
+void claim_reader_cleanup(struct claim_reader *reader);
+
+/*
+  Decode a descriptor payload, map its arena if needed and pin the segment.
+  An arena whose instance no longer matches is mapped again, so views into
+  it must have been released. MOSQ_ERR_NOT_FOUND if the payload is gone.
+*/
+int claim_resolve(struct claim_reader *reader, const void *payload, size_t len, struct claim_view *view);
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "msg_conflate.h"
+
+static uint64_t conflate_now_ms(void)
+{
+#ifdef _WINDOWS
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static bool congested(struct conflate_outbox *outbox, struct mosquitto *mosq)
+{
+	return outbox->inflight >= outbox->window || mosquitto_want_write(mosq);
+}
+
+static int send_tracked(struct conflate_outbox *outbox, struct mosquitto *mosq, const char *topic,
+	const void *payload, size_t len, int qos, bool retain, const mosquitto_property *props)
+{
+	int mid = 0;
+
+	/* the callback for a QoS 0 publish can run before we get the mid back */
+	outbox->publishing = true;
+	int rc = mosquitto_publish_v5(mosq, &mid, topic, (int)len, payload, qos, retain, props);
+	outbox->publishing = false;
+	if (rc != MOSQ_ERR_SUCCESS) return rc;
+
+	bool done = false;
+	for (size_t i = 0; i < outbox->early_mids.size(); i++) {
+		if (outbox->early_mids[i] == mid) done = true;
+	}
+	outbox->early_mids.clear();
+	if (done) return MOSQ_ERR_SUCCESS;
+
+	outbox->inflight_mids.insert(mid);
+	outbox->inflight++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void conflate_init(struct conflate_outbox *outbox, int window)
+{
+	outbox->patterns.clear();
+	outbox->window = window > 0 ? window : CONFLATE_DEFAULT_WINDOW;
+	outbox->inflight = 0;
+	outbox->inflight_mids.clear();
+	outbox->early_mids.clear();
+	outbox->publishing = false;
+	outbox->index.clear();
+	outbox->slots.clear();
+	outbox->ready.clear();
+	outbox->published = outbox->conflated = outbox->passthrough = outbox->max_delay_ms = 0;
+}
+
+void conflate_cleanup(struct conflate_outbox *outbox)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	for (size_t i = 0; i < outbox->slots.size(); i++) mosquitto_property_free_all(&outbox->slots[i].props);
+	outbox->index.clear();
+	outbox->slots.clear();
+	outbox->ready.clear();
+	outbox->inflight_mids.clear();
+}
+
+int conflate_add_state(struct conflate_outbox *outbox, const char *pattern)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	if (mosquitto_sub_topic_check(pattern) != MOSQ_ERR_SUCCESS) return MOSQ_ERR_INVAL;
+	outbox->patterns.push_back(pattern);
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool conflate_is_state(struct conflate_outbox *outbox, const char *topic)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	for (size_t i = 0; i < outbox->patterns.size(); i++) {
+		bool match = false;
+		mosquitto_topic_matches_sub(outbox->patterns[i].c_str(), topic, &match);
+		if (match) return true;
+	}
+	return false;
+}
+
+int conflate_publish(struct conflate_outbox *outbox, struct mosquitto *mosq, const char *topic,
+	const void *payload, size_t len, int qos, bool retain, const mosquitto_property *props)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	if (!conflate_is_state(outbox, topic)) {
+		outbox->passthrough++;
+		return send_tracked(outbox, mosq, topic, payload, len, qos, retain, props);
+	}
+
+	auto it = outbox->index.find(topic);
+	size_t n;
+	if (it == outbox->index.end()) {
+		n = outbox->slots.size();
+		outbox->slots.push_back(conflate_slot());
+		outbox->slots[n].topic = topic;
+		outbox->slots[n].props = NULL;
+		outbox->slots[n].dirty = false;
+		outbox->index[topic] = n;
+	}
+	else {
+		n = it->second;
+	}
+	struct conflate_slot *slot = &outbox->slots[n];
+
+	/* an older value still waiting would be overtaken: replace it instead */
+	if (!slot->dirty && !congested(outbox, mosq)) {
+		outbox->published++;
+		return send_tracked(outbox, mosq, topic, payload, len, qos, retain, props);
+	}
+
+	/* the caller frees its properties once we return */
+	mosquitto_property *copy = NULL;
+	if (props) {
+		int rc = mosquitto_property_copy_all(&copy, props);
+		if (rc != MOSQ_ERR_SUCCESS) return rc;
+	}
+
+	if (slot->dirty) {
+		outbox->conflated++;
+	}
+	else {
+		slot->dirty = true;
+		slot->dirty_since_ms = conflate_now_ms();
+		outbox->ready.push_back(n);
+	}
+	mosquitto_property_free_all(&slot->props);
+	slot->props = copy;
+	slot->payload.assign((const uint8_t *)payload, (const uint8_t *)payload + len);
+	slot->qos = qos;
+	slot->retain = retain;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int conflate_flush(struct conflate_outbox *outbox, struct mosquitto *mosq)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	while (!outbox->ready.empty() && !congested(outbox, mosq)) {
+		struct conflate_slot *slot = &outbox->slots[outbox->ready.front()];
+
+		int rc = send_tracked(outbox, mosq, slot->topic.c_str(), slot->payload.data(), slot->payload.size(), slot->qos,
+			slot->retain, slot->props);
+		if (rc != MOSQ_ERR_SUCCESS) return rc;
+		mosquitto_property_free_all(&slot->props);
+
+		uint64_t delay = conflate_now_ms() - slot->dirty_since_ms;
+		if (delay > outbox->max_delay_ms) outbox->max_delay_ms = delay;
+		slot->dirty = false;
+		outbox->published++;
+		outbox->ready.pop_front();
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void conflate_acked(struct conflate_outbox *outbox, struct mosquitto *mosq, int mid)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	if (outbox->inflight_mids.erase(mid)) {
+		outbox->inflight--;
+	}
+	else if (outbox->publishing) {
+		outbox->early_mids.push_back(mid);
+		return;
+	}
+	conflate_flush(outbox, mosq);
+}
+
+void conflate_get_stats(struct conflate_outbox *outbox, struct conflate_stats *stats)
+{
+	std::lock_guard<std::recursive_mutex> guard(outbox->lock);
+
+	stats->published = outbox->published;
+	stats->conflated = outbox->conflated;
+	stats->passthrough = outbox->passthrough;
+	stats->state_topics = outbox->slots.size();
+	stats->pending = outbox->ready.size();
+	stats->max_delay_ms = outbox->max_delay_ms;
+}
@@ -0,0 +1,94 @@
+#pragma once
+/*
+  msg_conflate
+  Conflating outbox for state topics.
+
+  A sensor that publishes its current state many times per second builds
+  an in-flight backlog as soon as the network or broker slows down, and
+  everything in it except the newest value is stale. Topics matching a
+  state pattern therefore go through a slot map with one slot per topic:
+  while the connection is congested, a new value overwrites the slot, and
+  the newest value goes out once capacity frees up. Memory is bounded by
+  the number of state topics and latency by one send window, whatever the
+  input rate.
+
+  The connection counts as congested while `window` publishes are
+  unacknowledged (PUBACK/PUBCOMP, or the socket write for QoS 0) or while
+  libmosquitto still has bytes queued for the socket. Other topics are
+  published straight through.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <mosquitto.h>
+
+#define CONFLATE_DEFAULT_WINDOW 8
+
+struct conflate_slot {
+	std::string topic;
+	std::vector<uint8_t> payload;
+	mosquitto_property *props; /* copied with the payload, freed once sent */
+	int qos;
+	bool retain;
+	bool dirty; /* holds a value not sent yet */
+	uint64_t dirty_since_ms;
+};
+
+struct conflate_stats {
+	uint64_t published; /* state values sent */
+	uint64_t conflated; /* state values overwritten before they were sent */
+	uint64_t passthrough; /* non-state publishes */
+	uint64_t state_topics;
+	uint64_t pending;
+	uint64_t max_delay_ms; /* longest a value waited in its slot */
+};
+
+struct conflate_outbox {
+	std::recursive_mutex lock; /* publish callbacks run on the network thread */
+	std::vector<std::string> patterns;
+	int window;
+	int inflight;
+	std::unordered_set<int> inflight_mids;
+	std::vector<int> early_mids; /* completed before mosquitto_publish_v5 returned */
+	bool publishing;
+
+	std::unordered_map<std::string, size_t> index;
+	std::vector<struct conflate_slot> slots;
+	std::deque<size_t> ready; /* dirty slots, oldest first */
+
+	uint64_t published;
+	uint64_t conflated;
+	uint64_t passthrough;
+	uint64_t max_delay_ms;
+};
+
+void conflate_init(struct conflate_outbox *outbox, int window);
+void conflate_cleanup(struct conflate_outbox *outbox);
+
+/* Mark topics matching pattern ('+'/'#' allowed) as state topics. */
+int conflate_add_state(struct conflate_outbox *outbox, const char *pattern);
+
+bool conflate_is_state(struct conflate_outbox *outbox, const char *topic);
+
+/*
+  Publish through the outbox. State topics are sent now if there is
+  capacity, otherwise kept (newest wins, with a copy of its properties)
+  for conflate_flush(). Returns a MOSQ_ERR_* code; a conflated value counts
+  as success.
+*/
+int conflate_publish(struct conflate_outbox *outbox, struct mosquitto *mosq, const char *topic,
+	const void *payload, size_t len, int qos, bool retain, const mosquitto_property *props);
+
+/* Call from the publish callback; sends waiting values as capacity frees up. */
+void conflate_acked(struct conflate_outbox *outbox, struct mosquitto *mosq, int mid);
+
+/* Send waiting state values while there is capacity. */
+int conflate_flush(struct conflate_outbox *outbox, struct mosquitto *mosq);
+
+void conflate_get_stats(struct conflate_outbox *outbox, struct conflate_stats *stats);
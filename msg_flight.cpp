@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <chrono>
+#include <fcntl.h>
+#if defined(_WINDOWS)
+# include <io.h>
+# include <process.h>
+# include <sys/stat.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "msg_flight.h"
+#include "msg_per_thread.h"
+
+#define FLIGHT_PATH_MAX 512
+#define FLIGHT_ALT_STACK (64 * 1024)
+
+static_assert(sizeof(struct flight_rec) == 64, "flight_rec is one cache line");
+
+bool flight_enabled = false;
+uint32_t flight_prefix = 0;
+thread_local struct flight_ring *flight_thread_ring = NULL;
+
+static thread_local bool thread_unregistered = false;
+static struct per_thread_registry<struct flight_ring> rings;
+static std::atomic<uint32_t> dump_count(0);
+static uint64_t ring_size = 0;
+static char dump_prefix[FLIGHT_PATH_MAX]; /* path.<pid>. */
+static struct flight_file_header file_header; /* rings, reason and dump time are filled in per dump */
+
+int64_t flight_now_ns(void)
+{
+	return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct flight_ring *flight_register_thread(void)
+{
+	if (thread_unregistered) return NULL;
+
+	flight_thread_ring = per_thread_register(&rings, [](int index) {
+		struct flight_ring *ring = new struct flight_ring;
+		ring->recs = new struct flight_rec[ring_size]();
+		ring->mask = ring_size - 1;
+		ring->thread = (uint32_t)index;
+		ring->head.store(0);
+		return ring;
+	});
+	thread_unregistered = !flight_thread_ring;
+	return flight_thread_ring;
+}
+
+/* Only what is async signal safe from here to flight_dump(). */
+
+#if defined(_WINDOWS)
+static int dump_open(const char *path)
+{
+	return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+
+static bool dump_write(int fd, const void *data, size_t len)
+{
+	return _write(fd, data, (unsigned int)len) == (int)len;
+}
+
+#define dump_close _close
+#else
+static int dump_open(const char *path)
+{
+	return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+static bool dump_write(int fd, const void *data, size_t len)
+{
+	const char *p = (const char *)data;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+#define dump_close close
+#endif
+
+static size_t put_uint(char *out, uint32_t v)
+{
+	char digits[10];
+	size_t n = 0;
+
+	do {
+		digits[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	for (size_t i = 0; i < n; i++) out[i] = digits[n - 1 - i];
+	return n;
+}
+
+static void dump_note(const char *path, bool ok)
+{
+	const char *what = ok ? "flight recorder: dumped to " : "flight recorder: unable to write ";
+	dump_write(2, what, strlen(what));
+	dump_write(2, path, strlen(path));
+	dump_write(2, "\n", 1);
+}
+
+int flight_dump(int reason)
+{
+	struct flight_ring *snapshot[PER_THREAD_MAX];
+	uint32_t count = 0;
+	char path[FLIGHT_PATH_MAX + 16];
+
+	if (!flight_enabled) return MOSQ_ERR_INVAL;
+
+	int registered = per_thread_count(&rings);
+	for (int i = 0; i < registered; i++) {
+		struct flight_ring *ring = per_thread_at(&rings, i);
+		if (ring) snapshot[count++] = ring;
+	}
+
+	size_t len = strlen(dump_prefix);
+	memcpy(path, dump_prefix, len);
+	len += put_uint(path + len, dump_count.fetch_add(1));
+	path[len] = '\0';
+
+	struct flight_file_header header = file_header;
+	header.rings = count;
+	header.reason = reason;
+	header.dump_ns = flight_now_ns();
+	header.dump_ticks = flight_ticks();
+
+	int fd = dump_open(path);
+	if (fd < 0) {
+		dump_note(path, false);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	/* the threads keep recording; the viewer drops slots overwritten meanwhile */
+	bool ok = dump_write(fd, &header, sizeof(header));
+	for (uint32_t i = 0; i < count && ok; i++) {
+		struct flight_ring_header ring_header;
+		memset(&ring_header, 0, sizeof(ring_header));
+		ring_header.thread = snapshot[i]->thread;
+		ring_header.head = snapshot[i]->head.load(std::memory_order_acquire);
+		ok = dump_write(fd, &ring_header, sizeof(ring_header))
+			&& dump_write(fd, snapshot[i]->recs, ring_size * sizeof(struct flight_rec));
+	}
+	dump_close(fd);
+	dump_note(path, ok);
+	return ok ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ERRNO;
+}
+
+static void crash_handler(int signum)
+{
+	flight_dump(signum);
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+#if !defined(_WINDOWS)
+static void request_handler(int signum)
+{
+	int saved = errno;
+	flight_dump(signum);
+	errno = saved;
+}
+#endif
+
+static int install_handlers(void)
+{
+#if defined(_WINDOWS)
+	static const int crash_signals[] = { SIGSEGV, SIGILL, SIGFPE, SIGABRT };
+	for (int signum : crash_signals) signal(signum, crash_handler);
+#else
+	static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+	struct sigaction sa;
+	stack_t ss;
+
+	/* a stack overflow leaves no stack to run the handler on (this thread only) */
+	ss.ss_sp = malloc(FLIGHT_ALT_STACK);
+	ss.ss_size = FLIGHT_ALT_STACK;
+	ss.ss_flags = 0;
+	if (!ss.ss_sp) return MOSQ_ERR_NOMEM;
+	if (sigaltstack(&ss, NULL) == -1) return MOSQ_ERR_ERRNO;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = crash_handler;
+	sa.sa_flags = SA_RESETHAND | SA_ONSTACK;
+	for (int signum : crash_signals) {
+		if (sigaction(signum, &sa, NULL) == -1) return MOSQ_ERR_ERRNO;
+	}
+
+	sa.sa_handler = request_handler;
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1) return MOSQ_ERR_ERRNO;
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+int flight_init(const char *path, const char *process, uint32_t records, uint32_t prefix)
+{
+	if (flight_enabled || !path || records == 0 || records > (1u << 24) || prefix > FLIGHT_PREFIX_MAX) {
+		return MOSQ_ERR_INVAL;
+	}
+
+	int len = snprintf(dump_prefix, sizeof(dump_prefix), "%s.%u.", path, (unsigned)getpid());
+	if (len < 0 || len >= (int)sizeof(dump_prefix)) return MOSQ_ERR_INVAL;
+
+	ring_size = 1;
+	while (ring_size < records) ring_size <<= 1;
+
+	memset(&file_header, 0, sizeof(file_header));
+	memcpy(file_header.magic, FLIGHT_MAGIC, sizeof(file_header.magic));
+	strncpy(file_header.process, process, sizeof(file_header.process) - 1);
+	file_header.pid = (uint32_t)getpid();
+	file_header.record_size = sizeof(struct flight_rec);
+	file_header.ring_size = (uint32_t)ring_size;
+	file_header.prefix = prefix;
+	file_header.start_ns = flight_now_ns();
+	file_header.start_ticks = flight_ticks();
+	flight_prefix = prefix;
+
+	int rc = install_handlers();
+	if (rc != MOSQ_ERR_SUCCESS) return rc;
+
+	flight_enabled = true;
+	return MOSQ_ERR_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#pragma once
+/*
+  msg_flight
+  Flight recorder (-F file): the last messages a consumer handled, kept in
+  memory and written out when something goes wrong.
+
+  Every recording thread owns a ring of its last N records: topic hash,
+  payload size, receive time, mid, QoS, time spent in a receive lane, the
+  decode result and optionally the first bytes of the payload. Recording
+  is an rdtsc, a topic hash and a few plain stores into the thread's own
+  ring; the oldest record is overwritten. Records keep raw ticks (TSC on
+  x86, wall clock nanoseconds elsewhere); the dump carries a wall clock and
+  tick reading from flight_init() and one from the dump, and the viewer
+  converts between them.
+
+  The rings are dumped to <file>.<pid>.<n>
+      on SIGUSR1           the process keeps running (not on Windows)
+      on a crash           SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT; the
+                           signal is then raised again with its default
+                           action
+      on flight_dump()
+  The dump is written from the signal handler with write(2) only, so it
+  still works when the heap or stdio are what broke. A record that is being
+  written meanwhile fails its sequence check and is left out by the viewer.
+  The message whose decode crashed the process is the one still "pending".
+
+  msg_flight_view prints a dump in time order.
+
+  File layout: a flight_file_header, then for every ring a flight_ring_header
+  and ring_size flight_rec slots, little endian as written by the host.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <mosquitto.h>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <intrin.h>
+# define FLIGHT_HAVE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define FLIGHT_HAVE_TSC 1
+#endif
+
+#define FLIGHT_MAGIC "MQFLT001"
+#define FLIGHT_PROCESS_MAX 32
+#define FLIGHT_PREFIX_MAX 28 /* keeps a record at 64 bytes */
+#define FLIGHT_DEFAULT_RECORDS 4096
+
+enum flight_result {
+	FLIGHT_PENDING = 0, /* recorded, decode not finished */
+	FLIGHT_OK = 1,
+	FLIGHT_MALFORMED = 2, /* failed verification */
+	FLIGHT_NOT_MAP = 3, /* verified, but not a map */
+	FLIGHT_QUEUED = 4, /* handed to a receive lane, decoded by another thread */
+	FLIGHT_CHUNK = 5, /* chunk of a message not complete yet */
+	FLIGHT_DROPPED = 6, /* claim or chunk could not be resolved */
+	FLIGHT_UNCHANGED = 7, /* same payload as the topic's last value, skipped (-D) */
+};
+
+struct flight_file_header {
+	char magic[8];
+	char process[FLIGHT_PROCESS_MAX];
+	uint32_t pid;
+	uint32_t record_size;
+	uint32_t ring_size;
+	uint32_t rings;
+	int32_t reason; /* signal number, 0: flight_dump() */
+	uint32_t prefix; /* payload bytes kept per record */
+	int64_t start_ns; /* wall clock at flight_init() */
+	uint64_t start_ticks;
+	int64_t dump_ns;
+	uint64_t dump_ticks;
+};
+
+struct flight_ring_header {
+	uint32_t thread;
+	uint32_t reserved;
+	uint64_t head; /* records written so far; slot of record p is p % ring_size */
+};
+
+struct flight_rec {
+	uint64_t ticks; /* at receive */
+	uint32_t topic_hash; /* FNV-1a, as trace_topic_hash() */
+	uint32_t size;
+	int32_t mid; /* 0: not known */
+	uint32_t queued_us; /* time in a receive lane */
+	int16_t result;
+	uint8_t qos;
+	uint8_t prefix_len;
+	uint8_t prefix[FLIGHT_PREFIX_MAX];
+	uint64_t seq; /* position + 1, stored after everything else; 0: being written */
+};
+
+struct flight_ring {
+	std::atomic<uint64_t> head; /* written by its thread only */
+	uint64_t mask;
+	uint32_t thread;
+	struct flight_rec *recs;
+};
+
+extern bool flight_enabled;
+extern uint32_t flight_prefix;
+extern thread_local struct flight_ring *flight_thread_ring;
+
+struct flight_ring *flight_register_thread(void); /* NULL beyond PER_THREAD_MAX */
+int64_t flight_now_ns(void);
+
+static inline uint64_t flight_ticks(void)
+{
+#if defined(FLIGHT_HAVE_TSC)
+	return __rdtsc();
+#else
+	return (uint64_t)flight_now_ns();
+#endif
+}
+
+static inline uint32_t flight_topic_hash(const char *topic)
+{
+	uint32_t h = 2166136261u;
+	for (; *topic; topic++) {
+		h ^= (uint8_t)*topic;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Record a received message; pass the result to flight_done(). NULL: not recording. */
+static inline struct flight_rec *flight_record(const char *topic, const void *payload, size_t len, int mid, int qos,
+	uint32_t queued_us)
+{
+	if (!flight_enabled) return NULL;
+
+	struct flight_ring *ring = flight_thread_ring ? flight_thread_ring : flight_register_thread();
+	if (!ring) return NULL;
+
+	uint64_t pos = ring->head.load(std::memory_order_relaxed);
+	struct flight_rec *rec = &ring->recs[pos & ring->mask];
+	size_t prefix = len < flight_prefix ? len : flight_prefix;
+
+	rec->seq = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	rec->ticks = flight_ticks();
+	rec->topic_hash = flight_topic_hash(topic);
+	rec->size = (uint32_t)len;
+	rec->mid = mid;
+	rec->queued_us = queued_us;
+	rec->result = FLIGHT_PENDING;
+	rec->qos = (uint8_t)qos;
+	rec->prefix_len = (uint8_t)prefix;
+	if (prefix) memcpy(rec->prefix, payload, prefix);
+	std::atomic_thread_fence(std::memory_order_release);
+	rec->seq = pos + 1;
+	ring->head.store(pos + 1, std::memory_order_release);
+	return rec;
+}
+
+static inline void flight_done(struct flight_rec *rec, enum flight_result result)
+{
+	if (rec) rec->result = (int16_t)result;
+}
+
+/*
+  Start recording the last `records` (rounded up to a power of two)
+  messages per thread with `prefix` payload bytes each, and install the
+  dump handlers. Dumps go to path.<pid>.<n>.
+*/
+int flight_init(const char *path, const char *process, uint32_t records, uint32_t prefix);
+
+/* Write all rings now. Async signal safe. */
+int flight_dump(int reason);
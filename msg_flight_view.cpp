@@ -0,0 +1,147 @@
+/*
+  msg_flight_view
+  Prints a flight recorder dump (see msg_flight.h) in time order, the
+  records of all threads merged. A message that was still being decoded
+  when the dump was taken shows as "pending"; after a crash that is the
+  suspect.
+
+  Compile:
+  c++ -std=c++14 -O2 -Imosquitto-2.0.8/includes -o msg_flight_view msg_flight_view.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "msg_flight.h"
+
+struct view_rec {
+	struct flight_rec rec;
+	uint32_t thread;
+	int64_t ts_ns;
+};
+
+static const char *result_names[] = { "pending", "ok", "malformed", "not-map", "queued", "chunk", "dropped", "unchanged" };
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n count] [-t thread] [-T topic]... dump_file\n"
+		" -n : print only the last count records\n"
+		" -t : print only the records of this thread\n"
+		" -T : show this topic's name where its hash appears, may be repeated\n", argv0);
+	exit(1);
+}
+
+static const char *result_name(int result)
+{
+	if (result >= 0 && result < (int)(sizeof(result_names) / sizeof(result_names[0]))) return result_names[result];
+	return "?";
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = NULL;
+	long last = -1;
+	long thread = -1;
+	std::unordered_map<uint32_t, std::string> topics;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "-t") || !strcmp(argv[i], "-T")) {
+			if (i == argc - 1) {
+				fprintf(stderr, "Error: %s argument given but no value specified.\n\n", argv[i]);
+				usage(argv[0]);
+			}
+			if (!strcmp(argv[i], "-n")) last = atol(argv[i + 1]);
+			else if (!strcmp(argv[i], "-t")) thread = atol(argv[i + 1]);
+			else topics[flight_topic_hash(argv[i + 1])] = argv[i + 1];
+			i++;
+		}
+		else if (argv[i][0] == '-' || path) usage(argv[0]);
+		else path = argv[i];
+	}
+	if (!path) usage(argv[0]);
+
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "Error: Unable to open '%s'.\n", path);
+		return 1;
+	}
+
+	struct flight_file_header header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, FLIGHT_MAGIC, sizeof(header.magic))
+		|| header.record_size != sizeof(struct flight_rec) || header.ring_size == 0
+		|| (header.ring_size & (header.ring_size - 1))) {
+		fprintf(stderr, "Error: '%s' is not a flight recorder dump.\n", path);
+		fclose(fp);
+		return 1;
+	}
+
+	/* ticks -> wall clock, from the two readings in the header */
+	double ns_per_tick = 1.0;
+	if (header.dump_ticks > header.start_ticks && header.dump_ns > header.start_ns) {
+		ns_per_tick = (double)(header.dump_ns - header.start_ns) / (double)(header.dump_ticks - header.start_ticks);
+	}
+
+	std::vector<struct view_rec> recs;
+	std::vector<struct flight_rec> slots(header.ring_size);
+	uint64_t torn = 0;
+	uint32_t rings = 0;
+
+	for (; rings < header.rings; rings++) {
+		struct flight_ring_header ring;
+		if (fread(&ring, sizeof(ring), 1, fp) != 1 || fread(slots.data(), sizeof(struct flight_rec), slots.size(), fp) != slots.size()) {
+			break;
+		}
+
+		/* a slot belongs to the dump only if it still holds the record its position says */
+		uint64_t first = ring.head > header.ring_size ? ring.head - header.ring_size : 0;
+		for (uint64_t p = first; p < ring.head; p++) {
+			const struct flight_rec &rec = slots[p & (header.ring_size - 1)];
+			if (rec.seq != p + 1) {
+				torn++;
+				continue;
+			}
+			if (thread >= 0 && ring.thread != (uint32_t)thread) continue;
+			int64_t ts_ns = header.start_ns + (int64_t)(((double)rec.ticks - (double)header.start_ticks) * ns_per_tick);
+			recs.push_back({ rec, ring.thread, ts_ns });
+		}
+	}
+	fclose(fp);
+
+	std::stable_sort(recs.begin(), recs.end(),
+		[](const struct view_rec &a, const struct view_rec &b) { return a.ts_ns < b.ts_ns; });
+
+	header.process[FLIGHT_PROCESS_MAX - 1] = '\0';
+	printf("%s[%u]: ", header.process, header.pid);
+	if (header.reason) printf("dumped on signal %d", header.reason);
+	else printf("dumped on request");
+	printf(" at %lld.%06lld, %u threads, %u records each, %u payload bytes kept\n",
+		(long long)(header.dump_ns / 1000000000), (long long)(header.dump_ns % 1000000000 / 1000),
+		header.rings, header.ring_size, header.prefix);
+	if (rings < header.rings) printf("truncated: %u of %u rings readable\n", rings, header.rings);
+	if (torn) printf("%llu records skipped, overwritten while dumping\n", (unsigned long long)torn);
+	printf("\n%-17s %6s %6s %3s %8s %-10s %9s %-9s %s\n", "time", "thread", "mid", "qos", "bytes", "topic", "lane us",
+		"result", "payload");
+
+	size_t start = last >= 0 && (size_t)last < recs.size() ? recs.size() - (size_t)last : 0;
+	for (size_t i = start; i < recs.size(); i++) {
+		const struct flight_rec &rec = recs[i].rec;
+		int64_t ts_ns = recs[i].ts_ns;
+		char topic[16];
+
+		snprintf(topic, sizeof(topic), "%08x", rec.topic_hash);
+		printf("%10lld.%06lld %6u %6d %3u %8u %-10s %9u %-9s ", (long long)(ts_ns / 1000000000),
+			(long long)(ts_ns % 1000000000 / 1000), recs[i].thread, rec.mid, rec.qos, rec.size, topic, rec.queued_us,
+			result_name(rec.result));
+		for (int b = 0; b < rec.prefix_len && b < FLIGHT_PREFIX_MAX; b++) printf("%02x", rec.prefix[b]);
+
+		auto name = topics.find(rec.topic_hash);
+		if (name != topics.end()) printf("  %s", name->second.c_str());
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include <math.h>
+#include <algorithm>
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+#include <mosquitto.h>
+#include "msg_hdr.h"
+
+static int highest_bit(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanReverse64(&index, v);
+	return (int)index;
+#elif defined(__GNUC__)
+	return 63 - __builtin_clzll(v);
+#else
+	int bit = 0;
+	while (v >>= 1) bit++;
+	return bit;
+#endif
+}
+
+static size_t counts_index(const struct hdr_histogram *h, int64_t value)
+{
+	int pow2ceiling = highest_bit((uint64_t)(value | h->sub_bucket_mask)) + 1;
+	int bucket = pow2ceiling - h->unit_magnitude - (h->sub_bucket_half_count_magnitude + 1);
+	int64_t sub_bucket = value >> (bucket + h->unit_magnitude);
+
+	return (size_t)(((int64_t)(bucket + 1) << h->sub_bucket_half_count_magnitude) + (sub_bucket - h->sub_bucket_half_count));
+}
+
+/* highest value that lands in counts[index] */
+static int64_t index_highest_value(const struct hdr_histogram *h, size_t index)
+{
+	int bucket = (int)(index >> h->sub_bucket_half_count_magnitude) - 1;
+	int64_t sub_bucket = (int64_t)(index & (h->sub_bucket_half_count - 1)) + h->sub_bucket_half_count;
+
+	if (bucket < 0) {
+		sub_bucket -= h->sub_bucket_half_count;
+		bucket = 0;
+	}
+	int64_t lowest = sub_bucket << (bucket + h->unit_magnitude);
+	return lowest + ((int64_t)1 << (bucket + h->unit_magnitude)) - 1;
+}
+
+int hdr_init(struct hdr_histogram *h, int64_t highest, int digits)
+{
+	if (highest < 2 || digits < 1 || digits > 5) return MOSQ_ERR_INVAL;
+
+	int64_t single_unit_range = 2;
+	for (int i = 0; i < digits; i++) single_unit_range *= 10;
+
+	int sub_bucket_count_magnitude = (int)ceil(log2((double)single_unit_range));
+	h->highest = highest;
+	h->digits = digits;
+	h->unit_magnitude = 0;
+	h->sub_bucket_half_count_magnitude = (sub_bucket_count_magnitude > 1 ? sub_bucket_count_magnitude : 1) - 1;
+	h->sub_bucket_count = (int64_t)1 << (h->sub_bucket_half_count_magnitude + 1);
+	h->sub_bucket_half_count = h->sub_bucket_count / 2;
+	h->sub_bucket_mask = (h->sub_bucket_count - 1) << h->unit_magnitude;
+
+	int64_t smallest_untrackable = h->sub_bucket_count << h->unit_magnitude;
+	h->bucket_count = 1;
+	while (smallest_untrackable <= highest) {
+		if (smallest_untrackable > INT64_MAX / 2) {
+			h->bucket_count++;
+			break;
+		}
+		smallest_untrackable <<= 1;
+		h->bucket_count++;
+	}
+
+	h->counts.assign((size_t)(h->bucket_count + 1) * (size_t)h->sub_bucket_half_count, 0);
+	hdr_reset(h);
+	return MOSQ_ERR_SUCCESS;
+}
+
+void hdr_reset(struct hdr_histogram *h)
+{
+	std::fill(h->counts.begin(), h->counts.end(), 0);
+	h->total = 0;
+	h->overflow = 0;
+	h->min = INT64_MAX;
+	h->max = 0;
+	h->sum = 0;
+}
+
+void hdr_record_n(struct hdr_histogram *h, int64_t value, uint64_t count)
+{
+	if (value < 0) value = 0;
+	if (value > h->highest) {
+		value = h->highest;
+		h->overflow += count;
+	}
+
+	h->counts[counts_index(h, value)] += count;
+	h->total += count;
+	h->sum += (double)value * count;
+	if (value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+}
+
+void hdr_record(struct hdr_histogram *h, int64_t value)
+{
+	hdr_record_n(h, value, 1);
+}
+
+void hdr_record_corrected(struct hdr_histogram *h, int64_t value, int64_t expected_interval)
+{
+	hdr_record(h, value);
+	if (expected_interval <= 0) return;
+
+	for (int64_t missing = value - expected_interval; missing >= expected_interval; missing -= expected_interval) {
+		hdr_record(h, missing);
+	}
+}
+
+int hdr_merge(struct hdr_histogram *h, const struct hdr_histogram *src)
+{
+	if (h->counts.size() != src->counts.size() || h->digits != src->digits) return MOSQ_ERR_INVAL;
+
+	for (size_t i = 0; i < h->counts.size(); i++) h->counts[i] += src->counts[i];
+	h->total += src->total;
+	h->overflow += src->overflow;
+	h->sum += src->sum;
+	if (src->total && src->min < h->min) h->min = src->min;
+	if (src->max > h->max) h->max = src->max;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int64_t hdr_value_at_percentile(const struct hdr_histogram *h, double percentile)
+{
+	if (!h->total) return 0;
+	if (percentile >= 100.0) return h->max;
+
+	uint64_t target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+	if (target < 1) target = 1;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < h->counts.size(); i++) {
+		seen += h->counts[i];
+		if (seen >= target) {
+			int64_t value = index_highest_value(h, i);
+			return value < h->max ? value : h->max;
+		}
+	}
+	return h->max;
+}
+
+double hdr_mean(const struct hdr_histogram *h)
+{
+	return h->total ? h->sum / h->total : 0.0;
+}
+
+void hdr_print_distribution(const struct hdr_histogram *h, FILE *out, double unit_scale)
+{
+	static const double percentiles[] = { 0, 10, 20, 30, 40, 50, 55, 60, 65, 70, 75, 77.5, 80, 82.5, 85, 87.5,
+		90, 91.25, 92.5, 93.75, 95, 96.25, 97.5, 98.4375, 99, 99.5, 99.75, 99.9, 99.95, 99.99, 99.999, 100 };
+
+	fprintf(out, "%12s %10s %12s\n", "value", "percentile", "count");
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		double p = percentiles[i];
+		fprintf(out, "%12.3f %10.5f %12llu\n", hdr_value_at_percentile(h, p) / unit_scale, p / 100.0,
+			(unsigned long long)(p / 100.0 * h->total + 0.5));
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+/*
+  msg_hdr
+  High dynamic range histogram (after Gil Tene's HdrHistogram).
+
+  Values from 1 to `highest` are counted with a fixed number of significant
+  decimal digits: buckets double in width, and each bucket is split into
+  2 * 10^digits linear sub-buckets. With 3 digits, a microsecond
+  and a minute are both recorded within 0.1%. Recording is one index
+  computation and an increment, so it can sit on a per-message path.
+
+  hdr_record_corrected() back-fills the samples a fixed-rate sender would
+  have taken while it was stalled (coordinated omission), so a pause is
+  counted as many late messages instead of one.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+struct hdr_histogram {
+	int64_t highest;
+	int digits;
+	int unit_magnitude;
+	int sub_bucket_half_count_magnitude;
+	int64_t sub_bucket_count;
+	int64_t sub_bucket_half_count;
+	int64_t sub_bucket_mask;
+	int bucket_count;
+	std::vector<uint64_t> counts;
+
+	uint64_t total;
+	uint64_t overflow; /* values above highest, recorded as highest */
+	int64_t min;
+	int64_t max;
+	double sum;
+};
+
+/* digits: 1..5 significant decimal digits kept for every value. */
+int hdr_init(struct hdr_histogram *h, int64_t highest, int digits);
+void hdr_reset(struct hdr_histogram *h);
+
+void hdr_record(struct hdr_histogram *h, int64_t value);
+void hdr_record_n(struct hdr_histogram *h, int64_t value, uint64_t count);
+
+/* Record value and the samples hidden behind it when expected_interval apart. */
+void hdr_record_corrected(struct hdr_histogram *h, int64_t value, int64_t expected_interval);
+
+/* Add the counts of src (same highest and digits) to h. */
+int hdr_merge(struct hdr_histogram *h, const struct hdr_histogram *src);
+
+/* Smallest recorded value (to the histogram's precision) >= percentile % of samples. */
+int64_t hdr_value_at_percentile(const struct hdr_histogram *h, double percentile);
+double hdr_mean(const struct hdr_histogram *h);
+
+/* Percentile distribution, one line per bucket step, for plotting. */
+void hdr_print_distribution(const struct hdr_histogram *h, FILE *out, double unit_scale);
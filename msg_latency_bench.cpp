@@ -0,0 +1,422 @@
+/*
+  msg_latency_bench
+  Publish-to-callback latency through a broker on this host. One process
+  runs a sender and a receiver client, so both read the same monotonic
+  clock. Every message carries the nanosecond time it was scheduled to go
+  out and the time it did, and the receiver records
+      scheduled -> message callback   (latency, immune to sender stalls)
+      sent      -> message callback   (service time)
+  into HDR histograms, for every combination of rate and QoS.
+
+  The sender follows a fixed schedule and does not skip slots it is late
+  for; measuring from the scheduled time keeps a stall from hiding the
+  messages queued up behind it (coordinated omission).
+
+  Runs against any MQTT broker: a local mosquitto, mosquitto_loopback, or
+  with -b the same stand-in broker started inside this process (msg_broker.h)
+  on a free loopback port, which leaves no external process to set up.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -Imosquitto-2.0.8/includes -o msg_latency_bench msg_latency_bench.cpp msg_hdr.cpp msg_samples.cpp msg_broker.cpp msg_trace.cpp -lmosquitto -lpthread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <mosquitto.h>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_schema.h"
+#include "msg_hdr.h"
+#include "msg_broker.h"
+
+#define DEFAULT_MQTT_HOST "127.0.0.1"
+#define DEFAULT_MQTT_PORT 1883
+#define DEFAULT_MQTT_KEEPALIVE 60
+#define DEFAULT_TOPIC "bench/latency"
+#define DEFAULT_DURATION 5
+#define DEFAULT_PAYLOAD 16
+#define DRAIN_TIMEOUT_MS 5000
+#define HIST_HIGHEST_NS 60000000000LL /* one minute */
+#define HIST_DIGITS 3
+#define MAX_RUNS 16
+
+/* what the sender puts on the wire */
+struct latency_msg {
+	uint32_t run;
+	uint64_t seq;
+	int64_t scheduled_ns;
+	int64_t sent_ns;
+	std::string pad;
+
+	static constexpr auto fields()
+	{
+		return std::make_tuple(
+			msg_schema::field("run", &latency_msg::run),
+			msg_schema::field("seq", &latency_msg::seq),
+			msg_schema::field("scheduled", &latency_msg::scheduled_ns),
+			msg_schema::field("sent", &latency_msg::sent_ns),
+			msg_schema::field("pad", &latency_msg::pad));
+	}
+};
+
+/* receiver side of one run, shared with the network thread */
+struct latency_run {
+	std::mutex lock;
+	uint32_t run;
+	uint64_t count;
+	std::vector<bool> seen;
+	uint64_t received;
+	uint64_t duplicates;
+	struct hdr_histogram latency;
+	struct hdr_histogram service;
+};
+
+struct run_result {
+	double rate;
+	int qos;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t duplicates;
+	uint64_t publish_errors;
+	int64_t latency[4]; /* p50, p99, p99.9, max */
+	int64_t service[4];
+	double latency_mean;
+};
+
+static volatile bool connected = false;
+static volatile bool subscribed = false;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-b] [-t topic] [-r rate,rate,...] [-q qos,qos,...] [-d seconds] [-s payload] [-j]\n"
+		" -b : run the stand-in broker in this process instead of using -h/-p\n"
+		" -r : messages per second per run (default 1000,10000)\n"
+		" -q : QoS levels to run each rate at (default 0,1,2)\n"
+		" -d : duration of each run (default %d s)\n"
+		" -s : padding bytes per message (default %d)\n"
+		" -j : print results as JSON\n", argv0, DEFAULT_DURATION, DEFAULT_PAYLOAD);
+	exit(1);
+}
+
+#ifndef _WINDOWS
+
+static int64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until_ns(int64_t deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(deadline / 1000000000);
+	ts.tv_nsec = (long)(deadline % 1000000000);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+void connect_callback(struct mosquitto *mosq, void *obj, int result)
+{
+	if (result) {
+		fprintf(stderr, "Connection error: %s\n", mosquitto_connack_string(result));
+		return;
+	}
+	/* the receiver subscribes; the sender has no user data */
+	if (obj) mosquitto_subscribe(mosq, NULL, (const char *)obj, 2);
+	else connected = true;
+}
+
+void subscribe_callback(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+	(void)mosq;
+	(void)obj;
+	(void)mid;
+	(void)qos_count;
+	(void)granted_qos;
+	subscribed = true;
+}
+
+static struct latency_run current;
+
+void message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
+{
+	int64_t now = bench_now_ns();
+	static latency_msg msg;
+
+	(void)mosq;
+	(void)obj;
+
+	std::lock_guard<std::mutex> guard(current.lock);
+	if (!msg_schema::decode_flex((const uint8_t *)message->payload, (size_t)message->payloadlen, msg)
+		|| msg.run != current.run || msg.seq >= current.count) {
+		/* left over from an earlier run */
+		return;
+	}
+	if (current.seen[msg.seq]) {
+		current.duplicates++;
+		return;
+	}
+	current.seen[msg.seq] = true;
+	current.received++;
+	hdr_record(&current.latency, now - msg.scheduled_ns);
+	hdr_record(&current.service, now - msg.sent_ns);
+}
+
+static bool wait_for(volatile bool *flag, int timeout_ms)
+{
+	for (int i = 0; i < timeout_ms / 10 && !*flag; i++) usleep(10000);
+	return *flag;
+}
+
+static void percentiles(const struct hdr_histogram *h, int64_t out[4])
+{
+	out[0] = hdr_value_at_percentile(h, 50.0);
+	out[1] = hdr_value_at_percentile(h, 99.0);
+	out[2] = hdr_value_at_percentile(h, 99.9);
+	out[3] = h->max;
+}
+
+static void run_once(struct mosquitto *sender, const char *topic, uint32_t run, double rate, int qos,
+	int duration, size_t payload, struct run_result *result)
+{
+	flexbuffers::Builder fbb(256 + payload, flexbuffers::BUILDER_FLAG_NONE);
+	uint64_t count = (uint64_t)(rate * duration);
+	int64_t period = (int64_t)(1e9 / rate);
+	latency_msg msg;
+
+	{
+		std::lock_guard<std::mutex> guard(current.lock);
+		current.run = run;
+		current.count = count;
+		current.seen.assign(count, false);
+		current.received = current.duplicates = 0;
+		hdr_reset(&current.latency);
+		hdr_reset(&current.service);
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->rate = rate;
+	result->qos = qos;
+
+	msg.run = run;
+	msg.pad.assign(payload, 'x');
+	int64_t start = bench_now_ns() + 10000000;
+	for (uint64_t seq = 0; seq < count; seq++) {
+		msg.seq = seq;
+		msg.scheduled_ns = start + (int64_t)seq * period;
+		if (bench_now_ns() < msg.scheduled_ns) sleep_until_ns(msg.scheduled_ns);
+		msg.sent_ns = bench_now_ns();
+
+		msg_schema::encode_flex(fbb, msg);
+		const std::vector<uint8_t> &buf = fbb.GetBuffer();
+		if (mosquitto_publish(sender, NULL, topic, (int)buf.size(), buf.data(), qos, false) == MOSQ_ERR_SUCCESS) {
+			result->sent++;
+		}
+		else {
+			result->publish_errors++;
+		}
+	}
+
+	/* let the tail arrive */
+	for (int i = 0; i < DRAIN_TIMEOUT_MS / 10; i++) {
+		{
+			std::lock_guard<std::mutex> guard(current.lock);
+			if (current.received >= result->sent) break;
+		}
+		usleep(10000);
+	}
+
+	std::lock_guard<std::mutex> guard(current.lock);
+	current.run = 0;
+	result->received = current.received;
+	result->duplicates = current.duplicates;
+	result->latency_mean = hdr_mean(&current.latency);
+	percentiles(&current.latency, result->latency);
+	percentiles(&current.service, result->service);
+}
+
+static size_t parse_list(char *arg, double *values, size_t max)
+{
+	size_t n = 0;
+	while (*arg && n < max) {
+		values[n++] = strtod(arg, &arg);
+		if (*arg == ',') arg++;
+		else if (*arg) return 0;
+	}
+	return n;
+}
+
+static void print_table(const struct run_result *results, size_t count)
+{
+	printf("%9s %3s %9s %9s %5s %10s %10s %10s %10s %10s\n", "rate/s", "qos", "sent", "received", "dups",
+		"p50 us", "p99 us", "p99.9 us", "max us", "svc p99 us");
+	for (size_t i = 0; i < count; i++) {
+		const struct run_result *r = &results[i];
+		printf("%9.0f %3d %9llu %9llu %5llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", r->rate, r->qos,
+			(unsigned long long)r->sent, (unsigned long long)r->received, (unsigned long long)r->duplicates,
+			r->latency[0] / 1e3, r->latency[1] / 1e3, r->latency[2] / 1e3, r->latency[3] / 1e3, r->service[1] / 1e3);
+	}
+}
+
+static void print_json(const struct run_result *results, size_t count)
+{
+	printf("[\n");
+	for (size_t i = 0; i < count; i++) {
+		const struct run_result *r = &results[i];
+		printf("  {\"rate\": %.1f, \"qos\": %d, \"sent\": %llu, \"received\": %llu, \"duplicates\": %llu, \"publish_errors\": %llu, "
+			"\"latency_ns\": {\"mean\": %.0f, \"p50\": %lld, \"p99\": %lld, \"p99.9\": %lld, \"max\": %lld}, "
+			"\"service_ns\": {\"p50\": %lld, \"p99\": %lld, \"p99.9\": %lld, \"max\": %lld}}%s\n",
+			r->rate, r->qos, (unsigned long long)r->sent, (unsigned long long)r->received,
+			(unsigned long long)r->duplicates, (unsigned long long)r->publish_errors, r->latency_mean,
+			(long long)r->latency[0], (long long)r->latency[1], (long long)r->latency[2], (long long)r->latency[3],
+			(long long)r->service[0], (long long)r->service[1], (long long)r->service[2], (long long)r->service[3],
+			i + 1 < count ? "," : "");
+	}
+	printf("]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	char *mqtt_host = strdup(DEFAULT_MQTT_HOST);
+	int mqtt_port = DEFAULT_MQTT_PORT;
+	char *topic = strdup(DEFAULT_TOPIC);
+	double rates[MAX_RUNS] = { 1000, 10000 };
+	size_t rate_count = 2;
+	double qos_levels[3] = { 0, 1, 2 };
+	size_t qos_count = 3;
+	int duration = DEFAULT_DURATION;
+	size_t payload = DEFAULT_PAYLOAD;
+	bool json = false;
+	bool in_process = false;
+	struct broker broker;
+	int rc;
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j")) {
+			json = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "-b")) {
+			in_process = true;
+			continue;
+		}
+		if (i == argc - 1) usage(argv[0]);
+
+		if (!strcmp(argv[i], "-h")) {
+			free(mqtt_host);
+			mqtt_host = strdup(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-p")) mqtt_port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t")) {
+			free(topic);
+			topic = strdup(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-r")) rate_count = parse_list(argv[++i], rates, MAX_RUNS);
+		else if (!strcmp(argv[i], "-q")) qos_count = parse_list(argv[++i], qos_levels, 3);
+		else if (!strcmp(argv[i], "-d")) duration = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s")) payload = (size_t)atoi(argv[++i]);
+		else usage(argv[0]);
+	}
+	if (!rate_count || !qos_count || duration <= 0) usage(argv[0]);
+	for (size_t i = 0; i < rate_count; i++) {
+		if (rates[i] <= 0) usage(argv[0]);
+	}
+	for (size_t i = 0; i < qos_count; i++) {
+		if (qos_levels[i] < 0 || qos_levels[i] > 2) usage(argv[0]);
+	}
+
+	if (in_process) {
+		rc = broker_init(&broker);
+		if (rc == MOSQ_ERR_SUCCESS) rc = broker_listen_tcp(&broker, DEFAULT_MQTT_HOST, 0);
+		if (rc == MOSQ_ERR_SUCCESS) rc = broker_start(&broker);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Error: in-process broker: %s\n", mosquitto_strerror(rc));
+			return 1;
+		}
+		free(mqtt_host);
+		mqtt_host = strdup(DEFAULT_MQTT_HOST);
+		mqtt_port = broker.port;
+	}
+
+	hdr_init(&current.latency, HIST_HIGHEST_NS, HIST_DIGITS);
+	hdr_init(&current.service, HIST_HIGHEST_NS, HIST_DIGITS);
+
+	mosquitto_lib_init();
+
+	struct mosquitto *receiver = mosquitto_new(NULL, true, topic);
+	struct mosquitto *sender = mosquitto_new(NULL, true, NULL);
+	if (!receiver || !sender) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+	mosquitto_connect_callback_set(receiver, connect_callback);
+	mosquitto_subscribe_callback_set(receiver, subscribe_callback);
+	mosquitto_message_callback_set(receiver, message_callback);
+	mosquitto_connect_callback_set(sender, connect_callback);
+	/* QoS 1/2 runs should not stall on the default in-flight window of 20 */
+	mosquitto_max_inflight_messages_set(sender, 0);
+
+	rc = mosquitto_connect(receiver, mqtt_host, mqtt_port, DEFAULT_MQTT_KEEPALIVE);
+	if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_connect(sender, mqtt_host, mqtt_port, DEFAULT_MQTT_KEEPALIVE);
+	if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_start(receiver);
+	if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_start(sender);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+		return 1;
+	}
+	if (!wait_for(&subscribed, 5000) || !wait_for(&connected, 5000)) {
+		fprintf(stderr, "Error: no connection to %s:%d\n", mqtt_host, mqtt_port);
+		return 1;
+	}
+
+	std::vector<struct run_result> results;
+	uint32_t run = 1;
+	for (size_t q = 0; q < qos_count; q++) {
+		for (size_t r = 0; r < rate_count; r++) {
+			struct run_result result;
+			if (!json) fprintf(stderr, "rate %.0f/s qos %d ...\n", rates[r], (int)qos_levels[q]);
+			run_once(sender, topic, run++, rates[r], (int)qos_levels[q], duration, payload, &result);
+			results.push_back(result);
+		}
+	}
+
+	if (json) print_json(results.data(), results.size());
+	else print_table(results.data(), results.size());
+
+	mosquitto_disconnect(sender);
+	mosquitto_disconnect(receiver);
+	mosquitto_loop_stop(sender, false);
+	mosquitto_loop_stop(receiver, false);
+	mosquitto_destroy(sender);
+	mosquitto_destroy(receiver);
+	mosquitto_lib_cleanup();
+	if (in_process) {
+		if (!json) broker_print_stats(&broker, stderr);
+		broker_cleanup(&broker);
+	}
+	free(topic);
+	free(mqtt_host);
+
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	fprintf(stderr, "msg_latency_bench needs clock_nanosleep() and is not supported on Windows.\n");
+	return 1;
+}
+
+#endif
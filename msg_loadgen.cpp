@@ -0,0 +1,380 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#if defined(_WINDOWS)
+# include <windows.h>
+#define strtok_r strtok_s
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+#include <flatbuffers/flexbuffers.h>
+#include "sensor_msg.h"
+#include "msg_loadgen.h"
+#include "msg_metrics.h"
+
+#define HIST_HIGHEST_NS 60000000000LL
+#define HIST_DIGITS 3
+#define CONNACK_TIMEOUT_MS 5000
+
+/* samples payload shape */
+struct samples_msg {
+	double time;
+	std::vector<float> samples;
+
+	static constexpr auto fields()
+	{
+		return std::make_tuple(
+			msg_schema::field("time", &samples_msg::time),
+			msg_schema::field("samples", &samples_msg::samples));
+	}
+};
+
+static int64_t loadgen_now_ns(void)
+{
+#ifdef _WINDOWS
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (int64_t)(count.QuadPart / freq.QuadPart * 1000000000 + count.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void sleep_until(int64_t deadline_ns)
+{
+#ifdef _WINDOWS
+	int64_t now = loadgen_now_ns();
+	if (deadline_ns > now) Sleep((DWORD)((deadline_ns - now) / 1000000));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t)(deadline_ns / 1000000000);
+	ts.tv_nsec = (long)(deadline_ns % 1000000000);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
+
+static uint64_t next_random(struct loadgen *gen)
+{
+	/* xorshift64* */
+	gen->rng ^= gen->rng >> 12;
+	gen->rng ^= gen->rng << 25;
+	gen->rng ^= gen->rng >> 27;
+	return gen->rng * 0x2545F4914F6CDD1DULL;
+}
+
+void loadgen_config_init(struct loadgen_config *config)
+{
+	config->process = LOADGEN_CONSTANT;
+	config->shape = LOADGEN_SENSOR;
+	config->rate = 1000;
+	config->burst = 100;
+	config->topics = 1;
+	config->connections = 1;
+	config->min_size = config->max_size = 64;
+	config->pool = 64;
+	config->qos = 0;
+	config->count = 0;
+	config->duration = 10;
+}
+
+int loadgen_parse(struct loadgen_config *config, const char *spec)
+{
+	std::string copy(spec);
+	char *saveptr = NULL;
+
+	for (char *item = strtok_r(&copy[0], ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+		if (value) *value++ = '\0';
+
+		if (!strcmp(item, "constant")) config->process = LOADGEN_CONSTANT;
+		else if (!strcmp(item, "poisson")) config->process = LOADGEN_POISSON;
+		else if (!strcmp(item, "burst") && !value) config->process = LOADGEN_BURST;
+		else if (!strcmp(item, "sensor")) config->shape = LOADGEN_SENSOR;
+		else if (!strcmp(item, "samples")) config->shape = LOADGEN_SAMPLES;
+		else if (!strcmp(item, "random")) config->shape = LOADGEN_RANDOM;
+		else if (!value) return MOSQ_ERR_INVAL;
+		else if (!strcmp(item, "rate")) config->rate = atof(value);
+		else if (!strcmp(item, "burst")) config->burst = atoi(value);
+		else if (!strcmp(item, "topics")) config->topics = atoi(value);
+		else if (!strcmp(item, "connections")) config->connections = atoi(value);
+		else if (!strcmp(item, "pool")) config->pool = atoi(value);
+		else if (!strcmp(item, "qos")) config->qos = atoi(value);
+		else if (!strcmp(item, "count")) config->count = strtoull(value, NULL, 10);
+		else if (!strcmp(item, "duration")) config->duration = atof(value);
+		else if (!strcmp(item, "size")) {
+			char *end;
+			config->min_size = config->max_size = strtoul(value, &end, 10);
+			if (*end == '-') config->max_size = strtoul(end + 1, NULL, 10);
+		}
+		else return MOSQ_ERR_INVAL;
+	}
+
+	if (config->rate < 0 || config->burst < 1 || config->topics < 1 || config->connections < 1
+		|| config->pool < 1 || config->qos < 0 || config->qos > 2 || config->duration < 0
+		|| config->max_size < config->min_size) {
+		return MOSQ_ERR_INVAL;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* one payload of the configured shape, as close to size bytes as the shape allows */
+static void build_payload(struct loadgen *gen, size_t size, std::vector<uint8_t> &out)
+{
+	switch (gen->config.shape) {
+	case LOADGEN_SENSOR: {
+		flexbuffers::Builder fbb(256, flexbuffers::BUILDER_FLAG_NONE);
+		sensor_msg msg;
+		msg.time = 0;
+		msg_schema::encode_flex(fbb, msg);
+		size_t overhead = fbb.GetSize();
+		msg.text.assign(size > overhead ? size - overhead : 0, 'x');
+		for (size_t i = 0; i < msg.text.size(); i++) msg.text[i] = (char)('a' + next_random(gen) % 26);
+		msg_schema::encode_flex(fbb, msg);
+		out = fbb.GetBuffer();
+		break;
+	}
+	case LOADGEN_SAMPLES: {
+		flexbuffers::Builder fbb(256, flexbuffers::BUILDER_FLAG_NONE);
+		samples_msg msg;
+		msg.time = 0;
+		msg_schema::encode_flex(fbb, msg);
+		size_t overhead = fbb.GetSize();
+		msg.samples.resize(size > overhead ? (size - overhead) / sizeof(float) : 0);
+		for (size_t i = 0; i < msg.samples.size(); i++) msg.samples[i] = (float)(next_random(gen) % 2000) / 1000.0f - 1.0f;
+		msg_schema::encode_flex(fbb, msg);
+		out = fbb.GetBuffer();
+		break;
+	}
+	default:
+		out.resize(size);
+		for (size_t i = 0; i < size; i++) out[i] = (uint8_t)next_random(gen);
+		break;
+	}
+}
+
+int loadgen_init(struct loadgen *gen, const struct loadgen_config *config, const char *topic)
+{
+	char name[256];
+
+	gen->config = *config;
+	gen->rng = (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL | 1;
+	gen->completed = 0;
+	memset(&gen->stats, 0, sizeof(gen->stats));
+	if (hdr_init(&gen->lateness, HIST_HIGHEST_NS, HIST_DIGITS) != MOSQ_ERR_SUCCESS) return MOSQ_ERR_INVAL;
+
+	gen->topics.clear();
+	for (int i = 0; i < config->topics; i++) {
+		if (config->topics == 1) snprintf(name, sizeof(name), "%s", topic);
+		else snprintf(name, sizeof(name), "%s/%d", topic, i);
+		gen->topics.push_back(name);
+	}
+
+	/* sizes spread evenly over the range, so the mean size is the middle of it */
+	gen->payloads.resize(config->pool);
+	for (int i = 0; i < config->pool; i++) {
+		size_t size = config->min_size;
+		if (config->pool > 1) size += (config->max_size - config->min_size) * i / (config->pool - 1);
+		build_payload(gen, size, gen->payloads[i]);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void loadgen_cleanup(struct loadgen *gen)
+{
+	for (size_t i = 0; i < gen->connections.size(); i++) {
+		mosquitto_disconnect(gen->connections[i]);
+		mosquitto_loop_stop(gen->connections[i], false);
+		mosquitto_destroy(gen->connections[i]);
+	}
+	gen->connections.clear();
+	gen->payloads.clear();
+	gen->topics.clear();
+}
+
+static std::atomic<int> connacks(0);
+
+static void loadgen_connect_callback(struct mosquitto *mosq, void *obj, int result, int flags, const mosquitto_property *props)
+{
+	(void)mosq;
+	(void)obj;
+	(void)flags;
+	(void)props;
+
+	if (result) {
+		fprintf(stderr, "Connection error: %s\n", mosquitto_reason_string(result));
+		return;
+	}
+	connacks++;
+}
+
+static void loadgen_publish_callback(struct mosquitto *mosq, void *obj, int mid, int reason_code, const mosquitto_property *props)
+{
+	struct loadgen *gen = (struct loadgen *)obj;
+	(void)mosq;
+	(void)mid;
+	(void)reason_code;
+	(void)props;
+
+	gen->completed++;
+}
+
+int loadgen_connect(struct loadgen *gen, const char *host, int port, int keepalive, int protocol_version,
+	const mosquitto_property *connect_props)
+{
+	int rc;
+
+	connacks = 0;
+	for (int i = 0; i < gen->config.connections; i++) {
+		struct mosquitto *mosq = mosquitto_new(NULL, true, gen);
+		if (!mosq) return MOSQ_ERR_NOMEM;
+		gen->connections.push_back(mosq);
+
+		mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, protocol_version);
+		mosquitto_connect_v5_callback_set(mosq, loadgen_connect_callback);
+		mosquitto_publish_v5_callback_set(mosq, loadgen_publish_callback);
+		rc = mosquitto_connect_bind_v5(mosq, host, port, keepalive, NULL, connect_props);
+		if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_start(mosq);
+		if (rc != MOSQ_ERR_SUCCESS) return rc;
+	}
+
+	/* publishing before CONNACK would only queue up */
+	int64_t deadline = loadgen_now_ns() + (int64_t)CONNACK_TIMEOUT_MS * 1000000;
+	while (connacks < gen->config.connections && loadgen_now_ns() < deadline) sleep_until(loadgen_now_ns() + 1000000);
+	return connacks == gen->config.connections ? MOSQ_ERR_SUCCESS : MOSQ_ERR_TIMEOUT;
+}
+
+/* ns from this arrival to the next */
+static int64_t next_gap(struct loadgen *gen, uint64_t sent)
+{
+	double rate = gen->config.rate;
+
+	if (rate <= 0) return 0;
+	switch (gen->config.process) {
+	case LOADGEN_POISSON: {
+		/* uniform in (0, 1] so the log stays finite */
+		double u = (double)((next_random(gen) >> 11) + 1) / 9007199254740992.0;
+		return (int64_t)(-log(u) * 1e9 / rate);
+	}
+	case LOADGEN_BURST:
+		return (sent + 1) % gen->config.burst ? 0 : (int64_t)(gen->config.burst * 1e9 / rate);
+	default:
+		return (int64_t)(1e9 / rate);
+	}
+}
+
+int loadgen_run(struct loadgen *gen, const mosquitto_property *publish_props, volatile bool *run)
+{
+	struct loadgen_config *config = &gen->config;
+	struct loadgen_stats *stats = &gen->stats;
+	int64_t start = loadgen_now_ns();
+	int64_t end = config->duration > 0 ? start + (int64_t)(config->duration * 1e9) : INT64_MAX;
+	int64_t scheduled = start;
+	int64_t now = start;
+	uint64_t max_in_flight = (uint64_t)LOADGEN_MAX_IN_FLIGHT * gen->connections.size();
+	uint64_t n;
+
+	if (gen->connections.empty()) return MOSQ_ERR_NO_CONN;
+
+	/* with no rate limit the schedule stands still, so the clock ends the run */
+	for (n = 0; *run && (!config->count || n < config->count) && std::max(scheduled, now) < end; n++) {
+		now = loadgen_now_ns();
+		if (now < scheduled) {
+			sleep_until(scheduled);
+			now = loadgen_now_ns();
+		}
+		/* the broker's pace, not libmosquitto's queue: a wait here shows up as lateness */
+		while (*run && now < end && stats->sent - gen->completed.load() >= max_in_flight) {
+			sleep_until(loadgen_now_ns() + 50000);
+			now = loadgen_now_ns();
+		}
+		if (!*run || now >= end) break;
+		if (config->rate > 0) hdr_record(&gen->lateness, now - scheduled);
+
+		size_t topic = (size_t)(next_random(gen) % gen->topics.size());
+		const std::vector<uint8_t> &payload = gen->payloads[next_random(gen) % gen->payloads.size()];
+		struct mosquitto *mosq = gen->connections[topic % gen->connections.size()];
+
+		int rc = mosquitto_publish_v5(mosq, NULL, gen->topics[topic].c_str(), (int)payload.size(), payload.data(),
+			config->qos, false, publish_props);
+		if (rc == MOSQ_ERR_SUCCESS) {
+			stats->sent++;
+			stats->bytes += payload.size();
+			metrics_message(METRIC_MSGS_OUT, METRIC_BYTES_OUT, payload.size());
+		}
+		else {
+			stats->errors++;
+			stats->errors_by_code[rc >= 0 && rc < LOADGEN_MAX_ERRORS ? rc : LOADGEN_MAX_ERRORS - 1]++;
+			metrics_publish_error(rc);
+		}
+
+		scheduled += next_gap(gen, n);
+	}
+
+	stats->elapsed_s = (loadgen_now_ns() - start) / 1e9;
+
+	int64_t drain = loadgen_now_ns() + (int64_t)LOADGEN_DRAIN_MS * 1000000;
+	while (gen->completed.load() < stats->sent && loadgen_now_ns() < drain) sleep_until(loadgen_now_ns() + 1000000);
+	stats->completed = gen->completed.load();
+	return MOSQ_ERR_SUCCESS;
+}
+
+void loadgen_print_stats(struct loadgen *gen, FILE *out)
+{
+	static const char *processes[] = { "constant", "poisson", "burst" };
+	static const char *shapes[] = { "sensor", "samples", "random" };
+	const struct loadgen_config *config = &gen->config;
+	const struct loadgen_stats *stats = &gen->stats;
+	double achieved = stats->elapsed_s > 0 ? stats->sent / stats->elapsed_s : 0;
+
+	fprintf(out, "load %s %s: %d topics on %d connections, payload %zu-%zu bytes, QoS %d\n",
+		processes[config->process], shapes[config->shape], config->topics, config->connections,
+		config->min_size, config->max_size, config->qos);
+	fprintf(out, "sent %llu (%llu bytes) in %.2f s: %.1f msg/s achieved", (unsigned long long)stats->sent,
+		(unsigned long long)stats->bytes, stats->elapsed_s, achieved);
+	if (config->rate > 0) fprintf(out, ", %.1f msg/s target (%+.2f%%)", config->rate, (achieved / config->rate - 1) * 100);
+	fprintf(out, "\n");
+	fprintf(out, "completed %llu (%s)\n", (unsigned long long)stats->completed,
+		config->qos ? "acknowledged" : "written to the socket");
+
+	fprintf(out, "publish errors %llu", (unsigned long long)stats->errors);
+	for (int i = 0; i < LOADGEN_MAX_ERRORS; i++) {
+		if (stats->errors_by_code[i]) fprintf(out, ", %s: %llu", mosquitto_strerror(i), (unsigned long long)stats->errors_by_code[i]);
+	}
+	fprintf(out, "\n");
+
+	if (!gen->lateness.total) return;
+	fprintf(out, "pacing error: mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		hdr_mean(&gen->lateness) / 1e3, hdr_value_at_percentile(&gen->lateness, 50) / 1e3,
+		hdr_value_at_percentile(&gen->lateness, 99) / 1e3, hdr_value_at_percentile(&gen->lateness, 99.9) / 1e3,
+		gen->lateness.max / 1e3);
+}
+
+int loadgen_main(const char *spec, const char *host, int port, int keepalive, int protocol_version, const char *topic,
+	const mosquitto_property *connect_props, const mosquitto_property *publish_props, volatile bool *run)
+{
+	struct loadgen_config config;
+	struct loadgen gen;
+	int rc;
+
+	loadgen_config_init(&config);
+	if (loadgen_parse(&config, spec) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Error: invalid load specification '%s'.\n", spec);
+		return MOSQ_ERR_INVAL;
+	}
+
+	rc = loadgen_init(&gen, &config, topic);
+	if (rc == MOSQ_ERR_SUCCESS) rc = loadgen_connect(&gen, host, port, keepalive, protocol_version, connect_props);
+	if (rc == MOSQ_ERR_SUCCESS) rc = loadgen_run(&gen, publish_props, run);
+
+	if (rc == MOSQ_ERR_SUCCESS) loadgen_print_stats(&gen, stderr);
+	else fprintf(stderr, "Error: %s\n", mosquitto_strerror(rc));
+	loadgen_cleanup(&gen);
+	return rc;
+}
@@ -0,0 +1,117 @@
+#pragma once
+/*
+  msg_loadgen
+  Synthetic publish load for the senders (-L).
+
+  Arrivals follow one of three processes at a mean `rate` per second:
+    constant  one message every 1/rate
+    poisson   exponential gaps with mean 1/rate
+    burst     `burst` messages back to back every burst/rate
+  Each message goes to one of `topics` topics (<topic>/<n>) and carries one
+  of the pooled payloads, both drawn at random and independently of each
+  other. Topics are spread over `connections` client connections; a topic
+  always uses the same connection, so per-topic order is kept.
+
+  Payloads are generated up front: a pool of `pool` payloads whose sizes
+  are spread over min_size..max_size, in one of the shapes
+    sensor    sensor_msg FlexBuffer map with text padding
+    samples   FlexBuffer map with a float typed vector
+    random    opaque random bytes
+  so the send loop only picks a buffer and publishes it.
+
+  The loop never skips an arrival it is late for; each message's lateness
+  against its scheduled time goes into an HDR histogram (pacing error).
+  At most LOADGEN_MAX_IN_FLIGHT publishes per connection are waiting to be
+  written (QoS 0) or acknowledged, so an unlimited rate measures what the
+  broker takes rather than how fast libmosquitto's queue grows; the report
+  counts completed publishes separately from the ones handed over.
+
+  The specification is one string of comma separated key=value pairs, e.g.
+      poisson,rate=5000,topics=100,connections=4,size=64-1024,duration=30
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <mosquitto.h>
+#include "msg_hdr.h"
+
+#define LOADGEN_MAX_ERRORS 32 /* MOSQ_ERR_* codes counted individually */
+#define LOADGEN_MAX_IN_FLIGHT 1024 /* per connection */
+#define LOADGEN_DRAIN_MS 2000 /* wait for completions after the run */
+
+enum loadgen_process {
+	LOADGEN_CONSTANT,
+	LOADGEN_POISSON,
+	LOADGEN_BURST,
+};
+
+enum loadgen_shape {
+	LOADGEN_SENSOR,
+	LOADGEN_SAMPLES,
+	LOADGEN_RANDOM,
+};
+
+struct loadgen_config {
+	enum loadgen_process process;
+	enum loadgen_shape shape;
+	double rate; /* messages per second, all topics together */
+	int burst;
+	int topics;
+	int connections;
+	size_t min_size;
+	size_t max_size;
+	int pool;
+	int qos;
+	uint64_t count; /* stop after this many, 0: no limit */
+	double duration; /* stop after this many seconds, 0: no limit */
+};
+
+struct loadgen_stats {
+	uint64_t sent; /* accepted by mosquitto_publish_v5 */
+	uint64_t completed; /* of those, written (QoS 0) or acknowledged */
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t errors_by_code[LOADGEN_MAX_ERRORS];
+	double elapsed_s;
+};
+
+struct loadgen {
+	struct loadgen_config config;
+	std::vector<std::string> topics;
+	std::vector<std::vector<uint8_t>> payloads;
+	std::vector<struct mosquitto *> connections;
+	uint64_t rng;
+	std::atomic<uint64_t> completed; /* publish callbacks, from the network threads */
+	struct loadgen_stats stats;
+	struct hdr_histogram lateness; /* ns behind schedule at publish */
+};
+
+/* Defaults: constant 1000/s, one topic and connection, 64 byte sensor payloads, QoS 0, 10 s. */
+void loadgen_config_init(struct loadgen_config *config);
+
+/* Apply a specification string on top of config. MOSQ_ERR_INVAL on an unknown key or bad value. */
+int loadgen_parse(struct loadgen_config *config, const char *spec);
+
+/* Build topic names and the payload pool. */
+int loadgen_init(struct loadgen *gen, const struct loadgen_config *config, const char *topic);
+void loadgen_cleanup(struct loadgen *gen);
+
+/* Open config.connections connections, each with its own network thread. */
+int loadgen_connect(struct loadgen *gen, const char *host, int port, int keepalive, int protocol_version,
+	const mosquitto_property *connect_props);
+
+/* Publish until the count or duration is reached or *run turns false. */
+int loadgen_run(struct loadgen *gen, const mosquitto_property *publish_props, volatile bool *run);
+
+void loadgen_print_stats(struct loadgen *gen, FILE *out);
+
+/*
+  The whole -L mode of a sender: parse spec, connect, run, print the
+  report to stderr and clean up. Returns a MOSQ_ERR_* code.
+*/
+int loadgen_main(const char *spec, const char *host, int port, int keepalive, int protocol_version, const char *topic,
+	const mosquitto_property *connect_props, const mosquitto_property *publish_props, volatile bool *run);
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <mosquitto.h>
+#include "msg_lvc.h"
+
+#define LVC_MAGIC "MQLVC001"
+#define LVC_PAGE 4096
+
+#ifndef _WINDOWS
+
+static uint64_t lvc_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t lvc_topic_hash(const char *topic, size_t len)
+{
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)topic[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static size_t lvc_align(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static struct lvc_slot *lvc_slot_at(const struct lvc *lvc, uint32_t i)
+{
+	return (struct lvc_slot *)(lvc->slots + (size_t)i * lvc->hdr->slot_stride);
+}
+
+static uint8_t *lvc_value(struct lvc_slot *slot)
+{
+	return (uint8_t *)(slot + 1);
+}
+
+static void lvc_bind(struct lvc *lvc, uint8_t *base, size_t map_size)
+{
+	lvc->base = base;
+	lvc->map_size = map_size;
+	lvc->hdr = (struct lvc_hdr *)base;
+	lvc->slots = base + lvc->hdr->data_offset;
+	lvc->mask = lvc->hdr->slot_count - 1;
+}
+
+static bool lvc_valid(const struct lvc_hdr *hdr, size_t map_size)
+{
+	if (memcmp(hdr->magic, LVC_MAGIC, sizeof(hdr->magic))) return false;
+	if (hdr->slot_count == 0 || (hdr->slot_count & (hdr->slot_count - 1))) return false;
+	if (hdr->slot_stride < sizeof(struct lvc_slot) + hdr->value_size) return false;
+	return hdr->data_offset >= sizeof(struct lvc_hdr)
+		&& hdr->data_offset + (uint64_t)hdr->slot_count * hdr->slot_stride == map_size;
+}
+
+int lvc_create(struct lvc *lvc, const char *path, uint32_t slot_count, uint32_t value_size)
+{
+	struct stat st;
+	uint32_t count = 64;
+
+	if (slot_count == 0 || slot_count > LVC_MAX_SLOTS) return MOSQ_ERR_INVAL;
+	if (value_size == 0 || value_size > LVC_MAX_VALUE_SIZE) return MOSQ_ERR_INVAL;
+	while (count < slot_count) count <<= 1;
+
+	size_t stride = lvc_align(sizeof(struct lvc_slot) + value_size, 64);
+	size_t data_offset = lvc_align(sizeof(struct lvc_hdr), LVC_PAGE);
+	uint64_t file_size = data_offset + (uint64_t)count * stride;
+	if (file_size > LVC_MAX_FILE_SIZE) return MOSQ_ERR_INVAL;
+	size_t map_size = (size_t)file_size;
+
+	int fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) return MOSQ_ERR_ERRNO;
+
+	/* a second writer would resize the file under the first and race its updates */
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		int err = errno;
+		close(fd);
+		return err == EWOULDBLOCK ? MOSQ_ERR_ALREADY_EXISTS : MOSQ_ERR_ERRNO;
+	}
+
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size != map_size && ftruncate(fd, (off_t)map_size) < 0)) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	struct lvc_hdr *hdr = (struct lvc_hdr *)base;
+	bool warm = (size_t)st.st_size == map_size && lvc_valid(hdr, map_size)
+		&& hdr->slot_count == count && hdr->value_size == value_size;
+
+	if (!warm) {
+		memset(base, 0, map_size);
+		hdr->slot_count = count;
+		hdr->value_size = value_size;
+		hdr->slot_stride = stride;
+		hdr->data_offset = data_offset;
+		/* readers check the magic last */
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(hdr->magic, LVC_MAGIC, sizeof(hdr->magic));
+	}
+
+	lvc->fd = fd;
+	lvc->writer = true;
+	lvc_bind(lvc, (uint8_t *)base, map_size);
+
+	if (warm) {
+		/* the previous writer died inside an update: the value is torn */
+		for (uint32_t i = 0; i < count; i++) {
+			struct lvc_slot *slot = lvc_slot_at(lvc, i);
+			uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+			if (seq & 1) {
+				/* the topic stays for the probe chains, the value reads as not found */
+				if (slot->used) slot->used = LVC_SLOT_TORN;
+				slot->len = 0;
+				slot->seq.store(seq + 1, std::memory_order_release);
+			}
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int lvc_open(struct lvc *lvc, const char *path)
+{
+	struct stat st;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return errno == ENOENT ? MOSQ_ERR_NOT_FOUND : MOSQ_ERR_ERRNO;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct lvc_hdr)) {
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	if (!lvc_valid((const struct lvc_hdr *)base, (size_t)st.st_size)) {
+		munmap(base, (size_t)st.st_size);
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	lvc->fd = fd;
+	lvc->writer = false;
+	lvc_bind(lvc, (uint8_t *)base, (size_t)st.st_size);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void lvc_close(struct lvc *lvc)
+{
+	if (!lvc->base) return;
+
+	munmap(lvc->base, lvc->map_size);
+	close(lvc->fd);
+	lvc->base = NULL;
+	lvc->fd = -1;
+}
+
+int lvc_put(struct lvc *lvc, const char *topic, const void *payload, size_t len)
+{
+	struct lvc_hdr *hdr = lvc->hdr;
+	size_t topic_len = strlen(topic);
+
+	if (!lvc->writer) return MOSQ_ERR_INVAL;
+	if (topic_len >= LVC_MAX_TOPIC || len > hdr->value_size) {
+		hdr->rejected.fetch_add(1, std::memory_order_relaxed);
+		return MOSQ_ERR_PAYLOAD_SIZE;
+	}
+
+	uint64_t h = lvc_topic_hash(topic, topic_len);
+	uint32_t i = (uint32_t)h & lvc->mask;
+
+	for (uint32_t n = 0; n <= lvc->mask; n++, i = (i + 1) & lvc->mask) {
+		struct lvc_slot *slot = lvc_slot_at(lvc, i);
+		bool claim = !slot->used;
+
+		/* only the writer changes these, no need to go through the seqlock */
+		if (!claim && (slot->topic_hash != h || slot->topic_len != topic_len || memcmp(slot->topic, topic, topic_len))) {
+			continue;
+		}
+
+		uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+		slot->seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		if (claim) {
+			slot->used = LVC_SLOT_USED;
+			slot->topic_hash = h;
+			slot->topic_len = (uint32_t)topic_len;
+			memcpy(slot->topic, topic, topic_len);
+			slot->topic[topic_len] = '\0';
+			slot->version = 0;
+		}
+		else if (slot->used == LVC_SLOT_TORN) {
+			slot->used = LVC_SLOT_USED;
+		}
+		memcpy(lvc_value(slot), payload, len);
+		slot->len = (uint32_t)len;
+		slot->version++;
+		slot->updated_ms = lvc_now_ms();
+
+		slot->seq.store(seq + 2, std::memory_order_release);
+
+		if (claim) hdr->used_slots.fetch_add(1, std::memory_order_relaxed);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	hdr->rejected.fetch_add(1, std::memory_order_relaxed);
+	return MOSQ_ERR_NOMEM;
+}
+
+int lvc_get(const struct lvc *lvc, const char *topic, uint8_t *buf, size_t size, struct lvc_entry *entry)
+{
+	size_t topic_len = strlen(topic);
+	if (topic_len >= LVC_MAX_TOPIC) return MOSQ_ERR_NOT_FOUND;
+
+	uint64_t h = lvc_topic_hash(topic, topic_len);
+	uint32_t i = (uint32_t)h & lvc->mask;
+
+	for (uint32_t n = 0; n <= lvc->mask; n++, i = (i + 1) & lvc->mask) {
+		struct lvc_slot *slot = lvc_slot_at(lvc, i);
+
+		for (int retry = 0;; retry++) {
+			if (retry == LVC_READ_RETRIES) return MOSQ_ERR_TIMEOUT;
+
+			uint32_t seq = slot->seq.load(std::memory_order_acquire);
+			if (seq & 1) continue;
+
+			uint32_t used = slot->used;
+			bool match = used && slot->topic_hash == h && slot->topic_len == topic_len
+				&& !memcmp(slot->topic, topic, topic_len);
+			size_t len = slot->len;
+			bool fits = len <= size && len <= lvc->hdr->value_size;
+
+			if (match && fits) memcpy(buf, lvc_value(slot), len);
+			entry->len = len;
+			entry->version = slot->version;
+			entry->updated_ms = slot->updated_ms;
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot->seq.load(std::memory_order_relaxed) != seq) continue;
+
+			/* a consistent view of this slot */
+			if (!used) return MOSQ_ERR_NOT_FOUND;
+			if (!match) break;
+			if (used == LVC_SLOT_TORN) return MOSQ_ERR_NOT_FOUND;
+			return fits ? MOSQ_ERR_SUCCESS : MOSQ_ERR_PAYLOAD_SIZE;
+		}
+	}
+
+	return MOSQ_ERR_NOT_FOUND;
+}
+
+bool lvc_topic_at(const struct lvc *lvc, uint32_t i, char *topic, size_t size)
+{
+	if (i > lvc->mask || size == 0) return false;
+
+	struct lvc_slot *slot = lvc_slot_at(lvc, i);
+	for (int retry = 0; retry < LVC_READ_RETRIES; retry++) {
+		uint32_t seq = slot->seq.load(std::memory_order_acquire);
+		if (seq & 1) continue;
+
+		uint32_t used = slot->used;
+		size_t len = slot->topic_len < LVC_MAX_TOPIC ? slot->topic_len : LVC_MAX_TOPIC - 1;
+		if (len > size - 1) len = size - 1;
+		memcpy(topic, slot->topic, len);
+		topic[len] = '\0';
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot->seq.load(std::memory_order_relaxed) == seq) return used == LVC_SLOT_USED;
+	}
+	return false;
+}
+
+#else
+
+int lvc_create(struct lvc *lvc, const char *path, uint32_t slot_count, uint32_t value_size)
+{
+	lvc->base = NULL;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int lvc_open(struct lvc *lvc, const char *path)
+{
+	lvc->base = NULL;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void lvc_close(struct lvc *lvc)
+{
+}
+
+int lvc_put(struct lvc *lvc, const char *topic, const void *payload, size_t len)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int lvc_get(const struct lvc *lvc, const char *topic, uint8_t *buf, size_t size, struct lvc_entry *entry)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+bool lvc_topic_at(const struct lvc *lvc, uint32_t i, char *topic, size_t size)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#pragma once
+/*
+  msg_lvc
+  Last-value cache in a memory-mapped file, shared between local processes.
+
+  One writer (mosquitto_lvc) keeps the latest payload of every topic in an
+  open-addressing table of fixed-size slots. Each slot carries a seqlock
+  counter: the writer makes it odd while updating and even again when done;
+  readers copy the slot and retry if the counter moved, so they never take a
+  lock or wait on the writer. Slots are never freed, which keeps probe chains
+  intact without tombstones.
+
+  The table lives in a regular file, so a restarted writer picks up the
+  cached values where it left off. Slots torn by a crash mid-update keep
+  their topic, so probe chains stay intact, but read as not found until the
+  topic is written again. Only one writer may have the file open at a time
+  (flock).
+
+  Linux/POSIX only; on Windows every call returns MOSQ_ERR_NOT_SUPPORTED.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#define LVC_MAX_TOPIC 256
+#define LVC_DEFAULT_SLOTS 4096
+#define LVC_DEFAULT_VALUE_SIZE 4096
+#define LVC_MAX_SLOTS (1 << 20)
+#define LVC_MAX_VALUE_SIZE (1024 * 1024)
+#define LVC_MAX_FILE_SIZE ((uint64_t)4 << 30)
+#define LVC_READ_RETRIES 1000
+
+/* lvc_slot.used */
+#define LVC_SLOT_USED 1
+#define LVC_SLOT_TORN 2 /* value lost in a crash, topic kept */
+
+struct lvc_slot {
+	std::atomic<uint32_t> seq; /* odd while the writer updates the slot */
+	uint32_t used; /* 0, LVC_SLOT_USED or LVC_SLOT_TORN */
+	uint64_t topic_hash;
+	uint64_t version; /* updates since the topic was first seen */
+	uint64_t updated_ms; /* wall clock, survives restarts */
+	uint32_t topic_len;
+	uint32_t len;
+	char topic[LVC_MAX_TOPIC];
+	/* value follows, value_size bytes */
+};
+
+struct lvc_hdr {
+	char magic[8];
+	uint32_t slot_count; /* power of two */
+	uint32_t value_size;
+	uint64_t slot_stride;
+	uint64_t data_offset;
+	std::atomic<uint32_t> used_slots;
+	std::atomic<uint32_t> rejected;
+};
+
+struct lvc {
+	int fd;
+	uint8_t *base;
+	size_t map_size;
+	struct lvc_hdr *hdr;
+	uint8_t *slots;
+	uint32_t mask;
+	bool writer;
+};
+
+struct lvc_entry {
+	size_t len;
+	uint64_t version;
+	uint64_t updated_ms;
+};
+
+/*
+  Writer: open or create the file. An existing file with the same geometry
+  is reused as is (warm restart), otherwise it is reinitialised.
+  MOSQ_ERR_INVAL if slot_count or value_size is 0 or over LVC_MAX_SLOTS,
+  LVC_MAX_VALUE_SIZE or LVC_MAX_FILE_SIZE; MOSQ_ERR_ALREADY_EXISTS if
+  another writer has the file open.
+*/
+int lvc_create(struct lvc *lvc, const char *path, uint32_t slot_count, uint32_t value_size);
+
+/* Reader: map an existing cache read-only. */
+int lvc_open(struct lvc *lvc, const char *path);
+void lvc_close(struct lvc *lvc);
+
+/* Store the latest value of topic. Returns a MOSQ_ERR_* code. */
+int lvc_put(struct lvc *lvc, const char *topic, const void *payload, size_t len);
+
+/*
+  Copy a consistent snapshot of the value of topic into buf. Returns
+  MOSQ_ERR_NOT_FOUND for unknown or torn topics, MOSQ_ERR_PAYLOAD_SIZE if buf is too
+  small (entry->len holds the size needed).
+*/
+int lvc_get(const struct lvc *lvc, const char *topic, uint8_t *buf, size_t size, struct lvc_entry *entry);
+
+/* Copy the topic of slot i; false if the slot holds no value. For listing the cache. */
+bool lvc_topic_at(const struct lvc *lvc, uint32_t i, char *topic, size_t size);
@@ -0,0 +1,484 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#if !defined(_WINDOWS)
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+#include <mosquitto.h>
+#include "msg_metrics.h"
+#include "msg_per_thread.h"
+
+#define METRICS_PREFIX "mqttfb_"
+#define METRICS_POLL_MS 100 /* longest wait before the thread sees metrics_stop() */
+#define METRICS_PROCESS_MAX 64
+#define METRICS_HTTP_TIMEOUT_S 1 /* per request, on the endpoint thread only */
+
+#if !defined(_WINDOWS) && !defined(MSG_NOSIGNAL)
+# define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE on the socket instead */
+#endif
+
+struct metric_desc {
+	const char *name;
+	const char *help;
+};
+
+struct metric_hist_desc {
+	const char *name;
+	const char *help;
+	double scale; /* recorded unit -> exported unit */
+	int first_pow2; /* Prometheus buckets at 2^first_pow2 .. 2^last_pow2 recorded units */
+	int last_pow2;
+};
+
+struct metrics_totals {
+	uint64_t counters[METRIC_COUNTER_COUNT];
+	uint64_t errors[METRICS_ERROR_CODES];
+	uint64_t hist_sum[METRIC_HIST_COUNT];
+	uint64_t hist_count[METRIC_HIST_COUNT];
+	uint64_t hist[METRIC_HIST_COUNT][METRICS_HIST_BUCKETS];
+};
+
+static const struct metric_desc counter_desc[METRIC_COUNTER_COUNT] = {
+	{ "messages_received_total", "Messages received." },
+	{ "received_bytes_total", "Payload bytes received." },
+	{ "messages_sent_total", "Messages accepted by mosquitto_publish." },
+	{ "sent_bytes_total", "Payload bytes accepted by mosquitto_publish." },
+	{ "reconnects_total", "Connections re-established after a loss." },
+	{ "decode_errors_total", "Payloads dropped as malformed." },
+	{ "claim_fallbacks_total", "Payloads sent without the claim arena because it was full." },
+};
+
+static const struct metric_desc gauge_desc[METRIC_GAUGE_COUNT] = {
+	{ "connected", "1 while connected to the broker." },
+	{ "send_queue_depth", "Publishes not yet written (QoS 0) or acknowledged." },
+	{ "receive_queue_depth", "Messages waiting in the receive lanes." },
+};
+
+static const struct metric_hist_desc hist_desc[METRIC_HIST_COUNT] = {
+	{ "decode_seconds", "Verify and decode time per payload.", 1e-9, 10, 34 },
+	{ "received_payload_bytes", "Size of received payloads.", 1.0, 4, 24 },
+};
+
+bool metrics_enabled = false;
+thread_local struct metrics_shard *metrics_thread_shard = NULL;
+
+static struct per_thread_registry<struct metrics_shard> shards;
+static struct metrics_shard overflow_shard;
+static std::atomic<int64_t> gauges[METRIC_GAUGE_COUNT];
+static char process_name[METRICS_PROCESS_MAX] = "";
+
+static struct metrics_export exporter;
+static std::thread *export_thread = NULL; /* never destroyed: a process may exit without metrics_stop() */
+static std::thread *http_thread = NULL; /* likewise */
+static std::atomic<bool> export_stopping(false);
+static std::mutex totals_lock; /* the text format is written from both threads */
+static flexbuffers::Builder snapshot_fbb(1024, flexbuffers::BUILDER_FLAG_NONE);
+static int listen_fd = -1;
+
+uint64_t metrics_now_ns(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void metrics_init(const char *process)
+{
+	strncpy(process_name, process, sizeof(process_name) - 1);
+	overflow_shard.shared = true;
+	metrics_enabled = true;
+}
+
+struct metrics_shard *metrics_register_thread(void)
+{
+	struct metrics_shard *registered = per_thread_register(&shards, [](int) {
+		struct metrics_shard *shard = new struct metrics_shard;
+		for (int i = 0; i < METRIC_COUNTER_COUNT; i++) shard->counters[i].store(0, std::memory_order_relaxed);
+		for (int i = 0; i < METRICS_ERROR_CODES; i++) shard->errors[i].store(0, std::memory_order_relaxed);
+		for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+			shard->hist_sum[i].store(0, std::memory_order_relaxed);
+			for (int b = 0; b < METRICS_HIST_BUCKETS; b++) shard->hist[i][b].store(0, std::memory_order_relaxed);
+		}
+		shard->shared = false;
+		return shard;
+	});
+
+	/* beyond PER_THREAD_MAX threads */
+	metrics_thread_shard = registered ? registered : &overflow_shard;
+	return metrics_thread_shard;
+}
+
+void metrics_gauge_set(enum metric_gauge gauge, int64_t value)
+{
+	gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta)
+{
+	if (metrics_enabled) gauges[gauge].fetch_add(delta, std::memory_order_relaxed);
+}
+
+static void add_shard(struct metrics_totals *t, const struct metrics_shard *shard)
+{
+	for (int i = 0; i < METRIC_COUNTER_COUNT; i++) t->counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+	for (int i = 0; i < METRICS_ERROR_CODES; i++) t->errors[i] += shard->errors[i].load(std::memory_order_relaxed);
+	for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+		t->hist_sum[i] += shard->hist_sum[i].load(std::memory_order_relaxed);
+		for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+			uint64_t n = shard->hist[i][b].load(std::memory_order_relaxed);
+			t->hist[i][b] += n;
+			t->hist_count[i] += n;
+		}
+	}
+}
+
+static void sum_shards(struct metrics_totals *t)
+{
+	memset(t, 0, sizeof(*t));
+
+	int count = per_thread_count(&shards);
+	for (int i = 0; i < count; i++) {
+		const struct metrics_shard *shard = per_thread_at(&shards, i);
+		if (shard) add_shard(t, shard);
+	}
+	add_shard(t, &overflow_shard);
+}
+
+/* smallest value counted in bucket */
+static uint64_t bucket_lower(int bucket)
+{
+	if (bucket < METRICS_HIST_SUB) return (uint64_t)bucket;
+
+	int e = bucket / METRICS_HIST_SUB + METRICS_HIST_SUB_BITS - 1;
+	uint64_t sub = (uint64_t)(bucket % METRICS_HIST_SUB);
+	return (METRICS_HIST_SUB + sub) << (e - METRICS_HIST_SUB_BITS);
+}
+
+/* largest value counted in bucket */
+static uint64_t bucket_upper(int bucket)
+{
+	return bucket + 1 < METRICS_HIST_BUCKETS ? bucket_lower(bucket + 1) - 1 : UINT64_MAX;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double percentile)
+{
+	uint64_t target = (uint64_t)(total * percentile / 100.0 + 0.5);
+	uint64_t seen = 0;
+
+	if (!total) return 0;
+	if (target < 1) target = 1;
+	for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= target) return bucket_upper(b);
+	}
+	return bucket_upper(METRICS_HIST_BUCKETS - 1);
+}
+
+void metrics_write_prometheus(FILE *out)
+{
+	static struct metrics_totals t;
+	std::lock_guard<std::mutex> guard(totals_lock);
+	sum_shards(&t);
+
+	for (int i = 0; i < METRIC_COUNTER_COUNT; i++) {
+		fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n", counter_desc[i].name,
+			counter_desc[i].help, counter_desc[i].name);
+		fprintf(out, METRICS_PREFIX "%s{process=\"%s\"} %llu\n", counter_desc[i].name, process_name,
+			(unsigned long long)t.counters[i]);
+	}
+
+	fprintf(out, "# HELP " METRICS_PREFIX "publish_errors_total Failed publish calls by MOSQ_ERR code.\n"
+		"# TYPE " METRICS_PREFIX "publish_errors_total counter\n");
+	for (int i = 0; i < METRICS_ERROR_CODES; i++) {
+		if (!t.errors[i]) continue;
+		if (i == METRICS_ERROR_CODES - 1) {
+			fprintf(out, METRICS_PREFIX "publish_errors_total{process=\"%s\",code=\"other\"} %llu\n", process_name,
+				(unsigned long long)t.errors[i]);
+		}
+		else {
+			fprintf(out, METRICS_PREFIX "publish_errors_total{process=\"%s\",code=\"%d\",error=\"%s\"} %llu\n", process_name, i,
+				mosquitto_strerror(i), (unsigned long long)t.errors[i]);
+		}
+	}
+
+	for (int i = 0; i < METRIC_GAUGE_COUNT; i++) {
+		fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s gauge\n", gauge_desc[i].name,
+			gauge_desc[i].help, gauge_desc[i].name);
+		fprintf(out, METRICS_PREFIX "%s{process=\"%s\"} %lld\n", gauge_desc[i].name, process_name,
+			(long long)gauges[i].load(std::memory_order_relaxed));
+	}
+
+	for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+		const struct metric_hist_desc *d = &hist_desc[i];
+		uint64_t cumulative = 0;
+		int b = 0;
+
+		fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s histogram\n", d->name, d->help, d->name);
+		/* fixed power of two bounds; the recorded buckets nest inside them */
+		for (int k = d->first_pow2; k <= d->last_pow2; k++) {
+			uint64_t bound = 1ull << k;
+			for (; b < METRICS_HIST_BUCKETS && bucket_lower(b) < bound; b++) cumulative += t.hist[i][b];
+			fprintf(out, METRICS_PREFIX "%s_bucket{process=\"%s\",le=\"%.9g\"} %llu\n", d->name, process_name,
+				bound * d->scale, (unsigned long long)cumulative);
+		}
+		fprintf(out, METRICS_PREFIX "%s_bucket{process=\"%s\",le=\"+Inf\"} %llu\n", d->name, process_name,
+			(unsigned long long)t.hist_count[i]);
+		fprintf(out, METRICS_PREFIX "%s_sum{process=\"%s\"} %.9g\n", d->name, process_name, t.hist_sum[i] * d->scale);
+		fprintf(out, METRICS_PREFIX "%s_count{process=\"%s\"} %llu\n", d->name, process_name, (unsigned long long)t.hist_count[i]);
+	}
+}
+
+int metrics_write_file(const char *path)
+{
+	char tmp[4096];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) return MOSQ_ERR_ERRNO;
+
+	metrics_write_prometheus(fp);
+	if (fclose(fp) != 0) {
+		remove(tmp);
+		return MOSQ_ERR_ERRNO;
+	}
+#if defined(_WINDOWS)
+	/* rename() does not replace on Windows */
+	remove(path);
+#endif
+	return rename(tmp, path) == 0 ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ERRNO;
+}
+
+void metrics_encode_flex(flexbuffers::Builder &fbb)
+{
+	static struct metrics_totals t;
+	sum_shards(&t);
+
+	fbb.Clear();
+	size_t root = fbb.StartMap();
+	fbb.String("process", process_name);
+	fbb.Double("time", std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count());
+	for (int i = 0; i < METRIC_COUNTER_COUNT; i++) fbb.UInt(counter_desc[i].name, t.counters[i]);
+	for (int i = 0; i < METRIC_GAUGE_COUNT; i++) fbb.Int(gauge_desc[i].name, gauges[i].load(std::memory_order_relaxed));
+
+	size_t errors = fbb.StartMap("publish_errors");
+	for (int i = 0; i < METRICS_ERROR_CODES; i++) {
+		char code[16];
+		if (!t.errors[i]) continue;
+		if (i == METRICS_ERROR_CODES - 1) snprintf(code, sizeof(code), "other");
+		else snprintf(code, sizeof(code), "%d", i);
+		fbb.UInt(code, t.errors[i]);
+	}
+	fbb.EndMap(errors);
+
+	for (int i = 0; i < METRIC_HIST_COUNT; i++) {
+		const struct metric_hist_desc *d = &hist_desc[i];
+		uint64_t total = t.hist_count[i];
+		size_t hist = fbb.StartMap(d->name);
+		fbb.UInt("count", total);
+		fbb.Double("sum", t.hist_sum[i] * d->scale);
+		fbb.Double("p50", hist_percentile(t.hist[i], total, 50.0) * d->scale);
+		fbb.Double("p99", hist_percentile(t.hist[i], total, 99.0) * d->scale);
+		fbb.Double("max", hist_percentile(t.hist[i], total, 100.0) * d->scale);
+		fbb.EndMap(hist);
+	}
+
+	fbb.EndMap(root);
+	fbb.Finish();
+}
+
+static void export_once(void)
+{
+	if (exporter.sample) exporter.sample(exporter.user);
+	if (exporter.text_path && metrics_write_file(exporter.text_path) != MOSQ_ERR_SUCCESS) {
+		fprintf(stderr, "Warning: Unable to write metrics to '%s'.\n", exporter.text_path);
+	}
+	if (exporter.snapshot) {
+		metrics_encode_flex(snapshot_fbb);
+		const std::vector<uint8_t> &buf = snapshot_fbb.GetBuffer();
+		exporter.snapshot(buf.data(), buf.size(), exporter.user);
+	}
+}
+
+#if !defined(_WINDOWS)
+static bool send_all(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n <= 0) return false;
+		data += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+/*
+  One request per connection: GET /metrics (or /) gets the text format.
+  The reply is rendered first and sent with MSG_NOSIGNAL, so a scraper
+  that hangs up costs a failed send, not a SIGPIPE.
+*/
+static void serve_http(int fd)
+{
+	char request[1024];
+	struct timeval tv = { METRICS_HTTP_TIMEOUT_S, 0 };
+	char *reply = NULL;
+	size_t reply_len = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#if defined(SO_NOSIGPIPE)
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+	request[len > 0 ? len : 0] = '\0';
+
+	FILE *out = open_memstream(&reply, &reply_len);
+	if (!out) {
+		close(fd);
+		return;
+	}
+	if (!strncmp(request, "GET /metrics", 12) || !strncmp(request, "GET / ", 6)) {
+		if (exporter.sample) exporter.sample(exporter.user);
+		fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		metrics_write_prometheus(out);
+	}
+	else {
+		fprintf(out, "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+	}
+	if (fclose(out) == 0) send_all(fd, reply, reply_len);
+	free(reply);
+	close(fd);
+}
+
+static int listen_http(const char *host, int port)
+{
+	struct sockaddr_in addr;
+	int on = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void http_main(void)
+{
+	while (!export_stopping.load()) {
+		struct pollfd pfd = { listen_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, METRICS_POLL_MS) > 0 && (pfd.revents & POLLIN)) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if (fd >= 0) serve_http(fd);
+		}
+	}
+}
+#endif
+
+static void export_main(void)
+{
+	uint64_t interval_ns = (uint64_t)exporter.interval_ms * 1000000;
+	uint64_t next = metrics_now_ns() + interval_ns;
+
+	while (!export_stopping.load()) {
+		uint64_t now = metrics_now_ns();
+		if (now >= next) {
+			export_once();
+			next = std::max(next + interval_ns, now);
+			continue;
+		}
+
+		int wait_ms = (int)std::min<uint64_t>((next - now) / 1000000 + 1, METRICS_POLL_MS);
+		std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+	}
+}
+
+void metrics_export_init(struct metrics_export *ex, const char *target, int interval_s)
+{
+	memset(ex, 0, sizeof(*ex));
+	ex->interval_ms = interval_s * 1000;
+	ex->http_port = -1;
+	strcpy(ex->http_host, METRICS_DEFAULT_HOST);
+	if (!target) return;
+
+	const char *port = strrchr(target, ':');
+	if (port) port++;
+	else port = target;
+	if (!port[0] || strspn(port, "0123456789") != strlen(port)) {
+		ex->text_path = target;
+		return;
+	}
+	if (port != target) {
+		size_t host_len = (size_t)(port - 1 - target);
+		if (!host_len || host_len >= sizeof(ex->http_host)) {
+			ex->text_path = target;
+			return;
+		}
+		memcpy(ex->http_host, target, host_len);
+		ex->http_host[host_len] = '\0';
+	}
+	ex->http_port = atoi(port);
+}
+
+int metrics_start(const struct metrics_export *ex)
+{
+	if (export_thread) return MOSQ_ERR_INVAL;
+
+	exporter = *ex;
+	if (exporter.interval_ms <= 0) exporter.interval_ms = METRICS_DEFAULT_INTERVAL_MS;
+
+	if (exporter.http_port >= 0) {
+#if !defined(_WINDOWS)
+		listen_fd = listen_http(exporter.http_host, exporter.http_port);
+		if (listen_fd < 0) return MOSQ_ERR_ERRNO;
+#else
+		return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+	}
+
+	export_stopping.store(false);
+	export_thread = new std::thread(export_main);
+#if !defined(_WINDOWS)
+	if (listen_fd >= 0) http_thread = new std::thread(http_main);
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+void metrics_stop(void)
+{
+	if (!export_thread) return;
+
+	export_stopping.store(true);
+	export_thread->join();
+	delete export_thread;
+	export_thread = NULL;
+	if (http_thread) {
+		http_thread->join();
+		delete http_thread;
+		http_thread = NULL;
+	}
+	export_once();
+
+#if !defined(_WINDOWS)
+	if (listen_fd >= 0) close(listen_fd);
+#endif
+	listen_fd = -1;
+}
@@ -0,0 +1,185 @@
+#pragma once
+/*
+  msg_metrics
+  Process-wide counters, gauges and histograms (-M, -S).
+
+  Every recording thread owns a shard of counter and histogram cells that
+  only it writes, so a count is a relaxed load and store on a cache line no
+  other thread touches: no lock prefix, no bouncing. Exporters add the
+  shards up; a sum read mid-update is at most that update behind. Threads
+  beyond PER_THREAD_MAX (msg_per_thread.h) share one overflow shard with atomic adds.
+  Gauges are set rather than added and live in one shared atomic each.
+
+  Histograms are log-linear: 8 linear buckets per power of two, so a value
+  is off by at most 12.5% of itself (exact below 8).
+
+  Nothing is recorded until metrics_init(); after that a count costs a
+  branch, a thread local load and two plain memory operations.
+
+  Export, from a background thread (metrics_start):
+      text file   Prometheus text format, written to a temporary and
+                  renamed so a scraper (node exporter textfile collector)
+                  never sees half a file
+      endpoint    the same text for GET on a TCP port (not on Windows),
+                  served from a thread of its own so a slow scraper
+                  delays only itself; bound to 127.0.0.1 unless the
+                  target names another address
+      snapshot    a FlexBuffer map handed to a callback; the clients
+                  publish it on their stats topic
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <flatbuffers/flexbuffers.h>
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+#define METRICS_ERROR_CODES 32 /* MOSQ_ERR_* 0..30, the last cell counts any other code */
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_BUCKETS 320 /* values up to 2^42 */
+#define METRICS_DEFAULT_INTERVAL_MS 10000
+#define METRICS_DEFAULT_HOST "127.0.0.1"
+#define METRICS_HOST_MAX 64
+
+enum metric_counter {
+	METRIC_MSGS_IN,
+	METRIC_BYTES_IN,
+	METRIC_MSGS_OUT,
+	METRIC_BYTES_OUT,
+	METRIC_RECONNECTS,
+	METRIC_DECODE_ERRORS,
+	METRIC_CLAIM_FALLBACKS, /* claim arena full, published inline or chunked */
+	METRIC_COUNTER_COUNT
+};
+
+enum metric_gauge {
+	METRIC_CONNECTED,
+	METRIC_SEND_QUEUE, /* publishes handed to libmosquitto and not yet written (QoS 0) or acknowledged */
+	METRIC_RECV_QUEUE, /* messages waiting in the receive lanes */
+	METRIC_GAUGE_COUNT
+};
+
+enum metric_hist {
+	METRIC_DECODE_NS,
+	METRIC_PAYLOAD_BYTES, /* received */
+	METRIC_HIST_COUNT
+};
+
+struct metrics_shard {
+	std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+	std::atomic<uint64_t> errors[METRICS_ERROR_CODES];
+	std::atomic<uint64_t> hist_sum[METRIC_HIST_COUNT];
+	std::atomic<uint64_t> hist[METRIC_HIST_COUNT][METRICS_HIST_BUCKETS];
+	bool shared; /* the overflow shard, written by several threads */
+};
+
+struct metrics_export {
+	int interval_ms;
+	const char *text_path; /* NULL: no text file */
+	int http_port; /* -1: no endpoint */
+	char http_host[METRICS_HOST_MAX]; /* IPv4 address the endpoint binds */
+	/* called before each export, e.g. to set gauges read from elsewhere */
+	void (*sample)(void *user);
+	/* called with each FlexBuffer snapshot; NULL: none */
+	void (*snapshot)(const uint8_t *data, size_t len, void *user);
+	void *user;
+};
+
+extern bool metrics_enabled;
+extern thread_local struct metrics_shard *metrics_thread_shard;
+
+struct metrics_shard *metrics_register_thread(void);
+uint64_t metrics_now_ns(void); /* monotonic, for the durations recorded below */
+
+static inline struct metrics_shard *metrics_shard(void)
+{
+	return metrics_thread_shard ? metrics_thread_shard : metrics_register_thread();
+}
+
+static inline void metrics_add(struct metrics_shard *shard, std::atomic<uint64_t> *cell, uint64_t n)
+{
+	if (shard->shared) cell->fetch_add(n, std::memory_order_relaxed);
+	else cell->store(cell->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline int metrics_bucket(uint64_t v)
+{
+	if (v < METRICS_HIST_SUB) return (int)v;
+#if defined(_MSC_VER)
+	unsigned long e;
+	_BitScanReverse64(&e, v);
+#else
+	int e = 63 - __builtin_clzll(v);
+#endif
+	int bucket = ((int)e - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB
+		+ (int)((v >> (e - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB - 1));
+	return bucket < METRICS_HIST_BUCKETS ? bucket : METRICS_HIST_BUCKETS - 1;
+}
+
+static inline void metrics_count(enum metric_counter counter, uint64_t n)
+{
+	if (!metrics_enabled) return;
+
+	struct metrics_shard *shard = metrics_shard();
+	metrics_add(shard, &shard->counters[counter], n);
+}
+
+/* one message and its payload bytes */
+static inline void metrics_message(enum metric_counter msgs, enum metric_counter bytes, uint64_t len)
+{
+	if (!metrics_enabled) return;
+
+	struct metrics_shard *shard = metrics_shard();
+	metrics_add(shard, &shard->counters[msgs], 1);
+	metrics_add(shard, &shard->counters[bytes], len);
+}
+
+/* a failed mosquitto_publish*(), by return code */
+static inline void metrics_publish_error(int rc)
+{
+	if (!metrics_enabled) return;
+
+	struct metrics_shard *shard = metrics_shard();
+	metrics_add(shard, &shard->errors[rc >= 0 && rc < METRICS_ERROR_CODES ? rc : METRICS_ERROR_CODES - 1], 1);
+}
+
+static inline void metrics_record(enum metric_hist hist, uint64_t value)
+{
+	if (!metrics_enabled) return;
+
+	struct metrics_shard *shard = metrics_shard();
+	metrics_add(shard, &shard->hist[hist][metrics_bucket(value)], 1);
+	metrics_add(shard, &shard->hist_sum[hist], value);
+}
+
+void metrics_gauge_set(enum metric_gauge gauge, int64_t value);
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta);
+
+/*
+  -M target: a port number selects the endpoint on 127.0.0.1, host:port
+  (e.g. 0.0.0.0:9100) the endpoint on that address, anything else the
+  text file.
+*/
+void metrics_export_init(struct metrics_export *ex, const char *target, int interval_s);
+
+/* Start recording. process names the exporter in every export. */
+void metrics_init(const char *process);
+
+/* Export every interval from a background thread until metrics_stop(). */
+int metrics_start(const struct metrics_export *ex);
+
+/* Stop the thread and export a last time. */
+void metrics_stop(void);
+
+/* The sums over all shards, in Prometheus text format. */
+void metrics_write_prometheus(FILE *out);
+
+/* Write the text format to path.tmp, then rename it to path. */
+int metrics_write_file(const char *path);
+
+/* The sums over all shards as a FlexBuffer map (Finish()ed). */
+void metrics_encode_flex(flexbuffers::Builder &fbb);
@@ -0,0 +1,166 @@
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+#include <mosquitto.h>
+#include "msg_pacer.h"
+
+static uint64_t pacer_now_ns(void)
+{
+#ifdef _WINDOWS
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000000 + count.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+#ifdef _WINDOWS
+	uint64_t now = pacer_now_ns();
+	if (deadline_ns > now + 1000000) Sleep((DWORD)((deadline_ns - now) / 1000000));
+#else
+	struct timespec ts;
+	ts.tv_sec = (time_t)(deadline_ns / 1000000000);
+	ts.tv_nsec = (long)(deadline_ns % 1000000000);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#endif
+}
+
+static void record(struct pacer *pacer, uint64_t now)
+{
+	struct pacer_stats *stats = &pacer->stats;
+
+	stats->ticks++;
+	if (!pacer->last_ns) {
+		pacer->last_ns = now;
+		return;
+	}
+
+	int64_t jitter = (int64_t)(now - pacer->last_ns) - (int64_t)pacer->period_ns;
+	pacer->last_ns = now;
+
+	if (stats->ticks == 2 || jitter < stats->min_jitter_ns) stats->min_jitter_ns = jitter;
+	if (stats->ticks == 2 || jitter > stats->max_jitter_ns) stats->max_jitter_ns = jitter;
+	stats->total_abs_jitter_ns += (uint64_t)(jitter < 0 ? -jitter : jitter);
+
+	/* floor division so -0.5 us lands in the bucket below zero */
+	int64_t us = jitter >= 0 ? jitter / 1000 : -((-jitter + 999) / 1000);
+	if (us < -PACER_HIST_SPAN_US) stats->below++;
+	else if (us >= PACER_HIST_SPAN_US) stats->above++;
+	else stats->hist[us + PACER_HIST_SPAN_US]++;
+}
+
+void pacer_init(struct pacer *pacer, uint64_t period_ns, uint64_t spin_ns)
+{
+	pacer->period_ns = period_ns ? period_ns : 1;
+	pacer->spin_ns = spin_ns;
+	pacer->next_ns = pacer_now_ns() + pacer->period_ns;
+	pacer->last_ns = 0;
+	memset(&pacer->stats, 0, sizeof(pacer->stats));
+}
+
+uint64_t pacer_wait(struct pacer *pacer)
+{
+	uint64_t deadline = pacer->next_ns;
+	uint64_t now = pacer_now_ns();
+
+	if (now < deadline) {
+		if (deadline - now > pacer->spin_ns) sleep_until(deadline - pacer->spin_ns);
+		while ((now = pacer_now_ns()) < deadline);
+	}
+
+	/* stay on the original grid; periods already gone are dropped, not bunched up */
+	pacer->next_ns = deadline + pacer->period_ns;
+	while (pacer->next_ns <= now) {
+		pacer->next_ns += pacer->period_ns;
+		pacer->stats.missed++;
+	}
+
+	record(pacer, now);
+	return now;
+}
+
+int pacer_pin_cpu(int cpu)
+{
+#if defined(_WINDOWS)
+	if (cpu < 0 || cpu >= 64) return MOSQ_ERR_INVAL;
+	if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu)) return MOSQ_ERR_ERRNO;
+	return MOSQ_ERR_SUCCESS;
+#elif defined(__linux__)
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) return MOSQ_ERR_INVAL;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) return MOSQ_ERR_ERRNO;
+	return MOSQ_ERR_SUCCESS;
+#else
+	(void)cpu;
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void pacer_get_stats(const struct pacer *pacer, struct pacer_stats *stats)
+{
+	*stats = pacer->stats;
+}
+
+/* smallest bound that |jitter| stays within for fraction q of the intervals */
+static int64_t jitter_bound_us(const struct pacer_stats *stats, double q)
+{
+	uint64_t intervals = stats->ticks > 1 ? stats->ticks - 1 : 0;
+	uint64_t target = (uint64_t)(intervals * q);
+	uint64_t seen = 0;
+
+	for (int d = 0; d < PACER_HIST_SPAN_US; d++) {
+		seen += stats->hist[PACER_HIST_SPAN_US + d];
+		if (d) seen += stats->hist[PACER_HIST_SPAN_US - d];
+		if (seen > target) return d + 1;
+	}
+	return -1;
+}
+
+static void print_bound(FILE *out, const char *name, int64_t bound)
+{
+	if (bound < 0) fprintf(out, " %s > %d us", name, PACER_HIST_SPAN_US);
+	else fprintf(out, " %s <= %lld us", name, (long long)bound);
+}
+
+void pacer_print_stats(const struct pacer *pacer, FILE *out)
+{
+	const struct pacer_stats *stats = &pacer->stats;
+	uint64_t intervals = stats->ticks > 1 ? stats->ticks - 1 : 0;
+
+	fprintf(out, "pacer period %llu ns spin %llu ns ticks %llu missed %llu",
+		(unsigned long long)pacer->period_ns, (unsigned long long)pacer->spin_ns,
+		(unsigned long long)stats->ticks, (unsigned long long)stats->missed);
+	if (!intervals) {
+		fprintf(out, "\n");
+		return;
+	}
+	fprintf(out, "\njitter min %lld ns max %lld ns mean |jitter| %llu ns",
+		(long long)stats->min_jitter_ns, (long long)stats->max_jitter_ns,
+		(unsigned long long)(stats->total_abs_jitter_ns / intervals));
+	print_bound(out, "p50", jitter_bound_us(stats, 0.5));
+	print_bound(out, "p99", jitter_bound_us(stats, 0.99));
+	print_bound(out, "p99.9", jitter_bound_us(stats, 0.999));
+	fprintf(out, "\n");
+
+	if (stats->below) fprintf(out, "  < %5d us %llu\n", -PACER_HIST_SPAN_US, (unsigned long long)stats->below);
+	for (int i = 0; i < PACER_HIST_BUCKETS; i++) {
+		if (!stats->hist[i]) continue;
+		fprintf(out, "  %+5d us %llu\n", i - PACER_HIST_SPAN_US, (unsigned long long)stats->hist[i]);
+	}
+	if (stats->above) fprintf(out, " >= %5d us %llu\n", PACER_HIST_SPAN_US, (unsigned long long)stats->above);
+}
@@ -0,0 +1,57 @@
+#pragma once
+/*
+  msg_pacer
+  Fixed-rate pacing for publish loops.
+
+  Deadlines are absolute: deadline n is start + n * period, so a late
+  wake-up does not push every later publish back and the rate does not
+  drift. The pacer sleeps with clock_nanosleep(TIMER_ABSTIME) until
+  `spin` before the deadline, then busy-waits the rest, trading one core
+  for wake-up jitter well below the scheduler's. If a deadline was missed
+  by more than a period, the missed periods are skipped and counted
+  rather than published in a burst.
+
+  Every wake-up records the interval since the previous one. Deviations
+  from the period go into a histogram of 1 us buckets (+-PACER_HIST_SPAN_US),
+  with exact min/max, so jitter bounds can be checked after a run.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PACER_HIST_SPAN_US 128
+#define PACER_HIST_BUCKETS (2 * PACER_HIST_SPAN_US) /* bucket i: jitter in [i - span, i - span + 1) us */
+
+struct pacer_stats {
+	uint64_t ticks;
+	uint64_t missed; /* periods skipped because the caller was late */
+	int64_t min_jitter_ns;
+	int64_t max_jitter_ns;
+	uint64_t total_abs_jitter_ns;
+	uint64_t below; /* jitter < -span */
+	uint64_t above; /* jitter >= span */
+	uint64_t hist[PACER_HIST_BUCKETS];
+};
+
+struct pacer {
+	uint64_t period_ns;
+	uint64_t spin_ns;
+	uint64_t next_ns; /* next deadline */
+	uint64_t last_ns; /* previous wake-up, 0 before the first */
+	struct pacer_stats stats;
+};
+
+/* spin_ns: busy-wait this long before each deadline (0: sleep only). */
+void pacer_init(struct pacer *pacer, uint64_t period_ns, uint64_t spin_ns);
+
+/* Wait for the next deadline. Returns the wake-up time (monotonic ns). */
+uint64_t pacer_wait(struct pacer *pacer);
+
+/* Pin the calling thread to one CPU. MOSQ_ERR_NOT_SUPPORTED where unavailable. */
+int pacer_pin_cpu(int cpu);
+
+void pacer_get_stats(const struct pacer *pacer, struct pacer_stats *stats);
+
+/* Summary plus the non-empty histogram buckets. */
+void pacer_print_stats(const struct pacer *pacer, FILE *out);
@@ -0,0 +1,115 @@
+#pragma once
+/*
+  msg_per_thread
+  Per-thread recording state of the diagnostics modules (msg_alloc,
+  msg_flight, msg_metrics, msg_stage, msg_tracepoint).
+
+  per_thread_registry: the first PER_THREAD_MAX threads that register get
+  a slot of their own; later ones are turned away and fall back on what
+  the module does for them (a shared overflow shard, or not recording).
+  What a thread registers is never freed, so collectors and crash dumps
+  still see what it did last after it exits. Registering and reading are
+  lock-free and async signal safe, and a static registry is zero
+  initialised before any constructor runs.
+
+  spsc_ring: N records (a power of two) written by their thread at head
+  and drained by one collector at tail, on separate cache lines. A full
+  ring drops the new record and counts it.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+
+#define PER_THREAD_MAX 64
+
+template <typename T>
+struct per_thread_registry {
+	std::atomic<int> count;
+	std::atomic<T *> items[PER_THREAD_MAX];
+};
+
+/*
+  Register the calling thread: make(index) returns its T, published to
+  readers once it is filled in. NULL (make not called) when all slots are
+  taken.
+*/
+template <typename T, typename F>
+T *per_thread_register(struct per_thread_registry<T> *reg, F make)
+{
+	int index = reg->count.fetch_add(1);
+	if (index >= PER_THREAD_MAX) {
+		reg->count.fetch_sub(1);
+		return NULL;
+	}
+
+	T *item = make(index);
+	reg->items[index].store(item, std::memory_order_release);
+	return item;
+}
+
+/* Slots to look at with per_thread_at(); one may still be NULL while its thread registers. */
+template <typename T>
+int per_thread_count(const struct per_thread_registry<T> *reg)
+{
+	return std::min(reg->count.load(std::memory_order_acquire), PER_THREAD_MAX);
+}
+
+template <typename T>
+T *per_thread_at(const struct per_thread_registry<T> *reg, int index)
+{
+	return reg->items[index].load(std::memory_order_acquire);
+}
+
+template <typename T, size_t N>
+struct spsc_ring {
+	std::atomic<uint64_t> head;
+	char pad_head[56];
+	std::atomic<uint64_t> tail;
+	char pad_tail[56];
+	std::atomic<uint64_t> dropped;
+	T recs[N];
+};
+
+template <typename T, size_t N>
+void spsc_reset(struct spsc_ring<T, N> *ring)
+{
+	static_assert((N & (N - 1)) == 0, "spsc_ring: N must be a power of two");
+
+	ring->head.store(0);
+	ring->tail.store(0);
+	ring->dropped.store(0);
+}
+
+/* Writer: slot for the next record, or NULL if the ring is full. spsc_commit() hands it over. */
+template <typename T, size_t N>
+T *spsc_claim(struct spsc_ring<T, N> *ring)
+{
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= N) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
+	}
+	return &ring->recs[head & (N - 1)];
+}
+
+template <typename T, size_t N>
+void spsc_commit(struct spsc_ring<T, N> *ring)
+{
+	ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/* Collector: f(rec) for every record committed since the last drain; returns the records dropped meanwhile. */
+template <typename T, size_t N, typename F>
+uint64_t spsc_drain(struct spsc_ring<T, N> *ring, F f)
+{
+	uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+	uint64_t head = ring->head.load(std::memory_order_acquire);
+
+	for (; tail != head; tail++) {
+		f(ring->recs[tail & (N - 1)]);
+	}
+	ring->tail.store(tail, std::memory_order_release);
+	return ring->dropped.exchange(0, std::memory_order_relaxed);
+}
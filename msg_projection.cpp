@@ -0,0 +1,115 @@
+#include <string.h>
+#include "msg_projection.h"
+#include "msg_samples.h"
+
+void projection_init(struct msg_projection *proj)
+{
+	proj->key_count = 0;
+}
+
+int projection_add(struct msg_projection *proj, const char *key)
+{
+	if (proj->key_count >= PROJECTION_MAX_FIELDS) {
+		fprintf(stderr, "Error: Too many projected fields (max %d).\n", PROJECTION_MAX_FIELDS);
+		return 1;
+	}
+	if (strlen(key) >= PROJECTION_MAX_KEY) {
+		fprintf(stderr, "Error: Projected field '%s' is too long.\n", key);
+		return 1;
+	}
+	proj->keys[proj->key_count++] = key;
+
+	return 0;
+}
+
+flexbuffers::Reference projection_lookup(const flexbuffers::Map &map, const char *key)
+{
+	const char *dot = strchr(key, '.');
+	if (!dot) {
+		/* binary search over the sorted key vector */
+		return map[key];
+	}
+
+	char segment[PROJECTION_MAX_KEY];
+	size_t len = (size_t)(dot - key);
+	if (len >= sizeof(segment)) return flexbuffers::Reference();
+
+	memcpy(segment, key, len);
+	segment[len] = '\0';
+
+	auto child = map[segment];
+	if (!child.IsMap()) return flexbuffers::Reference();
+
+	return projection_lookup(child.AsMap(), dot + 1);
+}
+
+int projection_decode(const struct msg_projection *proj, const uint8_t *data, size_t size, flexbuffers::Reference *fields)
+{
+	auto root = flexbuffers::GetRoot(data, size);
+	if (!root.IsMap()) return -1;
+
+	auto map = root.AsMap();
+	int found = 0;
+
+	for (int i = 0; i < proj->key_count; i++) {
+		fields[i] = projection_lookup(map, proj->keys[i]);
+		if (!fields[i].IsNull()) found++;
+	}
+
+	return found;
+}
+
+void projection_print(FILE *stream, const flexbuffers::Reference &val)
+{
+	if (val.IsNull()) {
+		fprintf(stream, "null");
+	}
+	else if (val.IsBool()) {
+		fprintf(stream, "%s", val.AsBool() ? "true" : "false");
+	}
+	else if (val.IsUInt()) {
+		fprintf(stream, "%llu", (unsigned long long)val.AsUInt64());
+	}
+	else if (val.IsInt()) {
+		fprintf(stream, "%lld", (long long)val.AsInt64());
+	}
+	else if (val.IsFloat()) {
+		fprintf(stream, "%.6f", val.AsDouble());
+	}
+	else if (val.IsString()) {
+		auto s = val.AsString();
+		fprintf(stream, "%.*s", (int)s.length(), s.c_str());
+	}
+	else if (val.IsKey()) {
+		fprintf(stream, "%s", val.AsKey());
+	}
+	else if (val.IsMap()) {
+		fprintf(stream, "{map, %zu keys}", val.AsMap().size());
+	}
+	else if (val.IsBlob()) {
+		fprintf(stream, "<blob, %zu bytes>", val.AsBlob().size());
+	}
+	else if (val.IsVector()) {
+		fprintf(stream, "[vector, %zu elements]", val.AsVector().size());
+	}
+	else if (val.IsTypedVector() || val.IsFixedTypedVector()) {
+		sample_view<float> samples;
+		struct sample_stats stats;
+
+		if (samples_view(val, &samples)) {
+			/* reduced in place, no per-element Reference */
+			samples_stats(samples.data, samples.size, &stats);
+			fprintf(stream, "[%zu floats, min %g, max %g, mean %g, rms %g]", samples.size,
+				stats.min, stats.max, samples.size ? stats.sum / samples.size : 0.0, stats.rms);
+		}
+		else if (val.IsTypedVector()) {
+			fprintf(stream, "[typed vector, %zu elements]", val.AsTypedVector().size());
+		}
+		else {
+			fprintf(stream, "[fixed vector, %d elements]", (int)val.AsFixedTypedVector().size());
+		}
+	}
+	else {
+		fprintf(stream, "<type %d>", (int)val.GetType());
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+/*
+  msg_projection
+  Field projections for FlexBuffer map payloads.
+
+  A handler lists the keys it needs ("time", "sensor.temp", ...) once, and
+  projection_decode() looks up only those keys in the received map. Keys are
+  compared in place inside the buffer, no std::string is built, and nested
+  maps/vectors stay unparsed flexbuffers::Reference values until accessed.
+  A dotted key descends one map level per segment.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <flatbuffers/flexbuffers.h>
+
+#define PROJECTION_MAX_FIELDS 16
+#define PROJECTION_MAX_KEY 64
+
+struct msg_projection {
+	const char *keys[PROJECTION_MAX_FIELDS];
+	int key_count;
+};
+
+void projection_init(struct msg_projection *proj);
+int projection_add(struct msg_projection *proj, const char *key);
+
+/*
+  Resolve every projected key of a FlexBuffer map payload.
+  fields[i] receives the value for proj->keys[i], or a null Reference when the
+  key is absent. Returns the number of keys found, or -1 if the root is not a map.
+*/
+int projection_decode(const struct msg_projection *proj, const uint8_t *data, size_t size, flexbuffers::Reference *fields);
+
+/* Look up a (possibly dotted) key inside a map without materialising strings. */
+flexbuffers::Reference projection_lookup(const flexbuffers::Map &map, const char *key);
+
+/* Print a value without ToString(); containers print their size only. */
+void projection_print(FILE *stream, const flexbuffers::Reference &val);
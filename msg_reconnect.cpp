@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+# include <process.h>
+#define getpid _getpid
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+#include "msg_reconnect.h"
+#include "msg_metrics.h"
+
+static uint64_t reconnect_now_ms(void)
+{
+#ifdef _WINDOWS
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void reconnect_sleep_ms(uint32_t ms)
+{
+#ifdef _WINDOWS
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static uint64_t reconnect_random(struct reconnect_state *state)
+{
+	/* xorshift64* */
+	state->rng ^= state->rng >> 12;
+	state->rng ^= state->rng << 25;
+	state->rng ^= state->rng >> 27;
+	return state->rng * 2685821657736338717ull;
+}
+
+void reconnect_init(struct reconnect_state *state, uint32_t base_ms, uint32_t cap_ms, uint64_t seed)
+{
+	memset(state, 0, sizeof(*state));
+	state->base_ms = base_ms ? base_ms : RECONNECT_DEFAULT_BASE_MS;
+	state->cap_ms = cap_ms ? cap_ms : RECONNECT_DEFAULT_CAP_MS;
+	if (state->cap_ms < state->base_ms) state->cap_ms = state->base_ms;
+	state->delay_ms = state->base_ms;
+
+	if (!seed) {
+		/* devices started from the same image must not share a sequence */
+		seed = reconnect_now_ms() * 0x9E3779B97F4A7C15ull ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)state;
+	}
+	state->rng = seed ? seed : 1;
+}
+
+uint32_t reconnect_next_delay(struct reconnect_state *state)
+{
+	uint64_t upper = (uint64_t)state->delay_ms * 3;
+	if (upper <= state->base_ms) upper = state->base_ms + 1;
+
+	uint64_t delay = state->base_ms + reconnect_random(state) % (upper - state->base_ms);
+	if (delay > state->cap_ms) delay = state->cap_ms;
+
+	state->delay_ms = (uint32_t)delay;
+	return state->delay_ms;
+}
+
+void reconnect_lost(struct reconnect_state *state)
+{
+	if (!state->connected) return;
+
+	state->connected = false;
+	state->lost_at_ms = reconnect_now_ms();
+	state->stats.outages++;
+}
+
+bool reconnect_connected(struct reconnect_state *state, int result, int flags)
+{
+	if (result != 0) {
+		state->stats.failed_attempts++;
+		return false;
+	}
+
+	if (state->ever_connected && !state->connected) {
+		uint64_t ms = reconnect_now_ms() - state->lost_at_ms;
+		int bucket = 0;
+		while (bucket < RECONNECT_HIST_BUCKETS - 1 && ms >= (1ull << bucket)) bucket++;
+
+		state->stats.recovered++;
+		state->stats.last_recover_ms = ms;
+		state->stats.total_recover_ms += ms;
+		if (ms > state->stats.max_recover_ms) state->stats.max_recover_ms = ms;
+		state->stats.recover_hist[bucket]++;
+		metrics_count(METRIC_RECONNECTS, 1);
+	}
+
+	/* bit 0 of the CONNACK flags: session present */
+	bool resubscribe = !(flags & 1);
+	if (resubscribe && state->ever_connected) state->stats.sessions_lost++;
+
+	state->connected = true;
+	state->ever_connected = true;
+	state->delay_ms = state->base_ms;
+	return resubscribe;
+}
+
+bool reconnect_wait(struct reconnect_state *state, volatile bool *run)
+{
+	reconnect_lost(state);
+
+	/* sleep in small steps so a signal can stop us */
+	uint64_t until = reconnect_now_ms() + reconnect_next_delay(state);
+	for (uint64_t now = reconnect_now_ms(); *run && now < until; now = reconnect_now_ms()) {
+		reconnect_sleep_ms(until - now < 100 ? (uint32_t)(until - now) : 100);
+	}
+	if (!*run) return false;
+
+	state->stats.attempts++;
+	return true;
+}
+
+int reconnect_run(struct reconnect_state *state, struct mosquitto *mosq, volatile bool *run)
+{
+	int rc = MOSQ_ERR_NO_CONN;
+
+	while (reconnect_wait(state, run)) {
+		rc = mosquitto_reconnect(mosq);
+		if (rc == MOSQ_ERR_SUCCESS) break;
+		state->stats.failed_attempts++;
+	}
+	return rc;
+}
+
+void reconnect_get_stats(const struct reconnect_state *state, struct reconnect_stats *stats)
+{
+	*stats = state->stats;
+}
+
+void reconnect_print_stats(const struct reconnect_state *state, FILE *out)
+{
+	const struct reconnect_stats *stats = &state->stats;
+
+	fprintf(out, "reconnect: %llu outages, %llu recovered, %llu attempts (%llu failed), %llu sessions lost\n",
+		(unsigned long long)stats->outages, (unsigned long long)stats->recovered,
+		(unsigned long long)stats->attempts, (unsigned long long)stats->failed_attempts,
+		(unsigned long long)stats->sessions_lost);
+	if (stats->recovered) {
+		fprintf(out, "time to recover: last %llu ms, mean %llu ms, max %llu ms\n",
+			(unsigned long long)stats->last_recover_ms,
+			(unsigned long long)(stats->total_recover_ms / stats->recovered),
+			(unsigned long long)stats->max_recover_ms);
+	}
+}
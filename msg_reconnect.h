@@ -0,0 +1,78 @@
+#pragma once
+/*
+  msg_reconnect
+  Reconnect engine for clients that lose the broker.
+
+  Delays follow "decorrelated jitter" exponential backoff:
+      delay = min(cap, random(base, previous * 3))
+  so thousands of devices that lost the same broker spread their attempts
+  out instead of hitting it in lock step when it comes back.
+
+  Clients keep a persistent session (fixed client id, clean_session=false).
+  reconnect_connected() is called with the CONNACK flags and tells whether
+  the broker still had the session; only then can subscriptions be skipped.
+
+  Time to recover (connection lost -> CONNACK) is recorded per outage.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <mosquitto.h>
+
+#define RECONNECT_DEFAULT_BASE_MS 100
+#define RECONNECT_DEFAULT_CAP_MS 30000
+#define RECONNECT_HIST_BUCKETS 24 /* powers of two, 1 ms .. ~2.3 h */
+
+struct reconnect_stats {
+	uint64_t outages;
+	uint64_t recovered;
+	uint64_t attempts;
+	uint64_t failed_attempts;
+	uint64_t sessions_lost; /* reconnected without a session, resubscribed */
+	uint64_t last_recover_ms;
+	uint64_t max_recover_ms;
+	uint64_t total_recover_ms;
+	uint64_t recover_hist[RECONNECT_HIST_BUCKETS]; /* bucket i: < 2^i ms */
+};
+
+struct reconnect_state {
+	uint32_t base_ms;
+	uint32_t cap_ms;
+	uint32_t delay_ms; /* previous delay */
+	uint64_t rng;
+	bool connected;
+	bool ever_connected;
+	uint64_t lost_at_ms;
+	struct reconnect_stats stats;
+};
+
+/* seed 0 picks one from the clock and pid */
+void reconnect_init(struct reconnect_state *state, uint32_t base_ms, uint32_t cap_ms, uint64_t seed);
+
+/* Next backoff delay; grows until a connection succeeds. */
+uint32_t reconnect_next_delay(struct reconnect_state *state);
+
+/* The connection dropped (loop error or disconnect callback). */
+void reconnect_lost(struct reconnect_state *state);
+
+/*
+  CONNACK received. flags is the connect flags of the callback. Returns
+  true when subscriptions have to be (re)made.
+*/
+bool reconnect_connected(struct reconnect_state *state, int result, int flags);
+
+/*
+  Mark the connection lost and sleep the next backoff delay. Returns false
+  if *run turned false meanwhile; otherwise the caller makes one attempt.
+*/
+bool reconnect_wait(struct reconnect_state *state, volatile bool *run);
+
+/*
+  Back off and call mosquitto_reconnect() until it succeeds or *run turns
+  false. For clients driving mosquitto_loop() themselves.
+*/
+int reconnect_run(struct reconnect_state *state, struct mosquitto *mosq, volatile bool *run);
+
+void reconnect_get_stats(const struct reconnect_state *state, struct reconnect_stats *stats);
+void reconnect_print_stats(const struct reconnect_state *state, FILE *out);
@@ -0,0 +1,311 @@
+/*
+  msg_reconnect_bench
+  Reconnect storm against a local broker: N clients with persistent sessions
+  connect, the broker is restarted, and every client reconnects with the
+  chosen strategy:
+    jitter    : msg_reconnect decorrelated-jitter backoff
+    fixed     : 1 s between attempts (the old mosquitto_recv loop)
+    immediate : retry at once (the old mosquittopp loop)
+  Reports time to recover per client (p50/p99/max), connection attempts and
+  the peak attempt rate the broker had to absorb.
+
+  The clients share one thread and a poll() loop, so N can exceed
+  FD_SETSIZE; raise the broker's max_connections and `ulimit -n` to match.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -Imosquitto-2.0.8/includes -o msg_reconnect_bench msg_reconnect_bench.cpp msg_reconnect.cpp msg_metrics.cpp -lmosquitto -lpthread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#include <mosquitto.h>
+#include "msg_reconnect.h"
+
+#define DEFAULT_MQTT_HOST "127.0.0.1"
+#define DEFAULT_MQTT_PORT 1883
+#define DEFAULT_MQTT_KEEPALIVE 60
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_TIMEOUT 120
+#define BENCH_TOPIC "bench/storm/#"
+#define RATE_WINDOW_MS 100
+
+enum strategy {
+	STRATEGY_JITTER,
+	STRATEGY_FIXED,
+	STRATEGY_IMMEDIATE,
+};
+
+struct storm_client {
+	struct mosquitto *mosq;
+	struct reconnect_state backoff;
+	bool connected;
+	bool pending; /* connect sent, no CONNACK yet */
+	uint64_t next_attempt_ms;
+	uint64_t recover_ms;
+	bool recovered;
+};
+
+static enum strategy strategy = STRATEGY_JITTER;
+static uint64_t attempts = 0;
+static uint64_t sessions_lost = 0;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-n clients] [-s jitter|fixed|immediate] [-r restart_command] [-t timeout]\n"
+		" -r : command that restarts the broker (e.g. \"systemctl restart mosquitto\");\n"
+		"      without it, restart the broker by hand once all clients are connected\n", argv0);
+	exit(1);
+}
+
+#ifndef _WINDOWS
+
+static uint64_t bench_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t next_delay(struct storm_client *c)
+{
+	switch (strategy) {
+	case STRATEGY_JITTER:
+		return reconnect_next_delay(&c->backoff);
+	case STRATEGY_FIXED:
+		return 1000;
+	default:
+		return 0;
+	}
+}
+
+void connect_callback(struct mosquitto *mosq, void *obj, int result, int flags)
+{
+	struct storm_client *c = (struct storm_client *)obj;
+	bool outage = c->backoff.ever_connected;
+
+	c->pending = false;
+	if (result != 0) {
+		c->next_attempt_ms = bench_now_ms() + next_delay(c);
+		reconnect_connected(&c->backoff, result, flags);
+		return;
+	}
+
+	c->connected = true;
+	if (reconnect_connected(&c->backoff, result, flags)) {
+		mosquitto_subscribe(mosq, NULL, BENCH_TOPIC, 1);
+		if (outage) sessions_lost++;
+	}
+	if (outage) {
+		c->recover_ms = c->backoff.stats.last_recover_ms;
+		c->recovered = true;
+	}
+}
+
+static void connection_lost(struct storm_client *c, uint64_t now)
+{
+	if (!c->connected && !c->pending) return;
+
+	c->connected = false;
+	c->pending = false;
+	reconnect_lost(&c->backoff);
+	c->next_attempt_ms = now + next_delay(c);
+}
+
+/* one poll() round over every client; returns the number connected */
+static size_t pump(std::vector<struct storm_client> &clients, std::vector<struct pollfd> &fds, std::vector<size_t> &owner,
+	std::vector<uint32_t> &rate, uint64_t start)
+{
+	uint64_t now = bench_now_ms();
+
+	fds.clear();
+	owner.clear();
+	for (size_t i = 0; i < clients.size(); i++) {
+		struct storm_client *c = &clients[i];
+
+		if (!c->connected && !c->pending && now >= c->next_attempt_ms) {
+			size_t window = (size_t)((now - start) / RATE_WINDOW_MS);
+			if (window >= rate.size()) rate.resize(window + 1, 0);
+			rate[window]++;
+			attempts++;
+
+			if (mosquitto_reconnect_async(c->mosq) == MOSQ_ERR_SUCCESS) {
+				c->pending = true;
+			}
+			else {
+				c->next_attempt_ms = now + next_delay(c);
+			}
+		}
+
+		int sock = mosquitto_socket(c->mosq);
+		if (sock < 0) continue;
+
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (mosquitto_want_write(c->mosq)) pfd.events |= POLLOUT;
+		pfd.revents = 0;
+		fds.push_back(pfd);
+		owner.push_back(i);
+	}
+
+	poll(fds.data(), fds.size(), 10);
+
+	now = bench_now_ms();
+	size_t connected = 0;
+	for (size_t i = 0; i < fds.size(); i++) {
+		struct storm_client *c = &clients[owner[i]];
+		int rc = MOSQ_ERR_SUCCESS;
+
+		if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) rc = mosquitto_loop_read(c->mosq, 1);
+		if (rc == MOSQ_ERR_SUCCESS && (fds[i].revents & POLLOUT)) rc = mosquitto_loop_write(c->mosq, 1);
+		if (rc == MOSQ_ERR_SUCCESS) rc = mosquitto_loop_misc(c->mosq);
+		if (rc != MOSQ_ERR_SUCCESS) connection_lost(c, now);
+	}
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (clients[i].connected) connected++;
+	}
+	return connected;
+}
+
+int main(int argc, char *argv[])
+{
+	char *mqtt_host = strdup(DEFAULT_MQTT_HOST);
+	char *restart_cmd = NULL;
+	int mqtt_port = DEFAULT_MQTT_PORT;
+	int client_count = DEFAULT_CLIENTS;
+	int timeout = DEFAULT_TIMEOUT;
+
+	for (int i = 1; i < argc; i++) {
+		if (i == argc - 1) usage(argv[0]);
+
+		if (!strcmp(argv[i], "-h")) {
+			free(mqtt_host);
+			mqtt_host = strdup(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-p")) mqtt_port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-n")) client_count = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t")) timeout = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r")) restart_cmd = strdup(argv[++i]);
+		else if (!strcmp(argv[i], "-s")) {
+			i++;
+			if (!strcmp(argv[i], "jitter")) strategy = STRATEGY_JITTER;
+			else if (!strcmp(argv[i], "fixed")) strategy = STRATEGY_FIXED;
+			else if (!strcmp(argv[i], "immediate")) strategy = STRATEGY_IMMEDIATE;
+			else usage(argv[0]);
+		}
+		else usage(argv[0]);
+	}
+	if (client_count <= 0) usage(argv[0]);
+
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	mosquitto_lib_init();
+
+	std::vector<struct storm_client> clients(client_count);
+	for (int i = 0; i < client_count; i++) {
+		struct storm_client *c = &clients[i];
+		char id[64];
+
+		snprintf(id, sizeof(id), "storm-%d-%d", (int)getpid(), i);
+		memset(c, 0, sizeof(*c));
+		reconnect_init(&c->backoff, RECONNECT_DEFAULT_BASE_MS, RECONNECT_DEFAULT_CAP_MS, 0);
+		c->mosq = mosquitto_new(id, false, c);
+		if (!c->mosq) {
+			fprintf(stderr, "Could not create new mosquitto struct\n");
+			return 1;
+		}
+		mosquitto_connect_with_flags_callback_set(c->mosq, connect_callback);
+		if (mosquitto_connect_async(c->mosq, mqtt_host, mqtt_port, DEFAULT_MQTT_KEEPALIVE) == MOSQ_ERR_SUCCESS) {
+			c->pending = true;
+		}
+	}
+
+	std::vector<struct pollfd> fds;
+	std::vector<size_t> owner;
+	std::vector<uint32_t> rate;
+	uint64_t start = bench_now_ms();
+
+	/* everybody online first */
+	size_t connected = 0;
+	while (connected < clients.size()) {
+		connected = pump(clients, fds, owner, rate, start);
+		if (bench_now_ms() - start > (uint64_t)timeout * 1000) {
+			fprintf(stderr, "only %zu of %d clients connected, giving up\n", connected, client_count);
+			return 1;
+		}
+	}
+	printf("%d clients connected in %llu ms\n", client_count, (unsigned long long)(bench_now_ms() - start));
+
+	if (restart_cmd) {
+		printf("restarting broker: %s\n", restart_cmd);
+		if (system(restart_cmd) != 0) fprintf(stderr, "Warning: restart command failed\n");
+	}
+	else {
+		printf("restart the broker now...\n");
+	}
+
+	/* wait for the outage, then for everybody to be back */
+	attempts = 0;
+	rate.clear();
+	start = bench_now_ms();
+	bool outage = false;
+	while (bench_now_ms() - start < (uint64_t)timeout * 1000) {
+		connected = pump(clients, fds, owner, rate, start);
+		if (connected < clients.size()) outage = true;
+		if (outage && connected == clients.size()) break;
+	}
+
+	std::vector<uint64_t> ttr;
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (clients[i].recovered) ttr.push_back(clients[i].recover_ms);
+	}
+	std::sort(ttr.begin(), ttr.end());
+
+	uint32_t peak = 0;
+	for (size_t i = 0; i < rate.size(); i++) peak = std::max(peak, rate[i]);
+
+	static const char *names[] = { "jitter", "fixed", "immediate" };
+	printf("strategy %s: %zu/%d recovered, %llu attempts, peak %u attempts/s, %llu sessions lost\n",
+		names[strategy], ttr.size(), client_count, (unsigned long long)attempts,
+		peak * (1000 / RATE_WINDOW_MS), (unsigned long long)sessions_lost);
+	if (!ttr.empty()) {
+		printf("time to recover: p50 %llu ms, p99 %llu ms, max %llu ms\n",
+			(unsigned long long)ttr[ttr.size() / 2], (unsigned long long)ttr[ttr.size() * 99 / 100],
+			(unsigned long long)ttr.back());
+	}
+
+	for (size_t i = 0; i < clients.size(); i++) {
+		mosquitto_disconnect(clients[i].mosq);
+		mosquitto_destroy(clients[i].mosq);
+	}
+	mosquitto_lib_cleanup();
+	free(restart_cmd);
+	free(mqtt_host);
+
+	return 0;
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+	fprintf(stderr, "msg_reconnect_bench needs poll() and is not supported on Windows.\n");
+	return 1;
+}
+
+#endif
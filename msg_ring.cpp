@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <mosquitto.h>
+#include "msg_ring.h"
+
+#define RING_MAGIC "MQRING01"
+#define RING_PAGE 4096
+#define RING_MIN_SIZE (64 * 1024)
+
+/* record layout: size, flags, seq, topic_len, payload_len, topic, payload */
+#define RING_REC_HEADER 24
+#define RING_REC_PAD 1
+
+#define RING_SPIN_POLLS 2000
+#define RING_YIELD_POLLS 2100
+#define RING_IDLE_SLEEP_US 100
+
+struct ring_rec {
+	uint32_t size;
+	uint32_t flags;
+	uint64_t seq;
+	uint32_t topic_len;
+	uint32_t payload_len;
+};
+
+#ifndef _WINDOWS
+
+static int ring_shm_name(const char *name, char *shm_name, size_t size)
+{
+	if (!name[0] || strchr(name, '/') || strlen(name) >= RING_NAME_MAX) return MOSQ_ERR_INVAL;
+
+	snprintf(shm_name, size, "/mqtt_ring.%s", name);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static size_t ring_align(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static void ring_bind(struct ring *ring, uint8_t *base, size_t map_size)
+{
+	ring->base = base;
+	ring->map_size = map_size;
+	ring->hdr = (struct ring_hdr *)base;
+	ring->data = base + ring->hdr->data_offset;
+	ring->mask = ring->hdr->capacity - 1;
+}
+
+static int ring_map(struct ring *ring, const char *name, bool create, size_t capacity)
+{
+	char shm_name[RING_NAME_MAX + 16];
+	struct stat st;
+	int rc = ring_shm_name(name, shm_name, sizeof(shm_name));
+	if (rc) return rc;
+
+	/* one writer per ring: never resize or write into another daemon's ring */
+	int fd = shm_open(shm_name, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+	if (fd < 0) {
+		if (errno == EEXIST) return MOSQ_ERR_ALREADY_EXISTS;
+		return errno == ENOENT ? MOSQ_ERR_NOT_FOUND : MOSQ_ERR_ERRNO;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		if (create) shm_unlink(shm_name);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	size_t data_offset = ring_align(sizeof(struct ring_hdr), RING_PAGE);
+	size_t map_size = create ? data_offset + capacity : (size_t)st.st_size;
+
+	if (create && ftruncate(fd, (off_t)map_size) < 0) {
+		close(fd);
+		shm_unlink(shm_name);
+		return MOSQ_ERR_ERRNO;
+	}
+	if (map_size < data_offset) {
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		if (create) shm_unlink(shm_name);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	struct ring_hdr *hdr = (struct ring_hdr *)base;
+	bool valid = !memcmp(hdr->magic, RING_MAGIC, sizeof(hdr->magic)) && hdr->data_offset == data_offset
+		&& hdr->capacity >= RING_MIN_SIZE && (hdr->capacity & (hdr->capacity - 1)) == 0
+		&& data_offset + hdr->capacity == map_size;
+
+	if (create) {
+		memset(base, 0, data_offset);
+		hdr->capacity = capacity;
+		hdr->data_offset = data_offset;
+		/* readers check the magic last */
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(hdr->magic, RING_MAGIC, sizeof(hdr->magic));
+	}
+	else if (!valid) {
+		munmap(base, map_size);
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	strcpy(ring->name, name);
+	ring->fd = fd;
+	ring->owner = create;
+	ring_bind(ring, (uint8_t *)base, map_size);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int ring_create(struct ring *ring, const char *name, size_t capacity)
+{
+	size_t size = RING_MIN_SIZE;
+
+	while (size < capacity) size <<= 1;
+	return ring_map(ring, name, true, size);
+}
+
+void ring_close(struct ring *ring)
+{
+	char shm_name[RING_NAME_MAX + 16];
+
+	if (!ring->base) return;
+
+	munmap(ring->base, ring->map_size);
+	close(ring->fd);
+	if (ring->owner && ring_shm_name(ring->name, shm_name, sizeof(shm_name)) == MOSQ_ERR_SUCCESS) {
+		shm_unlink(shm_name);
+	}
+	ring->base = NULL;
+	ring->fd = -1;
+}
+
+int ring_write(struct ring *ring, const char *topic, const void *payload, size_t len)
+{
+	struct ring_hdr *hdr = ring->hdr;
+	size_t topic_len = strlen(topic);
+	size_t need = ring_align(RING_REC_HEADER + topic_len + len, 8);
+
+	/* a record larger than half the ring would overrun every reader */
+	if (topic_len >= RING_MAX_TOPIC || need > hdr->capacity / 2) return MOSQ_ERR_PAYLOAD_SIZE;
+
+	uint64_t w = hdr->write_pos.load(std::memory_order_relaxed);
+	uint64_t off = w & ring->mask;
+	uint64_t pad = off + need > hdr->capacity ? hdr->capacity - off : 0;
+	uint64_t end = w + pad + need;
+
+	hdr->reserve_pos.store(end, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (pad) {
+		/* records never wrap, skip to the start of the ring */
+		struct ring_rec filler = { (uint32_t)pad, RING_REC_PAD, 0, 0, 0 };
+		memcpy(ring->data + off, &filler, 8);
+		off = 0;
+	}
+
+	uint64_t seq = hdr->write_seq.load(std::memory_order_relaxed);
+	struct ring_rec rec = { (uint32_t)need, 0, seq, (uint32_t)topic_len, (uint32_t)len };
+	uint8_t *p = ring->data + off;
+	memcpy(p, &rec, RING_REC_HEADER);
+	memcpy(p + RING_REC_HEADER, topic, topic_len);
+	memcpy(p + RING_REC_HEADER + topic_len, payload, len);
+
+	hdr->write_seq.store(seq + 1, std::memory_order_relaxed);
+	hdr->write_pos.store(end, std::memory_order_release);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+bool ring_stats(struct ring *ring, int i, struct ring_reader_stats *stats)
+{
+	struct ring_reader_slot *slot = &ring->hdr->readers[i];
+
+	if (!slot->active.load(std::memory_order_acquire)) return false;
+
+	stats->pid = slot->pid.load(std::memory_order_relaxed);
+	if (stats->pid > 0 && kill(stats->pid, 0) < 0 && errno == ESRCH) {
+		/* reader died without detaching */
+		slot->active.store(0, std::memory_order_release);
+		return false;
+	}
+
+	uint64_t w = ring->hdr->write_pos.load(std::memory_order_relaxed);
+	uint64_t r = slot->read_pos.load(std::memory_order_relaxed);
+	stats->lag_bytes = w > r ? w - r : 0;
+	stats->messages = slot->messages.load(std::memory_order_relaxed);
+	stats->dropped = slot->dropped.load(std::memory_order_relaxed);
+	stats->overruns = slot->overruns.load(std::memory_order_relaxed);
+	return true;
+}
+
+int ring_attach(struct ring_reader *reader, const char *name)
+{
+	int rc = ring_map(&reader->ring, name, false, 0);
+	if (rc) return rc;
+
+	struct ring_hdr *hdr = reader->ring.hdr;
+	reader->slot = -1;
+	for (int i = 0; i < RING_MAX_READERS; i++) {
+		uint32_t free_slot = 0;
+		if (hdr->readers[i].active.compare_exchange_strong(free_slot, 1, std::memory_order_acq_rel)) {
+			reader->slot = i;
+			break;
+		}
+	}
+	if (reader->slot < 0) {
+		ring_close(&reader->ring);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	reader->pos = hdr->write_pos.load(std::memory_order_acquire);
+	reader->next_seq = UINT64_MAX;
+	reader->idle = 0;
+	reader->buf.resize(64 * 1024);
+
+	struct ring_reader_slot *slot = &hdr->readers[reader->slot];
+	slot->pid.store((int32_t)getpid(), std::memory_order_relaxed);
+	slot->read_pos.store(reader->pos, std::memory_order_relaxed);
+	slot->messages.store(0, std::memory_order_relaxed);
+	slot->dropped.store(0, std::memory_order_relaxed);
+	slot->overruns.store(0, std::memory_order_relaxed);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void ring_detach(struct ring_reader *reader)
+{
+	if (!reader->ring.base) return;
+
+	if (reader->slot >= 0) {
+		reader->ring.hdr->readers[reader->slot].active.store(0, std::memory_order_release);
+		reader->slot = -1;
+	}
+	ring_close(&reader->ring);
+}
+
+/* the writer has not started overwriting [pos, pos + capacity) */
+static bool ring_intact(const struct ring_hdr *hdr, uint64_t pos)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return hdr->reserve_pos.load(std::memory_order_relaxed) - pos <= hdr->capacity;
+}
+
+static void ring_overrun(struct ring_reader *reader, struct ring_reader_slot *slot)
+{
+	/* write_pos always sits on a record boundary */
+	reader->pos = reader->ring.hdr->write_pos.load(std::memory_order_acquire);
+	slot->read_pos.store(reader->pos, std::memory_order_relaxed);
+	slot->overruns.store(slot->overruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+int ring_read(struct ring_reader *reader, struct ring_msg *msg)
+{
+	struct ring_hdr *hdr = reader->ring.hdr;
+	struct ring_reader_slot *slot = &hdr->readers[reader->slot];
+	struct ring_rec rec;
+
+	for (;;) {
+		uint64_t committed = hdr->write_pos.load(std::memory_order_acquire);
+		if (reader->pos == committed) return 0;
+		if (committed - reader->pos > hdr->capacity) {
+			ring_overrun(reader, slot);
+			continue;
+		}
+
+		uint64_t off = reader->pos & reader->ring.mask;
+		const uint8_t *p = reader->ring.data + off;
+
+		memcpy(&rec, p, 8);
+		if (rec.flags & RING_REC_PAD) {
+			if (!ring_intact(hdr, reader->pos) || rec.size != hdr->capacity - off) {
+				ring_overrun(reader, slot);
+				continue;
+			}
+			reader->pos += rec.size;
+			continue;
+		}
+
+		memcpy(&rec, p, RING_REC_HEADER);
+		/* sanity checks first: the record may be torn if we are being lapped */
+		if (rec.size < RING_REC_HEADER || rec.size > hdr->capacity - off || rec.topic_len >= RING_MAX_TOPIC
+			|| (uint64_t)RING_REC_HEADER + rec.topic_len + rec.payload_len > rec.size) {
+			ring_overrun(reader, slot);
+			continue;
+		}
+
+		/* payload first so it stays 8 byte aligned, then the terminated topic */
+		size_t need = ring_align(rec.payload_len, 8) + rec.topic_len + 1;
+		if (reader->buf.size() < need) reader->buf.resize(need);
+
+		uint8_t *buf = reader->buf.data();
+		char *topic = (char *)buf + ring_align(rec.payload_len, 8);
+		memcpy(buf, p + RING_REC_HEADER + rec.topic_len, rec.payload_len);
+		memcpy(topic, p + RING_REC_HEADER, rec.topic_len);
+		topic[rec.topic_len] = '\0';
+
+		if (!ring_intact(hdr, reader->pos)) {
+			ring_overrun(reader, slot);
+			continue;
+		}
+
+		if (reader->next_seq != UINT64_MAX && rec.seq > reader->next_seq) {
+			slot->dropped.store(slot->dropped.load(std::memory_order_relaxed) + rec.seq - reader->next_seq, std::memory_order_relaxed);
+		}
+		reader->next_seq = rec.seq + 1;
+		reader->pos += rec.size;
+		reader->idle = 0;
+
+		slot->read_pos.store(reader->pos, std::memory_order_relaxed);
+		slot->messages.store(slot->messages.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+		msg->topic = topic;
+		msg->payload = buf;
+		msg->payloadlen = rec.payload_len;
+		msg->seq = rec.seq;
+		return 1;
+	}
+}
+
+void ring_wait(struct ring_reader *reader)
+{
+	reader->idle++;
+	if (reader->idle < RING_SPIN_POLLS) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+	else if (reader->idle < RING_YIELD_POLLS) {
+		sched_yield();
+	}
+	else {
+		usleep(RING_IDLE_SLEEP_US);
+	}
+}
+
+#else
+
+int ring_create(struct ring *ring, const char *name, size_t capacity)
+{
+	ring->base = NULL;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void ring_close(struct ring *ring)
+{
+}
+
+int ring_write(struct ring *ring, const char *topic, const void *payload, size_t len)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+bool ring_stats(struct ring *ring, int i, struct ring_reader_stats *stats)
+{
+	return false;
+}
+
+int ring_attach(struct ring_reader *reader, const char *name)
+{
+	reader->ring.base = NULL;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void ring_detach(struct ring_reader *reader)
+{
+}
+
+int ring_read(struct ring_reader *reader, struct ring_msg *msg)
+{
+	return 0;
+}
+
+void ring_wait(struct ring_reader *reader)
+{
+	Sleep(1);
+}
+
+#endif
@@ -0,0 +1,111 @@
+#pragma once
+/*
+  msg_ring
+  Single-writer, multi-reader broadcast ring in named shared memory.
+
+  The fan-out daemon (mosquitto_fanout.cpp) holds the broker subscription and
+  appends every received frame (topic + payload) to the ring. Any number of
+  local readers attach by name and poll the ring from user space; reading
+  takes no locks and no system calls.
+
+  The writer never waits for readers. It announces the region it is about to
+  overwrite in reserve_pos before touching it, and readers validate each copy
+  against reserve_pos afterwards (seqlock style). A reader that fell more than
+  one ring behind skips to the newest record and counts the messages it lost.
+  Each reader publishes its position and counters in a slot of the ring
+  header so the daemon can report per-reader lag.
+
+  Linux/POSIX only; on Windows every call returns MOSQ_ERR_NOT_SUPPORTED.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+#define RING_NAME_MAX 64
+#define RING_MAX_READERS 32
+#define RING_MAX_TOPIC 1024
+#define RING_DEFAULT_SIZE (16 * 1024 * 1024)
+
+struct alignas(64) ring_reader_slot {
+	std::atomic<uint32_t> active;
+	std::atomic<int32_t> pid;
+	std::atomic<uint64_t> read_pos;
+	std::atomic<uint64_t> messages;
+	std::atomic<uint64_t> dropped; /* messages overwritten before this reader got to them */
+	std::atomic<uint64_t> overruns;
+};
+
+struct ring_hdr {
+	char magic[8];
+	uint64_t capacity; /* power of two */
+	uint64_t data_offset;
+	alignas(64) std::atomic<uint64_t> reserve_pos; /* end of the region being written */
+	std::atomic<uint64_t> write_pos; /* end of the last complete record */
+	std::atomic<uint64_t> write_seq;
+	struct ring_reader_slot readers[RING_MAX_READERS];
+};
+
+struct ring {
+	char name[RING_NAME_MAX];
+	int fd;
+	uint8_t *base;
+	size_t map_size;
+	struct ring_hdr *hdr;
+	uint8_t *data;
+	uint64_t mask;
+	bool owner;
+};
+
+struct ring_reader {
+	struct ring ring;
+	int slot;
+	uint64_t pos;
+	uint64_t next_seq;
+	int idle; /* empty polls in a row, see ring_wait */
+	std::vector<uint8_t> buf;
+};
+
+/* one record, valid until the next ring_read on the same reader */
+struct ring_msg {
+	const char *topic;
+	const uint8_t *payload;
+	size_t payloadlen;
+	uint64_t seq;
+};
+
+struct ring_reader_stats {
+	int pid;
+	uint64_t lag_bytes;
+	uint64_t messages;
+	uint64_t dropped;
+	uint64_t overruns;
+};
+
+/*
+  Create the ring; capacity is rounded up to a power of two. ring_close
+  removes the name again. MOSQ_ERR_ALREADY_EXISTS if the name is taken: by
+  another daemon, or left behind by one that crashed (/dev/shm/mqtt_ring.<name>).
+*/
+int ring_create(struct ring *ring, const char *name, size_t capacity);
+void ring_close(struct ring *ring);
+
+/* Append one record. Never blocks; returns a MOSQ_ERR_* code. */
+int ring_write(struct ring *ring, const char *topic, const void *payload, size_t len);
+
+/*
+  Fill stats for reader slot i. Returns false if the slot is free. Slots of
+  readers whose process has exited are released.
+*/
+bool ring_stats(struct ring *ring, int i, struct ring_reader_stats *stats);
+
+/* Attach as a reader; reading starts at the newest record. */
+int ring_attach(struct ring_reader *reader, const char *name);
+void ring_detach(struct ring_reader *reader);
+
+/* Returns 1 and fills msg if a record was read, 0 if the ring is empty. */
+int ring_read(struct ring_reader *reader, struct ring_msg *msg);
+
+/* Back off after an empty ring_read: spin first, sleep only when idle for long. */
+void ring_wait(struct ring_reader *reader);
@@ -0,0 +1,68 @@
+#include <math.h>
+#include "msg_samples.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SAMPLES_SSE2 1
+#endif
+
+void samples_stats(const float *samples, size_t count, struct sample_stats *stats)
+{
+	size_t i = 0;
+	float min, max;
+	double sum = 0, sum_sq = 0;
+
+	if (count == 0) {
+		stats->min = stats->max = 0;
+		stats->sum = stats->rms = 0;
+		return;
+	}
+
+	min = max = samples[0];
+
+#ifdef SAMPLES_SSE2
+	if (count >= 4) {
+		__m128 vmin = _mm_loadu_ps(samples);
+		__m128 vmax = vmin;
+		/* accumulate in double: thousands of float samples lose precision otherwise */
+		__m128d vsum = _mm_setzero_pd();
+		__m128d vsum_sq = _mm_setzero_pd();
+
+		for (; i + 4 <= count; i += 4) {
+			__m128 v = _mm_loadu_ps(samples + i);
+			__m128d lo = _mm_cvtps_pd(v);
+			__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+
+			vmin = _mm_min_ps(vmin, v);
+			vmax = _mm_max_ps(vmax, v);
+			vsum = _mm_add_pd(vsum, _mm_add_pd(lo, hi));
+			vsum_sq = _mm_add_pd(vsum_sq, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+		}
+
+		float lanes[4];
+		double pair[2];
+
+		_mm_storeu_ps(lanes, vmin);
+		for (int l = 0; l < 4; l++) if (lanes[l] < min) min = lanes[l];
+		_mm_storeu_ps(lanes, vmax);
+		for (int l = 0; l < 4; l++) if (lanes[l] > max) max = lanes[l];
+		_mm_storeu_pd(pair, vsum);
+		sum = pair[0] + pair[1];
+		_mm_storeu_pd(pair, vsum_sq);
+		sum_sq = pair[0] + pair[1];
+	}
+#endif
+
+	for (; i < count; i++) {
+		float v = samples[i];
+		if (v < min) min = v;
+		if (v > max) max = v;
+		sum += v;
+		sum_sq += (double)v * v;
+	}
+
+	stats->min = min;
+	stats->max = max;
+	stats->sum = sum;
+	stats->rms = sqrt(sum_sq / count);
+}
@@ -0,0 +1,129 @@
+#pragma once
+/*
+  msg_samples
+  Bulk numeric arrays (vibration, audio, ...) in FlexBuffer/FlatBuffer payloads.
+
+  put_samples() writes an array as a FlexBuffer typed vector (one type for the
+  whole array, elements packed at sizeof(T)), or as a fixed typed vector for
+  2-4 elements. samples_view() hands the receiver a pointer straight into the
+  payload, so samples never go through per-element flexbuffers::Reference
+  objects, and samples_stats() reduces a float array with SIMD.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+#include <flatbuffers/flatbuffers.h>
+#include <flatbuffers/flexbuffers.h>
+
+template <typename T>
+struct sample_view {
+	const T *data;
+	size_t size;
+
+	const T *begin() const { return data; }
+	const T *end() const { return data + size; }
+	const T &operator[](size_t i) const { return data[i]; }
+};
+
+struct sample_stats {
+	float min;
+	float max;
+	double sum;
+	double rms;
+};
+
+/* min/max/sum/RMS in one pass; all zero for an empty array */
+void samples_stats(const float *samples, size_t count, struct sample_stats *stats);
+
+template <typename T>
+void put_samples(flexbuffers::Builder &fbb, const char *key, const T *samples, size_t count)
+{
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, "put_samples: numeric samples only");
+
+	if (count >= 2 && count <= 4) {
+		fbb.FixedTypedVector(key, samples, count);
+	}
+	else {
+		fbb.Vector(key, samples, count);
+	}
+}
+
+/* FlatBuffers [T] field, to be added to a table with AddOffset() */
+template <typename T>
+flatbuffers::Offset<flatbuffers::Vector<T>> put_samples(flatbuffers::FlatBufferBuilder &fbb, const T *samples, size_t count)
+{
+	return fbb.CreateVector(samples, count);
+}
+
+/* Element type a typed vector of T carries. */
+template <typename T>
+constexpr flexbuffers::Type sample_type()
+{
+	return std::is_floating_point<T>::value ? flexbuffers::FBT_FLOAT
+		: std::is_signed<T>::value ? flexbuffers::FBT_INT : flexbuffers::FBT_UINT;
+}
+
+/* flexbuffers keeps the element pointer and width protected; read them in place */
+struct typed_vector_raw : public flexbuffers::TypedVector {
+	explicit typed_vector_raw(const flexbuffers::TypedVector &v) : flexbuffers::TypedVector(v) {}
+	const uint8_t *elements() const { return data_; }
+	uint8_t width() const { return byte_width_; }
+};
+
+struct fixed_vector_raw : public flexbuffers::FixedTypedVector {
+	explicit fixed_vector_raw(const flexbuffers::FixedTypedVector &v) : flexbuffers::FixedTypedVector(v) {}
+	const uint8_t *elements() const { return data_; }
+	uint8_t width() const { return byte_width_; }
+};
+
+/*
+  Zero-copy view of a typed or fixed typed vector whose elements are stored
+  exactly as T. Returns false (view untouched) when the value has another
+  element type or width, e.g. doubles requested as floats.
+*/
+template <typename T>
+bool samples_view(const flexbuffers::Reference &ref, sample_view<T> *view)
+{
+	const uint8_t *elements;
+	size_t count;
+	uint8_t width;
+
+	if (ref.IsTypedVector()) {
+		auto vec = ref.AsTypedVector();
+		typed_vector_raw raw(vec);
+		if (vec.ElementType() != sample_type<T>()) return false;
+		elements = raw.elements();
+		width = raw.width();
+		count = vec.size();
+	}
+	else if (ref.IsFixedTypedVector()) {
+		auto vec = ref.AsFixedTypedVector();
+		fixed_vector_raw raw(vec);
+		if (vec.ElementType() != sample_type<T>()) return false;
+		elements = raw.elements();
+		width = raw.width();
+		count = vec.size();
+	}
+	else {
+		return false;
+	}
+
+	if (width != sizeof(T) || (uintptr_t)elements % alignof(T) != 0) return false;
+
+	view->data = reinterpret_cast<const T *>(elements);
+	view->size = count;
+	return true;
+}
+
+/* Zero-copy view of a FlatBuffers [T] field in vtable slot `slot`. */
+template <typename T>
+bool samples_view(const flatbuffers::Table *table, flatbuffers::voffset_t slot, sample_view<T> *view)
+{
+	auto vec = table->GetPointer<const flatbuffers::Vector<T> *>(slot);
+	if (!vec) return false;
+
+	view->data = reinterpret_cast<const T *>(vec->Data());
+	view->size = vec->size();
+	return true;
+}
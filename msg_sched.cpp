@@ -0,0 +1,237 @@
+#include <string.h>
+#include <chrono>
+#include <mosquitto.h>
+#include "msg_chunk.h"
+#include "msg_claim.h"
+#include "msg_sched.h"
+
+static uint64_t sched_now_ns(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int route_topic(struct rx_sched *sched, const char *topic)
+{
+	auto it = sched->route.find(topic);
+	if (it != sched->route.end()) return it->second;
+
+	/* patterns are tried by lane priority so an overlapping control pattern wins */
+	int lane = sched->default_lane;
+	int priority = 0;
+	bool found = false;
+	for (size_t i = 0; i < sched->lanes.size(); i++) {
+		struct sched_lane *l = &sched->lanes[i];
+		if (found && l->priority >= priority) continue;
+
+		for (size_t p = 0; p < l->patterns.size(); p++) {
+			bool match = false;
+			mosquitto_topic_matches_sub(l->patterns[p].c_str(), topic, &match);
+			if (match) {
+				lane = (int)i;
+				priority = l->priority;
+				found = true;
+				break;
+			}
+		}
+	}
+
+	/* topics with an id in them would grow it without bound */
+	if (sched->route.size() >= SCHED_ROUTE_CACHE_MAX) sched->route.clear();
+	sched->route[topic] = lane;
+	return lane;
+}
+
+/* the front message leaves the lane; only a conflatable one is in queued */
+static void lane_forget_front(struct sched_lane *lane)
+{
+	if (!lane->conflate) return;
+
+	auto it = lane->queued.find(lane->queue.front().topic);
+	if (it != lane->queued.end() && it->second == &lane->queue.front()) lane->queued.erase(it);
+}
+
+static void lane_pop_front(struct sched_lane *lane)
+{
+	lane_forget_front(lane);
+	lane->queue.pop_front();
+}
+
+void sched_init(struct rx_sched *sched)
+{
+	sched->lanes.clear();
+	sched->route.clear();
+	sched->stopped = false;
+	sched->default_lane = -1;
+	sched->default_lane = sched_add_lane(sched, "default", SCHED_PRIORITY_BULK, false, SCHED_DEFAULT_CAPACITY);
+}
+
+void sched_cleanup(struct rx_sched *sched)
+{
+	std::lock_guard<std::mutex> guard(sched->lock);
+
+	sched->lanes.clear();
+	sched->route.clear();
+}
+
+int sched_add_lane(struct rx_sched *sched, const char *name, int priority, bool conflate, size_t capacity)
+{
+	std::lock_guard<std::mutex> guard(sched->lock);
+
+	if (sched->lanes.size() >= SCHED_MAX_LANES) return -1;
+
+	sched->lanes.push_back(sched_lane());
+	struct sched_lane *lane = &sched->lanes.back();
+	snprintf(lane->name, sizeof(lane->name), "%s", name);
+	lane->priority = priority;
+	lane->conflate = conflate;
+	lane->capacity = capacity ? capacity : SCHED_DEFAULT_CAPACITY;
+	memset(&lane->stats, 0, sizeof(lane->stats));
+
+	sched->route.clear();
+	return (int)sched->lanes.size() - 1;
+}
+
+int sched_add_pattern(struct rx_sched *sched, int lane, const char *pattern)
+{
+	std::lock_guard<std::mutex> guard(sched->lock);
+
+	if (lane < 0 || lane >= (int)sched->lanes.size()) return MOSQ_ERR_INVAL;
+	if (mosquitto_sub_topic_check(pattern) != MOSQ_ERR_SUCCESS) return MOSQ_ERR_INVAL;
+
+	sched->lanes[lane].patterns.push_back(pattern);
+	sched->route.clear();
+	return MOSQ_ERR_SUCCESS;
+}
+
+void sched_push(struct rx_sched *sched, const char *topic, const void *payload, size_t len)
+{
+	std::unique_lock<std::mutex> guard(sched->lock);
+	int n = route_topic(sched, topic);
+	struct sched_lane *lane = &sched->lanes[n];
+	const uint8_t *data = (const uint8_t *)payload;
+
+	lane->stats.enqueued++;
+
+	/* a chunk frame or claim replaced by the next one would break its transfer */
+	bool conflate = lane->conflate && !chunk_is_frame(payload, len) && !claim_is_desc(payload, len);
+	if (conflate) {
+		auto it = lane->queued.find(topic);
+		if (it != lane->queued.end()) {
+			/* consumer is behind: newest value takes the queued one's place */
+			it->second->payload.assign(data, data + len);
+			it->second->enqueued_ns = sched_now_ns();
+			lane->stats.conflated++;
+			return;
+		}
+	}
+
+	if (lane->queue.size() >= lane->capacity) {
+		lane_pop_front(lane);
+		lane->stats.dropped++;
+	}
+
+	lane->queue.push_back(sched_msg());
+	struct sched_msg *msg = &lane->queue.back();
+	msg->topic = topic;
+	msg->payload.assign(data, data + len);
+	msg->enqueued_ns = sched_now_ns();
+	msg->lane = n;
+	if (conflate) lane->queued[msg->topic] = msg;
+
+	if (lane->queue.size() > lane->stats.max_depth) lane->stats.max_depth = lane->queue.size();
+
+	guard.unlock();
+	sched->ready.notify_one();
+}
+
+static struct sched_lane *next_lane(struct rx_sched *sched)
+{
+	struct sched_lane *best = NULL;
+
+	for (size_t i = 0; i < sched->lanes.size(); i++) {
+		struct sched_lane *lane = &sched->lanes[i];
+		if (lane->queue.empty()) continue;
+		if (!best || lane->priority < best->priority) best = lane;
+	}
+	return best;
+}
+
+bool sched_pop(struct rx_sched *sched, struct sched_msg *msg, int timeout_ms)
+{
+	std::unique_lock<std::mutex> guard(sched->lock);
+	struct sched_lane *lane = NULL;
+
+	auto pending = [&]() { return sched->stopped || (lane = next_lane(sched)) != NULL; };
+	if (timeout_ms < 0) {
+		sched->ready.wait(guard, pending);
+	}
+	else if (!sched->ready.wait_for(guard, std::chrono::milliseconds(timeout_ms), pending)) {
+		return false;
+	}
+	if (sched->stopped) return false;
+
+	lane_forget_front(lane);
+	std::swap(*msg, lane->queue.front());
+	lane->queue.pop_front();
+
+	uint64_t us = (sched_now_ns() - msg->enqueued_ns) / 1000;
+	int bucket = 0;
+	while (bucket < SCHED_HIST_BUCKETS - 1 && us >= (1ull << bucket)) bucket++;
+
+	lane->stats.delivered++;
+	lane->stats.sojourn_total_us += us;
+	if (us > lane->stats.sojourn_max_us) lane->stats.sojourn_max_us = us;
+	lane->stats.sojourn_hist[bucket]++;
+	return true;
+}
+
+void sched_stop(struct rx_sched *sched)
+{
+	{
+		std::lock_guard<std::mutex> guard(sched->lock);
+		sched->stopped = true;
+	}
+	sched->ready.notify_all();
+}
+
+void sched_get_stats(struct rx_sched *sched, int lane, struct sched_lane_stats *stats)
+{
+	std::lock_guard<std::mutex> guard(sched->lock);
+
+	*stats = sched->lanes[lane].stats;
+	stats->depth = sched->lanes[lane].queue.size();
+}
+
+static uint64_t hist_percentile(const struct sched_lane_stats *stats, double q)
+{
+	uint64_t target = (uint64_t)(stats->delivered * q);
+	uint64_t seen = 0;
+
+	for (int i = 0; i < SCHED_HIST_BUCKETS; i++) {
+		seen += stats->sojourn_hist[i];
+		if (seen > target) return 1ull << i;
+	}
+	return stats->sojourn_max_us;
+}
+
+void sched_print_stats(struct rx_sched *sched, FILE *out)
+{
+	std::lock_guard<std::mutex> guard(sched->lock);
+
+	for (size_t i = 0; i < sched->lanes.size(); i++) {
+		const struct sched_lane *lane = &sched->lanes[i];
+		const struct sched_lane_stats *stats = &lane->stats;
+
+		fprintf(out, "lane %-10s prio %2d depth %zu (max %llu) in %llu out %llu conflated %llu dropped %llu",
+			lane->name, lane->priority, lane->queue.size(), (unsigned long long)stats->max_depth,
+			(unsigned long long)stats->enqueued, (unsigned long long)stats->delivered,
+			(unsigned long long)stats->conflated, (unsigned long long)stats->dropped);
+		if (stats->delivered) {
+			fprintf(out, " sojourn mean %llu us p99 < %llu us max %llu us",
+				(unsigned long long)(stats->sojourn_total_us / stats->delivered),
+				(unsigned long long)hist_percentile(stats, 0.99), (unsigned long long)stats->sojourn_max_us);
+		}
+		fprintf(out, "\n");
+	}
+}
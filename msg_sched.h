@@ -0,0 +1,109 @@
+#pragma once
+/*
+  msg_sched
+  Priority-aware, conflating receive queue.
+
+  The libmosquitto message callback only copies the message into a lane
+  picked by topic pattern (sched_push), and a consumer thread takes the
+  messages out with sched_pop(). Lanes are drained strictly by priority.
+  Control commands (STATUS/ON/OFF and the like) therefore never wait
+  behind a burst of telemetry.
+
+  A conflating lane keeps at most one queued message per topic. When the
+  consumer falls behind, a newer value replaces the queued one in place,
+  so a bulk lane holds the latest value of each topic instead of a
+  backlog. msg_chunk frames and msg_claim descriptors are never conflated:
+  every frame of a transfer is needed for the reassembly. Other lanes, and
+  a conflating lane for those frames, drop their oldest message once
+  `capacity` is reached.
+
+  Every lane counts its depth, drops, conflations and the sojourn time
+  (push -> pop) of what it delivers, with a log2 histogram in microseconds.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define SCHED_MAX_LANES 8
+#define SCHED_NAME_MAX 32
+#define SCHED_HIST_BUCKETS 32
+#define SCHED_DEFAULT_CAPACITY 10000
+#define SCHED_ROUTE_CACHE_MAX 4096 /* topics; the cache starts over when full */
+#define SCHED_PRIORITY_CONTROL 0
+#define SCHED_PRIORITY_BULK 10
+
+struct sched_msg {
+	std::string topic;
+	std::vector<uint8_t> payload;
+	uint64_t enqueued_ns;
+	int lane;
+};
+
+struct sched_lane_stats {
+	uint64_t depth;
+	uint64_t max_depth;
+	uint64_t enqueued;
+	uint64_t delivered;
+	uint64_t conflated;
+	uint64_t dropped;
+	uint64_t sojourn_total_us;
+	uint64_t sojourn_max_us;
+	uint64_t sojourn_hist[SCHED_HIST_BUCKETS]; /* bucket i: < 2^i us */
+};
+
+struct sched_lane {
+	char name[SCHED_NAME_MAX];
+	int priority; /* lower drains first */
+	bool conflate;
+	size_t capacity;
+	std::vector<std::string> patterns;
+	std::deque<struct sched_msg> queue;
+	std::unordered_map<std::string, struct sched_msg *> queued; /* conflating lanes: topic -> its queued message */
+	struct sched_lane_stats stats;
+};
+
+struct rx_sched {
+	std::mutex lock;
+	std::condition_variable ready;
+	std::deque<struct sched_lane> lanes;
+	std::unordered_map<std::string, int> route; /* topic -> lane, filled on first use */
+	int default_lane;
+	bool stopped;
+};
+
+/* Creates the "default" lane (bulk priority, not conflating) for unmatched topics. */
+void sched_init(struct rx_sched *sched);
+void sched_cleanup(struct rx_sched *sched);
+
+/* Returns the lane index, or -1 if there are already SCHED_MAX_LANES. */
+int sched_add_lane(struct rx_sched *sched, const char *name, int priority, bool conflate, size_t capacity);
+
+/*
+  Route topics matching pattern ('+'/'#' allowed) to lane. When patterns
+  of several lanes match, the highest priority lane wins, and of equal
+  priorities the one added first.
+*/
+int sched_add_pattern(struct rx_sched *sched, int lane, const char *pattern);
+
+/* Copy a message into its lane. Called from the message callback. */
+void sched_push(struct rx_sched *sched, const char *topic, const void *payload, size_t len);
+
+/*
+  Take the next message, highest priority lane first. Waits up to
+  timeout_ms (0: don't wait, -1: forever). Returns false on timeout or
+  after sched_stop().
+*/
+bool sched_pop(struct rx_sched *sched, struct sched_msg *msg, int timeout_ms);
+
+/* Wake up and stop waiting consumers. */
+void sched_stop(struct rx_sched *sched);
+
+void sched_get_stats(struct rx_sched *sched, int lane, struct sched_lane_stats *stats);
+void sched_print_stats(struct rx_sched *sched, FILE *out);
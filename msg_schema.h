@@ -0,0 +1,418 @@
+#pragma once
+/*
+  msg_schema
+  Header-only compile-time message schemas.
+
+  A message struct lists its fields once with a constexpr field list:
+
+	struct sensor_msg {
+		double time;
+		std::string text;
+
+		static constexpr auto fields() {
+			return std::make_tuple(
+				msg_schema::field("time", &sensor_msg::time),
+				msg_schema::field("text", &sensor_msg::text));
+		}
+	};
+
+  and gets a FlexBuffer map encoder/decoder and a FlatBuffer table
+  encoder/decoder from it. The key order of a FlexBuffer map (sorted by strcmp)
+  and the vtable slot of a FlatBuffer field are both resolved at compile time,
+  so decoding never searches for a key: it only checks that each key sits
+  where its field expects it.
+
+  Supported field types: bool, integers, float, double, std::string and
+  std::vector of a numeric type (written as a typed vector / FlatBuffers [T]).
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <flatbuffers/flatbuffers.h>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_samples.h"
+
+namespace msg_schema {
+
+template <typename S, typename T>
+struct field_def {
+	const char *name;
+	size_t name_len;
+	T S::*member;
+};
+
+template <typename S, typename T, size_t N>
+constexpr field_def<S, T> field(const char(&name)[N], T S::*member)
+{
+	return field_def<S, T>{ name, N - 1, member };
+}
+
+template <typename S>
+constexpr size_t field_count()
+{
+	return std::tuple_size<decltype(S::fields())>::value;
+}
+
+template <typename S, size_t I>
+constexpr const char *field_name()
+{
+	return std::get<I>(S::fields()).name;
+}
+
+template <typename S, size_t I>
+using field_type = typename std::decay<decltype(std::declval<S &>().*(std::get<I>(S::fields()).member))>::type;
+
+/* constexpr strcmp, same ordering flexbuffers::Builder::EndMap uses */
+constexpr int key_compare(const char *a, const char *b)
+{
+	while (*a && *a == *b) {
+		a++;
+		b++;
+	}
+	return (int)(unsigned char)*a - (int)(unsigned char)*b;
+}
+
+template <typename S, size_t... Is>
+constexpr std::array<const char *, sizeof...(Is)> field_names(std::index_sequence<Is...>)
+{
+	return std::array<const char *, sizeof...(Is)>{ { field_name<S, Is>()... } };
+}
+
+/* Position of field i inside the sorted FlexBuffer map. */
+template <typename S>
+constexpr size_t key_rank(size_t i)
+{
+	const auto names = field_names<S>(std::make_index_sequence<field_count<S>()>());
+	size_t rank = 0;
+	for (size_t j = 0; j < names.size(); j++) {
+		if (key_compare(names[j], names[i]) < 0) rank++;
+	}
+	return rank;
+}
+
+/* Inverse of key_rank: the field stored at sorted position rank. */
+template <typename S>
+constexpr size_t field_at_rank(size_t rank)
+{
+	for (size_t i = 0; i < field_count<S>(); i++) {
+		if (key_rank<S>(i) == rank) return i;
+	}
+	return field_count<S>();
+}
+
+template <typename S>
+constexpr bool keys_unique()
+{
+	constexpr auto names = field_names<S>(std::make_index_sequence<field_count<S>()>());
+	for (size_t i = 0; i < names.size(); i++) {
+		for (size_t j = i + 1; j < names.size(); j++) {
+			if (key_compare(names[i], names[j]) == 0) return false;
+		}
+	}
+	return true;
+}
+
+/* FlexBuffer value writers */
+inline void flex_put(flexbuffers::Builder &fbb, bool v) { fbb.Bool(v); }
+inline void flex_put(flexbuffers::Builder &fbb, float v) { fbb.Float(v); }
+inline void flex_put(flexbuffers::Builder &fbb, double v) { fbb.Double(v); }
+inline void flex_put(flexbuffers::Builder &fbb, const std::string &v) { fbb.String(v.c_str(), v.size()); }
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+flex_put(flexbuffers::Builder &fbb, T v) { fbb.Int((int64_t)v); }
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value>::type
+flex_put(flexbuffers::Builder &fbb, T v) { fbb.UInt((uint64_t)v); }
+
+template <typename T>
+void flex_put(flexbuffers::Builder &fbb, const std::vector<T> &v)
+{
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, "msg_schema: numeric vectors only");
+	fbb.Vector(v.data(), v.size());
+}
+
+/* FlexBuffer value readers */
+inline void flex_get(const flexbuffers::Reference &r, bool &v) { v = r.AsBool(); }
+inline void flex_get(const flexbuffers::Reference &r, float &v) { v = r.AsFloat(); }
+inline void flex_get(const flexbuffers::Reference &r, double &v) { v = r.AsDouble(); }
+inline void flex_get(const flexbuffers::Reference &r, std::string &v)
+{
+	auto s = r.AsString();
+	v.assign(s.c_str(), s.length());
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+flex_get(const flexbuffers::Reference &r, T &v) { v = (T)r.AsInt64(); }
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value>::type
+flex_get(const flexbuffers::Reference &r, T &v) { v = (T)r.AsUInt64(); }
+
+/* false if r is no typed vector (AsTypedVector() would read it as empty) */
+template <typename T>
+bool flex_get(const flexbuffers::Reference &r, std::vector<T> &v)
+{
+	sample_view<T> view;
+	if (samples_view(r, &view)) {
+		v.assign(view.begin(), view.end());
+		return true;
+	}
+
+	/* stored with another element type/width: convert one by one */
+	if (!r.IsTypedVector()) return false;
+	auto vec = r.AsTypedVector();
+	v.resize(vec.size());
+	for (size_t i = 0; i < vec.size(); i++) {
+		flex_get(vec[i], v[i]);
+	}
+	return true;
+}
+
+/* every reader above, as one that can fail */
+template <typename T>
+bool flex_read(const flexbuffers::Reference &r, T &v)
+{
+	flex_get(r, v);
+	return true;
+}
+
+template <typename T>
+bool flex_read(const flexbuffers::Reference &r, std::vector<T> &v) { return flex_get(r, v); }
+
+template <typename S, size_t I>
+void flex_put_field(flexbuffers::Builder &fbb, const S &msg)
+{
+	constexpr auto f = std::get<I>(S::fields());
+	fbb.Key(f.name, f.name_len);
+	flex_put(fbb, msg.*(f.member));
+}
+
+template <typename S, size_t... Rs>
+void flex_put_sorted(flexbuffers::Builder &fbb, const S &msg, std::index_sequence<Rs...>)
+{
+	/* emit in key order so EndMap() finds the map already sorted */
+	int expand[] = { 0, (flex_put_field<S, field_at_rank<S>(Rs)>(fbb, msg), 0)... };
+	(void)expand;
+}
+
+template <typename S, size_t... Is>
+bool flex_keys_match(const flexbuffers::TypedVector &keys, std::index_sequence<Is...>)
+{
+	bool match = true;
+	int expand[] = { 0, (match = match && !strcmp(keys[key_rank<S>(Is)].AsKey(), field_name<S, Is>()), 0)... };
+	(void)expand;
+	return match;
+}
+
+template <typename S, size_t... Is>
+bool flex_get_fields(const flexbuffers::Vector &values, S &msg, std::index_sequence<Is...>)
+{
+	bool ok = true;
+	int expand[] = { 0, (ok = flex_read(values[key_rank<S>(Is)], msg.*(std::get<Is>(S::fields()).member)) && ok, 0)... };
+	(void)expand;
+	return ok;
+}
+
+/*
+  Encode msg as a FlexBuffer map and finish the buffer.
+  Build with flexbuffers::BUILDER_FLAG_NONE to skip the builder's runtime key
+  pool; the keys are already unique string literals.
+*/
+template <typename S>
+void encode_flex(flexbuffers::Builder &fbb, const S &msg)
+{
+	static_assert(keys_unique<S>(), "msg_schema: duplicate field name");
+
+	fbb.Clear();
+	size_t start = fbb.StartMap();
+	flex_put_sorted(fbb, msg, std::make_index_sequence<field_count<S>()>());
+	fbb.EndMap(start);
+	fbb.Finish();
+}
+
+/*
+  Decode a FlexBuffer map written by encode_flex (or by any writer using the
+  same keys). Values are read by their compile-time position in the sorted map,
+  so the payload must carry exactly the schema's keys; each key is compared
+  once, at the position its field is expected in.
+  Returns false if the payload is not a map of the expected shape.
+*/
+template <typename S>
+bool decode_flex(const uint8_t *data, size_t size, S &msg)
+{
+	auto root = flexbuffers::GetRoot(data, size);
+	if (!root.IsMap()) return false;
+
+	auto map = root.AsMap();
+	if (map.size() != field_count<S>()) return false;
+
+	if (!flex_keys_match<S>(map.Keys(), std::make_index_sequence<field_count<S>()>())) return false;
+
+	return flex_get_fields(map.Values(), msg, std::make_index_sequence<field_count<S>()>());
+}
+
+/* FlatBuffer table writers/readers: field I lives in vtable slot I */
+template <typename S, size_t I>
+constexpr flatbuffers::voffset_t table_slot()
+{
+	return flatbuffers::FieldIndexToOffset((flatbuffers::voffset_t)I);
+}
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type
+table_prepare(flatbuffers::FlatBufferBuilder &, const T &, flatbuffers::uoffset_t &) {}
+
+inline void table_prepare(flatbuffers::FlatBufferBuilder &fbb, const std::string &v, flatbuffers::uoffset_t &off)
+{
+	off = fbb.CreateString(v.c_str(), v.size()).o;
+}
+
+template <typename T>
+void table_prepare(flatbuffers::FlatBufferBuilder &fbb, const std::vector<T> &v, flatbuffers::uoffset_t &off)
+{
+	off = fbb.CreateVector(v.data(), v.size()).o;
+}
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type
+table_put(flatbuffers::FlatBufferBuilder &fbb, flatbuffers::voffset_t slot, const T &v, flatbuffers::uoffset_t)
+{
+	fbb.AddElement<T>(slot, v, T());
+}
+
+inline void table_put(flatbuffers::FlatBufferBuilder &fbb, flatbuffers::voffset_t slot, const std::string &, flatbuffers::uoffset_t off)
+{
+	fbb.AddOffset(slot, flatbuffers::Offset<flatbuffers::String>(off));
+}
+
+template <typename T>
+void table_put(flatbuffers::FlatBufferBuilder &fbb, flatbuffers::voffset_t slot, const std::vector<T> &, flatbuffers::uoffset_t off)
+{
+	fbb.AddOffset(slot, flatbuffers::Offset<flatbuffers::Vector<T>>(off));
+}
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value>::type
+table_get(const flatbuffers::Table *table, flatbuffers::voffset_t slot, T &v)
+{
+	v = table->GetField<T>(slot, T());
+}
+
+inline void table_get(const flatbuffers::Table *table, flatbuffers::voffset_t slot, std::string &v)
+{
+	auto s = table->GetPointer<const flatbuffers::String *>(slot);
+	if (s) v.assign(s->c_str(), s->size());
+	else v.clear();
+}
+
+template <typename T>
+void table_get(const flatbuffers::Table *table, flatbuffers::voffset_t slot, std::vector<T> &v)
+{
+	sample_view<T> view;
+	if (samples_view(table, slot, &view)) v.assign(view.begin(), view.end());
+	else v.clear();
+}
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+table_verify(const flatbuffers::Table *table, flatbuffers::Verifier &verifier, flatbuffers::voffset_t slot, const T *)
+{
+	return table->VerifyField<T>(verifier, slot);
+}
+
+inline bool table_verify(const flatbuffers::Table *table, flatbuffers::Verifier &verifier, flatbuffers::voffset_t slot, const std::string *)
+{
+	return table->VerifyOffset(verifier, slot)
+		&& verifier.VerifyString(table->GetPointer<const flatbuffers::String *>(slot));
+}
+
+template <typename T>
+bool table_verify(const flatbuffers::Table *table, flatbuffers::Verifier &verifier, flatbuffers::voffset_t slot, const std::vector<T> *)
+{
+	return table->VerifyOffset(verifier, slot)
+		&& verifier.VerifyVector(table->GetPointer<const flatbuffers::Vector<T> *>(slot));
+}
+
+template <typename S, size_t... Is>
+void table_encode_fields(flatbuffers::FlatBufferBuilder &fbb, const S &msg, const char *file_identifier, std::index_sequence<Is...>)
+{
+	/* strings must be serialized before the table is started */
+	flatbuffers::uoffset_t offsets[sizeof...(Is) + 1] = {};
+	int prepare[] = { 0, (table_prepare(fbb, msg.*(std::get<Is>(S::fields()).member), offsets[Is]), 0)... };
+	(void)prepare;
+
+	flatbuffers::uoffset_t start = fbb.StartTable();
+	int put[] = { 0, (table_put(fbb, table_slot<S, Is>(), msg.*(std::get<Is>(S::fields()).member), offsets[Is]), 0)... };
+	(void)put;
+	fbb.Finish(flatbuffers::Offset<flatbuffers::Table>(fbb.EndTable(start)), file_identifier);
+}
+
+template <typename S, size_t... Is>
+void table_decode_fields(const flatbuffers::Table *table, S &msg, std::index_sequence<Is...>)
+{
+	int get[] = { 0, (table_get(table, table_slot<S, Is>(), msg.*(std::get<Is>(S::fields()).member)), 0)... };
+	(void)get;
+}
+
+template <typename S, size_t... Is>
+bool table_verify_fields(const flatbuffers::Table *table, flatbuffers::Verifier &verifier, std::index_sequence<Is...>)
+{
+	bool ok[] = { true, table_verify(table, verifier, table_slot<S, Is>(), (const field_type<S, Is> *)nullptr)... };
+	for (bool b : ok) {
+		if (!b) return false;
+	}
+	return true;
+}
+
+/*
+  Encode msg as a schema-less FlatBuffer table and finish the buffer,
+  optionally tagged with a 4 character file_identifier.
+*/
+template <typename S>
+void encode_table(flatbuffers::FlatBufferBuilder &fbb, const S &msg, const char *file_identifier = nullptr)
+{
+	fbb.Clear();
+	table_encode_fields(fbb, msg, file_identifier, std::make_index_sequence<field_count<S>()>());
+}
+
+/*
+  Verify an untrusted FlatBuffer table against the schema: root offset, vtable,
+  every scalar field's extent and every string's bounds and terminator.
+*/
+template <typename S>
+bool verify_table(const uint8_t *data, size_t size)
+{
+	if (size < sizeof(flatbuffers::uoffset_t)) return false;
+
+	flatbuffers::uoffset_t root = flatbuffers::ReadScalar<flatbuffers::uoffset_t>(data);
+	if (root > size - sizeof(flatbuffers::soffset_t)) return false;
+
+	flatbuffers::Verifier verifier(data, size);
+	auto table = flatbuffers::GetRoot<flatbuffers::Table>(data);
+	if (!table->VerifyTableStart(verifier)) return false;
+	if (!table_verify_fields<S>(table, verifier, std::make_index_sequence<field_count<S>()>())) return false;
+
+	return verifier.EndTable();
+}
+
+/* Decode a FlatBuffer table written by encode_table. */
+template <typename S>
+bool decode_table(const uint8_t *data, size_t size, S &msg)
+{
+	if (size < sizeof(flatbuffers::uoffset_t)) return false;
+
+	auto table = flatbuffers::GetRoot<flatbuffers::Table>(data);
+	table_decode_fields(table, msg, std::make_index_sequence<field_count<S>()>());
+	return true;
+}
+
+} // namespace msg_schema
@@ -0,0 +1,137 @@
+/*
+  msg_schema_bench
+  Compares the fbb.Map lambda encoding used by the senders and the generic
+  key/value decode used by the receivers with the msg_schema encoders/decoders.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -o msg_schema_bench msg_schema_bench.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <flatbuffers/flexbuffers.h>
+#include "sensor_msg.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double ns_per_op(bench_clock::time_point start, int iterations)
+{
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+	return (double)ns / iterations;
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n iterations] [-t text]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = DEFAULT_ITERATIONS;
+	const char *text = "hello";
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i < argc - 1) {
+			iterations = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-t") && i < argc - 1) {
+			text = argv[++i];
+		}
+		else {
+			usage(argv[0]);
+		}
+	}
+	if (iterations <= 0) usage(argv[0]);
+
+	flexbuffers::Builder map_fbb;
+	flexbuffers::Builder schema_fbb(256, flexbuffers::BUILDER_FLAG_NONE);
+	flatbuffers::FlatBufferBuilder table_fbb;
+	sensor_msg msg;
+	sensor_msg out;
+	double sink = 0;
+
+	msg.time = 1.0;
+	msg.text = text;
+
+	/* encode: fbb.Map lambda */
+	auto start = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		double timestamp = msg.time + i;
+		map_fbb.Clear();
+		map_fbb.Map([&]() {
+			map_fbb.Double("time", timestamp);
+			map_fbb.String("text", text);
+		});
+		map_fbb.Finish();
+		sink += map_fbb.GetSize();
+	}
+	double map_encode = ns_per_op(start, iterations);
+
+	/* encode: msg_schema FlexBuffer */
+	start = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		msg.time = 1.0 + i;
+		msg_schema::encode_flex(schema_fbb, msg);
+		sink += schema_fbb.GetSize();
+	}
+	double schema_encode = ns_per_op(start, iterations);
+
+	/* encode: msg_schema FlatBuffer table */
+	start = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		msg.time = 1.0 + i;
+		msg_schema::encode_table(table_fbb, msg);
+		sink += table_fbb.GetSize();
+	}
+	double table_encode = ns_per_op(start, iterations);
+
+	std::vector<uint8_t> flex_buf = map_fbb.GetBuffer();
+	std::vector<uint8_t> table_buf(table_fbb.GetBufferPointer(), table_fbb.GetBufferPointer() + table_fbb.GetSize());
+
+	/* decode: keys/values walk as in my_message_callback, typed instead of ToString() */
+	start = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		auto map = flexbuffers::GetRoot(flex_buf).AsMap();
+		auto keys = map.Keys();
+		auto values = map.Values();
+		for (size_t k = 0; k < keys.size(); k++) {
+			const char *key = keys[k].AsKey();
+			if (!strcmp(key, "time")) out.time = values[k].AsDouble();
+			else if (!strcmp(key, "text")) out.text = values[k].AsString().str();
+		}
+		sink += out.time;
+	}
+	double map_decode = ns_per_op(start, iterations);
+
+	/* decode: msg_schema FlexBuffer */
+	start = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		msg_schema::decode_flex(flex_buf.data(), flex_buf.size(), out);
+		sink += out.time;
+	}
+	double schema_decode = ns_per_op(start, iterations);
+
+	/* decode: msg_schema FlatBuffer table */
+	start = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		msg_schema::decode_table(table_buf.data(), table_buf.size(), out);
+		sink += out.time;
+	}
+	double table_decode = ns_per_op(start, iterations);
+
+	printf("iterations: %d, text: %zu bytes\n", iterations, strlen(text));
+	printf("%-22s %10s %10s %8s\n", "method", "enc ns/op", "dec ns/op", "bytes");
+	printf("%-22s %10.1f %10.1f %8zu\n", "fbb.Map lambda", map_encode, map_decode, flex_buf.size());
+	printf("%-22s %10.1f %10.1f %8zu\n", "msg_schema flexbuffer", schema_encode, schema_decode, (size_t)schema_fbb.GetSize());
+	printf("%-22s %10.1f %10.1f %8zu\n", "msg_schema flatbuffer", table_encode, table_decode, table_buf.size());
+	fprintf(stderr, "(sink %g)\n", sink);
+
+	return 0;
+}
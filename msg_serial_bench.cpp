@@ -0,0 +1,313 @@
+/*
+  msg_serial_bench
+  Encode/decode cost of the payload encodings available to the clients,
+  across payload sizes:
+
+    map       fbb.Map lambda with "time"/"text" keys, as the senders used to
+              build it, decoded by walking keys/values as the receivers did
+    flex      msg_schema FlexBuffer map (encode_flex/decode_flex)
+    table     msg_schema FlatBuffer table (encode_table/decode_table)
+    raw       packed struct header + text bytes, memcpy in and out
+    vector    msg_schema FlexBuffer map with a float typed vector instead of
+              text, decoded as a zero-copy samples_view
+
+  The payload size is the text length (or samples * 4 for vector). Builders
+  and the decode target are reused across iterations like the clients do,
+  so allocs/op is the steady-state count. Results go to stdout as a table,
+  or as a JSON array with -j.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -o msg_serial_bench msg_serial_bench.cpp msg_samples.cpp
+  or build the msg_serial_bench target with CMake.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+#include <flatbuffers/flexbuffers.h>
+#include "sensor_msg.h"
+#include "msg_samples.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define MAX_SIZES 16
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* operator new calls and bytes, sampled around each timed loop */
+static uint64_t alloc_count = 0;
+static uint64_t alloc_bytes = 0;
+
+void *operator new(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	alloc_count++;
+	alloc_bytes += size;
+	return p;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+/* same payload carried as samples instead of text */
+struct vector_msg {
+	double time;
+	std::vector<float> samples;
+
+	static constexpr auto fields()
+	{
+		return std::make_tuple(
+			msg_schema::field("time", &vector_msg::time),
+			msg_schema::field("samples", &vector_msg::samples));
+	}
+};
+
+#pragma pack(push, 1)
+struct raw_sensor_header {
+	double time;
+	uint32_t text_len;
+};
+#pragma pack(pop)
+
+struct bench_result {
+	const char *codec;
+	size_t payload;
+	int iterations;
+	double encode_ns;
+	double decode_ns;
+	size_t bytes;
+	double encode_allocs;
+	double decode_allocs;
+	double encode_alloc_bytes;
+};
+
+struct bench_timer {
+	bench_clock::time_point start;
+	uint64_t allocs;
+	uint64_t bytes;
+};
+
+static void timer_start(struct bench_timer *t)
+{
+	t->allocs = alloc_count;
+	t->bytes = alloc_bytes;
+	t->start = bench_clock::now();
+}
+
+static double timer_stop(struct bench_timer *t, int iterations, double *allocs, double *bytes)
+{
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t->start).count();
+	*allocs = (double)(alloc_count - t->allocs) / iterations;
+	if (bytes) *bytes = (double)(alloc_bytes - t->bytes) / iterations;
+	return (double)ns / iterations;
+}
+
+static double sink = 0;
+
+/*
+  Run encode() then decode() `iterations` times each, after one untimed
+  round so the builders and the decode target have reached their size.
+*/
+template <typename E, typename D>
+static void run(struct bench_result *r, const char *codec, size_t payload, int iterations, E encode, D decode)
+{
+	struct bench_timer t;
+
+	r->codec = codec;
+	r->payload = payload;
+	r->iterations = iterations;
+
+	r->bytes = encode(0);
+	decode();
+
+	timer_start(&t);
+	for (int i = 0; i < iterations; i++) sink += (double)encode(i);
+	r->encode_ns = timer_stop(&t, iterations, &r->encode_allocs, &r->encode_alloc_bytes);
+
+	timer_start(&t);
+	for (int i = 0; i < iterations; i++) sink += decode();
+	r->decode_ns = timer_stop(&t, iterations, &r->decode_allocs, NULL);
+}
+
+static size_t bench_size(struct bench_result *results, size_t payload, int iterations)
+{
+	flexbuffers::Builder map_fbb;
+	flexbuffers::Builder schema_fbb(256, flexbuffers::BUILDER_FLAG_NONE);
+	flatbuffers::FlatBufferBuilder table_fbb;
+	std::vector<uint8_t> buf;
+	sensor_msg msg, out;
+	vector_msg vmsg;
+	size_t n = 0;
+
+	msg.time = 1.0;
+	msg.text.assign(payload, 'x');
+	vmsg.time = 1.0;
+	vmsg.samples.assign((payload + sizeof(float) - 1) / sizeof(float), 0.5f);
+
+	run(&results[n++], "map", payload, iterations,
+		[&](int i) {
+			double timestamp = msg.time + i;
+			map_fbb.Clear();
+			map_fbb.Map([&]() {
+				map_fbb.Double("time", timestamp);
+				map_fbb.String("text", msg.text);
+			});
+			map_fbb.Finish();
+			return map_fbb.GetSize();
+		},
+		[&]() {
+			auto map = flexbuffers::GetRoot(map_fbb.GetBuffer()).AsMap();
+			auto keys = map.Keys();
+			auto values = map.Values();
+			for (size_t k = 0; k < keys.size(); k++) {
+				const char *key = keys[k].AsKey();
+				if (!strcmp(key, "time")) out.time = values[k].AsDouble();
+				else if (!strcmp(key, "text")) out.text = values[k].AsString().str();
+			}
+			return out.time;
+		});
+
+	run(&results[n++], "flex", payload, iterations,
+		[&](int i) {
+			msg.time = 1.0 + i;
+			msg_schema::encode_flex(schema_fbb, msg);
+			return schema_fbb.GetSize();
+		},
+		[&]() {
+			const std::vector<uint8_t> &flex_buf = schema_fbb.GetBuffer();
+			msg_schema::decode_flex(flex_buf.data(), flex_buf.size(), out);
+			return out.time;
+		});
+
+	run(&results[n++], "table", payload, iterations,
+		[&](int i) {
+			msg.time = 1.0 + i;
+			msg_schema::encode_table(table_fbb, msg);
+			return (size_t)table_fbb.GetSize();
+		},
+		[&]() {
+			msg_schema::decode_table(table_fbb.GetBufferPointer(), table_fbb.GetSize(), out);
+			return out.time;
+		});
+
+	run(&results[n++], "raw", payload, iterations,
+		[&](int i) {
+			struct raw_sensor_header header;
+			header.time = 1.0 + i;
+			header.text_len = (uint32_t)msg.text.size();
+			buf.resize(sizeof(header) + header.text_len);
+			memcpy(buf.data(), &header, sizeof(header));
+			memcpy(buf.data() + sizeof(header), msg.text.data(), header.text_len);
+			return buf.size();
+		},
+		[&]() {
+			struct raw_sensor_header header;
+			if (buf.size() < sizeof(header)) return 0.0;
+			memcpy(&header, buf.data(), sizeof(header));
+			if (buf.size() - sizeof(header) < header.text_len) return 0.0;
+			out.time = header.time;
+			out.text.assign((const char *)buf.data() + sizeof(header), header.text_len);
+			return out.time;
+		});
+
+	run(&results[n++], "vector", payload, iterations,
+		[&](int i) {
+			vmsg.time = 1.0 + i;
+			msg_schema::encode_flex(schema_fbb, vmsg);
+			return schema_fbb.GetSize();
+		},
+		[&]() {
+			/* "samples" sorts before "time" */
+			sample_view<float> view;
+			auto values = flexbuffers::GetRoot(schema_fbb.GetBuffer()).AsMap().Values();
+			if (!samples_view(values[0], &view) || !view.size) return 0.0;
+			return values[1].AsDouble() + view[view.size - 1];
+		});
+
+	return n;
+}
+
+static void print_table(const struct bench_result *results, size_t count)
+{
+	printf("%-7s %8s %10s %10s %8s %10s %10s\n", "codec", "payload", "enc ns/op", "dec ns/op", "bytes", "enc allocs", "dec allocs");
+	for (size_t i = 0; i < count; i++) {
+		const struct bench_result *r = &results[i];
+		printf("%-7s %8zu %10.1f %10.1f %8zu %10.2f %10.2f\n", r->codec, r->payload,
+			r->encode_ns, r->decode_ns, r->bytes, r->encode_allocs, r->decode_allocs);
+	}
+}
+
+static void print_json(const struct bench_result *results, size_t count)
+{
+	printf("[\n");
+	for (size_t i = 0; i < count; i++) {
+		const struct bench_result *r = &results[i];
+		printf("  {\"codec\": \"%s\", \"payload\": %zu, \"iterations\": %d, "
+			"\"encode_ns_per_op\": %.2f, \"decode_ns_per_op\": %.2f, \"bytes_per_op\": %zu, "
+			"\"encode_allocs_per_op\": %.3f, \"decode_allocs_per_op\": %.3f, \"encode_alloc_bytes_per_op\": %.1f}%s\n",
+			r->codec, r->payload, r->iterations, r->encode_ns, r->decode_ns, r->bytes,
+			r->encode_allocs, r->decode_allocs, r->encode_alloc_bytes, i + 1 < count ? "," : "");
+	}
+	printf("]\n");
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-n iterations] [-s size,size,...] [-j]\n"
+		" -n : iterations at 16 bytes; larger payloads run proportionally fewer (default %d)\n"
+		" -s : payload sizes in bytes (default 16,256,4096,65536)\n"
+		" -j : print results as JSON\n", argv0, DEFAULT_ITERATIONS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = DEFAULT_ITERATIONS;
+	size_t sizes[MAX_SIZES] = { 16, 256, 4096, 65536 };
+	size_t size_count = 4;
+	bool json = false;
+
+	/* Parse options */
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-n") && i < argc - 1) {
+			iterations = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-s") && i < argc - 1) {
+			char *p = argv[++i];
+			size_count = 0;
+			while (*p && size_count < MAX_SIZES) {
+				sizes[size_count++] = strtoul(p, &p, 10);
+				if (*p == ',') p++;
+				else if (*p) usage(argv[0]);
+			}
+		}
+		else if (!strcmp(argv[i], "-j")) {
+			json = true;
+		}
+		else {
+			usage(argv[0]);
+		}
+	}
+	if (iterations <= 0 || size_count == 0) usage(argv[0]);
+
+	std::vector<struct bench_result> results(size_count * 5);
+	size_t count = 0;
+	for (size_t s = 0; s < size_count; s++) {
+		/* keep the bytes processed per size roughly constant */
+		int n = (int)(iterations * 16 / (sizes[s] > 16 ? sizes[s] : 16));
+		if (n < 100) n = 100;
+		count += bench_size(&results[count], sizes[s], n);
+	}
+
+	if (json) print_json(results.data(), count);
+	else print_table(results.data(), count);
+	fprintf(stderr, "(sink %g)\n", sink);
+
+	return 0;
+}
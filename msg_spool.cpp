@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "msg_spool.h"
+
+#define SPOOL_MAGIC "MQSPOOL1"
+#define SPOOL_INDEX_MAGIC 0x5853514du /* "MQSX" */
+#define SPOOL_SEGMENT_HEADER 32
+#define SPOOL_RECORD_HEADER 32
+#define SPOOL_INDEX_SLOT 64
+
+/* record: size, crc, id, time_ms, payload_len, topic_len, qos, flags, topic, payload */
+struct spool_record {
+	uint32_t size;
+	uint32_t crc; /* over everything after this field, up to the end of the payload */
+	uint64_t id;
+	uint64_t time_ms;
+	uint32_t payload_len;
+	uint16_t topic_len;
+	uint8_t qos;
+	uint8_t flags;
+};
+
+struct spool_index {
+	uint32_t magic;
+	uint32_t crc;
+	uint64_t generation;
+	uint64_t read_id;
+};
+
+#ifndef _WINDOWS
+
+static uint32_t spool_crc32(const uint8_t *p, size_t len)
+{
+	static uint32_t table[256];
+	static bool ready = false;
+
+	if (!ready) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		ready = true;
+	}
+
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < len; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFFu;
+}
+
+static uint64_t spool_now_ms(void)
+{
+	/* wall clock: retention has to survive restarts */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t spool_align(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+static void segment_path(const struct spool *spool, uint64_t number, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx.seg", spool->dir, (unsigned long long)number);
+}
+
+/* the record at offset, or NULL at the end of the valid log */
+static const struct spool_record *record_at(const struct spool_segment *seg, size_t offset, uint64_t expected_id)
+{
+	struct spool_record rec;
+
+	if (offset + SPOOL_RECORD_HEADER > seg->map_size) return NULL;
+	memcpy(&rec, seg->base + offset, sizeof(rec));
+
+	if (rec.size != spool_align(SPOOL_RECORD_HEADER + rec.topic_len + (size_t)rec.payload_len)) return NULL;
+	if (rec.size > seg->map_size - offset || rec.id != expected_id) return NULL;
+	if (spool_crc32(seg->base + offset + 8, SPOOL_RECORD_HEADER - 8 + rec.topic_len + (size_t)rec.payload_len) != rec.crc) return NULL;
+
+	return (const struct spool_record *)(seg->base + offset);
+}
+
+static void segment_unmap(struct spool_segment *seg)
+{
+	munmap(seg->base, seg->map_size);
+	close(seg->fd);
+}
+
+static int segment_map(struct spool *spool, uint64_t number, bool create, uint64_t first_id, struct spool_segment *seg)
+{
+	char path[SPOOL_PATH_MAX + 32];
+	struct stat st;
+
+	segment_path(spool, number, path, sizeof(path));
+	int fd = open(path, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0644);
+	if (fd < 0) return MOSQ_ERR_ERRNO;
+
+	if (create && ftruncate(fd, (off_t)spool->segment_size) < 0) {
+		close(fd);
+		unlink(path);
+		return MOSQ_ERR_ERRNO;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < SPOOL_SEGMENT_HEADER) {
+		close(fd);
+		return MOSQ_ERR_INVAL;
+	}
+
+	void *base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return MOSQ_ERR_ERRNO;
+	}
+
+	seg->number = number;
+	seg->fd = fd;
+	seg->base = (uint8_t *)base;
+	seg->map_size = (size_t)st.st_size;
+
+	if (create) {
+		memcpy(seg->base, SPOOL_MAGIC, 8);
+		memcpy(seg->base + 8, &number, 8);
+		memcpy(seg->base + 16, &first_id, 8);
+		msync(seg->base, SPOOL_SEGMENT_HEADER, MS_SYNC);
+	}
+	else {
+		uint64_t stored;
+		memcpy(&stored, seg->base + 8, 8);
+		if (memcmp(seg->base, SPOOL_MAGIC, 8) || stored != number) {
+			segment_unmap(seg);
+			return MOSQ_ERR_INVAL;
+		}
+	}
+	memcpy(&seg->first_id, seg->base + 16, 8);
+
+	/* replay: stop at the first record that is missing or torn */
+	size_t offset = SPOOL_SEGMENT_HEADER;
+	uint64_t id = seg->first_id;
+	const struct spool_record *rec;
+	while ((rec = record_at(seg, offset, id)) != NULL) {
+		offset += rec->size;
+		id++;
+	}
+	seg->used = offset;
+	seg->end_id = id;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void segment_remove(struct spool *spool, struct spool_segment *seg)
+{
+	char path[SPOOL_PATH_MAX + 32];
+
+	segment_unmap(seg);
+	segment_path(spool, seg->number, path, sizeof(path));
+	unlink(path);
+}
+
+static int index_write(struct spool *spool)
+{
+	struct spool_index index;
+	uint8_t slot[SPOOL_INDEX_SLOT];
+
+	index.magic = SPOOL_INDEX_MAGIC;
+	index.generation = ++spool->index_generation;
+	index.read_id = spool->read_id;
+	index.crc = spool_crc32((const uint8_t *)&index.generation, sizeof(index) - 8);
+
+	/* alternate between two slots so a torn write leaves the other intact */
+	memset(slot, 0, sizeof(slot));
+	memcpy(slot, &index, sizeof(index));
+	off_t offset = (off_t)(index.generation & 1) * SPOOL_INDEX_SLOT;
+	if (pwrite(spool->index_fd, slot, sizeof(slot), offset) != (ssize_t)sizeof(slot)) return MOSQ_ERR_ERRNO;
+	if (fdatasync(spool->index_fd) < 0) return MOSQ_ERR_ERRNO;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void index_read(struct spool *spool)
+{
+	struct spool_index index;
+	uint8_t slot[SPOOL_INDEX_SLOT];
+
+	spool->index_generation = 0;
+	spool->read_id = 0;
+	for (int i = 0; i < 2; i++) {
+		if (pread(spool->index_fd, slot, sizeof(slot), (off_t)i * SPOOL_INDEX_SLOT) != (ssize_t)sizeof(slot)) continue;
+
+		memcpy(&index, slot, sizeof(index));
+		if (index.magic != SPOOL_INDEX_MAGIC) continue;
+		if (index.crc != spool_crc32((const uint8_t *)&index.generation, sizeof(index) - 8)) continue;
+		if (index.generation > spool->index_generation) {
+			spool->index_generation = index.generation;
+			spool->read_id = index.read_id;
+		}
+	}
+}
+
+/* point the send cursor at record id (or the end of the log) */
+static void seek_send(struct spool *spool, uint64_t id)
+{
+	for (size_t i = 0; i < spool->segments.size(); i++) {
+		struct spool_segment *seg = &spool->segments[i];
+		if (id >= seg->end_id) continue;
+		if (id < seg->first_id) id = seg->first_id;
+
+		size_t offset = SPOOL_SEGMENT_HEADER;
+		for (uint64_t n = seg->first_id; n < id; n++) {
+			offset += record_at(seg, offset, n)->size;
+		}
+		spool->send_segment = i;
+		spool->send_offset = offset;
+		spool->send_id = id;
+		return;
+	}
+
+	spool->send_segment = spool->segments.size() - 1;
+	spool->send_offset = spool->segments.back().used;
+	spool->send_id = spool->segments.back().end_id;
+}
+
+/* drop fully acknowledged segments, never the one being appended to */
+static void reclaim(struct spool *spool)
+{
+	bool removed = false;
+
+	while (spool->segments.size() > 1 && spool->send_segment > 0 && spool->segments.front().end_id <= spool->read_id) {
+		segment_remove(spool, &spool->segments.front());
+		spool->segments.pop_front();
+		spool->send_segment--;
+		removed = true;
+	}
+	if (removed) index_write(spool);
+}
+
+static void advance_read(struct spool *spool)
+{
+	while (!spool->inflight.empty() && spool->inflight.front().acked) {
+		if (spool->inflight.front().id + 1 > spool->read_id) spool->read_id = spool->inflight.front().id + 1;
+		spool->inflight.pop_front();
+	}
+	reclaim(spool);
+}
+
+static const struct spool_policy *find_policy(const struct spool *spool, const char *topic)
+{
+	for (size_t i = 0; i < spool->policies.size(); i++) {
+		bool match = false;
+		mosquitto_topic_matches_sub(spool->policies[i].pattern.c_str(), topic, &match);
+		if (match) return &spool->policies[i];
+	}
+	return NULL;
+}
+
+/* disk cap reached: the oldest segment goes, sent or not */
+static void drop_oldest(struct spool *spool)
+{
+	struct spool_segment *oldest = &spool->segments.front();
+	uint64_t next_id = oldest->end_id;
+
+	if (spool->read_id < next_id) {
+		spool->dropped += next_id - spool->read_id;
+		spool->read_id = next_id;
+	}
+	while (!spool->inflight.empty() && spool->inflight.front().id < next_id) {
+		spool->inflight.pop_front();
+	}
+
+	segment_remove(spool, oldest);
+	spool->segments.pop_front();
+
+	if (spool->send_segment > 0) {
+		spool->send_segment--;
+	}
+	else {
+		seek_send(spool, next_id);
+	}
+	index_write(spool);
+}
+
+int spool_open(struct spool *spool, const char *dir, size_t segment_size, uint64_t max_bytes)
+{
+	char path[SPOOL_PATH_MAX + 32];
+	std::vector<uint64_t> numbers;
+
+	spool->index_fd = -1;
+	if (strlen(dir) >= SPOOL_PATH_MAX) return MOSQ_ERR_INVAL;
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) return MOSQ_ERR_ERRNO;
+
+	strcpy(spool->dir, dir);
+	spool->segment_size = segment_size ? segment_size : SPOOL_DEFAULT_SEGMENT_SIZE;
+	spool->max_bytes = max_bytes ? max_bytes : SPOOL_DEFAULT_MAX_BYTES;
+	spool->window = SPOOL_DEFAULT_WINDOW;
+	spool->sync_every = SPOOL_DEFAULT_SYNC_EVERY;
+	spool->unsynced = 0;
+	spool->segments.clear();
+	spool->inflight.clear();
+	spool->policies.clear();
+	spool->latest.clear();
+	spool->sent = spool->dropped = spool->expired = spool->superseded = 0;
+
+	snprintf(path, sizeof(path), "%s/spool.idx", dir);
+	spool->index_fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (spool->index_fd < 0) return MOSQ_ERR_ERRNO;
+	index_read(spool);
+
+	DIR *d = opendir(dir);
+	if (!d) {
+		int err = errno;
+		close(spool->index_fd);
+		spool->index_fd = -1;
+		errno = err;
+		return MOSQ_ERR_ERRNO;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		unsigned long long number;
+		char suffix[8];
+		if (strlen(entry->d_name) == 20 && sscanf(entry->d_name, "%16llx.%3s", &number, suffix) == 2 && !strcmp(suffix, "seg")) {
+			numbers.push_back(number);
+		}
+	}
+	closedir(d);
+	std::sort(numbers.begin(), numbers.end());
+
+	for (size_t i = 0; i < numbers.size(); i++) {
+		struct spool_segment seg;
+		if (segment_map(spool, numbers[i], false, 0, &seg) != MOSQ_ERR_SUCCESS) {
+			fprintf(stderr, "Warning: spool segment %016llx unreadable, skipped.\n", (unsigned long long)numbers[i]);
+			continue;
+		}
+		spool->segments.push_back(seg);
+	}
+
+	if (spool->segments.empty()) {
+		struct spool_segment seg;
+		int rc = segment_map(spool, 0, true, spool->read_id, &seg);
+		if (rc) {
+			int err = errno;
+			close(spool->index_fd);
+			spool->index_fd = -1;
+			errno = err;
+			return rc;
+		}
+		spool->segments.push_back(seg);
+	}
+
+	if (spool->read_id < spool->segments.front().first_id) spool->read_id = spool->segments.front().first_id;
+	if (spool->read_id > spool->segments.back().end_id) spool->read_id = spool->segments.back().end_id;
+
+	seek_send(spool, spool->read_id);
+	reclaim(spool);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void spool_close(struct spool *spool)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	if (spool->index_fd < 0) return;
+
+	spool_commit(spool);
+	for (size_t i = 0; i < spool->segments.size(); i++) {
+		segment_unmap(&spool->segments[i]);
+	}
+	spool->segments.clear();
+	close(spool->index_fd);
+	spool->index_fd = -1;
+}
+
+int spool_add_policy(struct spool *spool, const char *pattern, uint32_t max_age_ms, bool latest_only)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	if (mosquitto_sub_topic_check(pattern) != MOSQ_ERR_SUCCESS) return MOSQ_ERR_INVAL;
+
+	struct spool_policy policy;
+	policy.pattern = pattern;
+	policy.max_age_ms = max_age_ms;
+	policy.latest_only = latest_only;
+	spool->policies.push_back(policy);
+
+	if (!latest_only) return MOSQ_ERR_SUCCESS;
+
+	/* records recovered from disk take part as well */
+	for (size_t i = 0; i < spool->segments.size(); i++) {
+		struct spool_segment *seg = &spool->segments[i];
+		size_t offset = SPOOL_SEGMENT_HEADER;
+		for (uint64_t id = seg->first_id; id < seg->end_id; id++) {
+			const struct spool_record *rec = record_at(seg, offset, id);
+			std::string topic((const char *)(rec + 1), rec->topic_len);
+			if (find_policy(spool, topic.c_str()) == &spool->policies.back()) spool->latest[topic] = id;
+			offset += rec->size;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int spool_append(struct spool *spool, const char *topic, const void *payload, size_t len, int qos)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+	struct spool_record rec;
+	size_t topic_len = strlen(topic);
+	size_t need = spool_align(SPOOL_RECORD_HEADER + topic_len + len);
+
+	if (topic_len >= SPOOL_MAX_TOPIC || need > spool->segment_size - SPOOL_SEGMENT_HEADER) return MOSQ_ERR_PAYLOAD_SIZE;
+
+	struct spool_segment *tail = &spool->segments.back();
+	if (tail->used + need > tail->map_size) {
+		struct spool_segment seg;
+		int rc = spool_commit(spool);
+		if (rc) return rc;
+
+		rc = segment_map(spool, tail->number + 1, true, tail->end_id, &seg);
+		if (rc) return rc;
+		spool->segments.push_back(seg);
+
+		while (spool->segments.size() > 1 && spool->segments.size() * (uint64_t)spool->segment_size > spool->max_bytes) {
+			drop_oldest(spool);
+		}
+		tail = &spool->segments.back();
+	}
+
+	uint8_t *p = tail->base + tail->used;
+	rec.size = (uint32_t)need;
+	rec.id = tail->end_id;
+	rec.time_ms = spool_now_ms();
+	rec.payload_len = (uint32_t)len;
+	rec.topic_len = (uint16_t)topic_len;
+	rec.qos = (uint8_t)qos;
+	rec.flags = 0;
+	memcpy(p + SPOOL_RECORD_HEADER, topic, topic_len);
+	memcpy(p + SPOOL_RECORD_HEADER + topic_len, payload, len);
+	memcpy(p, &rec, sizeof(rec));
+	rec.crc = spool_crc32(p + 8, SPOOL_RECORD_HEADER - 8 + topic_len + len);
+	memcpy(p + 4, &rec.crc, 4);
+
+	tail->used += need;
+	tail->end_id++;
+
+	const struct spool_policy *policy = find_policy(spool, topic);
+	if (policy && policy->latest_only) spool->latest[topic] = rec.id;
+
+	if (++spool->unsynced >= spool->sync_every) return spool_commit(spool);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int spool_set_sync_every(struct spool *spool, int every)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	if (every < 1) return MOSQ_ERR_INVAL;
+	spool->sync_every = every;
+	if (spool->unsynced >= every) return spool_commit(spool);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int spool_commit(struct spool *spool)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	struct spool_segment *tail = &spool->segments.back();
+	if (msync(tail->base, tail->used, MS_SYNC) < 0) return MOSQ_ERR_ERRNO;
+
+	spool->unsynced = 0;
+	return index_write(spool);
+}
+
+int spool_drain(struct spool *spool, struct mosquitto *mosq)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+	std::string topic;
+	uint64_t now = spool_now_ms();
+
+	while ((int)spool->inflight.size() < spool->window) {
+		struct spool_segment *seg = &spool->segments[spool->send_segment];
+		if (spool->send_offset >= seg->used) {
+			if (spool->send_segment + 1 >= spool->segments.size()) break;
+
+			spool->send_segment++;
+			spool->send_offset = SPOOL_SEGMENT_HEADER;
+			spool->send_id = spool->segments[spool->send_segment].first_id;
+			continue;
+		}
+
+		const struct spool_record *rec = record_at(seg, spool->send_offset, spool->send_id);
+		const uint8_t *payload = (const uint8_t *)(rec + 1) + rec->topic_len;
+		topic.assign((const char *)(rec + 1), rec->topic_len);
+
+		const struct spool_policy *policy = find_policy(spool, topic.c_str());
+		bool skip = false;
+		/* A wall clock stepped back makes the record look new, not ancient. */
+		uint64_t age = now > rec->time_ms ? now - rec->time_ms : 0;
+		if (policy && policy->max_age_ms && age > policy->max_age_ms) {
+			spool->expired++;
+			skip = true;
+		}
+		else if (policy && policy->latest_only && spool->latest[topic] != rec->id) {
+			spool->superseded++;
+			skip = true;
+		}
+
+		struct spool_inflight entry = { -1, rec->id, true };
+		if (!skip) {
+			int rc = mosquitto_publish(mosq, &entry.mid, topic.c_str(), (int)rec->payload_len, payload, rec->qos, false);
+			if (rc != MOSQ_ERR_SUCCESS) return rc;
+
+			/* only QoS 1/2 get a PUBACK/PUBCOMP to wait for */
+			entry.acked = rec->qos == 0;
+			spool->sent++;
+		}
+		spool->inflight.push_back(entry);
+		spool->send_offset += rec->size;
+		spool->send_id++;
+
+		/* skipped records must not hold up the window */
+		if (skip) advance_read(spool);
+	}
+
+	advance_read(spool);
+	return MOSQ_ERR_SUCCESS;
+}
+
+void spool_acked(struct spool *spool, int mid)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	for (size_t i = 0; i < spool->inflight.size(); i++) {
+		struct spool_inflight *entry = &spool->inflight[i];
+		if (entry->mid == mid && !entry->acked) {
+			entry->acked = true;
+			break;
+		}
+	}
+	advance_read(spool);
+}
+
+void spool_rewind(struct spool *spool)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	spool->inflight.clear();
+	seek_send(spool, spool->read_id);
+}
+
+void spool_get_stats(struct spool *spool, struct spool_stats *stats)
+{
+	std::lock_guard<std::recursive_mutex> guard(spool->lock);
+
+	stats->pending = spool->segments.back().end_id - spool->read_id;
+	stats->inflight = spool->inflight.size();
+	stats->disk_bytes = 0;
+	for (size_t i = 0; i < spool->segments.size(); i++) {
+		stats->disk_bytes += spool->segments[i].map_size;
+	}
+	stats->sent = spool->sent;
+	stats->dropped = spool->dropped;
+	stats->expired = spool->expired;
+	stats->superseded = spool->superseded;
+}
+
+#else
+
+int spool_open(struct spool *spool, const char *dir, size_t segment_size, uint64_t max_bytes)
+{
+	spool->index_fd = -1;
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void spool_close(struct spool *spool)
+{
+}
+
+int spool_add_policy(struct spool *spool, const char *pattern, uint32_t max_age_ms, bool latest_only)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int spool_append(struct spool *spool, const char *topic, const void *payload, size_t len, int qos)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int spool_set_sync_every(struct spool *spool, int every)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int spool_commit(struct spool *spool)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+int spool_drain(struct spool *spool, struct mosquitto *mosq)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
+
+void spool_acked(struct spool *spool, int mid)
+{
+}
+
+void spool_rewind(struct spool *spool)
+{
+}
+
+void spool_get_stats(struct spool *spool, struct spool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
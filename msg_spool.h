@@ -0,0 +1,129 @@
+#pragma once
+/*
+  msg_spool
+  Store-and-forward outbox for publishing while the broker is unreachable.
+
+  Every outgoing message is appended to a log of fixed-size, memory-mapped
+  segment files in a spool directory. Records carry a CRC, so after a crash
+  the log is replayed up to the last intact record. A small index file,
+  written alternately into two checksummed slots, holds the read cursor.
+
+  spool_drain() publishes records from the send cursor with a bounded number
+  in flight. PUBACKs (spool_acked) advance the read cursor. Fully
+  acknowledged segments are deleted. After a disconnect spool_rewind() resends
+  everything that was not acknowledged (at least once).
+
+  Disk use is capped at max_bytes by dropping the oldest segment. Retention
+  policies per topic pattern expire old records and, for state-like topics,
+  send only the newest record of each topic.
+
+  Linux/POSIX only; on Windows every call returns MOSQ_ERR_NOT_SUPPORTED.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <mosquitto.h>
+
+#define SPOOL_PATH_MAX 512
+#define SPOOL_MAX_TOPIC 1024
+#define SPOOL_DEFAULT_SEGMENT_SIZE (4 * 1024 * 1024)
+#define SPOOL_DEFAULT_MAX_BYTES (256ull * 1024 * 1024)
+#define SPOOL_DEFAULT_WINDOW 64
+#define SPOOL_DEFAULT_SYNC_EVERY 1
+
+struct spool_segment {
+	uint64_t number;
+	uint64_t first_id;
+	uint64_t end_id; /* one past the last record */
+	int fd;
+	uint8_t *base;
+	size_t map_size;
+	size_t used;
+};
+
+struct spool_policy {
+	std::string pattern;
+	uint32_t max_age_ms; /* 0: keep until sent */
+	bool latest_only; /* send only the newest record of each matching topic */
+};
+
+struct spool_inflight {
+	int mid;
+	uint64_t id;
+	bool acked;
+};
+
+struct spool_stats {
+	uint64_t pending; /* appended, not yet acknowledged */
+	uint64_t inflight;
+	uint64_t disk_bytes;
+	uint64_t sent;
+	uint64_t dropped; /* lost to the disk cap */
+	uint64_t expired;
+	uint64_t superseded;
+};
+
+struct spool {
+	std::recursive_mutex lock; /* drain and acks run on the network thread */
+	char dir[SPOOL_PATH_MAX];
+	int index_fd;
+	uint64_t index_generation;
+	size_t segment_size;
+	uint64_t max_bytes;
+	int window;
+	int sync_every;
+	int unsynced;
+
+	std::deque<struct spool_segment> segments;
+	uint64_t read_id; /* first record not acknowledged */
+	uint64_t send_id; /* next record to publish */
+	size_t send_segment;
+	size_t send_offset;
+
+	std::deque<struct spool_inflight> inflight;
+	std::vector<struct spool_policy> policies;
+	std::unordered_map<std::string, uint64_t> latest; /* topic -> newest record id, latest_only topics */
+
+	uint64_t sent;
+	uint64_t dropped;
+	uint64_t expired;
+	uint64_t superseded;
+};
+
+/* Open or recover the spool in dir (created if missing). */
+int spool_open(struct spool *spool, const char *dir, size_t segment_size, uint64_t max_bytes);
+void spool_close(struct spool *spool);
+
+/* Retention for topics matching pattern ('+'/'#' allowed). */
+int spool_add_policy(struct spool *spool, const char *pattern, uint32_t max_age_ms, bool latest_only);
+
+/*
+  Commit every `every` appends instead of after each one (default
+  SPOOL_DEFAULT_SYNC_EVERY). A commit is an msync of the tail segment and
+  an index write, most of what an append costs. Records live in a shared
+  mapping, so a crash of the process loses nothing either way; a power
+  failure or kernel crash can lose up to every - 1 appended records.
+*/
+int spool_set_sync_every(struct spool *spool, int every);
+
+/* Append a message; made durable every sync_every appends. */
+int spool_append(struct spool *spool, const char *topic, const void *payload, size_t len, int qos);
+
+/* Flush appended records and the cursors to disk. */
+int spool_commit(struct spool *spool);
+
+/* Publish pending records until the window is full. Returns a MOSQ_ERR_* code. */
+int spool_drain(struct spool *spool, struct mosquitto *mosq);
+
+/* Call from the publish callback. */
+void spool_acked(struct spool *spool, int mid);
+
+/* Connection lost: resend everything not acknowledged on the next drain. */
+void spool_rewind(struct spool *spool);
+
+void spool_get_stats(struct spool *spool, struct spool_stats *stats);
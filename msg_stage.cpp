@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <cpuid.h>
+#endif
+#include <mosquitto.h>
+#include "msg_hdr.h"
+#include "msg_per_thread.h"
+#include "msg_stage.h"
+
+#define STAGE_HIST_HIGHEST_NS 10000000000LL /* 10 s */
+#define STAGE_HIST_DIGITS 3
+#define STAGE_CALIBRATE_MS 20
+#define STAGE_COLLECT_MS 100
+
+struct stage_rec {
+	uint32_t stage;
+	uint64_t ns;
+};
+
+typedef struct spsc_ring<struct stage_rec, STAGE_RING_SIZE> stage_ring;
+
+bool stage_enabled = false;
+bool stage_use_tsc = false;
+double stage_ns_per_tick = 1.0;
+
+static uint32_t sample_every = 0;
+static struct per_thread_registry<stage_ring> rings;
+static thread_local stage_ring *thread_ring = NULL;
+static thread_local bool thread_unregistered = false;
+static thread_local uint32_t thread_counter = 0; /* sampling */
+static struct hdr_histogram hist[STAGE_COUNT];
+static uint64_t dropped_total = 0;
+static std::mutex collect_lock;
+static std::thread collector;
+static std::mutex collector_lock;
+static std::condition_variable collector_wake;
+static bool collector_stopping = false;
+
+static const char *stage_names[STAGE_COUNT] = { "encode", "copy", "publish", "transit", "queue", "decode" };
+
+const char *stage_name(enum stage_id stage)
+{
+	return stage < STAGE_COUNT ? stage_names[stage] : "?";
+}
+
+uint64_t stage_now_ns(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if defined(STAGE_HAVE_TSC)
+/* ticks at a constant rate across frequency changes and C-states */
+static bool tsc_invariant(void)
+{
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] < 0x80000007u) return false;
+	__cpuid(regs, 0x80000007);
+	return (regs[3] & (1 << 8)) != 0;
+#else
+	unsigned eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0x80000000u, NULL) < 0x80000007u) return false;
+	__get_cpuid(0x80000007u, &eax, &ebx, &ecx, &edx);
+	return (edx & (1u << 8)) != 0;
+#endif
+}
+#endif
+
+static void collector_run(void)
+{
+	std::unique_lock<std::mutex> guard(collector_lock);
+
+	while (!collector_wake.wait_for(guard, std::chrono::milliseconds(STAGE_COLLECT_MS),
+		[]() { return collector_stopping; })) {
+		guard.unlock();
+		stage_collect();
+		guard.lock();
+	}
+}
+
+void stage_stop(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(collector_lock);
+		collector_stopping = true;
+	}
+	collector_wake.notify_all();
+	if (collector.joinable()) collector.join();
+}
+
+int stage_init(uint32_t every, bool use_tsc)
+{
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		int rc = hdr_init(&hist[i], STAGE_HIST_HIGHEST_NS, STAGE_HIST_DIGITS);
+		if (rc != MOSQ_ERR_SUCCESS) return rc;
+	}
+
+	sample_every = every;
+	stage_use_tsc = false;
+	stage_ns_per_tick = 1.0;
+
+#if defined(STAGE_HAVE_TSC)
+	if (use_tsc && every && tsc_invariant()) {
+		uint64_t ns0 = stage_now_ns();
+		uint64_t tsc0 = __rdtsc();
+		std::this_thread::sleep_for(std::chrono::milliseconds(STAGE_CALIBRATE_MS));
+		uint64_t ns1 = stage_now_ns();
+		uint64_t tsc1 = __rdtsc();
+
+		if (tsc1 > tsc0) {
+			stage_ns_per_tick = (double)(ns1 - ns0) / (double)(tsc1 - tsc0);
+			stage_use_tsc = true;
+		}
+	}
+#endif
+
+	stage_enabled = every > 0;
+	if (stage_enabled && !collector.joinable()) {
+		/* keeps the rings from filling up between reports */
+		collector = std::thread(collector_run);
+		/* runs before the histograms and the thread object are destroyed */
+		atexit(stage_stop);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static stage_ring *stage_thread_ring(void)
+{
+	if (thread_ring || thread_unregistered) return thread_ring;
+
+	thread_ring = per_thread_register(&rings, [](int) {
+		stage_ring *ring = new stage_ring;
+		spsc_reset(ring);
+		return ring;
+	});
+	/* past PER_THREAD_MAX this thread goes untraced */
+	thread_unregistered = !thread_ring;
+	return thread_ring;
+}
+
+void stage_begin_sampled(struct stage_span *span)
+{
+	if (!stage_thread_ring()) return;
+
+	if (++thread_counter < sample_every) return;
+	thread_counter = 0;
+
+	span->last = stage_ticks();
+	if (!span->last) span->last = 1;
+}
+
+void stage_push(enum stage_id stage, uint64_t ns)
+{
+	stage_ring *ring = stage_thread_ring();
+	if (!ring) return;
+
+	struct stage_rec *rec = spsc_claim(ring);
+	if (!rec) return;
+
+	rec->stage = stage;
+	rec->ns = ns;
+	spsc_commit(ring);
+}
+
+void stage_collect(void)
+{
+	std::lock_guard<std::mutex> guard(collect_lock);
+	int count = per_thread_count(&rings);
+
+	for (int i = 0; i < count; i++) {
+		stage_ring *ring = per_thread_at(&rings, i);
+		if (!ring) continue;
+
+		dropped_total += spsc_drain(ring, [](const struct stage_rec &rec) {
+			if (rec.stage < STAGE_COUNT) hdr_record(&hist[rec.stage], (int64_t)rec.ns);
+		});
+	}
+}
+
+void stage_print(FILE *out)
+{
+	stage_collect();
+
+	std::lock_guard<std::mutex> guard(collect_lock);
+	fprintf(out, "stage timing: 1 in %u messages, clock %s\n", sample_every, stage_use_tsc ? "tsc" : "monotonic");
+	fprintf(out, "%-8s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		const struct hdr_histogram *h = &hist[i];
+		if (!h->total) continue;
+
+		fprintf(out, "%-8s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\n", stage_names[i], (unsigned long long)h->total,
+			hdr_mean(h) / 1e3, hdr_value_at_percentile(h, 50.0) / 1e3, hdr_value_at_percentile(h, 99.0) / 1e3,
+			hdr_value_at_percentile(h, 99.9) / 1e3, h->max / 1e3);
+	}
+	if (dropped_total) fprintf(out, "%llu records dropped on full rings\n", (unsigned long long)dropped_total);
+}
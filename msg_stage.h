@@ -0,0 +1,125 @@
+#pragma once
+/*
+  msg_stage
+  Per-message pipeline stage timing (-T every).
+
+  A traced message carries a stage_span along its path, and each
+  stage_mark() closes the stage that began at the previous mark:
+      send     encode   encode_flex (fbb.Map/Finish)
+               copy     FlexBuffer into flex_buf
+               publish  mosquitto_publish call
+      receive  transit  sender's timestamp to the message callback
+               queue    time spent in a receive lane (-C/-B)
+               decode   verify and FlexBuffer decode
+  Durations measured elsewhere (transit, queue) are added with
+  stage_record().
+
+  Each recording thread owns a ring of fixed size (one producer, one
+  consumer, no locks). A background thread started by stage_init() drains
+  the rings every 100 ms into one HDR histogram per stage until
+  stage_stop(); a ring that fills up in between drops the record and
+  counts it.
+
+  One message in `every` per thread is traced. With tracing off,
+  stage_begin() costs a load and a branch, stage_mark() a branch.
+
+  Time comes from the TSC (rdtsc) on x86 CPUs with an invariant TSC
+  (CPUID 0x80000007 EDX bit 8), calibrated against the monotonic clock in
+  stage_init(); elsewhere from the monotonic clock.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <intrin.h>
+# define STAGE_HAVE_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define STAGE_HAVE_TSC 1
+#endif
+
+#define STAGE_RING_SIZE 4096 /* records per thread, power of two */
+
+enum stage_id {
+	STAGE_ENCODE,
+	STAGE_COPY,
+	STAGE_PUBLISH,
+	STAGE_TRANSIT,
+	STAGE_QUEUE,
+	STAGE_DECODE,
+	STAGE_COUNT
+};
+
+struct stage_span {
+	uint64_t last; /* ticks at the previous mark, 0: not traced */
+};
+
+extern bool stage_enabled;
+extern bool stage_use_tsc;
+extern double stage_ns_per_tick;
+
+uint64_t stage_now_ns(void); /* the monotonic clock msg_sched stamps with */
+
+static inline uint64_t stage_ticks(void)
+{
+#if defined(STAGE_HAVE_TSC)
+	if (stage_use_tsc) return __rdtsc();
+#endif
+	return stage_now_ns();
+}
+
+/* out of line halves of the calls below */
+void stage_begin_sampled(struct stage_span *span);
+void stage_push(enum stage_id stage, uint64_t ns);
+
+/*
+  Trace one message in every `every` from each thread (0 turns tracing off)
+  and start the collector. use_tsc picks rdtsc where available. Call once,
+  before any other thread records.
+*/
+int stage_init(uint32_t every, bool use_tsc);
+
+static inline void stage_begin(struct stage_span *span)
+{
+	span->last = 0;
+	if (stage_enabled) stage_begin_sampled(span);
+}
+
+static inline bool stage_traced(const struct stage_span *span)
+{
+	return span->last != 0;
+}
+
+static inline void stage_mark(struct stage_span *span, enum stage_id stage)
+{
+	if (!span->last) return;
+
+	uint64_t now = stage_ticks();
+	stage_push(stage, (uint64_t)((now - span->last) * stage_ns_per_tick));
+	span->last = now;
+}
+
+static inline void stage_record(const struct stage_span *span, enum stage_id stage, uint64_t ns)
+{
+	if (span->last) stage_push(stage, ns);
+}
+
+/* Restart the span clock, e.g. after work that belongs to no stage. */
+static inline void stage_skip(struct stage_span *span)
+{
+	if (span->last) span->last = stage_ticks();
+}
+
+/*
+  Stop and join the collector. Call before stage_print() at exit; also
+  registered with atexit(), for exits that skip it.
+*/
+void stage_stop(void);
+
+/* Move every thread's records into the histograms now. */
+void stage_collect(void);
+
+/* Collect, then print count and p50/p99/p99.9/max per stage in microseconds. */
+void stage_print(FILE *out);
+
+const char *stage_name(enum stage_id stage);
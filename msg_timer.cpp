@@ -0,0 +1,258 @@
+#include <string.h>
+#if defined(_WINDOWS)
+# include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#endif
+#include <mosquitto.h>
+#include "msg_timer.h"
+
+#define TIMER_BITS 8
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+static uint64_t timer_now_us(void)
+{
+#ifdef _WINDOWS
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000 + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static uint64_t current_tick(const struct timer_wheel *wheel)
+{
+	return (timer_now_us() - wheel->start_us) / wheel->tick_us;
+}
+
+static void link_job(struct timer_wheel *wheel, uint32_t id, uint32_t list)
+{
+	struct timer_job *job = &wheel->jobs[id];
+
+	job->list = list;
+	job->prev = TIMER_NONE;
+	job->next = wheel->heads[list];
+	if (job->next != TIMER_NONE) wheel->jobs[job->next].prev = id;
+	wheel->heads[list] = id;
+}
+
+static void unlink_job(struct timer_wheel *wheel, uint32_t id)
+{
+	struct timer_job *job = &wheel->jobs[id];
+
+	if (job->prev != TIMER_NONE) wheel->jobs[job->prev].next = job->next;
+	else wheel->heads[job->list] = job->next;
+	if (job->next != TIMER_NONE) wheel->jobs[job->next].prev = job->prev;
+}
+
+/* file a job by how far away it is */
+static void place_job(struct timer_wheel *wheel, uint32_t id)
+{
+	uint64_t expires = wheel->jobs[id].expires;
+	if (expires < wheel->next_tick) expires = wheel->next_tick;
+
+	uint64_t delta = expires - wheel->next_tick;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= (1ull << (TIMER_BITS * (level + 1)))) level++;
+
+	/* beyond the top wheel: park in its furthest slot and re-cascade later */
+	if (delta >= (1ull << (TIMER_BITS * TIMER_LEVELS))) expires = wheel->next_tick + (1ull << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+	uint32_t slot = (uint32_t)((expires >> (TIMER_BITS * level)) & TIMER_MASK);
+	link_job(wheel, id, level * TIMER_SLOTS + slot);
+}
+
+static void cascade(struct timer_wheel *wheel, int level, uint32_t slot)
+{
+	uint32_t list = level * TIMER_SLOTS + slot;
+	uint32_t id = wheel->heads[list];
+
+	wheel->heads[list] = TIMER_NONE;
+	while (id != TIMER_NONE) {
+		uint32_t next = wheel->jobs[id].next;
+		place_job(wheel, id);
+		id = next;
+	}
+}
+
+/* first occupied level 0 slot before the wheel wraps, else the wrap (a cascade) */
+static uint64_t next_due_tick(const struct timer_wheel *wheel)
+{
+	uint64_t tick = wheel->next_tick;
+	uint64_t boundary = (tick | TIMER_MASK) + 1;
+
+	if (!wheel->active) return UINT64_MAX;
+	if (!(tick & TIMER_MASK)) return tick;
+	for (; tick < boundary; tick++) {
+		if (wheel->heads[tick & TIMER_MASK] != TIMER_NONE) break;
+	}
+	return tick;
+}
+
+int timer_wheel_init(struct timer_wheel *wheel, uint64_t tick_us)
+{
+	wheel->tick_us = tick_us ? tick_us : TIMER_DEFAULT_TICK_US;
+	wheel->start_us = timer_now_us();
+	wheel->next_tick = 0;
+	for (int i = 0; i <= TIMER_WORK_LIST; i++) wheel->heads[i] = TIMER_NONE;
+	wheel->jobs.clear();
+	wheel->free_jobs.clear();
+	wheel->active = 0;
+	wheel->fired = wheel->missed = wheel->passes = 0;
+
+#ifndef _WINDOWS
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->fd < 0) return MOSQ_ERR_ERRNO;
+#else
+	wheel->fd = -1;
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+void timer_wheel_cleanup(struct timer_wheel *wheel)
+{
+#ifndef _WINDOWS
+	if (wheel->fd >= 0) close(wheel->fd);
+#endif
+	wheel->fd = -1;
+	wheel->jobs.clear();
+	wheel->free_jobs.clear();
+	wheel->active = 0;
+}
+
+uint32_t timer_add(struct timer_wheel *wheel, uint64_t delay_us, uint64_t period_us, timer_cb cb, void *user)
+{
+	uint32_t id;
+
+	if (!wheel->free_jobs.empty()) {
+		id = wheel->free_jobs.back();
+		wheel->free_jobs.pop_back();
+	}
+	else {
+		id = (uint32_t)wheel->jobs.size();
+		wheel->jobs.push_back(timer_job());
+	}
+
+	/* deadlines round up so a job never fires early */
+	struct timer_job *job = &wheel->jobs[id];
+	uint64_t due = (timer_now_us() - wheel->start_us + delay_us + wheel->tick_us - 1) / wheel->tick_us;
+	job->expires = due > wheel->next_tick ? due : wheel->next_tick;
+	job->period = period_us ? (period_us + wheel->tick_us / 2) / wheel->tick_us : 0;
+	if (period_us && !job->period) job->period = 1;
+	job->cb = cb;
+	job->user = user;
+
+	place_job(wheel, id);
+	wheel->active++;
+	return id;
+}
+
+void timer_cancel(struct timer_wheel *wheel, uint32_t id)
+{
+	if (id >= wheel->jobs.size() || wheel->jobs[id].list == TIMER_NONE) return;
+
+	unlink_job(wheel, id);
+	wheel->jobs[id].list = TIMER_NONE;
+	wheel->free_jobs.push_back(id);
+	wheel->active--;
+}
+
+size_t timer_advance(struct timer_wheel *wheel)
+{
+	uint64_t now = current_tick(wheel);
+	size_t fired = 0;
+
+	while (wheel->next_tick <= now) {
+		uint64_t tick = wheel->next_tick;
+		uint32_t slot = (uint32_t)(tick & TIMER_MASK);
+
+		/* lower wheel wrapped: pull the next slot of each level above down */
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			if ((tick >> (TIMER_BITS * level - TIMER_BITS)) & TIMER_MASK) break;
+			cascade(wheel, level, (uint32_t)((tick >> (TIMER_BITS * level)) & TIMER_MASK));
+		}
+
+		/* the slot moves to a work list so callbacks may add or cancel freely */
+		wheel->heads[TIMER_WORK_LIST] = wheel->heads[slot];
+		wheel->heads[slot] = TIMER_NONE;
+		for (uint32_t id = wheel->heads[TIMER_WORK_LIST]; id != TIMER_NONE; id = wheel->jobs[id].next) {
+			wheel->jobs[id].list = TIMER_WORK_LIST;
+		}
+		wheel->next_tick = tick + 1;
+
+		uint32_t id;
+		while ((id = wheel->heads[TIMER_WORK_LIST]) != TIMER_NONE) {
+			struct timer_job *job = &wheel->jobs[id];
+			unlink_job(wheel, id);
+
+			if (job->period) {
+				job->expires += job->period;
+				while (job->expires < now) {
+					job->expires += job->period;
+					wheel->missed++;
+				}
+				place_job(wheel, id);
+			}
+			else {
+				job->list = TIMER_NONE;
+				wheel->free_jobs.push_back(id);
+				wheel->active--;
+			}
+
+			job->cb(wheel, id, job->user);
+			fired++;
+		}
+
+		/* empty slots in between need no visit */
+		uint64_t due = next_due_tick(wheel);
+		wheel->next_tick = due < now + 1 ? due : now + 1;
+	}
+
+	wheel->fired += fired;
+	if (fired) wheel->passes++;
+	return fired;
+}
+
+int64_t timer_next_us(const struct timer_wheel *wheel)
+{
+	if (!wheel->active) return -1;
+
+	uint64_t tick = next_due_tick(wheel);
+	uint64_t due_us = wheel->start_us + tick * wheel->tick_us;
+	uint64_t now_us = timer_now_us();
+	return due_us > now_us ? (int64_t)(due_us - now_us) : 0;
+}
+
+int timer_arm(struct timer_wheel *wheel)
+{
+#ifndef _WINDOWS
+	struct itimerspec spec;
+	int64_t wait = timer_next_us(wheel);
+
+	memset(&spec, 0, sizeof(spec));
+	if (wait >= 0) {
+		/* zero would disarm the timer */
+		if (wait == 0) wait = 1;
+		spec.it_value.tv_sec = wait / 1000000;
+		spec.it_value.tv_nsec = (wait % 1000000) * 1000;
+	}
+	if (timerfd_settime(wheel->fd, 0, &spec, NULL) < 0) return MOSQ_ERR_ERRNO;
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void timer_ack(struct timer_wheel *wheel)
+{
+#ifndef _WINDOWS
+	uint64_t expirations;
+	if (read(wheel->fd, &expirations, sizeof(expirations)) < 0) return;
+#endif
+}
@@ -0,0 +1,77 @@
+#pragma once
+/*
+  msg_timer
+  Hierarchical timing wheel for periodic and one-shot publish jobs.
+
+  Four wheels of 256 slots: level 0 holds jobs due within 256 ticks, and
+  level n jobs due within 256^(n+1) ticks. A level n slot is cascaded into
+  the level below when the lower wheel wraps, so adding, cancelling and
+  firing a job are all O(1). Jobs live in one pool and are chained into
+  slots by index, so the wheel allocates only when the pool grows.
+
+  timer_advance() fires every job due up to the current tick. Jobs due in
+  the same tick run in one pass, and the caller flushes the socket once
+  afterwards. Periodic jobs are rescheduled from their previous deadline
+  rather than from when they ran, so rates do not drift. Missed periods
+  (the loop stalled) are skipped and counted.
+
+  On Linux the wheel owns a timerfd armed for the next due slot
+  (timer_arm), for poll()/epoll loops. timer_next_us() gives the same
+  deadline as a timeout.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define TIMER_NONE 0xffffffffu
+#define TIMER_LEVELS 4
+#define TIMER_SLOTS 256
+#define TIMER_WORK_LIST (TIMER_LEVELS * TIMER_SLOTS)
+#define TIMER_DEFAULT_TICK_US 1000
+
+struct timer_wheel;
+
+typedef void (*timer_cb)(struct timer_wheel *wheel, uint32_t id, void *user);
+
+struct timer_job {
+	uint64_t expires; /* tick */
+	uint64_t period; /* ticks, 0: one-shot */
+	timer_cb cb;
+	void *user;
+	uint32_t prev;
+	uint32_t next;
+	uint32_t list; /* slot index, TIMER_WORK_LIST while firing, TIMER_NONE when free */
+};
+
+struct timer_wheel {
+	uint64_t tick_us;
+	uint64_t start_us;
+	uint64_t next_tick; /* first tick not processed yet */
+	uint32_t heads[TIMER_WORK_LIST + 1];
+	std::vector<struct timer_job> jobs;
+	std::vector<uint32_t> free_jobs;
+	size_t active;
+	int fd; /* timerfd, -1 where unavailable */
+
+	uint64_t fired;
+	uint64_t missed; /* periods skipped because the loop was late */
+	uint64_t passes; /* timer_advance calls that fired something */
+};
+
+int timer_wheel_init(struct timer_wheel *wheel, uint64_t tick_us);
+void timer_wheel_cleanup(struct timer_wheel *wheel);
+
+/* Schedule cb after delay_us, then every period_us (0: once). Returns the job id. */
+uint32_t timer_add(struct timer_wheel *wheel, uint64_t delay_us, uint64_t period_us, timer_cb cb, void *user);
+void timer_cancel(struct timer_wheel *wheel, uint32_t id);
+
+/* Fire everything due by now; returns the number of jobs run. */
+size_t timer_advance(struct timer_wheel *wheel);
+
+/* Microseconds until the next slot that may hold a due job, -1 if idle. */
+int64_t timer_next_us(const struct timer_wheel *wheel);
+
+/* Arm the timerfd for timer_next_us(); read it (timer_ack) when it fires. */
+int timer_arm(struct timer_wheel *wheel);
+void timer_ack(struct timer_wheel *wheel);
@@ -0,0 +1,613 @@
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "msg_topic_cache.h"
+
+#define TOPIC_KIND_TABLE 4
+#define TOPIC_TOMBSTONE 0xfffffffeu
+
+static uint64_t topic_hash(const void *data, size_t len)
+{
+	/* FNV-1a */
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static uint32_t id_hash(uint32_t id)
+{
+	return (uint32_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/* --- slabs --- */
+
+static int slab_class(size_t len)
+{
+	if (len <= 256) return len ? (int)((len + 15) / 16) - 1 : 0;
+
+	int cls = 16;
+	for (size_t size = 512; size < len; size <<= 1) cls++;
+	return cls < TOPIC_SLAB_CLASSES ? cls : -1;
+}
+
+static uint8_t *slab_alloc(struct topic_cache *cache, size_t len)
+{
+	int cls = slab_class(len);
+	if (cls < 0) {
+		cache->large_bytes += len;
+		return (uint8_t *)malloc(len);
+	}
+
+	struct topic_slab *slab = &cache->slabs[cls];
+	if (!slab->free_list.empty()) {
+		uint8_t *p = slab->free_list.back();
+		slab->free_list.pop_back();
+		return p;
+	}
+	if (!slab->page || slab->used + slab->size > TOPIC_SLAB_PAGE) {
+		slab->page = (uint8_t *)malloc(TOPIC_SLAB_PAGE);
+		if (!slab->page) return NULL;
+		cache->pages.push_back(slab->page);
+		slab->used = 0;
+	}
+
+	uint8_t *p = slab->page + slab->used;
+	slab->used += slab->size;
+	return p;
+}
+
+static void slab_free(struct topic_cache *cache, uint8_t *p, size_t len)
+{
+	int cls = slab_class(len);
+	if (cls < 0) {
+		cache->large_bytes -= len;
+		free(p);
+		return;
+	}
+	cache->slabs[cls].free_list.push_back(p);
+}
+
+/* --- interned segments --- */
+
+static uint32_t seg_len(const struct topic_cache *cache, uint32_t id)
+{
+	return cache->seg_offset[id + 1] - cache->seg_offset[id];
+}
+
+static const char *seg_str(const struct topic_cache *cache, uint32_t id)
+{
+	return cache->seg_chars.data() + cache->seg_offset[id];
+}
+
+static uint32_t seg_find(const struct topic_cache *cache, const char *s, size_t len)
+{
+	uint32_t mask = (uint32_t)cache->seg_slots.size() - 1;
+	uint32_t i = (uint32_t)topic_hash(s, len) & mask;
+
+	for (;; i = (i + 1) & mask) {
+		uint32_t id = cache->seg_slots[i];
+		if (id == TOPIC_NONE) return TOPIC_NONE;
+		if (seg_len(cache, id) == len && !memcmp(seg_str(cache, id), s, len)) return id;
+	}
+}
+
+static void seg_insert_slot(struct topic_cache *cache, uint32_t id)
+{
+	uint32_t mask = (uint32_t)cache->seg_slots.size() - 1;
+	uint32_t i = (uint32_t)topic_hash(seg_str(cache, id), seg_len(cache, id)) & mask;
+
+	while (cache->seg_slots[i] != TOPIC_NONE) i = (i + 1) & mask;
+	cache->seg_slots[i] = id;
+}
+
+static uint32_t seg_intern(struct topic_cache *cache, const char *s, size_t len)
+{
+	uint32_t id = seg_find(cache, s, len);
+	if (id != TOPIC_NONE) return id;
+
+	id = (uint32_t)cache->seg_offset.size() - 1;
+	cache->seg_chars.insert(cache->seg_chars.end(), s, s + len);
+	cache->seg_offset.push_back((uint32_t)cache->seg_chars.size());
+
+	if ((size_t)(id + 1) * 2 > cache->seg_slots.size()) {
+		cache->seg_slots.assign(cache->seg_slots.size() * 2, TOPIC_NONE);
+		for (uint32_t i = 0; i <= id; i++) seg_insert_slot(cache, i);
+	}
+	else {
+		seg_insert_slot(cache, id);
+	}
+	return id;
+}
+
+/* --- children --- */
+
+static void table_insert(struct topic_child_table *table, uint32_t segment, uint32_t node)
+{
+	uint32_t mask = (uint32_t)table->segments.size() - 1;
+	uint32_t i = id_hash(segment) & mask;
+
+	while (table->segments[i] != TOPIC_NONE) i = (i + 1) & mask;
+	table->segments[i] = segment;
+	table->nodes[i] = node;
+}
+
+static uint32_t find_child(const struct topic_cache *cache, uint32_t parent, uint32_t segment)
+{
+	const struct topic_node *n = &cache->nodes[parent];
+	if (n->children == TOPIC_NONE) return TOPIC_NONE;
+
+	if (n->kind == TOPIC_KIND_TABLE) {
+		const struct topic_child_table *table = &cache->tables[n->children];
+		uint32_t mask = (uint32_t)table->segments.size() - 1;
+		for (uint32_t i = id_hash(segment) & mask;; i = (i + 1) & mask) {
+			if (table->segments[i] == segment) return table->nodes[i];
+			if (table->segments[i] == TOPIC_NONE) return TOPIC_NONE;
+		}
+	}
+
+	const uint32_t *child = &cache->child_pool[n->children];
+	for (uint32_t i = 0; i < n->child_count; i++) {
+		if (cache->nodes[child[i]].segment == segment) return child[i];
+	}
+	return TOPIC_NONE;
+}
+
+static uint32_t pool_alloc(struct topic_cache *cache, int kind)
+{
+	std::vector<uint32_t> &free_list = cache->child_free[kind];
+	if (!free_list.empty()) {
+		uint32_t off = free_list.back();
+		free_list.pop_back();
+		return off;
+	}
+
+	uint32_t off = (uint32_t)cache->child_pool.size();
+	cache->child_pool.resize(off + (1u << kind));
+	return off;
+}
+
+static void add_child(struct topic_cache *cache, uint32_t parent, uint32_t child)
+{
+	struct topic_node *n = &cache->nodes[parent];
+	uint32_t segment = cache->nodes[child].segment;
+
+	if (n->kind == TOPIC_KIND_TABLE) {
+		struct topic_child_table *table = &cache->tables[n->children];
+		if ((size_t)(n->child_count + 1) * 2 > table->segments.size()) {
+			std::vector<uint32_t> segments(table->segments.size() * 2, TOPIC_NONE);
+			std::vector<uint32_t> nodes(table->segments.size() * 2);
+			segments.swap(table->segments);
+			nodes.swap(table->nodes);
+			for (size_t i = 0; i < segments.size(); i++) {
+				if (segments[i] != TOPIC_NONE) table_insert(table, segments[i], nodes[i]);
+			}
+		}
+		table_insert(table, segment, child);
+		n->child_count++;
+		return;
+	}
+
+	if (n->children == TOPIC_NONE) {
+		uint32_t off = pool_alloc(cache, 0);
+		n = &cache->nodes[parent];
+		n->children = off;
+		n->kind = 0;
+	}
+	else if (n->child_count == (1u << n->kind)) {
+		uint32_t old = n->children;
+		int kind = n->kind;
+
+		if (n->child_count == TOPIC_SMALL_MAX) {
+			/* fan out too wide for a linear scan */
+			struct topic_child_table table;
+			table.segments.assign(TOPIC_SMALL_MAX * 4, TOPIC_NONE);
+			table.nodes.resize(TOPIC_SMALL_MAX * 4);
+			for (uint32_t i = 0; i < n->child_count; i++) {
+				uint32_t c = cache->child_pool[old + i];
+				table_insert(&table, cache->nodes[c].segment, c);
+			}
+			table_insert(&table, segment, child);
+
+			cache->tables.push_back(std::move(table));
+			cache->child_free[kind].push_back(old);
+			n->children = (uint32_t)cache->tables.size() - 1;
+			n->kind = TOPIC_KIND_TABLE;
+			n->child_count++;
+			return;
+		}
+
+		uint32_t off = pool_alloc(cache, kind + 1);
+		memcpy(&cache->child_pool[off], &cache->child_pool[old], (size_t)n->child_count * sizeof(uint32_t));
+		cache->child_free[kind].push_back(old);
+		n = &cache->nodes[parent];
+		n->children = off;
+		n->kind = (uint8_t)(kind + 1);
+	}
+
+	cache->child_pool[n->children + n->child_count] = child;
+	n->child_count++;
+}
+
+template <typename F>
+static void for_each_child(const struct topic_cache *cache, uint32_t parent, F f)
+{
+	const struct topic_node *n = &cache->nodes[parent];
+	if (n->children == TOPIC_NONE) return;
+
+	if (n->kind == TOPIC_KIND_TABLE) {
+		const struct topic_child_table *table = &cache->tables[n->children];
+		for (size_t i = 0; i < table->segments.size(); i++) {
+			if (table->segments[i] != TOPIC_NONE) f(table->nodes[i]);
+		}
+		return;
+	}
+	for (uint32_t i = 0; i < n->child_count; i++) {
+		f(cache->child_pool[n->children + i]);
+	}
+}
+
+/* --- values --- */
+
+static void value_insert_slot(struct topic_cache *cache, uint32_t id)
+{
+	uint32_t mask = (uint32_t)cache->value_slots.size() - 1;
+	uint32_t i = (uint32_t)cache->values[id].hash & mask;
+
+	while (cache->value_slots[i] != TOPIC_NONE && cache->value_slots[i] != TOPIC_TOMBSTONE) i = (i + 1) & mask;
+	if (cache->value_slots[i] == TOPIC_TOMBSTONE) cache->value_tombstones--;
+	cache->value_slots[i] = id;
+}
+
+static void value_rehash(struct topic_cache *cache)
+{
+	size_t live = cache->values.size() - cache->value_free.size();
+	size_t size = 64;
+	while (size < live * 4) size <<= 1;
+
+	cache->value_slots.assign(size, TOPIC_NONE);
+	cache->value_tombstones = 0;
+	for (uint32_t id = 0; id < cache->values.size(); id++) {
+		if (cache->values[id].refs) value_insert_slot(cache, id);
+	}
+}
+
+static uint32_t value_intern(struct topic_cache *cache, const void *payload, size_t len)
+{
+	uint64_t h = topic_hash(payload, len);
+	uint32_t mask = (uint32_t)cache->value_slots.size() - 1;
+
+	for (uint32_t i = (uint32_t)h & mask;; i = (i + 1) & mask) {
+		uint32_t id = cache->value_slots[i];
+		if (id == TOPIC_NONE) break;
+		if (id == TOPIC_TOMBSTONE) continue;
+
+		struct topic_value *v = &cache->values[id];
+		if (v->hash == h && v->len == len && !memcmp(v->data, payload, len)) {
+			v->refs++;
+			return id;
+		}
+	}
+
+	uint8_t *data = slab_alloc(cache, len);
+	if (!data) return TOPIC_NONE;
+	memcpy(data, payload, len);
+
+	uint32_t id;
+	if (!cache->value_free.empty()) {
+		id = cache->value_free.back();
+		cache->value_free.pop_back();
+	}
+	else {
+		id = (uint32_t)cache->values.size();
+		cache->values.push_back(topic_value());
+	}
+	cache->values[id] = { data, (uint32_t)len, 1, h };
+
+	size_t live = cache->values.size() - cache->value_free.size();
+	if ((live + cache->value_tombstones) * 2 > cache->value_slots.size()) {
+		value_rehash(cache);
+	}
+	else {
+		value_insert_slot(cache, id);
+	}
+	return id;
+}
+
+static void value_release(struct topic_cache *cache, uint32_t id)
+{
+	struct topic_value *v = &cache->values[id];
+	if (--v->refs) return;
+
+	uint32_t mask = (uint32_t)cache->value_slots.size() - 1;
+	for (uint32_t i = (uint32_t)v->hash & mask;; i = (i + 1) & mask) {
+		if (cache->value_slots[i] == id) {
+			cache->value_slots[i] = TOPIC_TOMBSTONE;
+			cache->value_tombstones++;
+			break;
+		}
+	}
+
+	slab_free(cache, v->data, v->len);
+	v->data = NULL;
+	cache->value_free.push_back(id);
+}
+
+/* --- cache --- */
+
+void topic_cache_init(struct topic_cache *cache)
+{
+	cache->nodes.assign(1, { TOPIC_NONE, TOPIC_NONE, TOPIC_NONE, 0, 0 });
+	cache->child_pool.clear();
+	for (int i = 0; i < 4; i++) cache->child_free[i].clear();
+	cache->tables.clear();
+
+	cache->seg_chars.clear();
+	cache->seg_offset.assign(1, 0);
+	cache->seg_slots.assign(64, TOPIC_NONE);
+
+	cache->values.clear();
+	cache->value_free.clear();
+	cache->value_slots.assign(64, TOPIC_NONE);
+	cache->value_tombstones = 0;
+
+	for (int i = 0; i < TOPIC_SLAB_CLASSES; i++) {
+		cache->slabs[i].size = i < 16 ? (uint32_t)(i + 1) * 16 : 512u << (i - 16);
+		cache->slabs[i].page = NULL;
+		cache->slabs[i].used = 0;
+		cache->slabs[i].free_list.clear();
+	}
+	cache->pages.clear();
+	cache->large_bytes = 0;
+
+	cache->topics = 0;
+	cache->payload_bytes = 0;
+}
+
+void topic_cache_cleanup(struct topic_cache *cache)
+{
+	for (size_t id = 0; id < cache->values.size(); id++) {
+		struct topic_value *v = &cache->values[id];
+		if (v->refs && slab_class(v->len) < 0) free(v->data);
+	}
+	for (size_t i = 0; i < cache->pages.size(); i++) {
+		free(cache->pages[i]);
+	}
+	topic_cache_init(cache);
+}
+
+/* node of topic, or TOPIC_NONE; creates missing nodes when insert is set */
+static uint32_t topic_node_find(struct topic_cache *cache, const char *topic, bool insert)
+{
+	uint32_t node = 0;
+	int depth = 0;
+
+	for (const char *s = topic;; depth++) {
+		const char *end = strchr(s, '/');
+		size_t len = end ? (size_t)(end - s) : strlen(s);
+
+		if (depth == TOPIC_MAX_DEPTH) return TOPIC_NONE;
+
+		uint32_t segment = insert ? seg_intern(cache, s, len) : seg_find(cache, s, len);
+		if (segment == TOPIC_NONE) return TOPIC_NONE;
+
+		uint32_t child = find_child(cache, node, segment);
+		if (child == TOPIC_NONE) {
+			if (!insert) return TOPIC_NONE;
+
+			child = (uint32_t)cache->nodes.size();
+			cache->nodes.push_back({ segment, TOPIC_NONE, TOPIC_NONE, 0, 0 });
+			add_child(cache, node, child);
+		}
+		node = child;
+
+		if (!end) return node;
+		s = end + 1;
+	}
+}
+
+bool topic_cache_put(struct topic_cache *cache, const char *topic, const void *payload, size_t len)
+{
+	uint32_t node = topic_node_find(cache, topic, true);
+	if (node == TOPIC_NONE) return false;
+
+	uint32_t id = value_intern(cache, payload, len);
+	if (id == TOPIC_NONE) return false;
+
+	uint32_t old = cache->nodes[node].value;
+	cache->nodes[node].value = id;
+	if (old != TOPIC_NONE) {
+		cache->payload_bytes -= cache->values[old].len;
+		value_release(cache, old);
+	}
+	else {
+		cache->topics++;
+	}
+	cache->payload_bytes += len;
+
+	return true;
+}
+
+bool topic_cache_get(const struct topic_cache *cache, const char *topic, struct topic_cache_view *view)
+{
+	uint32_t node = topic_node_find((struct topic_cache *)cache, topic, false);
+	if (node == TOPIC_NONE || cache->nodes[node].value == TOPIC_NONE) return false;
+
+	const struct topic_value *v = &cache->values[cache->nodes[node].value];
+	view->data = v->data;
+	view->len = v->len;
+	return true;
+}
+
+bool topic_cache_erase(struct topic_cache *cache, const char *topic)
+{
+	uint32_t node = topic_node_find(cache, topic, false);
+	if (node == TOPIC_NONE || cache->nodes[node].value == TOPIC_NONE) return false;
+
+	uint32_t id = cache->nodes[node].value;
+	cache->nodes[node].value = TOPIC_NONE;
+	cache->payload_bytes -= cache->values[id].len;
+	cache->topics--;
+	value_release(cache, id);
+	return true;
+}
+
+struct topic_match {
+	const struct topic_cache *cache;
+	const char *pattern[TOPIC_MAX_DEPTH];
+	size_t pattern_len[TOPIC_MAX_DEPTH];
+	int depth;
+	std::string topic;
+	topic_cache_cb cb;
+	void *user;
+	size_t count;
+};
+
+static void match_emit(struct topic_match *m, uint32_t node)
+{
+	uint32_t id = m->cache->nodes[node].value;
+	if (id == TOPIC_NONE) return;
+
+	const struct topic_value *v = &m->cache->values[id];
+	if (m->cb) m->cb(m->user, m->topic.c_str(), v->data, v->len);
+	m->count++;
+}
+
+/* appends "/segment" (or "segment" at the root), returns the old length */
+static size_t match_push(struct topic_match *m, uint32_t node, int depth)
+{
+	size_t mark = m->topic.size();
+	uint32_t segment = m->cache->nodes[node].segment;
+
+	if (depth) m->topic.push_back('/');
+	m->topic.append(seg_str(m->cache, segment), seg_len(m->cache, segment));
+	return mark;
+}
+
+/* wildcards never match topics starting with '$' at the first level */
+static bool match_hidden(const struct topic_match *m, uint32_t node, int depth)
+{
+	uint32_t segment = m->cache->nodes[node].segment;
+	return depth == 0 && seg_len(m->cache, segment) && seg_str(m->cache, segment)[0] == '$';
+}
+
+static void match_all(struct topic_match *m, uint32_t node, int depth)
+{
+	for_each_child(m->cache, node, [&](uint32_t child) {
+		if (match_hidden(m, child, depth)) return;
+
+		size_t mark = match_push(m, child, depth);
+		match_emit(m, child);
+		match_all(m, child, depth + 1);
+		m->topic.resize(mark);
+	});
+}
+
+static void match_node(struct topic_match *m, uint32_t node, int depth)
+{
+	if (depth == m->depth) {
+		match_emit(m, node);
+		return;
+	}
+
+	const char *p = m->pattern[depth];
+	size_t len = m->pattern_len[depth];
+
+	if (len == 1 && p[0] == '#') {
+		/* "a/#" matches "a" itself as well */
+		if (depth) match_emit(m, node);
+		match_all(m, node, depth);
+	}
+	else if (len == 1 && p[0] == '+') {
+		for_each_child(m->cache, node, [&](uint32_t child) {
+			if (match_hidden(m, child, depth)) return;
+
+			size_t mark = match_push(m, child, depth);
+			match_node(m, child, depth + 1);
+			m->topic.resize(mark);
+		});
+	}
+	else {
+		uint32_t segment = seg_find(m->cache, p, len);
+		if (segment == TOPIC_NONE) return;
+
+		uint32_t child = find_child(m->cache, node, segment);
+		if (child == TOPIC_NONE) return;
+
+		size_t mark = match_push(m, child, depth);
+		match_node(m, child, depth + 1);
+		m->topic.resize(mark);
+	}
+}
+
+size_t topic_cache_match(const struct topic_cache *cache, const char *pattern, topic_cache_cb cb, void *user)
+{
+	struct topic_match m;
+	m.cache = cache;
+	m.depth = 0;
+	m.cb = cb;
+	m.user = user;
+	m.count = 0;
+
+	for (const char *s = pattern;; s++) {
+		const char *end = strchr(s, '/');
+		if (m.depth == TOPIC_MAX_DEPTH) return 0;
+
+		m.pattern[m.depth] = s;
+		m.pattern_len[m.depth] = end ? (size_t)(end - s) : strlen(s);
+		m.depth++;
+
+		if (!end) break;
+		s = end;
+	}
+
+	match_node(&m, 0, 0);
+	return m.count;
+}
+
+template <typename T>
+static size_t vector_bytes(const std::vector<T> &v)
+{
+	return v.capacity() * sizeof(T);
+}
+
+void topic_cache_usage(const struct topic_cache *cache, struct topic_cache_stats *stats)
+{
+	size_t index = vector_bytes(cache->nodes) + vector_bytes(cache->child_pool) + vector_bytes(cache->tables)
+		+ vector_bytes(cache->seg_chars) + vector_bytes(cache->seg_offset) + vector_bytes(cache->seg_slots)
+		+ vector_bytes(cache->values) + vector_bytes(cache->value_free) + vector_bytes(cache->value_slots)
+		+ vector_bytes(cache->pages);
+
+	for (int i = 0; i < 4; i++) index += vector_bytes(cache->child_free[i]);
+	for (size_t i = 0; i < cache->tables.size(); i++) {
+		index += vector_bytes(cache->tables[i].segments) + vector_bytes(cache->tables[i].nodes);
+	}
+
+	size_t value_bytes = 0;
+	uint64_t unique = 0;
+	for (size_t id = 0; id < cache->values.size(); id++) {
+		const struct topic_value *v = &cache->values[id];
+		if (!v->refs) continue;
+
+		int cls = slab_class(v->len);
+		value_bytes += cls < 0 ? v->len : cache->slabs[cls].size;
+		unique++;
+	}
+	for (int i = 0; i < TOPIC_SLAB_CLASSES; i++) {
+		index += vector_bytes(cache->slabs[i].free_list);
+	}
+
+	stats->topics = cache->topics;
+	stats->nodes = cache->nodes.size();
+	stats->segments = cache->seg_offset.size() - 1;
+	stats->unique_values = unique;
+	stats->payload_bytes = cache->payload_bytes;
+	stats->value_bytes = value_bytes;
+	stats->index_bytes = index;
+	/* slab pages are counted whole, including free and unused space */
+	stats->total_bytes = index + cache->pages.size() * (uint64_t)TOPIC_SLAB_PAGE + cache->large_bytes;
+	stats->bytes_per_topic = cache->topics ? (double)stats->total_bytes / cache->topics : 0.0;
+}
@@ -0,0 +1,119 @@
+#pragma once
+/*
+  msg_topic_cache
+  In-process last-value cache sized for millions of topics.
+
+  Topics are split at '/' and stored as a radix tree over segments. Every
+  distinct segment string is interned once, so "devices" or "telemetry" cost
+  four bytes per use instead of a heap string. Tree nodes adapt to their fan
+  out: up to TOPIC_SMALL_MAX children live in a small array from a shared
+  pool, larger nodes (the per-device level) switch to an open-addressing
+  table keyed by segment id.
+
+  Values are deduplicated by content: identical payloads (status maps,
+  firmware versions, ...) are stored once and reference counted. Payload
+  bytes live in size-class slabs rather than individual heap blocks.
+
+  topic_cache_get() finds an exact topic, topic_cache_match() walks a
+  subscription pattern with '+' and '#', and topic_cache_usage() reports the
+  memory used per topic.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define TOPIC_NONE 0xffffffffu
+#define TOPIC_SMALL_MAX 8
+#define TOPIC_MAX_DEPTH 64
+#define TOPIC_SLAB_CLASSES 24
+#define TOPIC_SLAB_PAGE (64 * 1024)
+
+struct topic_node {
+	uint32_t segment;
+	uint32_t value; /* value id or TOPIC_NONE */
+	uint32_t children; /* child pool offset, child table index or TOPIC_NONE */
+	uint32_t child_count;
+	uint8_t kind; /* 0-3: small array of 1 << kind, TOPIC_KIND_TABLE: table */
+};
+
+struct topic_child_table {
+	std::vector<uint32_t> segments;
+	std::vector<uint32_t> nodes;
+};
+
+struct topic_value {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t refs;
+	uint64_t hash;
+};
+
+struct topic_slab {
+	uint32_t size;
+	uint8_t *page; /* current page, bump allocated */
+	uint32_t used;
+	std::vector<uint8_t *> free_list;
+};
+
+struct topic_cache {
+	std::vector<struct topic_node> nodes;
+	std::vector<uint32_t> child_pool;
+	std::vector<uint32_t> child_free[4];
+	std::vector<struct topic_child_table> tables;
+
+	/* interned segments */
+	std::vector<char> seg_chars;
+	std::vector<uint32_t> seg_offset;
+	std::vector<uint32_t> seg_slots;
+
+	/* deduplicated values */
+	std::vector<struct topic_value> values;
+	std::vector<uint32_t> value_free;
+	std::vector<uint32_t> value_slots;
+	uint32_t value_tombstones;
+
+	struct topic_slab slabs[TOPIC_SLAB_CLASSES];
+	std::vector<uint8_t *> pages;
+	size_t large_bytes; /* values too big for a slab, malloc'd on their own */
+
+	uint64_t topics;
+	uint64_t payload_bytes; /* sum over topics, before dedup */
+};
+
+struct topic_cache_stats {
+	uint64_t topics;
+	uint64_t nodes;
+	uint64_t segments;
+	uint64_t unique_values;
+	uint64_t payload_bytes;
+	uint64_t value_bytes; /* after dedup, slab rounding included */
+	uint64_t index_bytes; /* tree, segment and value tables */
+	uint64_t total_bytes;
+	double bytes_per_topic;
+};
+
+struct topic_cache_view {
+	const uint8_t *data;
+	size_t len;
+};
+
+/* called for each cached topic matching a pattern */
+typedef void (*topic_cache_cb)(void *user, const char *topic, const uint8_t *data, size_t len);
+
+void topic_cache_init(struct topic_cache *cache);
+void topic_cache_cleanup(struct topic_cache *cache);
+
+/* Store the latest value of topic. Returns false if topic is too deep. */
+bool topic_cache_put(struct topic_cache *cache, const char *topic, const void *payload, size_t len);
+
+/* Exact lookup; view stays valid until the next put or erase. */
+bool topic_cache_get(const struct topic_cache *cache, const char *topic, struct topic_cache_view *view);
+
+/* Forget the value of topic. Tree nodes stay for the next update. */
+bool topic_cache_erase(struct topic_cache *cache, const char *topic);
+
+/* Visit every topic matching an MQTT subscription pattern; returns the count. */
+size_t topic_cache_match(const struct topic_cache *cache, const char *pattern, topic_cache_cb cb, void *user);
+
+void topic_cache_usage(const struct topic_cache *cache, struct topic_cache_stats *stats);
@@ -0,0 +1,158 @@
+/*
+  msg_topic_cache_bench
+  Memory per topic of topic_cache against std::unordered_map<std::string,
+  std::vector<uint8_t>> for N device topics, half of them carrying one of a
+  few shared status payloads and half a unique telemetry payload.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -o msg_topic_cache_bench msg_topic_cache_bench.cpp msg_topic_cache.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_topic_cache.h"
+
+#define DEFAULT_DEVICES 500000
+#define LOOKUPS 1000000
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* heap bytes currently allocated through operator new, for the baseline */
+static size_t heap_bytes = 0;
+
+/* the size goes in front; a full header keeps the 16 byte alignment new promises */
+#define HEAP_HEADER 16
+
+void *operator new(size_t size)
+{
+	uint8_t *p = (uint8_t *)malloc(size + HEAP_HEADER);
+	if (!p) throw std::bad_alloc();
+	memcpy(p, &size, sizeof(size));
+	heap_bytes += size;
+	return p + HEAP_HEADER;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	if (!ptr) return;
+	uint8_t *p = (uint8_t *)ptr - HEAP_HEADER;
+	size_t size;
+	memcpy(&size, p, sizeof(size));
+	heap_bytes -= size;
+	free(p);
+}
+
+void operator delete(void *ptr, size_t size) noexcept
+{
+	(void)size;
+	operator delete(ptr);
+}
+
+static const char *states[] = { "online", "offline", "updating", "error" };
+static const char *firmware[] = { "1.0.0", "1.0.1", "1.1.0", "1.2.0", "1.2.1", "2.0.0", "2.0.1", "2.1.0" };
+
+static void build_status(flexbuffers::Builder &fbb, size_t device)
+{
+	fbb.Clear();
+	fbb.Map([&]() {
+		fbb.String("state", states[device % 4]);
+		fbb.String("fw", firmware[(device / 4) % 8]);
+	});
+	fbb.Finish();
+}
+
+static void build_telemetry(flexbuffers::Builder &fbb, size_t device)
+{
+	fbb.Clear();
+	fbb.Map([&]() {
+		fbb.Double("time", 1615190400.0 + device);
+		fbb.Double("temp", 20.0 + (device % 100) * 0.1);
+		fbb.UInt("seq", device);
+	});
+	fbb.Finish();
+}
+
+static void make_topic(char *topic, size_t size, size_t device, const char *leaf)
+{
+	snprintf(topic, size, "site/%zu/device/%08zx/%s", device % 100, device * 2654435761u, leaf);
+}
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t devices = argc > 1 ? (size_t)atol(argv[1]) : DEFAULT_DEVICES;
+	flexbuffers::Builder fbb;
+	char topic[128];
+
+	/* baseline */
+	size_t baseline_bytes;
+	{
+		size_t before = heap_bytes;
+		std::unordered_map<std::string, std::vector<uint8_t>> map;
+		for (size_t d = 0; d < devices; d++) {
+			build_status(fbb, d);
+			make_topic(topic, sizeof(topic), d, "status");
+			map[topic] = fbb.GetBuffer();
+
+			build_telemetry(fbb, d);
+			make_topic(topic, sizeof(topic), d, "telemetry");
+			map[topic] = fbb.GetBuffer();
+		}
+		baseline_bytes = heap_bytes - before;
+	}
+
+	static struct topic_cache cache;
+	topic_cache_init(&cache);
+
+	auto start = bench_clock::now();
+	for (size_t d = 0; d < devices; d++) {
+		build_status(fbb, d);
+		make_topic(topic, sizeof(topic), d, "status");
+		topic_cache_put(&cache, topic, fbb.GetBuffer().data(), fbb.GetSize());
+
+		build_telemetry(fbb, d);
+		make_topic(topic, sizeof(topic), d, "telemetry");
+		topic_cache_put(&cache, topic, fbb.GetBuffer().data(), fbb.GetSize());
+	}
+	double put_ns = elapsed_ns(start) / (devices * 2);
+
+	struct topic_cache_view view;
+	size_t found = 0;
+	start = bench_clock::now();
+	for (size_t i = 0; i < LOOKUPS; i++) {
+		make_topic(topic, sizeof(topic), (i * 7919) % devices, i & 1 ? "status" : "telemetry");
+		found += topic_cache_get(&cache, topic, &view);
+	}
+	double get_ns = elapsed_ns(start) / LOOKUPS;
+
+	start = bench_clock::now();
+	size_t matched = topic_cache_match(&cache, "site/7/device/+/status", NULL, NULL);
+	double match_ms = elapsed_ns(start) / 1e6;
+
+	struct topic_cache_stats stats;
+	topic_cache_usage(&cache, &stats);
+
+	printf("topics          %llu (%llu nodes, %llu segments)\n", (unsigned long long)stats.topics,
+		(unsigned long long)stats.nodes, (unsigned long long)stats.segments);
+	printf("payload bytes   %llu, %llu unique values in %llu bytes\n", (unsigned long long)stats.payload_bytes,
+		(unsigned long long)stats.unique_values, (unsigned long long)stats.value_bytes);
+	printf("topic_cache     %llu bytes, %.1f bytes/topic (index %llu)\n", (unsigned long long)stats.total_bytes,
+		stats.bytes_per_topic, (unsigned long long)stats.index_bytes);
+	printf("unordered_map   %zu bytes, %.1f bytes/topic (heap, excluding malloc headers)\n", baseline_bytes,
+		(double)baseline_bytes / (devices * 2));
+	printf("put %.0f ns, get %.0f ns (%zu/%d found), site/7/device/+/status: %zu topics in %.2f ms\n",
+		put_ns, get_ns, found, LOOKUPS, matched, match_ms);
+
+	topic_cache_cleanup(&cache);
+	return 0;
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#if defined(_WINDOWS)
+# include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include <mosquitto.h>
+#include <mqtt_protocol.h>
+#include "msg_trace.h"
+
+int64_t trace_now_ns(void)
+{
+	return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+uint32_t trace_topic_hash(const char *topic, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)topic[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void put_hex(char *out, uint64_t v, int digits)
+{
+	for (int i = digits - 1; i >= 0; i--) {
+		out[i] = hex_digits[v & 0x0F];
+		v >>= 4;
+	}
+}
+
+static bool get_hex(const char *in, int digits, uint64_t *v)
+{
+	*v = 0;
+	for (int i = 0; i < digits; i++) {
+		char c = in[i];
+		int d;
+		if (c >= '0' && c <= '9') d = c - '0';
+		else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') d = c - 'A' + 10;
+		else return false;
+		*v = (*v << 4) | (uint64_t)d;
+	}
+	return true;
+}
+
+void trace_format(const struct trace_ctx *ctx, char *out)
+{
+	put_hex(out, ctx->trace_id, 16);
+	out[16] = '-';
+	put_hex(out + 17, ctx->hop, 2);
+	out[19] = '-';
+	put_hex(out + 20, ctx->flags, 2);
+	out[TRACE_VALUE_LEN] = '\0';
+}
+
+bool trace_parse(const char *value, size_t len, struct trace_ctx *ctx)
+{
+	uint64_t id, hop, flags;
+
+	if (len != TRACE_VALUE_LEN || value[16] != '-' || value[19] != '-') return false;
+	if (!get_hex(value, 16, &id) || !get_hex(value + 17, 2, &hop) || !get_hex(value + 20, 2, &flags)) return false;
+
+	ctx->trace_id = id;
+	ctx->hop = (uint8_t)hop;
+	ctx->flags = (uint8_t)flags;
+	return true;
+}
+
+int trace_file_open(struct trace_file *tf, const char *path, const char *process)
+{
+	struct trace_file_header header;
+
+	tf->records = 0;
+	tf->fp = fopen(path, "wb");
+	if (!tf->fp) return MOSQ_ERR_ERRNO;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	strncpy(header.process, process, sizeof(header.process) - 1);
+	header.pid = (uint32_t)getpid();
+	header.record_size = sizeof(struct trace_rec);
+	header.start_ns = trace_now_ns();
+	if (fwrite(&header, sizeof(header), 1, tf->fp) != 1) {
+		fclose(tf->fp);
+		tf->fp = NULL;
+		return MOSQ_ERR_ERRNO;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void file_event_at(struct trace_file *tf, const struct trace_ctx *ctx, enum trace_event event, uint16_t hop,
+	const char *topic, size_t topic_len, int64_t ts_ns)
+{
+	struct trace_rec rec;
+
+	if (!tf->fp) return;
+
+	rec.trace_id = ctx->trace_id;
+	rec.ts_ns = ts_ns;
+	rec.topic_hash = trace_topic_hash(topic, topic_len);
+	rec.hop = hop;
+	rec.event = (uint16_t)event;
+	if (fwrite(&rec, sizeof(rec), 1, tf->fp) == 1) tf->records++;
+}
+
+void trace_file_event(struct trace_file *tf, const struct trace_ctx *ctx, enum trace_event event, uint16_t hop,
+	const char *topic, size_t topic_len)
+{
+	file_event_at(tf, ctx, event, hop, topic, topic_len, trace_now_ns());
+}
+
+void trace_file_close(struct trace_file *tf)
+{
+	if (!tf->fp) return;
+
+	fclose(tf->fp);
+	tf->fp = NULL;
+}
+
+static uint64_t splitmix64(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+int tracer_open(struct tracer *t, const char *path, const char *process, uint32_t every)
+{
+	t->every = every;
+	t->count = 0;
+	t->has_pending = false;
+	/* ids only need to be unique across the processes of one run */
+	t->rng = (uint64_t)trace_now_ns() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)t;
+	return trace_file_open(&t->file, path, process);
+}
+
+void tracer_close(struct tracer *t)
+{
+	trace_file_close(&t->file);
+}
+
+static const mosquitto_property *attach_context(const struct trace_ctx *ctx, const mosquitto_property *props,
+	mosquitto_property **owned)
+{
+	char value[TRACE_VALUE_LEN + 1];
+
+	*owned = NULL;
+	if (props && mosquitto_property_copy_all(owned, props) != MOSQ_ERR_SUCCESS) return props;
+
+	trace_format(ctx, value);
+	if (mosquitto_property_add_string_pair(owned, MQTT_PROP_USER_PROPERTY, TRACE_PROPERTY, value) != MOSQ_ERR_SUCCESS) {
+		mosquitto_property_free_all(owned);
+		return props;
+	}
+	return *owned;
+}
+
+const mosquitto_property *tracer_send(struct tracer *t, const mosquitto_property *props, mosquitto_property **owned)
+{
+	struct trace_ctx ctx;
+
+	*owned = NULL;
+	if (!t->file.fp || !t->every || ++t->count < t->every) return props;
+	t->count = 0;
+
+	ctx.trace_id = splitmix64(&t->rng);
+	ctx.hop = 0;
+	ctx.flags = TRACE_SAMPLED;
+	const mosquitto_property *traced = attach_context(&ctx, props, owned);
+	if (traced == props) return props;
+
+	/* recorded by tracer_sent once the publish went through */
+	t->pending = ctx;
+	t->pending_ns = trace_now_ns();
+	t->has_pending = true;
+	return traced;
+}
+
+void tracer_sent(struct tracer *t, const char *topic, int rc)
+{
+	if (!t->has_pending) return;
+
+	t->has_pending = false;
+	if (rc == MOSQ_ERR_SUCCESS) file_event_at(&t->file, &t->pending, TRACE_SEND, 0, topic, strlen(topic), t->pending_ns);
+}
+
+bool tracer_receive(struct tracer *t, const char *topic, const mosquitto_property *props, struct trace_ctx *ctx)
+{
+	char *name = NULL, *value = NULL;
+	bool found = false;
+
+	if (!t->file.fp || !props) return false;
+
+	const mosquitto_property *p = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+	while (p) {
+		if (!strcmp(name, TRACE_PROPERTY)) found = trace_parse(value, strlen(value), ctx);
+		free(name);
+		free(value);
+		if (found) break;
+		p = mosquitto_property_read_string_pair(p, MQTT_PROP_USER_PROPERTY, &name, &value, true);
+	}
+	if (!found || !(ctx->flags & TRACE_SAMPLED)) return false;
+
+	ctx->hop++;
+	trace_file_event(&t->file, ctx, TRACE_RECV, ctx->hop, topic, strlen(topic));
+	return true;
+}
@@ -0,0 +1,110 @@
+#pragma once
+/*
+  msg_trace
+  Cross-process message tracing (-X file).
+
+  The sender decides whether a message is traced (head-based sampling, one
+  in `every`) and, if so, attaches a trace context as an MQTT v5 user
+  property
+      mqtr = <trace id, 16 hex>-<hop, 2 hex>-<flags, 2 hex>
+  Untraced messages carry nothing. Every process on the way records what it
+  did with a traced message into its own binary trace file:
+      send     the origin publishes it (hop 0)
+      recv     a hop receives it (hop of the context + 1)
+      forward  a hop publishes it on, with the context's hop advanced
+  The stand-in broker (msg_broker) is such a forwarding hop.
+
+  msg_trace_stitch reads the files of all processes, joins the records by
+  trace id and prints latency distributions per hop (emitter -> receiver),
+  time spent inside forwarding processes, and end to end.
+
+  Timestamps are wall clock nanoseconds, so processes on different hosts
+  are only comparable as far as their clocks are synchronised.
+
+  File layout: a trace_file_header, then trace_rec records, little endian
+  as written by the host.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <mosquitto.h>
+
+#define TRACE_PROPERTY "mqtr"
+#define TRACE_VALUE_LEN 22 /* 16 + 1 + 2 + 1 + 2 */
+#define TRACE_SAMPLED 0x01
+#define TRACE_MAGIC "MQTRC001"
+#define TRACE_PROCESS_MAX 32
+
+enum trace_event {
+	TRACE_SEND = 0,
+	TRACE_RECV = 1,
+	TRACE_FORWARD = 2,
+};
+
+struct trace_ctx {
+	uint64_t trace_id;
+	uint8_t hop;
+	uint8_t flags;
+};
+
+struct trace_file_header {
+	char magic[8];
+	char process[TRACE_PROCESS_MAX];
+	uint32_t pid;
+	uint32_t record_size;
+	int64_t start_ns;
+};
+
+struct trace_rec {
+	uint64_t trace_id;
+	int64_t ts_ns;
+	uint32_t topic_hash;
+	uint16_t hop;
+	uint16_t event;
+};
+
+struct trace_file {
+	FILE *fp;
+	uint64_t records;
+};
+
+struct tracer {
+	struct trace_file file;
+	uint32_t every; /* head sampling: one message in every, 0: only follow received contexts */
+	uint32_t count;
+	uint64_t rng;
+	struct trace_ctx pending; /* from tracer_send, recorded by tracer_sent */
+	int64_t pending_ns;
+	bool has_pending;
+};
+
+int64_t trace_now_ns(void);
+uint32_t trace_topic_hash(const char *topic, size_t len);
+
+/* Context <-> property value; out must hold TRACE_VALUE_LEN + 1 bytes. */
+void trace_format(const struct trace_ctx *ctx, char *out);
+bool trace_parse(const char *value, size_t len, struct trace_ctx *ctx);
+
+/* Record files. process names the writer in the stitched report. */
+int trace_file_open(struct trace_file *tf, const char *path, const char *process);
+void trace_file_event(struct trace_file *tf, const struct trace_ctx *ctx, enum trace_event event, uint16_t hop,
+	const char *topic, size_t topic_len);
+void trace_file_close(struct trace_file *tf);
+
+/* Client side on top of libmosquitto properties. */
+int tracer_open(struct tracer *t, const char *path, const char *process, uint32_t every);
+void tracer_close(struct tracer *t);
+
+/*
+  Head: decide whether this message is traced. If it is, return a copy of
+  props with the context added in *owned (free it after publishing);
+  otherwise return props unchanged.
+*/
+const mosquitto_property *tracer_send(struct tracer *t, const mosquitto_property *props, mosquitto_property **owned);
+
+/* After the publish: record the send, stamped at tracer_send, if rc is MOSQ_ERR_SUCCESS. */
+void tracer_sent(struct tracer *t, const char *topic, int rc);
+
+/* Hop: if props carry a sampled context, record the receive and fill ctx (hop advanced). */
+bool tracer_receive(struct tracer *t, const char *topic, const mosquitto_property *props, struct trace_ctx *ctx);
@@ -0,0 +1,216 @@
+/*
+  msg_trace_stitch
+  Joins the trace files written with -X by the senders, the stand-in broker
+  and the receivers (see msg_trace.h) and prints latency distributions:
+      hop N: A -> B        emitter's send/forward to B's receive
+      in B                 B's receive to its forward (forwarding hops)
+      end to end: A -> B   origin's send to the receive at a final hop
+  A receive is attributed only when exactly one process emitted the hop
+  before it.
+
+  Compile:
+  c++ -std=c++14 -O2 -Imosquitto-2.0.8/includes -o msg_trace_stitch msg_trace_stitch.cpp msg_hdr.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "msg_trace.h"
+#include "msg_hdr.h"
+
+#define HIST_HIGHEST_NS 600000000000LL /* ten minutes */
+#define HIST_DIGITS 3
+
+struct trace_point {
+	uint32_t process; /* index into the process names */
+	int64_t ts_ns;
+	uint16_t hop;
+	uint16_t event;
+};
+
+struct stitch_stat {
+	std::string label;
+	struct hdr_histogram hist;
+	uint64_t negative; /* clock skew between processes */
+};
+
+static std::vector<std::string> processes;
+static std::unordered_map<uint64_t, std::vector<struct trace_point>> traces;
+static std::vector<struct stitch_stat> stats;
+static std::map<std::string, size_t> stat_index;
+static uint64_t records = 0;
+
+void usage(char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-j] trace_file...\n"
+		" -j : print results as JSON\n", argv0);
+	exit(1);
+}
+
+static int read_file(const char *path)
+{
+	struct trace_file_header header;
+	struct trace_rec rec;
+
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		fprintf(stderr, "Error: Unable to open '%s'.\n", path);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+		|| header.record_size != sizeof(struct trace_rec)) {
+		fprintf(stderr, "Error: '%s' is not a trace file.\n", path);
+		fclose(fp);
+		return 1;
+	}
+
+	char name[TRACE_PROCESS_MAX + 16];
+	header.process[TRACE_PROCESS_MAX - 1] = '\0';
+	snprintf(name, sizeof(name), "%s[%u]", header.process, header.pid);
+	uint32_t process = (uint32_t)processes.size();
+	processes.push_back(name);
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		traces[rec.trace_id].push_back({ process, rec.ts_ns, rec.hop, rec.event });
+		records++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void add_sample(const std::string &label, int64_t ns)
+{
+	auto it = stat_index.find(label);
+	if (it == stat_index.end()) {
+		it = stat_index.emplace(label, stats.size()).first;
+		stats.emplace_back();
+		stats.back().label = label;
+		stats.back().negative = 0;
+		hdr_init(&stats.back().hist, HIST_HIGHEST_NS, HIST_DIGITS);
+	}
+
+	struct stitch_stat *stat = &stats[it->second];
+	if (ns < 0) {
+		stat->negative++;
+		ns = 0;
+	}
+	hdr_record(&stat->hist, ns);
+}
+
+/* the single emitter of hop, or NULL when there is none or more than one */
+static const struct trace_point *emitter(const std::vector<struct trace_point> &points, uint16_t hop)
+{
+	const struct trace_point *found = NULL;
+	for (const struct trace_point &p : points) {
+		if (p.hop != hop || p.event == TRACE_RECV) continue;
+		if (found) return NULL;
+		found = &p;
+	}
+	return found;
+}
+
+static void stitch(const std::vector<struct trace_point> &points, uint64_t *complete)
+{
+	const struct trace_point *origin = emitter(points, 0);
+	if (origin && origin->event == TRACE_SEND) (*complete)++;
+	else origin = NULL;
+
+	for (const struct trace_point &p : points) {
+		if (p.event == TRACE_RECV && p.hop > 0) {
+			const struct trace_point *from = emitter(points, (uint16_t)(p.hop - 1));
+			if (from) {
+				add_sample("hop " + std::to_string(p.hop) + ": " + processes[from->process] + " -> " + processes[p.process],
+					p.ts_ns - from->ts_ns);
+			}
+
+			bool forwarded = false;
+			for (const struct trace_point &q : points) {
+				if (q.event == TRACE_FORWARD && q.hop == p.hop && q.process == p.process) forwarded = true;
+			}
+			if (!forwarded && origin) {
+				add_sample("end to end: " + processes[origin->process] + " -> " + processes[p.process], p.ts_ns - origin->ts_ns);
+			}
+		}
+		else if (p.event == TRACE_FORWARD) {
+			for (const struct trace_point &q : points) {
+				if (q.event == TRACE_RECV && q.hop == p.hop && q.process == p.process) {
+					add_sample("in " + processes[p.process], p.ts_ns - q.ts_ns);
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void print_table(uint64_t complete)
+{
+	printf("%zu files, %llu records, %zu traces (%llu with their send)\n\n", processes.size(),
+		(unsigned long long)records, traces.size(), (unsigned long long)complete);
+	printf("%-60s %10s %10s %10s %10s %10s\n", "", "count", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (const struct stitch_stat &stat : stats) {
+		const struct hdr_histogram *h = &stat.hist;
+		printf("%-60s %10llu %10.1f %10.1f %10.1f %10.1f", stat.label.c_str(), (unsigned long long)h->total,
+			hdr_value_at_percentile(h, 50.0) / 1e3, hdr_value_at_percentile(h, 99.0) / 1e3,
+			hdr_value_at_percentile(h, 99.9) / 1e3, h->max / 1e3);
+		if (stat.negative) printf("  (%llu negative, clocks disagree)", (unsigned long long)stat.negative);
+		printf("\n");
+	}
+}
+
+/* process names come from the trace files: escape them */
+static void print_json_string(const std::string &s)
+{
+	putchar('"');
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') printf("\\%c", c);
+		else if (c < 0x20) printf("\\u%04x", c);
+		else putchar(c);
+	}
+	putchar('"');
+}
+
+static void print_json(uint64_t complete)
+{
+	printf("{\"files\":%zu,\"records\":%llu,\"traces\":%zu,\"complete\":%llu,\"stats\":[", processes.size(),
+		(unsigned long long)records, traces.size(), (unsigned long long)complete);
+	for (size_t i = 0; i < stats.size(); i++) {
+		const struct hdr_histogram *h = &stats[i].hist;
+		printf("{\"label\":");
+		print_json_string(stats[i].label);
+		printf(",\"count\":%llu,\"p50_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld,\"negative\":%llu}%s",
+			(unsigned long long)h->total, (long long)hdr_value_at_percentile(h, 50.0),
+			(long long)hdr_value_at_percentile(h, 99.0), (long long)hdr_value_at_percentile(h, 99.9), (long long)h->max,
+			(unsigned long long)stats[i].negative, i + 1 < stats.size() ? "," : "");
+	}
+	printf("]}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	bool json = false;
+	int files = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-j")) json = true;
+		else if (argv[i][0] == '-') usage(argv[0]);
+		else {
+			if (read_file(argv[i])) return 1;
+			files++;
+		}
+	}
+	if (!files) usage(argv[0]);
+
+	uint64_t complete = 0;
+	for (auto &trace : traces) stitch(trace.second, &complete);
+	std::sort(stats.begin(), stats.end(), [](const struct stitch_stat &a, const struct stitch_stat &b) { return a.label < b.label; });
+
+	if (json) print_json(complete);
+	else print_table(complete);
+	return 0;
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "msg_per_thread.h"
+#include "msg_tracepoint.h"
+
+typedef struct spsc_ring<struct tp_rec, TP_RING_SIZE> tp_ring;
+
+struct tp_pending {
+	struct tp_rec rec;
+	int thread;
+};
+
+int tp_level = TP_LEVEL_OFF;
+
+static FILE *tp_out = NULL;
+static struct per_thread_registry<tp_ring> rings;
+static thread_local tp_ring *thread_ring = NULL;
+static thread_local bool thread_unregistered = false;
+static std::mutex drain_lock;
+static std::vector<struct tp_pending> pending;
+static bool drain_started = false;
+static std::thread drain_thread;
+static std::mutex stop_lock;
+static std::condition_variable stop_wake;
+static bool stopping = false;
+
+static const char level_letters[] = "-EWID";
+
+uint64_t tp_now_ns(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static tp_ring *tp_thread_ring(void)
+{
+	if (thread_ring || thread_unregistered) return thread_ring;
+
+	thread_ring = per_thread_register(&rings, [](int) {
+		tp_ring *ring = new tp_ring;
+		spsc_reset(ring);
+		return ring;
+	});
+	/* past PER_THREAD_MAX, this thread's tracepoints only reach the USDT probes */
+	thread_unregistered = !thread_ring;
+	return thread_ring;
+}
+
+struct tp_rec *tp_claim(void)
+{
+	tp_ring *ring = tp_thread_ring();
+	return ring ? spsc_claim(ring) : NULL;
+}
+
+void tp_commit(void)
+{
+	spsc_commit(thread_ring);
+}
+
+/* printf one conversion spec (without length modifier) with a recorded argument */
+static void format_arg(std::string *line, const std::string &spec, char conv, const struct tp_rec *rec, int arg)
+{
+	char buf[256];
+	std::string f = spec;
+	union tp_arg v = rec->args[arg];
+	int type = rec->types[arg];
+
+	switch (conv) {
+	case 'd': case 'i':
+		f += "ll";
+		f += conv;
+		snprintf(buf, sizeof(buf), f.c_str(), type == TP_ARG_DOUBLE ? (long long)v.d : (long long)v.i);
+		break;
+	case 'u': case 'o': case 'x': case 'X':
+		f += "ll";
+		f += conv;
+		snprintf(buf, sizeof(buf), f.c_str(), type == TP_ARG_DOUBLE ? (unsigned long long)v.d : (unsigned long long)v.u);
+		break;
+	case 'c':
+		f += conv;
+		snprintf(buf, sizeof(buf), f.c_str(), (int)v.i);
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		f += conv;
+		snprintf(buf, sizeof(buf), f.c_str(), type == TP_ARG_DOUBLE ? v.d : type == TP_ARG_INT ? (double)v.i : (double)v.u);
+		break;
+	case 's':
+		f += conv;
+		snprintf(buf, sizeof(buf), f.c_str(), type == TP_ARG_STR ? rec->text + v.u : "?");
+		break;
+	case 'p':
+		f += conv;
+		snprintf(buf, sizeof(buf), f.c_str(), v.p);
+		break;
+	default:
+		snprintf(buf, sizeof(buf), "%s%c", spec.c_str(), conv);
+		break;
+	}
+	*line += buf;
+}
+
+static void format_rec(std::string *line, const struct tp_pending *p)
+{
+	const struct tp_rec *rec = &p->rec;
+	const struct tp_site *site = rec->site;
+	char head[128];
+	int arg = 0;
+
+	snprintf(head, sizeof(head), "%llu.%06llu %c t%d %s: ", (unsigned long long)(rec->ns / 1000000000),
+		(unsigned long long)(rec->ns % 1000000000 / 1000), level_letters[site->level], p->thread, site->name);
+	*line = head;
+
+	for (const char *c = site->fmt; *c; c++) {
+		if (*c != '%') {
+			*line += *c;
+			continue;
+		}
+		if (c[1] == '%') {
+			*line += '%';
+			c++;
+			continue;
+		}
+
+		std::string spec = "%";
+		for (c++; *c && strchr("-+ #0123456789.", *c); c++) spec += *c;
+		while (*c && strchr("hlLqjzt", *c)) c++;
+		if (!*c) break;
+
+		if (arg < rec->count) format_arg(line, spec, *c, rec, arg++);
+		else *line += spec + *c;
+	}
+	*line += '\n';
+}
+
+void tp_flush(void)
+{
+	std::lock_guard<std::mutex> guard(drain_lock);
+	int count = per_thread_count(&rings);
+	uint64_t dropped = 0;
+
+	pending.clear();
+	for (int i = 0; i < count; i++) {
+		tp_ring *ring = per_thread_at(&rings, i);
+		if (!ring) continue;
+
+		dropped += spsc_drain(ring, [i](const struct tp_rec &rec) { pending.push_back({ rec, i }); });
+	}
+	if (!tp_out) return;
+
+	/* rings are drained one after the other; the output is in time order */
+	std::stable_sort(pending.begin(), pending.end(),
+		[](const struct tp_pending &a, const struct tp_pending &b) { return a.rec.ns < b.rec.ns; });
+
+	std::string line;
+	for (const struct tp_pending &p : pending) {
+		format_rec(&line, &p);
+		fwrite(line.data(), 1, line.size(), tp_out);
+	}
+	if (dropped) {
+		fprintf(tp_out, "tracepoints: %llu records dropped on full rings\n", (unsigned long long)dropped);
+	}
+	fflush(tp_out);
+}
+
+void tp_init(FILE *out, int level)
+{
+	tp_out = out;
+	tp_level = level;
+	if (drain_started || tp_level <= TP_LEVEL_OFF) return;
+
+	drain_started = true;
+	/* runs before pending, drain_lock and the thread object are destroyed */
+	atexit(tp_stop);
+	drain_thread = std::thread([]() {
+		std::unique_lock<std::mutex> guard(stop_lock);
+		while (!stop_wake.wait_for(guard, std::chrono::milliseconds(TP_DRAIN_MS), []() { return stopping; })) {
+			guard.unlock();
+			tp_flush();
+			guard.lock();
+		}
+	});
+}
+
+void tp_stop(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(stop_lock);
+		stopping = true;
+	}
+	stop_wake.notify_all();
+	if (drain_thread.joinable()) drain_thread.join();
+	tp_flush();
+}
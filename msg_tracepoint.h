@@ -0,0 +1,238 @@
+#pragma once
+/*
+  msg_tracepoint
+  Debug and diagnostic output that stays off the message path.
+
+      TP_ERROR(name, fmt, args...)
+      TP_WARN(name, fmt, args...)
+      TP_INFO(name, fmt, args...)
+      TP_DEBUG(name, fmt, args...)
+
+  name is an identifier naming the tracepoint, fmt a printf format. The
+  arguments may be evaluated more than once and must not have side effects.
+
+  Levels above MSG_TP_LEVEL (a build flag; TP_LEVEL_DEBUG when DEBUG is
+  defined, TP_LEVEL_INFO otherwise) compile to nothing: the arguments are
+  not evaluated, only the format is checked against them. Enabled
+  tracepoints below the runtime level (tp_init) cost a load and a branch.
+
+  A tracepoint that fires does not format anything. It copies its
+  arguments (integers, doubles, pointers, C strings) into a fixed size
+  record in a ring owned by the calling thread. A drain thread started by
+  tp_init() takes the records of all threads every TP_DRAIN_MS, orders
+  them by time and only then formats and writes them, until tp_stop()
+  (registered with atexit()) joins it and writes what is left. A ring that fills up
+  in between drops records and counts them. String arguments are cut to
+  what fits in the record.
+
+  On Linux with <sys/sdt.h> (systemtap-sdt-dev), every enabled tracepoint
+  is also a USDT probe "mqttfb:<name>" taking the tracepoint's arguments,
+  independent of the runtime level:
+      bpftrace -e 'usdt:./mosquittopp:mqttfb:on_message { printf("%s\n", str(arg0)); }'
+  Build with -DMSG_TP_USDT=0 to leave the probes out.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+
+#define TP_LEVEL_OFF 0
+#define TP_LEVEL_ERROR 1
+#define TP_LEVEL_WARN 2
+#define TP_LEVEL_INFO 3
+#define TP_LEVEL_DEBUG 4
+
+#ifndef MSG_TP_LEVEL
+# ifdef DEBUG
+#  define MSG_TP_LEVEL TP_LEVEL_DEBUG
+# else
+#  define MSG_TP_LEVEL TP_LEVEL_INFO
+# endif
+#endif
+
+#if !defined(MSG_TP_USDT) && defined(__linux__) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  define MSG_TP_USDT 1
+# endif
+#endif
+#if defined(MSG_TP_USDT) && MSG_TP_USDT
+# include <sys/sdt.h>
+# define TP_PROBE(name, ...) STAP_PROBEV(mqttfb, name, ##__VA_ARGS__)
+#else
+# define TP_PROBE(name, ...) do { } while (0)
+#endif
+
+#define TP_RING_SIZE 1024 /* records per thread, power of two */
+#define TP_MAX_ARGS 6
+#define TP_REC_SIZE 256
+#define TP_DRAIN_MS 50
+
+enum tp_arg_type {
+	TP_ARG_INT,
+	TP_ARG_UINT,
+	TP_ARG_DOUBLE,
+	TP_ARG_PTR,
+	TP_ARG_STR, /* value: offset into text */
+};
+
+struct tp_site {
+	const char *name;
+	const char *fmt;
+	const char *file;
+	int line;
+	int level;
+};
+
+union tp_arg {
+	int64_t i;
+	uint64_t u;
+	double d;
+	const void *p;
+};
+
+#define TP_TEXT_MAX (TP_REC_SIZE - 2 * sizeof(uint64_t) - 8 - TP_MAX_ARGS * sizeof(union tp_arg))
+
+struct tp_rec {
+	const struct tp_site *site;
+	uint64_t ns; /* wall clock */
+	uint8_t count;
+	uint8_t types[TP_MAX_ARGS];
+	uint8_t text_used;
+	union tp_arg args[TP_MAX_ARGS];
+	char text[TP_TEXT_MAX];
+};
+
+extern int tp_level;
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 1, 2)))
+#endif
+static inline void tp_check_format(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+/* The calling thread's next free record, NULL if its ring is full; tp_commit() publishes it. */
+struct tp_rec *tp_claim(void);
+void tp_commit(void);
+uint64_t tp_now_ns(void);
+
+template<typename T>
+static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+tp_put(struct tp_rec *rec, T v)
+{
+	if (std::is_signed<T>::value) {
+		rec->types[rec->count] = TP_ARG_INT;
+		rec->args[rec->count].i = (int64_t)v;
+	}
+	else {
+		rec->types[rec->count] = TP_ARG_UINT;
+		rec->args[rec->count].u = (uint64_t)v;
+	}
+	rec->count++;
+}
+
+static inline void tp_put(struct tp_rec *rec, double v)
+{
+	rec->types[rec->count] = TP_ARG_DOUBLE;
+	rec->args[rec->count].d = v;
+	rec->count++;
+}
+
+static inline void tp_put(struct tp_rec *rec, const void *v)
+{
+	rec->types[rec->count] = TP_ARG_PTR;
+	rec->args[rec->count].p = v;
+	rec->count++;
+}
+
+static inline void tp_put(struct tp_rec *rec, const char *v)
+{
+	size_t room = TP_TEXT_MAX - rec->text_used;
+	size_t len = v ? strlen(v) : 0;
+
+	rec->types[rec->count] = TP_ARG_STR;
+	rec->args[rec->count].u = rec->text_used;
+	rec->count++;
+	if (!room) return;
+
+	if (len > room - 1) len = room - 1;
+	memcpy(rec->text + rec->text_used, v ? v : "", len);
+	rec->text[rec->text_used + len] = '\0';
+	rec->text_used = (uint8_t)(rec->text_used + len + 1);
+}
+
+static inline void tp_put_all(struct tp_rec *rec)
+{
+	(void)rec;
+}
+
+template<typename T, typename... Rest>
+static inline void tp_put_all(struct tp_rec *rec, T v, Rest... rest)
+{
+	tp_put(rec, v);
+	tp_put_all(rec, rest...);
+}
+
+template<typename... Args>
+static inline void tp_emit(const struct tp_site *site, Args... args)
+{
+	static_assert(sizeof...(Args) <= TP_MAX_ARGS, "too many tracepoint arguments");
+
+	struct tp_rec *rec = tp_claim();
+	if (!rec) return;
+
+	rec->site = site;
+	rec->ns = tp_now_ns();
+	rec->count = 0;
+	rec->text_used = 0;
+	tp_put_all(rec, args...);
+	tp_commit();
+}
+
+#define TP_NONE(fmt, ...) do { if (0) tp_check_format(fmt, ##__VA_ARGS__); } while (0)
+
+#define TP_LOG(level, name, fmt, ...) do { \
+	if (0) tp_check_format(fmt, ##__VA_ARGS__); \
+	TP_PROBE(name, ##__VA_ARGS__); \
+	if ((level) <= tp_level) { \
+		static const struct tp_site tp_site_ = { #name, fmt, __FILE__, __LINE__, level }; \
+		tp_emit(&tp_site_, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#if MSG_TP_LEVEL >= TP_LEVEL_ERROR
+# define TP_ERROR(name, fmt, ...) TP_LOG(TP_LEVEL_ERROR, name, fmt, ##__VA_ARGS__)
+#else
+# define TP_ERROR(name, fmt, ...) TP_NONE(fmt, ##__VA_ARGS__)
+#endif
+#if MSG_TP_LEVEL >= TP_LEVEL_WARN
+# define TP_WARN(name, fmt, ...) TP_LOG(TP_LEVEL_WARN, name, fmt, ##__VA_ARGS__)
+#else
+# define TP_WARN(name, fmt, ...) TP_NONE(fmt, ##__VA_ARGS__)
+#endif
+#if MSG_TP_LEVEL >= TP_LEVEL_INFO
+# define TP_INFO(name, fmt, ...) TP_LOG(TP_LEVEL_INFO, name, fmt, ##__VA_ARGS__)
+#else
+# define TP_INFO(name, fmt, ...) TP_NONE(fmt, ##__VA_ARGS__)
+#endif
+#if MSG_TP_LEVEL >= TP_LEVEL_DEBUG
+# define TP_DEBUG(name, fmt, ...) TP_LOG(TP_LEVEL_DEBUG, name, fmt, ##__VA_ARGS__)
+#else
+# define TP_DEBUG(name, fmt, ...) TP_NONE(fmt, ##__VA_ARGS__)
+#endif
+
+/*
+  Record tracepoints up to level (those compiled in) and start the
+  drain thread writing to out. Until then nothing is recorded. The rest is
+  drained at exit.
+*/
+void tp_init(FILE *out, int level);
+
+/* Join the drain thread and write what is left; later records stay in the rings. */
+void tp_stop(void);
+
+/* Format and write everything recorded so far. */
+void tp_flush(void);
@@ -0,0 +1,333 @@
+#include <string.h>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_verify.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VERIFY_SSE2 1
+#endif
+
+/* budget = VERIFY_WORK_FACTOR * size + VERIFY_WORK_BASE nodes/bytes */
+#define VERIFY_WORK_FACTOR 16
+#define VERIFY_WORK_BASE 1024
+
+struct verifier {
+	const uint8_t *begin;
+	const uint8_t *end;
+	size_t budget;
+	/* maps built with shared key vectors point at the same keys */
+	const uint8_t *last_keys;
+	int last_keys_width;
+	size_t last_keys_size;
+};
+
+static inline uint64_t read_uint(const uint8_t *p, int width)
+{
+	switch (width) {
+	case 1: return *p;
+	case 2: { uint16_t v; memcpy(&v, p, 2); return v; }
+	case 4: { uint32_t v; memcpy(&v, p, 4); return v; }
+	default: { uint64_t v; memcpy(&v, p, 8); return v; }
+	}
+}
+
+static inline bool valid_width(uint64_t width)
+{
+	return width == 1 || width == 2 || width == 4 || width == 8;
+}
+
+static inline bool spend(struct verifier *v, size_t work)
+{
+	if (work > v->budget) return false;
+	v->budget -= work;
+	return true;
+}
+
+/* p..p+len lies inside the buffer */
+static inline bool in_range(const struct verifier *v, const uint8_t *p, uint64_t len)
+{
+	return p >= v->begin && p <= v->end && len <= (uint64_t)(v->end - p);
+}
+
+/* Packed type bytes: upper 6 bits must name a flexbuffers::Type. */
+static bool packed_types_valid(const uint8_t *types, size_t count)
+{
+	size_t i = 0;
+#ifdef VERIFY_SSE2
+	const __m128i mask = _mm_set1_epi8(0x3F);
+	const __m128i last_scalar = _mm_set1_epi8(flexbuffers::FBT_BOOL);
+	const __m128i vector_bool = _mm_set1_epi8(flexbuffers::FBT_VECTOR_BOOL);
+
+	for (; i + 16 <= count; i += 16) {
+		__m128i t = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)(types + i)), 2), mask);
+		__m128i ok = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, last_scalar), t), _mm_cmpeq_epi8(t, vector_bool));
+		if (_mm_movemask_epi8(ok) != 0xFFFF) return false;
+	}
+#endif
+	unsigned bad = 0;
+	for (; i < count; i++) {
+		unsigned t = types[i] >> 2;
+		bad |= (unsigned)(t > flexbuffers::FBT_BOOL) & (unsigned)(t != flexbuffers::FBT_VECTOR_BOOL);
+	}
+	return bad == 0;
+}
+
+/*
+  Every element of an offset array points backwards into the buffer:
+  0 < off <= position of the element (base is the position of element 0).
+*/
+static bool offsets_in_bounds(const uint8_t *elems, size_t count, int width, uint64_t base)
+{
+	size_t i = 0;
+#ifdef VERIFY_SSE2
+	if (width == 4 && base + (uint64_t)count * 4 <= 0xFFFFFFFFu) {
+		const __m128i sign = _mm_set1_epi32((int)0x80000000u);
+		const __m128i one = _mm_set1_epi32(1);
+		const __m128i step = _mm_set1_epi32(16);
+		__m128i pos = _mm_add_epi32(_mm_set1_epi32((int)(uint32_t)base), _mm_setr_epi32(0, 4, 8, 12));
+
+		for (; i + 4 <= count; i += 4) {
+			/* unsigned (off - 1) < pos, biased for the signed compare; off == 0 wraps and fails */
+			__m128i off = _mm_loadu_si128((const __m128i *)(elems + i * 4));
+			__m128i lhs = _mm_xor_si128(_mm_sub_epi32(off, one), sign);
+			__m128i rhs = _mm_xor_si128(pos, sign);
+			if (_mm_movemask_epi8(_mm_cmplt_epi32(lhs, rhs)) != 0xFFFF) return false;
+			pos = _mm_add_epi32(pos, step);
+		}
+	}
+#endif
+	unsigned bad = 0;
+	for (; i < count; i++) {
+		uint64_t off = read_uint(elems + i * width, width);
+		bad |= (unsigned)(off == 0) | (unsigned)(off > base + (uint64_t)i * width);
+	}
+	return bad == 0;
+}
+
+static bool deref(const struct verifier *v, const uint8_t *p, int width, const uint8_t **target)
+{
+	uint64_t off = read_uint(p, width);
+	if (off == 0 || off > (uint64_t)(p - v->begin)) return false;
+	*target = p - off;
+	return true;
+}
+
+static bool read_size(const struct verifier *v, const uint8_t *target, int width, uint64_t *size)
+{
+	if ((uint64_t)(target - v->begin) < (uint64_t)width) return false;
+	*size = read_uint(target - width, width);
+	return true;
+}
+
+static bool verify_key(struct verifier *v, const uint8_t *key)
+{
+	const uint8_t *nul = (const uint8_t *)memchr(key, 0, (size_t)(v->end - key));
+	if (!nul) return false;
+	return spend(v, (size_t)(nul - key) + 1);
+}
+
+static bool verify_key_vector(struct verifier *v, const uint8_t *keys, int width, uint64_t *size)
+{
+	if (!read_size(v, keys, width, size)) return false;
+	if (*size > (uint64_t)(v->end - keys) / width) return false;
+
+	if (keys == v->last_keys && width == v->last_keys_width) {
+		return *size == v->last_keys_size;
+	}
+
+	if (!offsets_in_bounds(keys, (size_t)*size, width, (uint64_t)(keys - v->begin))) return false;
+	for (uint64_t i = 0; i < *size; i++) {
+		const uint8_t *elem = keys + i * width;
+		if (!verify_key(v, elem - read_uint(elem, width))) return false;
+	}
+
+	v->last_keys = keys;
+	v->last_keys_width = width;
+	v->last_keys_size = (size_t)*size;
+	return true;
+}
+
+static bool verify_value(struct verifier *v, uint8_t packed, int parent_width, const uint8_t *p, int depth);
+
+static bool verify_elements(struct verifier *v, const uint8_t *elems, int width, uint64_t *size, int depth)
+{
+	if (!read_size(v, elems, width, size)) return false;
+	/* elements plus one packed type byte each */
+	if (*size > (uint64_t)(v->end - elems) / (width + 1)) return false;
+	/* charged per visit: children shared by many parents are scanned each time */
+	if (!spend(v, (size_t)*size)) return false;
+
+	const uint8_t *types = elems + *size * width;
+	if (!packed_types_valid(types, (size_t)*size)) return false;
+
+	for (uint64_t i = 0; i < *size; i++) {
+		if (!verify_value(v, types[i], width, elems + i * width, depth + 1)) return false;
+	}
+	return true;
+}
+
+static bool verify_map(struct verifier *v, const uint8_t *values, int width, int depth)
+{
+	/* [keys offset][keys byte width][size] precede the values */
+	if ((uint64_t)(values - v->begin) < (uint64_t)width * 3) return false;
+
+	const uint8_t *keys_field = values - width * 3;
+	uint64_t keys_width = read_uint(values - width * 2, width);
+	const uint8_t *keys;
+	uint64_t key_count, value_count;
+
+	if (!valid_width(keys_width)) return false;
+	if (!deref(v, keys_field, width, &keys)) return false;
+	if (!verify_key_vector(v, keys, (int)keys_width, &key_count)) return false;
+	if (!verify_elements(v, values, width, &value_count, depth)) return false;
+
+	return key_count == value_count;
+}
+
+static bool verify_value(struct verifier *v, uint8_t packed, int parent_width, const uint8_t *p, int depth)
+{
+	int type = packed >> 2;
+	int width = 1 << (packed & 3);
+	const uint8_t *target;
+	uint64_t size;
+
+	switch (type) {
+	case flexbuffers::FBT_NULL:
+	case flexbuffers::FBT_INT:
+	case flexbuffers::FBT_UINT:
+	case flexbuffers::FBT_FLOAT:
+	case flexbuffers::FBT_BOOL:
+		/* stored inline in the parent slot, already range checked */
+		return spend(v, 1);
+	default:
+		break;
+	}
+
+	if (depth > VERIFY_MAX_DEPTH || !spend(v, 1)) return false;
+	if (!deref(v, p, parent_width, &target)) return false;
+
+	switch (type) {
+	case flexbuffers::FBT_KEY:
+		return verify_key(v, target);
+	case flexbuffers::FBT_STRING:
+		if (!read_size(v, target, width, &size)) return false;
+		if (!in_range(v, target, size + 1)) return false;
+		return target[size] == 0;
+	case flexbuffers::FBT_BLOB:
+		if (!read_size(v, target, width, &size)) return false;
+		return in_range(v, target, size);
+	case flexbuffers::FBT_INDIRECT_INT:
+	case flexbuffers::FBT_INDIRECT_UINT:
+	case flexbuffers::FBT_INDIRECT_FLOAT:
+		return in_range(v, target, width);
+	case flexbuffers::FBT_MAP:
+		return verify_map(v, target, width, depth);
+	case flexbuffers::FBT_VECTOR:
+		return verify_elements(v, target, width, &size, depth);
+	case flexbuffers::FBT_VECTOR_INT:
+	case flexbuffers::FBT_VECTOR_UINT:
+	case flexbuffers::FBT_VECTOR_FLOAT:
+	case flexbuffers::FBT_VECTOR_BOOL:
+		if (!read_size(v, target, width, &size)) return false;
+		return size <= (uint64_t)(v->end - target) / width;
+	case flexbuffers::FBT_VECTOR_KEY:
+		return verify_key_vector(v, target, width, &size);
+	case flexbuffers::FBT_VECTOR_INT2:
+	case flexbuffers::FBT_VECTOR_UINT2:
+	case flexbuffers::FBT_VECTOR_FLOAT2:
+	case flexbuffers::FBT_VECTOR_INT3:
+	case flexbuffers::FBT_VECTOR_UINT3:
+	case flexbuffers::FBT_VECTOR_FLOAT3:
+	case flexbuffers::FBT_VECTOR_INT4:
+	case flexbuffers::FBT_VECTOR_UINT4:
+	case flexbuffers::FBT_VECTOR_FLOAT4:
+		return in_range(v, target, (uint64_t)((type - flexbuffers::FBT_VECTOR_INT2) / 3 + 2) * width);
+	default:
+		/* FBT_VECTOR_STRING_DEPRECATED and unknown types */
+		return false;
+	}
+}
+
+bool verify_flex(const uint8_t *data, size_t size)
+{
+	struct verifier v;
+
+	if (!data || size < 3) return false;
+
+	int root_width = data[size - 1];
+	uint8_t root_packed = data[size - 2];
+	if (!valid_width(root_width) || size < (size_t)root_width + 2) return false;
+	if (!packed_types_valid(&root_packed, 1)) return false;
+
+	v.begin = data;
+	v.end = data + size;
+	v.budget = size * VERIFY_WORK_FACTOR + VERIFY_WORK_BASE;
+	v.last_keys = NULL;
+	v.last_keys_width = 0;
+	v.last_keys_size = 0;
+
+	return verify_value(&v, root_packed, root_width, data + size - 2 - root_width, 0);
+}
+
+int verify_batch(const struct verify_frame *frames, int count, bool *results)
+{
+	int passed = 0;
+
+	for (int i = 0; i < count; i++) {
+#if defined(__GNUC__)
+		/* the root lives at the tail of the frame */
+		if (i + 1 < count && frames[i + 1].size) {
+			__builtin_prefetch(frames[i + 1].data + frames[i + 1].size - 1);
+		}
+#endif
+		results[i] = verify_flex(frames[i].data, frames[i].size);
+		if (results[i]) passed++;
+	}
+
+	return passed;
+}
+
+void verify_cache_init(struct verify_cache *cache)
+{
+	for (int i = 0; i < VERIFY_CACHE_SLOTS; i++) {
+		cache->slots[i].topic_hash = 0;
+		cache->slots[i].frame.clear();
+		cache->slots[i].valid = false;
+	}
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+static uint64_t topic_hash(const char *topic)
+{
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ull;
+	for (; *topic; topic++) {
+		h ^= (uint8_t)*topic;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+bool verify_cached(struct verify_cache *cache, const char *topic, const uint8_t *data, size_t size)
+{
+	uint64_t h = topic_hash(topic);
+	struct verify_cache_slot *slot = &cache->slots[h % VERIFY_CACHE_SLOTS];
+
+	/* exact byte comparison: a hit means these very bytes passed before */
+	if (slot->valid && slot->topic_hash == h && slot->frame.size() == size
+		&& !memcmp(slot->frame.data(), data, size)) {
+		cache->hits++;
+		return true;
+	}
+
+	cache->misses++;
+	if (!verify_flex(data, size)) return false;
+
+	if (size <= VERIFY_CACHE_MAX_FRAME) {
+		slot->topic_hash = h;
+		slot->frame.assign(data, data + size);
+		slot->valid = true;
+	}
+	return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+/*
+  msg_verify
+  Bounds verification of untrusted FlexBuffer payloads before GetRoot().
+
+  verify_flex() walks the buffer once and checks every offset, byte width,
+  type byte, string/key terminator and vector extent. The per-vector checks
+  (offset bounds, packed type bytes) run over whole element arrays at a time,
+  with SSE2 kernels where available. Work is capped by a budget proportional
+  to the payload size, so shared or overlapping children cannot blow it up.
+
+  verify_batch() verifies several frames in one pass, and a verify_cache keeps
+  the last verified frame per topic so that an identical frame (e.g. a
+  retained state re-sent every second) costs one memcmp.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define VERIFY_MAX_DEPTH 64
+#define VERIFY_CACHE_SLOTS 256
+#define VERIFY_CACHE_MAX_FRAME 65536
+
+struct verify_frame {
+	const char *topic;
+	const uint8_t *data;
+	size_t size;
+};
+
+struct verify_cache_slot {
+	uint64_t topic_hash;
+	std::vector<uint8_t> frame;
+	bool valid;
+};
+
+struct verify_cache {
+	verify_cache_slot slots[VERIFY_CACHE_SLOTS];
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/* true if data[0..size) is a well-formed FlexBuffer that GetRoot() can read safely */
+bool verify_flex(const uint8_t *data, size_t size);
+
+/* Verify count frames; results[i] is set for frames[i]. Returns the number that passed. */
+int verify_batch(const struct verify_frame *frames, int count, bool *results);
+
+void verify_cache_init(struct verify_cache *cache);
+
+/* verify_flex() with a per-topic "already verified" shortcut */
+bool verify_cached(struct verify_cache *cache, const char *topic, const uint8_t *data, size_t size);
@@ -0,0 +1,118 @@
+/*
+  msg_verify_bench
+  Cost of verify_flex(), verify_batch() and a verify_cached() hit for
+  FlexBuffer payloads from 64 B to 1 MB.
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -o msg_verify_bench msg_verify_bench.cpp msg_verify.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_verify.h"
+
+#define BATCH_FRAMES 64
+#define MIN_BYTES_PER_SIZE (64 * 1024 * 1024)
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const size_t payload_sizes[] = { 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576 };
+
+/* time/text plus a vector of small sensor maps until the target size is reached */
+static void build_payload(flexbuffers::Builder &fbb, size_t target)
+{
+	size_t readings = 0;
+
+	do {
+		fbb.Clear();
+		fbb.Map([&]() {
+			fbb.Double("time", 1615190400.0);
+			fbb.String("text", "verify");
+			if (readings) {
+				fbb.Vector("readings", [&]() {
+					char name[32];
+					for (size_t i = 0; i < readings; i++) {
+						snprintf(name, sizeof(name), "sensor-%zu", i);
+						fbb.Map([&]() {
+							fbb.UInt("id", i);
+							fbb.String("name", name);
+							fbb.Double("value", i * 0.5);
+						});
+					}
+				});
+			}
+		});
+		fbb.Finish();
+		readings = readings ? readings + readings / 4 + 1 : 1;
+	} while (fbb.GetSize() < target && target > 64);
+}
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	flexbuffers::Builder fbb;
+	static struct verify_cache cache;
+	struct verify_frame frames[BATCH_FRAMES];
+	bool results[BATCH_FRAMES];
+
+	verify_cache_init(&cache);
+
+	printf("%10s %10s %12s %12s %12s %10s\n", "target", "bytes", "verify ns", "batch ns/msg", "cached ns", "MB/s");
+
+	for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++) {
+		build_payload(fbb, payload_sizes[s]);
+		std::vector<uint8_t> payload = fbb.GetBuffer();
+
+		if (!verify_flex(payload.data(), payload.size())) {
+			fprintf(stderr, "Error: builder output failed verification (%zu bytes).\n", payload.size());
+			return 1;
+		}
+
+		int iterations = (int)(MIN_BYTES_PER_SIZE / payload.size());
+		if (iterations < 16) iterations = 16;
+		int ok = 0;
+
+		auto start = bench_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			ok += verify_flex(payload.data(), payload.size());
+		}
+		double verify_ns = elapsed_ns(start) / iterations;
+
+		/* distinct copies so the batch does not just re-read one hot frame */
+		std::vector<std::vector<uint8_t>> copies(BATCH_FRAMES, payload);
+		for (int f = 0; f < BATCH_FRAMES; f++) {
+			frames[f].topic = "EXAMPLE_TOPIC";
+			frames[f].data = copies[f].data();
+			frames[f].size = copies[f].size();
+		}
+		int batches = iterations / BATCH_FRAMES + 1;
+		start = bench_clock::now();
+		for (int i = 0; i < batches; i++) {
+			ok += verify_batch(frames, BATCH_FRAMES, results);
+		}
+		double batch_ns = elapsed_ns(start) / ((double)batches * BATCH_FRAMES);
+
+		verify_cached(&cache, "EXAMPLE_TOPIC", payload.data(), payload.size());
+		start = bench_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			ok += verify_cached(&cache, "EXAMPLE_TOPIC", payload.data(), payload.size());
+		}
+		double cached_ns = elapsed_ns(start) / iterations;
+
+		printf("%10zu %10zu %12.1f %12.1f ", payload_sizes[s], payload.size(), verify_ns, batch_ns);
+		/* larger frames are not cached, every call is a full verify_flex() */
+		if (payload.size() <= VERIFY_CACHE_MAX_FRAME) printf("%12.1f", cached_ns);
+		else printf("%12s", "-");
+		printf(" %10.1f\n", payload.size() / verify_ns * 1e3);
+		if (!ok) fprintf(stderr, "(no frame verified)\n");
+	}
+
+	return 0;
+}
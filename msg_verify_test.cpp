@@ -0,0 +1,83 @@
+/*
+  msg_verify_test
+  verify_flex() on hand-built FlexBuffers that the builder would never
+  produce. Exits 1 on the first unexpected result.
+
+  Compile:
+  c++ -std=c++14 -O2 -Iflatbuffers/include -o msg_verify_test msg_verify_test.cpp msg_verify.cpp
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <flatbuffers/flexbuffers.h>
+#include "msg_verify.h"
+
+static void put_le(std::vector<uint8_t> &buf, uint64_t v, int width)
+{
+	for (int i = 0; i < width; i++) buf.push_back((uint8_t)(v >> (8 * i)));
+}
+
+/*
+  One vector of inner_count 16 bit ints, and a vector of outer_count
+  offsets that all point at it. The buffer grows with inner + outer, the
+  work to verify it with inner * outer.
+*/
+static std::vector<uint8_t> shared_child(uint32_t inner_count, uint32_t outer_count)
+{
+	std::vector<uint8_t> buf;
+
+	put_le(buf, inner_count, 2);
+	size_t inner = buf.size();
+	for (uint32_t i = 0; i < inner_count; i++) put_le(buf, i, 2);
+	for (uint32_t i = 0; i < inner_count; i++) buf.push_back(flexbuffers::FBT_INT << 2 | 1);
+
+	while (buf.size() % 4) buf.push_back(0);
+	put_le(buf, outer_count, 4);
+	size_t outer = buf.size();
+	for (uint32_t i = 0; i < outer_count; i++) put_le(buf, buf.size() - inner, 4);
+	for (uint32_t i = 0; i < outer_count; i++) buf.push_back(flexbuffers::FBT_VECTOR << 2 | 1);
+
+	while (buf.size() % 4) buf.push_back(0);
+	put_le(buf, buf.size() - outer, 4);
+	buf.push_back(flexbuffers::FBT_VECTOR << 2 | 2);
+	buf.push_back(4);
+	return buf;
+}
+
+static int failures = 0;
+
+static void expect(const char *what, bool got, bool want)
+{
+	if (got == want) return;
+	fprintf(stderr, "FAIL %s: verify_flex() returned %s\n", what, got ? "true" : "false");
+	failures++;
+}
+
+int main(void)
+{
+	std::vector<uint8_t> small = shared_child(16, 4);
+	expect("shared child, 4 x 16", verify_flex(small.data(), small.size()), true);
+
+	/* about 7 KB that costs a million element checks: must run out of budget */
+	std::vector<uint8_t> big = shared_child(1000, 1000);
+	expect("shared child, 1000 x 1000", verify_flex(big.data(), big.size()), false);
+
+	flexbuffers::Builder fbb;
+	fbb.Map([&]() {
+		fbb.Double("time", 1.0);
+		fbb.String("text", "hello");
+		fbb.Vector("samples", [&]() {
+			for (int i = 0; i < 64; i++) fbb.Int(i);
+		});
+	});
+	fbb.Finish();
+	const std::vector<uint8_t> &built = fbb.GetBuffer();
+	expect("builder output", verify_flex(built.data(), built.size()), true);
+
+	std::vector<uint8_t> cut(built.begin(), built.end() - 1);
+	expect("truncated builder output", verify_flex(cut.data(), cut.size()), false);
+
+	if (!failures) printf("msg_verify_test: ok\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include "msg_schema.h"
+
+/* time/text payload published by mosquitto_send and mosquitto_v5_send */
+struct sensor_msg {
+	double time;
+	std::string text;
+
+	static constexpr auto fields()
+	{
+		return std::make_tuple(
+			msg_schema::field("time", &sensor_msg::time),
+			msg_schema::field("text", &sensor_msg::text));
+	}
+};